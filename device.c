@@ -31,6 +31,7 @@
 #include <apr_lib.h>
 #include <apr_network_io.h>
 #include <apr_poll.h>
+#include <apr_signal.h>
 #include <apr_strings.h>
 #include <apr_thread_proc.h>
 
@@ -43,6 +44,7 @@
 #include "device_read.h"
 #include "device_replxx.h"
 #include "device_libedit.h"
+#include "device_spawn.h"
 #include "device_util.h"
 
 #if HAVE_TERMIOS_H
@@ -53,6 +55,14 @@
 #include <libgen.h>
 #endif
 
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 #define DEVICE_PATHEXT "PATHEXT"
 #define DEVICE_ENV_EDITLINE "DEVICE_EDITLINE"
 #define DEVICE_PKGLIBEXECDIR "DEVICE_LIBEXEC"
@@ -65,6 +75,18 @@
 #define DEVICE_COMMANDLINE "COMMAND_LINE"
 #define DEVICE_COMPPOINT "COMP_POINT"
 
+#define DEVICE_SERVE_TIMEOUT apr_time_from_sec(5)
+
+#define DEVICE_BATCH_MARKER ".batch"
+#define DEVICE_BATCH_MARKER_LEN 6
+#define DEVICE_SERVE_MARKER ".serve"
+#define DEVICE_SERVE_MARKER_LEN 6
+
+#define DEVICE_PROC_LINE_MAX (HUGE_STRING_LEN * 16)
+
+#define DEVICE_MEMO_MAX 64
+#define DEVICE_MEMO_TTL apr_time_from_sec(10)
+
 enum lines {
     DEVICE_PREFER_NONE,
     DEVICE_PREFER_REPLXX,
@@ -948,79 +970,145 @@ void device_is_executable(apr_finfo_t *dirent,
 
 }
 
-const device_name_t* device_find_name(apr_array_header_t *names, const char *search)
+static int device_names_cmp(const void *a, const void *b)
 {
-    int i;
+    const device_name_t *na = a;
+    const device_name_t *nb = b;
 
-    for (i = 0; names && i < names->nelts; i++)
-    {
-        device_name_t *name = &APR_ARRAY_IDX(names, i, device_name_t);
+    return strcmp(na->name, nb->name);
+}
+
+/*
+ * Sort a set of names once it is complete, so that it can be searched
+ * by the functions below. Names sharing a prefix sort next to one
+ * another.
+ */
+static void device_names_sort(apr_array_header_t *names)
+{
+    if (names && names->nelts > 1) {
+        qsort(names->elts, names->nelts, names->elt_size, device_names_cmp);
+    }
+}
+
+/*
+ * Search a sorted set of names for the given prefix, returning the
+ * range of names that match, any exact match, and the length of the
+ * longest prefix common to the range.
+ */
+static void device_names_find(apr_array_header_t *names, const char *search,
+        device_found_t *found)
+{
+    apr_size_t len = strlen(search);
+    int lo = 0, hi, mid;
+
+    memset(found, 0, sizeof(device_found_t));
+
+    if (!names || !names->nelts) {
+        return;
+    }
+
+    /* first name not less than the search */
+    hi = names->nelts;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (strcmp(APR_ARRAY_IDX(names, mid, device_name_t).name, search) < 0) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    found->first = lo;
+
+    /* first name past the prefix */
+    hi = names->nelts;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (!strncmp(APR_ARRAY_IDX(names, mid, device_name_t).name, search, len)) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
 
-        if (!strcmp(name->name, search)) {
-            return name;
+    found->count = lo - found->first;
+
+    if (found->count) {
+        const device_name_t *first = &APR_ARRAY_IDX(names, found->first, device_name_t);
+        const device_name_t *last = &APR_ARRAY_IDX(names, lo - 1, device_name_t);
+        apr_size_t j;
+
+        if (!first->name[len]) {
+            found->exact = first;
         }
+
+        /* in a sorted range, the first and last share the least */
+        for (j = len; first->name[j] && first->name[j] == last->name[j]; j++);
+
+        found->last = last;
+        found->common = j - len;
     }
+}
+
+const device_name_t* device_find_name(apr_array_header_t *names, const char *search)
+{
+    device_found_t found;
 
-    return NULL;
+    device_names_find(names, search, &found);
+
+    return found.exact;
 }
 
 int device_find_prefix(apr_array_header_t *names, const char *search,
         const device_name_t **recent)
 {
-    int i;
-    apr_size_t len =  strlen(search);
-    int count = 0;
+    device_found_t found;
 
-    for (i = 0; names && i < names->nelts; i++)
-    {
-        device_name_t *name = &APR_ARRAY_IDX(names, i, device_name_t);
+    device_names_find(names, search, &found);
 
-        if (!strncmp(name->name, search, len)) {
-            if (recent) {
-                *recent = name;
-            }
-            count++;
-        }
+    if (found.count && recent) {
+        *recent = found.last;
     }
 
-    return count;
+    return found.count;
 }
 
 int device_find_prefixes(apr_array_header_t *names, const char *search,
         apr_array_header_t *results, char **common)
 {
+    device_found_t found;
+    apr_size_t len = strlen(search);
     int i;
-    apr_size_t len =  strlen(search);
-    int count = 0;
 
-    for (i = 0; names && i < names->nelts; i++)
-    {
-        device_name_t *name = &APR_ARRAY_IDX(names, i, device_name_t);
-
-        if (!strncmp(name->name, search, len)) {
+    device_names_find(names, search, &found);
 
-            device_name_t *result = apr_array_push(results);
+    if (!found.count) {
+        return 0;
+    }
 
-            result->name = name->name;
-            result->size = name->size;
+    for (i = found.first; i < found.first + found.count; i++) {
+        const device_name_t *name = &APR_ARRAY_IDX(names, i, device_name_t);
+        device_name_t *result = apr_array_push(results);
 
-            if (*common) {
-                const char *buf = name->name + len;
-                int j;
+        result->name = name->name;
+        result->size = name->size;
+    }
 
-                for (j = 0; buf[j] && (*common)[j] && buf[j] == (*common)[j]; j++);
+    if (*common) {
+        const char *buf = found.last->name + len;
+        apr_size_t j;
 
-                (*common)[j] = 0;
-            }
-            else {
-                *common = apr_pstrdup(results->pool, name->name + len);
-            }
+        for (j = 0; j < found.common && (*common)[j] && buf[j] == (*common)[j]; j++);
 
-            count++;
-        }
+        (*common)[j] = 0;
+    }
+    else {
+        *common = apr_pstrndup(results->pool, found.last->name + len, found.common);
     }
 
-    return count;
+    return found.count;
 }
 
 static const char **device_environment_make(device_t *d)
@@ -1089,42 +1177,199 @@ device_parse_t *device_ambiguous_make(device_parse_t *dp,
     return dp;
 }
 
-static device_parse_t *device_container_make(device_parse_t *dp, const char *libexec,
-        const char *sysconf, const char *name, apr_array_header_t *pathext)
+static apr_status_t device_listing_release(void *data)
 {
-    apr_dir_t *thedir;
-    apr_finfo_t dirent;
-    apr_status_t status;
+    device_listing_t *listing = data;
 
-    dp->name = apr_pstrdup(dp->pool, name);
-    dp->type = DEVICE_PARSE_CONTAINER;
-    dp->c.containers = apr_array_make(dp->pool, 1, sizeof(device_name_t));
-    dp->c.commands = apr_array_make(dp->pool, 1, sizeof(device_name_t));
-    dp->c.builtins = apr_array_make(dp->pool, 2, sizeof(device_name_t));
+    listing->refcount--;
 
-    if (dp->parent == NULL) {
-        device_name_t *name;
+    if (listing->stale && !listing->refcount) {
+        apr_pool_destroy(listing->pool);
+    }
 
-        name = apr_array_push(dp->c.builtins);
-        name->size = strlen("exit");
-        name->name = apr_pstrndup(dp->c.builtins->pool, "exit", name->size);
+    return APR_SUCCESS;
+}
 
-        name = apr_array_push(dp->c.builtins);
-        name->size = strlen("quit");
-        name->name = apr_pstrndup(dp->c.builtins->pool, "quit", name->size);
+/*
+ * Return the record kept for the given libexec directory, made once per
+ * directory for the session.
+ */
+static device_watch_t *device_watch_get(device_t *d, const char *libexec)
+{
+    device_watch_t *watch;
+
+    watch = apr_hash_get(d->paths, libexec, APR_HASH_KEY_STRING);
 
+    if (!watch) {
+        watch = apr_palloc(d->cpool, sizeof(device_watch_t));
+        watch->path = apr_pstrdup(d->cpool, libexec);
+        watch->wd = -1;
+        apr_hash_set(d->paths, watch->path, APR_HASH_KEY_STRING, watch);
     }
 
-    if ((apr_filepath_merge(&dp->c.sysconf, sysconf, name, APR_FILEPATH_SECUREROOT | APR_FILEPATH_NATIVE, dp->pool))) {
-        return dp;
+    return watch;
+}
+
+#if HAVE_SYS_INOTIFY_H && HAVE_INOTIFY_INIT1
+
+static void device_listing_invalidate(device_t *d, const char *libexec)
+{
+    device_listing_t *listing;
+
+    listing = apr_hash_get(d->listings, libexec, APR_HASH_KEY_STRING);
+
+    if (listing) {
+
+        /* free once the last parse lets go */
+        listing->stale = 1;
+        if (!listing->refcount) {
+            apr_pool_destroy(listing->pool);
+        }
+
+        apr_hash_set(d->listings, libexec, APR_HASH_KEY_STRING, NULL);
+
+        d->generation++;
+    }
+}
+
+#define DEVICE_NOTIFY_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+        | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static apr_status_t device_notify_cleanup(void *data)
+{
+    device_t *d = data;
+
+    if (d->notify > -1) {
+        close(d->notify);
+        d->notify = -1;
     }
 
-    if ((apr_filepath_merge(&dp->c.libexec, libexec, name, APR_FILEPATH_SECUREROOT | APR_FILEPATH_NATIVE, dp->pool))) {
-        return dp;
+    return APR_SUCCESS;
+}
+
+static int device_notify_watch(device_t *d, const char *libexec)
+{
+    device_watch_t *watch;
+    int wd;
+
+    if (d->notify < 0) {
+        return -1;
     }
 
-    if ((status = apr_dir_open(&thedir, dp->c.libexec, dp->pool)) != APR_SUCCESS) {
-        return dp;
+    if ((wd = inotify_add_watch(d->notify, libexec, DEVICE_NOTIFY_EVENTS)) < 0) {
+        return -1;
+    }
+
+    if (!apr_hash_get(d->watches, &wd, sizeof(int))) {
+
+        watch = device_watch_get(d, libexec);
+
+        /* the directory moved to a new watch, forget the old one */
+        if (watch->wd > -1
+                && apr_hash_get(d->watches, &watch->wd, sizeof(int)) == watch) {
+            apr_hash_set(d->watches, &watch->wd, sizeof(int), NULL);
+        }
+
+        watch->wd = wd;
+        apr_hash_set(d->watches, &watch->wd, sizeof(int), watch);
+    }
+
+    return wd;
+}
+
+/*
+ * Drain pending inotify events, dropping the listing of each directory
+ * that has changed. Listings of unaffected directories are left alone.
+ */
+static void device_notify_read(device_t *d)
+{
+    union {
+        struct inotify_event event;
+        char buf[HUGE_STRING_LEN];
+    } events;
+    ssize_t len;
+
+    if (d->notify < 0) {
+        return;
+    }
+
+    while ((len = read(d->notify, events.buf, sizeof(events.buf))) > 0) {
+
+        char *ptr = events.buf;
+
+        while (ptr < events.buf + len) {
+
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            device_watch_t *watch;
+
+            watch = apr_hash_get(d->watches, &event->wd, sizeof(int));
+
+            if (watch) {
+
+                device_listing_invalidate(d, watch->path);
+
+                /* the watch is gone, a new one is added on rescan */
+                if (event->mask & IN_IGNORED) {
+                    apr_hash_set(d->watches, &event->wd, sizeof(int), NULL);
+                    watch->wd = -1;
+                }
+            }
+
+            /* queue overflowed, we cannot know what changed */
+            if (event->mask & IN_Q_OVERFLOW) {
+
+                apr_hash_index_t *hi;
+
+                for (hi = apr_hash_first(NULL, d->watches); hi; hi = apr_hash_next(hi)) {
+                    device_watch_t *watch;
+
+                    apr_hash_this(hi, NULL, NULL, (void **)&watch);
+
+                    device_listing_invalidate(d, watch->path);
+                }
+            }
+
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+
+    }
+
+}
+
+#endif
+
+static device_listing_t *device_listing_make(device_t *d, const char *libexec,
+        apr_finfo_t *finfo)
+{
+    apr_pool_t *pool;
+    apr_dir_t *thedir;
+    apr_finfo_t dirent;
+    device_listing_t *listing;
+    apr_status_t status;
+
+    apr_pool_create(&pool, d->cpool);
+
+    listing = apr_pcalloc(pool, sizeof(device_listing_t));
+    listing->pool = pool;
+    listing->containers = apr_array_make(pool, 1, sizeof(device_name_t));
+    listing->commands = apr_array_make(pool, 1, sizeof(device_name_t));
+    listing->batches = apr_array_make(pool, 1, sizeof(device_name_t));
+    listing->serves = apr_array_make(pool, 1, sizeof(device_name_t));
+    listing->mtime = finfo->mtime;
+    listing->inode = finfo->inode;
+    listing->device = finfo->device;
+    listing->scanned = apr_time_now();
+
+    /* watch before we read, so that no change can slip past */
+#if HAVE_SYS_INOTIFY_H && HAVE_INOTIFY_INIT1
+    listing->watch = device_notify_watch(d, libexec);
+#else
+    listing->watch = -1;
+#endif
+
+    if ((status = apr_dir_open(&thedir, libexec, pool)) != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        return NULL;
     }
 
     do {
@@ -1136,8 +1381,29 @@ static device_parse_t *device_container_make(device_parse_t *dp, const char *lib
             break;
         }
 
-        /* hidden files are ignored */
+        /* hidden files are ignored, bar markers of --batch/--serve support */
         if (dirent.name[0] == '.') {
+
+            apr_size_t len = strlen(dirent.name);
+
+            if (len > 1 + DEVICE_BATCH_MARKER_LEN
+                    && !strcmp(dirent.name + len - DEVICE_BATCH_MARKER_LEN,
+                            DEVICE_BATCH_MARKER)) {
+
+                device_name_t *name = apr_array_push(listing->batches);
+                name->size = len - 1 - DEVICE_BATCH_MARKER_LEN;
+                name->name = apr_pstrndup(pool, dirent.name + 1, name->size);
+            }
+
+            else if (len > 1 + DEVICE_SERVE_MARKER_LEN
+                    && !strcmp(dirent.name + len - DEVICE_SERVE_MARKER_LEN,
+                            DEVICE_SERVE_MARKER)) {
+
+                device_name_t *name = apr_array_push(listing->serves);
+                name->size = len - 1 - DEVICE_SERVE_MARKER_LEN;
+                name->name = apr_pstrndup(pool, dirent.name + 1, name->size);
+            }
+
             continue;
         }
 
@@ -1145,16 +1411,16 @@ static device_parse_t *device_container_make(device_parse_t *dp, const char *lib
         case APR_LNK:
         case APR_REG: {
 
-            device_is_executable(&dirent, pathext, dp->c.commands);
+            device_is_executable(&dirent, d->pathext, listing->commands);
 
             break;
         }
 
         case APR_DIR: {
 
-            device_name_t *name = apr_array_push(dp->c.containers);
+            device_name_t *name = apr_array_push(listing->containers);
             name->size = strlen(dirent.name);
-            name->name = apr_pstrndup(dp->c.containers->pool, dirent.name, name->size);
+            name->name = apr_pstrndup(pool, dirent.name, name->size);
 
             break;
         }
@@ -1166,6 +1432,112 @@ static device_parse_t *device_container_make(device_parse_t *dp, const char *lib
 
     apr_dir_close(thedir);
 
+    device_names_sort(listing->containers);
+    device_names_sort(listing->commands);
+    device_names_sort(listing->batches);
+    device_names_sort(listing->serves);
+
+    return listing;
+}
+
+/*
+ * Return the listing of the given libexec directory, rescanning the
+ * directory only when it has changed since we last looked.
+ *
+ * Watched directories are trusted until inotify tells us otherwise. When
+ * no watch is possible we fall back to comparing the directory's stat,
+ * and a directory modified within a second of being scanned is rescanned
+ * next time, as the mtime granularity may have hidden a later change.
+ */
+static device_listing_t *device_listing_get(device_t *d, const char *libexec)
+{
+    device_listing_t *listing;
+    apr_finfo_t finfo;
+
+#if HAVE_SYS_INOTIFY_H && HAVE_INOTIFY_INIT1
+    device_notify_read(d);
+#endif
+
+    listing = apr_hash_get(d->listings, libexec, APR_HASH_KEY_STRING);
+
+    if (listing && listing->watch > -1) {
+        return listing;
+    }
+
+    if (APR_SUCCESS != apr_stat(&finfo, libexec,
+            APR_FINFO_TYPE | APR_FINFO_MTIME | APR_FINFO_INODE | APR_FINFO_DEV,
+            d->cpool) || finfo.filetype != APR_DIR) {
+        return NULL;
+    }
+
+    if (listing) {
+
+        if (listing->mtime == finfo.mtime && listing->inode == finfo.inode
+                && listing->device == finfo.device
+                && listing->scanned - listing->mtime > apr_time_from_sec(1)) {
+            return listing;
+        }
+
+        /* out of date, free once the last parse lets go */
+        listing->stale = 1;
+        if (!listing->refcount) {
+            apr_pool_destroy(listing->pool);
+        }
+    }
+
+    if (!(listing = device_listing_make(d, libexec, &finfo))) {
+        apr_hash_set(d->listings, libexec, APR_HASH_KEY_STRING, NULL);
+        return NULL;
+    }
+
+    /* keys outlive the listings, reuse the one kept for the directory */
+    apr_hash_set(d->listings, device_watch_get(d, libexec)->path,
+            APR_HASH_KEY_STRING, listing);
+
+    return listing;
+}
+
+static device_parse_t *device_container_make(device_t *d, device_parse_t *dp,
+        const char *libexec, const char *sysconf, const char *name)
+{
+    device_listing_t *listing;
+
+    dp->name = apr_pstrdup(dp->pool, name);
+    dp->type = DEVICE_PARSE_CONTAINER;
+    dp->c.builtins = apr_array_make(dp->pool, 2, sizeof(device_name_t));
+
+    if (dp->parent == NULL) {
+        device_name_t *name;
+
+        name = apr_array_push(dp->c.builtins);
+        name->size = strlen("exit");
+        name->name = apr_pstrndup(dp->c.builtins->pool, "exit", name->size);
+
+        name = apr_array_push(dp->c.builtins);
+        name->size = strlen("quit");
+        name->name = apr_pstrndup(dp->c.builtins->pool, "quit", name->size);
+
+        device_names_sort(dp->c.builtins);
+    }
+
+    if ((apr_filepath_merge(&dp->c.sysconf, sysconf, name, APR_FILEPATH_SECUREROOT | APR_FILEPATH_NATIVE, dp->pool))
+            || (apr_filepath_merge(&dp->c.libexec, libexec, name, APR_FILEPATH_SECUREROOT | APR_FILEPATH_NATIVE, dp->pool))
+            || !(listing = device_listing_get(d, dp->c.libexec))) {
+
+        dp->c.containers = apr_array_make(dp->pool, 1, sizeof(device_name_t));
+        dp->c.commands = apr_array_make(dp->pool, 1, sizeof(device_name_t));
+
+        return dp;
+    }
+
+    /* share the cached listing for as long as this parse lives */
+    listing->refcount++;
+    apr_pool_cleanup_register(dp->pool, listing, device_listing_release,
+            apr_pool_cleanup_null);
+
+    dp->c.containers = listing->containers;
+    dp->c.commands = listing->commands;
+
     return dp;
 }
 
@@ -1198,96 +1570,210 @@ typedef enum device_proc_std_e {
     DEVICE_PROC_STDERR = 2,
 } device_proc_std_e;
 
-static apr_status_t device_proc_gets(apr_pool_t *pool, apr_proc_t *proc, char *buf,
-    apr_size_t *buflen, device_proc_std_e *what)
-{
-    apr_pool_t *p;
-    apr_status_t status;
-    apr_pollfd_t pfd = {0};
+/*
+ * Buffered reader for the stdout and stderr of a child, made once per
+ * child so that the pollset outlives each line read.
+ *
+ * Stdout is read in large chunks into a buffer that slides down as lines
+ * are consumed, and grows when a line will not fit, up to
+ * DEVICE_PROC_LINE_MAX. Lines are returned by pointer into the buffer,
+ * NUL terminated in place, and stay valid until the next read. The byte
+ * under the NUL is put back before the next read. Longer lines are
+ * returned in pieces without a trailing newline.
+ */
+typedef struct device_proc_reader_t {
+    apr_pool_t *pool;
+    apr_proc_t *proc;
     apr_pollset_t *pollset;
-    apr_size_t len = *buflen;
+    char *buf;
+    apr_size_t start;
+    apr_size_t end;
+    apr_size_t scanned;
+    apr_size_t size;
+    int held;
+    char saved;
     int fds_waiting;
+    char err[HUGE_STRING_LEN];
+} device_proc_reader_t;
 
-    apr_pool_create(&p, pool);
+static apr_status_t device_proc_reader_make(apr_pool_t *pool, apr_proc_t *proc,
+        device_proc_reader_t **reader)
+{
+    device_proc_reader_t *r;
+    apr_pollfd_t pfd = {0};
+    apr_status_t status;
 
-    if (APR_SUCCESS != (status = apr_pollset_create(&pollset, 2, p, 0))) {
+    r = apr_pcalloc(pool, sizeof(device_proc_reader_t));
+    r->pool = pool;
+    r->proc = proc;
+    r->size = HUGE_STRING_LEN;
+    r->buf = apr_palloc(pool, r->size);
+
+    /* a wakeable pollset lets a cancelled request be abandoned */
+    if (APR_SUCCESS != apr_pollset_create(&r->pollset, 2, pool,
+            APR_POLLSET_WAKEABLE)
+            && APR_SUCCESS != (status = apr_pollset_create(&r->pollset, 2,
+                    pool, 0))) {
         return status;
     }
 
-    fds_waiting = 0;
-
     pfd.p = pool;
     pfd.desc_type = APR_POLL_FILE;
     pfd.reqevents = APR_POLLIN;
 
     if (proc->err) {
         pfd.desc.f = proc->err;
-        if (APR_SUCCESS != (status = apr_pollset_add(pollset, &pfd))) {
-            apr_pool_destroy(p);
+        if (APR_SUCCESS != (status = apr_pollset_add(r->pollset, &pfd))) {
             return status;
         }
-        fds_waiting++;
+        r->fds_waiting++;
     }
 
     if (proc->out) {
         pfd.desc.f = proc->out;
-        if (APR_SUCCESS != (status = apr_pollset_add(pollset, &pfd))) {
-            apr_pool_destroy(p);
+        if (APR_SUCCESS != (status = apr_pollset_add(r->pollset, &pfd))) {
             return status;
         }
-        fds_waiting++;
+        r->fds_waiting++;
     }
 
-    while (fds_waiting) {
-        int i, num_events;
-        const apr_pollfd_t *pdesc;
-
-        status = apr_pollset_poll(pollset, -1, &num_events, &pdesc);
-        if (status != APR_SUCCESS && !APR_STATUS_IS_EINTR(status)) {
-            break;
-        }
+    *reader = r;
 
-        for (i = 0; i < num_events; i++) {
+    return APR_SUCCESS;
+}
 
-            if (pdesc[i].desc.f == proc->out) {
+/*
+ * Make room at the end of the stdout buffer, sliding what is left down
+ * to the start, or growing the buffer when already full.
+ */
+static void device_proc_reader_room(device_proc_reader_t *r)
+{
+    apr_size_t left = r->end - r->start;
 
-                status = apr_file_gets(buf, len, proc->out);
-                if (APR_STATUS_IS_EOF(status)) {
-                    apr_file_close(proc->out);
-                    proc->out = NULL;
-                    apr_pollset_remove(pollset, &pdesc[i]);
-                    --fds_waiting;
-                }
-                else if (status != APR_SUCCESS) {
-                    apr_pool_destroy(p);
-                    return status;
-                }
-                else {
-                    *buflen = strlen(buf);
-                    apr_pool_destroy(p);
-                    *what = DEVICE_PROC_STDOUT;
-                    return APR_SUCCESS;
-                }
+    if (r->end + 1 < r->size) {
+        /* room enough */
+    }
+    else if (r->start) {
+        memmove(r->buf, r->buf + r->start, left);
+        r->scanned -= r->start;
+        r->start = 0;
+        r->end = left;
+    }
+    else if (r->size < DEVICE_PROC_LINE_MAX) {
+        char *buf = apr_palloc(r->pool, r->size * 2);
+        memcpy(buf, r->buf, left);
+        r->buf = buf;
+        r->size *= 2;
+    }
+}
 
+/*
+ * Return the next line of stdout, or the next chunk of stderr, whichever
+ * comes first.
+ *
+ * Returns APR_EINTR when interrupted or woken, leaving the caller to
+ * decide whether to carry on reading.
+ */
+static apr_status_t device_proc_getline(device_proc_reader_t *r,
+        const char **line, apr_size_t *linelen, device_proc_std_e *what,
+        apr_interval_time_t timeout)
+{
+    apr_proc_t *proc = r->proc;
+    apr_status_t status;
+
+    /* put back the byte under the last line's NUL */
+    if (r->held) {
+        r->buf[r->start] = r->saved;
+        r->held = 0;
+    }
+
+    if (r->start == r->end) {
+        r->start = r->end = r->scanned = 0;
+    }
+
+    while (1) {
+        int i, num_events;
+        const apr_pollfd_t *pdesc;
+
+        /* a whole line waiting, or all we will ever get? */
+        if (r->start < r->end) {
+            char *eol = memchr(r->buf + r->scanned, '\n', r->end - r->scanned);
+
+            if (eol || !proc->out
+                    || r->end - r->start + 1 >= DEVICE_PROC_LINE_MAX) {
+                apr_size_t len = eol ? eol - r->buf - r->start + 1 :
+                        r->end - r->start;
+
+                *line = r->buf + r->start;
+                *linelen = len;
+                *what = DEVICE_PROC_STDOUT;
+
+                r->start += len;
+                r->scanned = r->start;
+                r->saved = r->buf[r->start];
+                r->held = 1;
+                r->buf[r->start] = 0;
+
+                return APR_SUCCESS;
+            }
+
+            r->scanned = r->end;
+        }
+
+        if (!r->fds_waiting) {
+            return APR_EOF;
+        }
+
+        status = apr_pollset_poll(r->pollset, timeout, &num_events, &pdesc);
+        if (status != APR_SUCCESS) {
+            return status;
+        }
+
+        for (i = 0; i < num_events; i++) {
+
+            if (pdesc[i].desc.f == proc->out) {
+
+                apr_size_t len;
+
+                device_proc_reader_room(r);
+
+                len = r->size - r->end - 1;
+                status = apr_file_read(proc->out, r->buf + r->end, &len);
+                if (APR_STATUS_IS_EOF(status)) {
+                    apr_pollset_remove(r->pollset, &pdesc[i]);
+                    apr_file_close(proc->out);
+                    proc->out = NULL;
+                    --r->fds_waiting;
+                }
+                else if (status != APR_SUCCESS) {
+                    return status;
+                }
+                else {
+                    r->end += len;
+                }
+
+                /* look for lines before anything else */
+                break;
             }
 
             else if (pdesc[i].desc.f == proc->err) {
 
-                *buflen = len;
-                status = apr_file_read(proc->err, buf, buflen);
+                apr_size_t len = sizeof(r->err);
+
+                status = apr_file_read(proc->err, r->err, &len);
                 if (APR_STATUS_IS_EOF(status)) {
+                    apr_pollset_remove(r->pollset, &pdesc[i]);
                     apr_file_close(proc->err);
                     proc->err = NULL;
-                    apr_pollset_remove(pollset, &pdesc[i]);
-                    --fds_waiting;
+                    --r->fds_waiting;
                 }
                 else if (status != APR_SUCCESS) {
-                    apr_pool_destroy(p);
                     return status;
                 }
                 else {
+                    *line = r->err;
+                    *linelen = len;
                     *what = DEVICE_PROC_STDERR;
-                    apr_pool_destroy(p);
                     return APR_SUCCESS;
                 }
 
@@ -1296,23 +1782,602 @@ static apr_status_t device_proc_gets(apr_pool_t *pool, apr_proc_t *proc, char *b
         }
     }
 
-    apr_pool_destroy(p);
-    return APR_EOF;
 }
 
-device_parse_t* device_parameter_make(device_parse_t *dp, const char *name,
+static apr_status_t device_server_cleanup(void *data)
+{
+    device_server_t *server = data;
+
+    if (server->proc) {
+
+        /* closing stdin asks the server to leave */
+        if (server->proc->in) {
+            apr_file_close(server->proc->in);
+        }
+
+        apr_proc_wait(server->proc, NULL, NULL, APR_WAIT);
+
+        server->proc = NULL;
+    }
+
+    return APR_SUCCESS;
+}
+
+static void device_server_stop(device_server_t *server)
+{
+    if (server->proc) {
+        apr_proc_kill(server->proc, SIGTERM);
+        device_server_cleanup(server);
+    }
+}
+
+/*
+ * Read a server response up to and including the terminating line,
+ * which consists of a NUL followed by the exit code.
+ *
+ * Other output is passed to out and err where given, and is otherwise
+ * ignored. The server writes stderr before the terminating line, so
+ * once we have seen it whatever is left on stderr is already waiting.
+ */
+static apr_status_t device_server_response(device_server_t *server,
+        apr_interval_time_t timeout, int *exitcode, apr_file_t *out,
+        apr_file_t *err)
+{
+    apr_status_t status;
+    int done = 0;
+
+    while (1) {
+        const char *buf;
+        apr_size_t buflen;
+        device_proc_std_e what;
+
+        status = device_proc_getline(server->reader, &buf, &buflen, &what,
+                done ? 0 : timeout);
+        if (APR_STATUS_IS_EINTR(status)) {
+            continue;
+        }
+        else if (status != APR_SUCCESS) {
+            return done && APR_STATUS_IS_TIMEUP(status) ? APR_SUCCESS : status;
+        }
+
+        if (what == DEVICE_PROC_STDOUT && !buf[0] && !done) {
+            *exitcode = atoi(buf + 1);
+            if (!err) {
+                return APR_SUCCESS;
+            }
+            done = 1;
+        }
+        else if (what == DEVICE_PROC_STDOUT && out) {
+            apr_file_write_full(out, buf, buflen, NULL);
+        }
+        else if (what == DEVICE_PROC_STDERR && err) {
+            apr_file_write_full(err, buf, buflen, NULL);
+        }
+    }
+
+}
+
+/*
+ * Send a completion request to the server, each argument encoded as a
+ * netstring, the request terminated by a newline.
+ */
+static apr_status_t device_server_request(device_server_t *server,
+        const char **args, apr_pool_t *pool)
+{
+    apr_array_header_t *request;
+    apr_sigfunc_t *sigpipe;
+    const char *buf;
+    apr_status_t status;
+
+    request = apr_array_make(pool, 8, sizeof(const char *));
+
+    while (*args) {
+        APR_ARRAY_PUSH(request, const char *) = apr_psprintf(pool,
+                "%" APR_SIZE_T_FMT ":%s,", strlen(*args), *args);
+        args++;
+    }
+
+    APR_ARRAY_PUSH(request, const char *) = "\n";
+
+    buf = apr_array_pstrcat(pool, request, 0);
+
+    /* a server that has gone away must not take us with it */
+    sigpipe = apr_signal(SIGPIPE, SIG_IGN);
+
+    status = apr_file_write_full(server->proc->in, buf, strlen(buf), NULL);
+
+    apr_signal(SIGPIPE, sigpipe);
+
+    return status;
+}
+
+/*
+ * Start a server in the given mode, and wait for it to say it is ready.
+ */
+static apr_status_t device_server_start(device_server_t *server,
+        device_parse_t *command, const char **env, const char *mode)
+{
+    apr_proc_t *proc;
+    const char *argv[3];
+    apr_status_t status;
+    int exitcode = 0;
+
+    argv[0] = command->r.libexec;
+    argv[1] = mode;
+    argv[2] = NULL;
+
+    /* launched like any other command, with a pipe to send requests */
+    proc = apr_pcalloc(server->pool, sizeof(apr_proc_t));
+    if (APR_SUCCESS != (status = device_spawn(proc, command->r.libexec,
+            argv, env, command->r.sysconf, NULL, NULL, NULL, 1,
+            server->pool))) {
+        return status;
+    }
+
+    server->proc = proc;
+
+    apr_pool_cleanup_register(server->pool, server, device_server_cleanup,
+            apr_pool_cleanup_null);
+
+    if (APR_SUCCESS != (status = device_proc_reader_make(server->pool, proc,
+            &server->reader))) {
+        device_server_stop(server);
+        return status;
+    }
+
+    /* anything said before we are ready is not for the user */
+    if (APR_SUCCESS != (status = device_server_response(server,
+            DEVICE_SERVE_TIMEOUT, &exitcode, NULL, NULL))) {
+        device_server_stop(server);
+        return status;
+    }
+
+    if (exitcode) {
+        device_server_stop(server);
+        return APR_ENOTIMPL;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Does the command declare support for --batch or --serve?
+ *
+ * A command we know nothing about might take the option for an argument
+ * and run, so only commands with a marker file ".<command>.batch" or
+ * ".<command>.serve" beside them are started this way.
+ */
+static int device_marker_declared(device_t *d, device_parse_t *command,
+        int serve)
+{
+    device_listing_t *listing;
+    device_found_t found;
+    const char *slash = strrchr(command->r.libexec, '/');
+
+    if (!slash || !(listing = device_listing_get(d,
+            apr_pstrndup(command->pool, command->r.libexec,
+                    slash - command->r.libexec)))) {
+        return 0;
+    }
+
+    device_names_find(serve ? listing->serves : listing->batches,
+            command->name, &found);
+
+    return found.exact != NULL;
+}
+
+/*
+ * Return the completion server for the given command, starting it if
+ * needed.
+ *
+ * Commands that do not declare --serve support go straight to one
+ * process per request, as do those that fail to send the ready response,
+ * which are remembered.
+ */
+static device_server_t *device_server_get(device_t *d, device_parse_t *command,
+        const char **env)
+{
+    device_server_t *server;
+    apr_pool_t *pool;
+
+    server = apr_hash_get(d->servers, command->r.libexec, APR_HASH_KEY_STRING);
+
+    /* drain the rest of a cancelled response, or start afresh */
+    if (server && server->proc && server->pending) {
+        int exitcode;
+
+        if (APR_SUCCESS == device_server_response(server,
+                DEVICE_SERVE_TIMEOUT, &exitcode, NULL, NULL)) {
+            server->pending = 0;
+        }
+        else {
+            device_server_stop(server);
+            apr_hash_set(d->servers, server->libexec, APR_HASH_KEY_STRING,
+                    NULL);
+            apr_pool_destroy(server->pool);
+            server = NULL;
+        }
+    }
+
+    if (server) {
+        return server->proc ? server : NULL;
+    }
+
+    if (!device_marker_declared(d, command, 1)) {
+        return NULL;
+    }
+
+    apr_pool_create(&pool, d->cpool);
+
+    server = apr_pcalloc(pool, sizeof(device_server_t));
+    server->pool = pool;
+    server->libexec = apr_pstrdup(pool, command->r.libexec);
+
+    apr_hash_set(d->servers, server->libexec, APR_HASH_KEY_STRING, server);
+
+    if (APR_SUCCESS != device_server_start(server, command, env, "--serve")) {
+        return NULL;
+    }
+
+    return server;
+}
+
+/*
+ * Stop the batch in progress, if any.
+ */
+void device_batch_stop(device_t *d)
+{
+    if (d->batch) {
+        apr_pool_destroy(d->batch->pool);
+        d->batch = NULL;
+    }
+}
+
+/*
+ * Return the batch for the given command, starting it if needed. Only
+ * one batch runs at a time, so that lines run in order.
+ *
+ * Commands that do not declare --batch support fall back to one process
+ * per line, as do those that fail to answer the handshake, which are
+ * remembered.
+ * Nothing is sent to a batch before the handshake, so a failed start
+ * never runs the line.
+ */
+static device_server_t *device_batch_get(device_t *d, device_parse_t *command,
+        const char **env)
+{
+    device_server_t *batch;
+    apr_pool_t *pool;
+
+    if (d->batch && !strcmp(d->batch->libexec, command->r.libexec)) {
+        return d->batch;
+    }
+
+    device_batch_stop(d);
+
+    if (apr_hash_get(d->batchless, command->r.libexec, APR_HASH_KEY_STRING)) {
+        return NULL;
+    }
+
+    if (!device_marker_declared(d, command, 0)) {
+        return NULL;
+    }
+
+    apr_pool_create(&pool, d->cpool);
+
+    batch = apr_pcalloc(pool, sizeof(device_server_t));
+    batch->pool = pool;
+    batch->libexec = apr_pstrdup(pool, command->r.libexec);
+
+    if (APR_SUCCESS != device_server_start(batch, command, env, "--batch")) {
+        apr_hash_set(d->batchless, apr_pstrdup(d->cpool, command->r.libexec),
+                APR_HASH_KEY_STRING, "");
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+
+    d->batch = batch;
+
+    return batch;
+}
+
+/*
+ * Cancel the completion in progress on another thread. A one shot
+ * command in flight is killed, while a server is left running and the
+ * wait for its response abandoned, to be drained before the next
+ * request. Results parsed from here on are not remembered.
+ */
+void device_cancel(device_t *d)
+{
+#if APR_HAS_THREADS
+    if (d->inflight_mutex) {
+        apr_thread_mutex_lock(d->inflight_mutex);
+        d->cancelled = 1;
+        if (d->inflight) {
+            apr_proc_kill(d->inflight, SIGTERM);
+        }
+        if (d->inflight_pollset) {
+            apr_pollset_wakeup(d->inflight_pollset);
+        }
+        apr_thread_mutex_unlock(d->inflight_mutex);
+    }
+#endif
+}
+
+void device_cancel_reset(device_t *d)
+{
+#if APR_HAS_THREADS
+    if (d->inflight_mutex) {
+        apr_thread_mutex_lock(d->inflight_mutex);
+        d->cancelled = 0;
+        apr_thread_mutex_unlock(d->inflight_mutex);
+    }
+#endif
+}
+
+static int device_cancelled(device_t *d)
+{
+    int cancelled = 0;
+
+#if APR_HAS_THREADS
+    if (d->inflight_mutex) {
+        apr_thread_mutex_lock(d->inflight_mutex);
+        cancelled = d->cancelled;
+        apr_thread_mutex_unlock(d->inflight_mutex);
+    }
+#endif
+
+    return cancelled;
+}
+
+/*
+ * Record the one shot command (if any) and the pollset we are waiting
+ * on, so that device_cancel() can reach them.
+ */
+static void device_inflight(device_t *d, apr_proc_t *proc,
+        apr_pollset_t *pollset)
+{
+#if APR_HAS_THREADS
+    if (d->inflight_mutex) {
+        apr_thread_mutex_lock(d->inflight_mutex);
+        d->inflight = proc;
+        d->inflight_pollset = pollset;
+        if (proc && d->cancelled) {
+            apr_proc_kill(proc, SIGTERM);
+        }
+        if (pollset && d->cancelled) {
+            apr_pollset_wakeup(pollset);
+        }
+        apr_thread_mutex_unlock(d->inflight_mutex);
+    }
+#endif
+}
+
+static apr_status_t device_memo_release(void *data)
+{
+    device_memo_t *memo = data;
+
+    memo->refcount--;
+
+    if (memo->stale && !memo->refcount) {
+        apr_pool_destroy(memo->pool);
+    }
+
+    return APR_SUCCESS;
+}
+
+static void device_memo_remove(device_t *d, device_memo_t *memo)
+{
+    apr_hash_set(d->memos, memo->key, APR_HASH_KEY_STRING, NULL);
+
+    if (memo->prev) {
+        memo->prev->next = memo->next;
+    }
+    else {
+        d->mru = memo->next;
+    }
+
+    if (memo->next) {
+        memo->next->prev = memo->prev;
+    }
+    else {
+        d->lru = memo->prev;
+    }
+
+    /* free once the last parse lets go */
+    memo->stale = 1;
+    if (!memo->refcount) {
+        apr_pool_destroy(memo->pool);
+    }
+}
+
+/*
+ * Forget all completion results, as after running a command that may
+ * have changed what completes.
+ */
+static void device_memo_clear(device_t *d)
+{
+    while (d->mru) {
+        device_memo_remove(d, d->mru);
+    }
+
+    d->generation++;
+}
+
+/*
+ * The memo key is the command followed by each argument, encoded as
+ * netstrings so that no two argument lists share a key.
+ */
+static const char *device_memo_key(apr_pool_t *pool, device_parse_t *command,
+        apr_array_header_t *argv)
+{
+    apr_array_header_t *key;
+    int i;
+
+    key = apr_array_make(pool, argv->nelts, sizeof(const char *));
+
+    APR_ARRAY_PUSH(key, const char *) = apr_psprintf(pool,
+            "%" APR_SIZE_T_FMT ":%s,", strlen(command->r.libexec),
+            command->r.libexec);
+
+    for (i = 2; i < argv->nelts; i++) {
+        const char *arg = APR_ARRAY_IDX(argv, i, const char *);
+
+        if (arg) {
+            APR_ARRAY_PUSH(key, const char *) = apr_psprintf(pool,
+                    "%" APR_SIZE_T_FMT ":%s,", strlen(arg), arg);
+        }
+    }
+
+    return apr_array_pstrcat(pool, key, 0);
+}
+
+static device_memo_t *device_memo_get(device_t *d, const char *key)
+{
+    device_memo_t *memo;
+
+    memo = apr_hash_get(d->memos, key, APR_HASH_KEY_STRING);
+
+    if (!memo) {
+        return NULL;
+    }
+
+    if (apr_time_now() - memo->created > DEVICE_MEMO_TTL) {
+        device_memo_remove(d, memo);
+        return NULL;
+    }
+
+    /* move to the front */
+    if (memo->prev) {
+
+        memo->prev->next = memo->next;
+        if (memo->next) {
+            memo->next->prev = memo->prev;
+        }
+        else {
+            d->lru = memo->prev;
+        }
+
+        memo->prev = NULL;
+        memo->next = d->mru;
+        d->mru->prev = memo;
+        d->mru = memo;
+    }
+
+    return memo;
+}
+
+static apr_array_header_t *device_memo_names(apr_pool_t *pool,
+        apr_array_header_t *names)
+{
+    apr_array_header_t *copy;
+    int i;
+
+    copy = apr_array_make(pool, names->nelts, sizeof(device_name_t));
+
+    for (i = 0; i < names->nelts; i++) {
+        const device_name_t *name = &APR_ARRAY_IDX(names, i, const device_name_t);
+        device_name_t *c = apr_array_push(copy);
+
+        c->size = name->size;
+        c->name = apr_pstrndup(pool, name->name, name->size);
+    }
+
+    return copy;
+}
+
+static void device_memo_put(device_t *d, const char *key, device_parse_t *dp)
+{
+    apr_pool_t *pool;
+    device_memo_t *memo;
+
+    apr_pool_create(&pool, d->cpool);
+
+    memo = apr_pcalloc(pool, sizeof(device_memo_t));
+    memo->pool = pool;
+    memo->key = apr_pstrdup(pool, key);
+    memo->pkey = dp->p.key ? apr_pstrdup(pool, dp->p.key) : NULL;
+    memo->keys = device_memo_names(pool, dp->p.keys);
+    memo->requires = device_memo_names(pool, dp->p.requires);
+    memo->values = device_memo_names(pool, dp->p.values);
+    memo->error = dp->p.error ? apr_pstrdup(pool, dp->p.error) : NULL;
+    if (dp->p.stderr) {
+        memo->stderr = apr_pmemdup(pool, dp->p.stderr, dp->p.stderrlen);
+        memo->stderrlen = dp->p.stderrlen;
+    }
+    memo->required = dp->p.required;
+    memo->created = apr_time_now();
+
+    memo->next = d->mru;
+    if (d->mru) {
+        d->mru->prev = memo;
+    }
+    else {
+        d->lru = memo;
+    }
+    d->mru = memo;
+
+    apr_hash_set(d->memos, memo->key, APR_HASH_KEY_STRING, memo);
+
+    if (apr_hash_count(d->memos) > DEVICE_MEMO_MAX) {
+        device_memo_remove(d, d->lru);
+    }
+}
+
+static void device_memo_use(device_parse_t *dp, device_memo_t *memo)
+{
+    memo->refcount++;
+    apr_pool_cleanup_register(dp->pool, memo, device_memo_release,
+            apr_pool_cleanup_null);
+
+    if (dp->p.key) {
+        dp->p.key = memo->pkey;
+    }
+    dp->p.keys = memo->keys;
+    dp->p.requires = memo->requires;
+    dp->p.values = memo->values;
+    dp->p.error = memo->error;
+    dp->p.stderr = memo->stderr;
+    dp->p.stderrlen = memo->stderrlen;
+    dp->p.required = memo->required;
+}
+
+/*
+ * Run the command once to complete a single parameter.
+ */
+static apr_status_t device_parameter_spawn(device_parse_t *dp,
+        device_parse_t *command, apr_array_header_t *argv, const char **env,
+        apr_proc_t **proc)
+{
+    apr_status_t status;
+
+    *proc = apr_pcalloc(dp->pool, sizeof(apr_proc_t));
+    if ((status = device_spawn(*proc, command->r.libexec,
+            (const char* const*) argv->elts, env, command->r.sysconf,
+            NULL, NULL, NULL, 0, dp->pool)) != APR_SUCCESS) {
+        dp->p.error = apr_psprintf(dp->pool, "cannot run command: %pm\n", &status);
+        return status;
+    }
+
+    return APR_SUCCESS;
+}
+
+device_parse_t* device_parameter_make(device_t *d, device_parse_t *dp, const char *name,
         device_offset_t *offset, device_parse_t *command, const char **env,
         int completion)
 {
     device_parse_t *parent;
-    apr_file_t *ioread, *iowrite;
+    device_server_t *server;
+    device_memo_t *memo;
     apr_array_header_t *argv;
-    apr_procattr_t *procattr;
+    const char *key;
     apr_proc_t *proc;
+    device_proc_reader_t *reader;
     const char **arg;
     device_name_t *result;
     apr_finfo_t finfo;
     apr_status_t status;
+    int done = 0;
     int skip = 0;
     int count = 0;
     int overflow = DEVICE_MAX_PARAMETERS;
@@ -1413,6 +2478,13 @@ device_parse_t* device_parameter_make(device_parse_t *dp, const char *name,
 
     apr_array_push(argv);
 
+    /* have we asked exactly this before? */
+    key = device_memo_key(dp->pool, command, argv);
+    if ((memo = device_memo_get(d, key))) {
+        device_memo_use(dp, memo);
+        return dp;
+    }
+
     /* sanity check - is sysconf a directory? */
     if ((status = apr_stat(&finfo, command->r.sysconf, APR_FINFO_TYPE, command->pool))) {
         dp->p.error = apr_psprintf(dp->pool, "cannot stat sysconfdir: %pm\n", &status);
@@ -1423,76 +2495,40 @@ device_parse_t* device_parameter_make(device_parse_t *dp, const char *name,
         return dp;
     }
 
-    if ((status = apr_procattr_create(&procattr, dp->pool)) != APR_SUCCESS) {
-        dp->p.error = apr_psprintf(dp->pool, "cannot create procattr: %pm\n", &status);
-        return dp;
-    }
-
-//        if ((status = apr_procattr_detach_set(procattr, 1))
-//                != APR_SUCCESS) {
-//        dp->p.error = apr_psprintf(dp->pool, "cannot set detached in procattr: %pm\n", &status);
-//            break;
-//        }
-
-
-    if ((status = apr_file_pipe_create_ex(&ioread, &iowrite, APR_FULL_BLOCK,
-            dp->pool)) != APR_SUCCESS) {
-        dp->p.error = apr_psprintf(dp->pool, "cannot create pipes: %pm\n", &status);
-        return dp;
-    }
-
-//    if ((status = apr_procattr_child_in_set(procattr, NULL, NULL)) != APR_SUCCESS) {
-//        dp->p.error = apr_psprintf(dp->pool, "cannot set stdin: %pm\n", &status);
-//        return dp;
-//    }
+    /* prefer a warm server, otherwise run the command for this parameter */
+    if ((server = device_server_get(d, command, env))) {
 
-    //        if ((status = apr_procattr_child_out_set(procattr, &iowrite, &ioread)) != APR_SUCCESS) {
-//    if ((status = apr_procattr_child_out_set(procattr, NULL, NULL)) != APR_SUCCESS) {
-//        dp->p.error = apr_psprintf(dp->pool, "cannot set out pipe: %pm\n", &status);
-//        return dp;
-//    }
+        if ((status = device_server_request(server,
+                (const char **)argv->elts + 2, dp->pool)) != APR_SUCCESS) {
+            device_server_stop(server);
+            dp->p.error = apr_psprintf(dp->pool, "cannot send to command: %pm\n", &status);
+            return dp;
+        }
 
-//    if ((status = apr_procattr_child_err_set(procattr, NULL, NULL)) != APR_SUCCESS) {
-//        dp->p.error = apr_psprintf(dp->pool, "cannot set stderr: %pm\n", &status);
-//        return dp;
-//    }
+        server->pending = 1;
 
-    if ((status = apr_procattr_io_set(procattr, APR_CHILD_BLOCK, APR_CHILD_BLOCK,
-            APR_CHILD_BLOCK)) != APR_SUCCESS) {
-        dp->p.error = apr_psprintf(dp->pool, "cannot set io procattr: %pm\n", &status);
-        return dp;
+        proc = server->proc;
+        reader = server->reader;
     }
-
-    if ((status = apr_procattr_dir_set(procattr, command->r.sysconf))
-            != APR_SUCCESS) {
-        dp->p.error = apr_psprintf(dp->pool, "cannot set directory in procattr: %pm\n", &status);
+    else if (APR_SUCCESS != device_parameter_spawn(dp, command, argv, env, &proc)) {
         return dp;
     }
-
-    if ((status = apr_procattr_cmdtype_set(procattr, APR_PROGRAM)) != APR_SUCCESS) {
-        dp->p.error = apr_psprintf(dp->pool, "cannot set command type in procattr: %pm\n", &status);
-        return dp;
-    }
-
-    proc = apr_pcalloc(dp->pool, sizeof(apr_proc_t));
-    if ((status = apr_proc_create(proc, command->r.libexec, (const char* const*) argv->elts,
-            env, procattr, dp->pool)) != APR_SUCCESS) {
-        dp->p.error = apr_psprintf(dp->pool, "cannot run command: %pm\n", &status);
+    else if (APR_SUCCESS != (status = device_proc_reader_make(dp->pool, proc, &reader))) {
+        apr_proc_kill(proc, SIGTERM);
+        apr_proc_wait(proc, NULL, NULL, APR_WAIT);
+        dp->p.error = apr_psprintf(dp->pool, "cannot read from command: %pm\n", &status);
         return dp;
     }
 
-    apr_file_close(proc->in);
-    // apr_file_close(proc->err);
-    // apr_file_close(proc->out);
+    device_inflight(d, server ? NULL : proc, reader->pollset);
 
     /* read the results */
     while (1) {
-        char buf[HUGE_STRING_LEN];
-        apr_size_t buflen = sizeof(buf);
-        char *val = buf + 1;
+        const char *buf;
+        apr_size_t buflen;
         device_proc_std_e what;
 
-        if (APR_SUCCESS == (status = device_proc_gets(dp->pool, proc, buf, &buflen, &what))) {
+        if (APR_SUCCESS == (status = device_proc_getline(reader, &buf, &buflen, &what, -1))) {
 
             /* handle stderr... */
             if (what == DEVICE_PROC_STDERR) {
@@ -1503,6 +2539,14 @@ device_parse_t* device_parameter_make(device_parse_t *dp, const char *name,
                 continue;
             }
 
+            /* a line with a NUL ends a server response */
+            if (server && !buf[0]) {
+                exitcode = atoi(buf + 1);
+                server->pending = 0;
+                done = 1;
+                break;
+            }
+
             /* ...otherwise we deal with stdout */
             if (overflow > 0) {
 
@@ -1511,7 +2555,7 @@ device_parse_t* device_parameter_make(device_parse_t *dp, const char *name,
                 const char *error;
                 device_tokenize_state_t state = { 0 };
 
-                int len = strlen(buf);
+                int len = buflen;
                 char mandatory = buf[0];
 
                 /* silently ignore lines that are too long */
@@ -1526,8 +2570,9 @@ device_parse_t* device_parameter_make(device_parse_t *dp, const char *name,
                 else if (!('-' == mandatory || '*' == mandatory)) {
                     continue;
                 }
+                /* tokenize in place, the line is NUL terminated */
                 else if (APR_SUCCESS
-                        != device_tokenize_to_argv(val, &args, &offsets,
+                        != device_tokenize_to_argv(buf + 1, &args, &offsets,
                                 NULL, &state, &error, dp->pool)) {
                     /* could not parse line, skip */
                     continue;
@@ -1609,6 +2654,12 @@ device_parse_t* device_parameter_make(device_parse_t *dp, const char *name,
                 dp->p.error = apr_psprintf(dp->pool,
                         "more than %d parameters read, not completing.\n",
                         DEVICE_MAX_PARAMETERS);
+
+                /* a server must be drained up to the end of the response */
+                if (server) {
+                    continue;
+                }
+
                 break;
             }
 
@@ -1617,6 +2668,15 @@ device_parse_t* device_parameter_make(device_parse_t *dp, const char *name,
         else if (APR_EOF == status) {
             break;
         }
+        else if (APR_STATUS_IS_EINTR(status)) {
+
+            /* cancelled, abandon the wait */
+            if (device_cancelled(d)) {
+                break;
+            }
+
+            continue;
+        }
         else {
             dp->p.error = apr_psprintf(dp->pool, "cannot read from command: %pm\n", &status);
             break;
@@ -1631,7 +2691,32 @@ device_parse_t* device_parameter_make(device_parse_t *dp, const char *name,
 
     // apr_file_close(proc->out);
 
-    if ((status = apr_proc_wait(proc, &exitcode, &exitwhy, APR_WAIT)) != APR_CHILD_DONE) {
+    device_inflight(d, NULL, NULL);
+
+    device_names_sort(dp->p.keys);
+    device_names_sort(dp->p.requires);
+    device_names_sort(dp->p.values);
+
+    if (server) {
+
+        /* cancelled part way through, the rest is drained next time */
+        if (!done && server->pending && device_cancelled(d)) {
+            dp->p.error = apr_psprintf(dp->pool, "command was cancelled\n");
+            return dp;
+        }
+
+        /* server went away part way through, do not trust it again */
+        else if (!done) {
+            device_server_stop(server);
+            if (!dp->p.error) {
+                dp->p.error = apr_psprintf(dp->pool, "command exited before completing\n");
+            }
+            return dp;
+        }
+
+        exitwhy = APR_PROC_EXIT;
+    }
+    else if ((status = apr_proc_wait(proc, &exitcode, &exitwhy, APR_WAIT)) != APR_CHILD_DONE) {
         dp->p.error = apr_psprintf(dp->pool, "cannot wait for command: %pm\n", &status);
         return dp;
     }
@@ -1642,9 +2727,17 @@ device_parse_t* device_parameter_make(device_parse_t *dp, const char *name,
                         exitwhy == APR_PROC_SIGNAL ? "on signal" :
                                 exitwhy == APR_PROC_SIGNAL_CORE ? "and dumped core" :
                                         "", exitcode);
+    }
+
+    /* a cancelled command says nothing worth remembering */
+    if (device_cancelled(d)) {
+        dp->p.error = apr_psprintf(dp->pool, "command was cancelled\n");
         return dp;
     }
 
+    /* the command ran to the end, remember what it said */
+    device_memo_put(d, key, dp);
+
     return dp;
 }
 
@@ -1708,8 +2801,8 @@ apr_status_t device_parse(device_t *d, const char *arg, device_offset_t *offset,
                     parent->c.libexec, parent->c.sysconf, name->name, d->pathext);
         }
         else if ((name = device_find_name(parent->c.containers, arg))) {
-            *result = current = device_container_make(device_parse_make(parent->pool, parent),
-                    parent->c.libexec, parent->c.sysconf, name->name, d->pathext);
+            *result = current = device_container_make(d, device_parse_make(parent->pool, parent),
+                    parent->c.libexec, parent->c.sysconf, name->name);
         }
 
         /* handle prefix matches with exactly one result */
@@ -1726,8 +2819,8 @@ apr_status_t device_parse(device_t *d, const char *arg, device_offset_t *offset,
                         parent->c.libexec, parent->c.sysconf, rname->name, d->pathext);
             }
             else if (cname) {
-                *result = current = device_container_make(device_parse_make(parent->pool, parent),
-                        parent->c.libexec, parent->c.sysconf, cname->name, d->pathext);
+                *result = current = device_container_make(d, device_parse_make(parent->pool, parent),
+                        parent->c.libexec, parent->c.sysconf, cname->name);
             }
             else {
                 /* theoretically not possible */
@@ -1762,7 +2855,7 @@ apr_status_t device_parse(device_t *d, const char *arg, device_offset_t *offset,
 
         const char **env = device_environment_make(d);
 
-        *result = current = device_parameter_make(device_parse_make(parent->pool, parent), arg,
+        *result = current = device_parameter_make(d, device_parse_make(parent->pool, parent), arg,
                 offset, parent, env, completion);
 
         break;
@@ -1771,7 +2864,7 @@ apr_status_t device_parse(device_t *d, const char *arg, device_offset_t *offset,
 
         const char **env = device_environment_make(d);
 
-        *result = current = device_parameter_make(device_parse_make(parent->pool, parent), arg,
+        *result = current = device_parameter_make(d, device_parse_make(parent->pool, parent), arg,
                 offset, parent->p.command, env, completion);
 
         break;
@@ -1918,15 +3011,93 @@ apr_status_t device_parse(device_t *d, const char *arg, device_offset_t *offset,
     return APR_SUCCESS;
 }
 
+/*
+ * Parse the next token, reusing the parse of the previous line if the
+ * token has not changed. The first changed token drops the remembered
+ * parse from that point onwards.
+ */
+static apr_status_t device_reparse(device_t *d, const char *arg,
+        device_offset_t *offset, int completion, int *count,
+        device_parse_t **current)
+{
+    device_reparse_t *reparse;
+    device_parse_t *previous = *current;
+    apr_status_t status;
+    int equals = offset ? offset->equals : -1;
+    int i;
+
+    if (*count < d->reparse->nelts) {
+
+        reparse = &APR_ARRAY_IDX(d->reparse, *count, device_reparse_t);
+
+        if (reparse->completion == completion && reparse->equals == equals
+                && !strcmp(reparse->arg, arg)) {
+
+            /* offsets belong to the line, not the token */
+            reparse->parse->offset = offset;
+
+            *current = reparse->parse;
+            (*count)++;
+
+            return APR_SUCCESS;
+        }
+
+        /* newest first, children before their parents */
+        for (i = d->reparse->nelts - 1; i >= *count; i--) {
+            reparse = &APR_ARRAY_IDX(d->reparse, i, device_reparse_t);
+            if (reparse->owned) {
+                apr_pool_destroy(reparse->parse->pool);
+            }
+        }
+        d->reparse->nelts = *count;
+    }
+
+    if (APR_SUCCESS != (status = device_parse(d, arg, offset, previous,
+            completion, current))) {
+        return status;
+    }
+
+    /* a cancelled parse is not worth keeping */
+    if (device_cancelled(d)) {
+        if ((*current)->parent == previous) {
+            apr_pool_destroy((*current)->pool);
+        }
+        *current = previous;
+        return APR_EINTR;
+    }
+
+    reparse = apr_array_push(d->reparse);
+    reparse->parse = *current;
+    reparse->equals = equals;
+    reparse->completion = completion;
+    reparse->owned = (*current)->parent == previous;
+    reparse->arg = apr_pstrdup(reparse->owned ? (*current)->pool : d->first->pool, arg);
+
+    (*count)++;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Parse the line for colouring.
+ *
+ * Colouring happens on every keypress, so the parse is kept between
+ * calls and only the tokens from the first change onwards are parsed
+ * again. The parse remains owned by the device, and the pool returned
+ * is always NULL.
+ */
 apr_status_t device_colourise(device_t *d, const char **args,
         device_offset_t *offsets, device_tokenize_state_t state, device_parse_t **result,
         apr_pool_t **pool)
 {
-    device_parse_t *first, *current;
+    device_parse_t *current;
     int i;
     int root = 0;
+    int count = 0;
     apr_status_t status;
 
+    *pool = NULL;
+
     /* detect a comment, and ignore if so */
     if (*args && (*args)[0] == '#') {
         *result = NULL;
@@ -1946,19 +3117,33 @@ apr_status_t device_colourise(device_t *d, const char **args,
         }
     }
 
+#if HAVE_SYS_INOTIFY_H && HAVE_INOTIFY_INIT1
+    device_notify_read(d);
+#endif
+
+    /* has anything changed under the previous parse? */
+    if (d->first && d->reparse_generation != d->generation) {
+        apr_pool_destroy(d->first->pool);
+        d->first = NULL;
+    }
+
     /* initialise the root level */
-    first = current = device_container_make(device_parse_make(d->pool, NULL), d->libexec,
-            d->sysconf, NULL, d->pathext);
+    if (!d->first) {
+        d->first = device_container_make(d, device_parse_make(d->pool, NULL),
+                d->libexec, d->sysconf, NULL);
+        d->reparse->nelts = 0;
+        d->reparse_generation = d->generation;
+    }
+    current = d->first;
 
     /* walk the saved path */
     for (i = 0; !root && d->args && i < d->args->nelts; i++)
     {
         const char *arg = APR_ARRAY_IDX(d->args, i, const char *);
 
-        if (APR_SUCCESS != (status = device_parse(d, arg, NULL, current, 0, &current))) {
+        if (APR_SUCCESS != (status = device_reparse(d, arg, NULL, 0, &count, &current))) {
 
             /* no complete */
-            apr_pool_destroy(first->pool);
             return status;
         }
 
@@ -1979,7 +3164,7 @@ apr_status_t device_colourise(device_t *d, const char **args,
         }
 
         if (APR_SUCCESS != (status =
-                device_parse(d, arg, offsets, current, 1, &current))) {
+                device_reparse(d, arg, offsets, 1, &count, &current))) {
 
             /* this is as far as we can go, ignore everything past this*/
             break;
@@ -1992,7 +3177,6 @@ apr_status_t device_colourise(device_t *d, const char **args,
     }
 
     *result = current;
-    *pool = first->pool;
 
     return APR_SUCCESS;
 }
@@ -2026,8 +3210,8 @@ apr_status_t device_complete(device_t *d, const char **args,
     }
 
     /* initialise the root level */
-    first = current = device_container_make(device_parse_make(d->pool, NULL), d->libexec,
-            d->sysconf, NULL, d->pathext);
+    first = current = device_container_make(d, device_parse_make(d->pool, NULL), d->libexec,
+            d->sysconf, NULL);
 
     /* walk the saved path */
     for (i = 0; !root && d->args && i < d->args->nelts; i++)
@@ -2121,8 +3305,8 @@ apr_status_t device_command(device_t *d, const char **args,
     }
 
     /* initialise the root level */
-    first = current = device_container_make(device_parse_make(d->pool, NULL), d->libexec,
-            d->sysconf, NULL, d->pathext);
+    first = current = device_container_make(d, device_parse_make(d->pool, NULL), d->libexec,
+            d->sysconf, NULL);
 
     /* walk the saved path */
     for (i = 0; !root && d->args && i < d->args->nelts; i++)
@@ -2214,8 +3398,8 @@ apr_status_t device_command(device_t *d, const char **args,
     case DEVICE_PARSE_PARAMETER: {
 
         device_parse_t *command;
+        device_server_t *batch = NULL;
         apr_array_header_t *argv;
-        apr_procattr_t *procattr;
         apr_proc_t *proc;
         const char **arg;
         const char *error = NULL;
@@ -2278,53 +3462,48 @@ apr_status_t device_command(device_t *d, const char **args,
             break;
         }
 
-        if ((status = apr_procattr_create(&procattr, first->pool)) != APR_SUCCESS) {
-            apr_file_printf(d->err, "cannot create procattr: %pm\n", &status);
-            break;
-        }
+        /* stream into the batch where we can */
+        if (d->batching
+                && (batch = device_batch_get(d, command, device_environment_make(d)))
+                && APR_SUCCESS != device_server_request(batch,
+                        (const char **)argv->elts + 2, first->pool)) {
 
-        if ((status = apr_procattr_child_in_set(procattr, d->in, NULL)) != APR_SUCCESS) {
-            apr_file_printf(d->err, "cannot set stdin: %pm\n", &status);
-            break;
+            /* batch went away between lines, nothing has run yet */
+            device_batch_stop(d);
+            batch = NULL;
         }
 
-        if ((status = apr_procattr_child_out_set(procattr, d->out, NULL)) != APR_SUCCESS) {
-            apr_file_printf(d->err, "cannot set stdout: %pm\n", &status);
-            break;
-        }
+        if (batch) {
 
-        if ((status = apr_procattr_child_err_set(procattr, d->err, NULL)) != APR_SUCCESS) {
-            apr_file_printf(d->err, "cannot set stderr: %pm\n", &status);
-            break;
-        }
+            /* the command may change what completes, start afresh */
+            device_memo_clear(d);
 
-//        if ((status = apr_procattr_io_set(procattr, APR_FULL_BLOCK, APR_FULL_BLOCK,
-//                                APR_FULL_BLOCK)) != APR_SUCCESS) {
-//            apr_file_printf(d->err, "cannot set io procattr: %pm\n", &status);
-//            break;
-//        }
+            if ((status = device_server_response(batch, -1, &exitcode, d->out,
+                    d->err)) != APR_SUCCESS) {
+                device_batch_stop(d);
+                apr_file_printf(d->err, "command exited before completing: %pm\n", &status);
+                break;
+            }
 
-        if ((status = apr_procattr_dir_set(procattr, command->r.sysconf))
-                != APR_SUCCESS) {
-            apr_file_printf(d->err, "cannot set directory in procattr: %pm\n", &status);
-            break;
+            exitwhy = APR_PROC_EXIT;
         }
+        else {
 
-        if ((status = apr_procattr_cmdtype_set(procattr, APR_PROGRAM)) != APR_SUCCESS) {
-            apr_file_printf(d->err, "cannot set command type in procattr: %pm\n", &status);
-            break;
-        }
+            proc = apr_pcalloc(first->pool, sizeof(apr_proc_t));
+            if ((status = device_spawn(proc, command->r.libexec, (const char* const*) argv->elts,
+                    device_environment_make(d), command->r.sysconf, d->in, d->out, d->err,
+                    0, first->pool)) != APR_SUCCESS) {
+                apr_file_printf(d->err, "cannot run command: %pm\n", &status);
+                break;
+            }
 
-        proc = apr_pcalloc(first->pool, sizeof(apr_proc_t));
-        if ((status = apr_proc_create(proc, command->r.libexec, (const char* const*) argv->elts,
-                device_environment_make(d), procattr, first->pool)) != APR_SUCCESS) {
-            apr_file_printf(d->err, "cannot run command: %pm\n", &status);
-            break;
-        }
+            /* the command may change what completes, start afresh */
+            device_memo_clear(d);
 
-        if ((status = apr_proc_wait(proc, &exitcode, &exitwhy, APR_WAIT)) != APR_CHILD_DONE) {
-            apr_file_printf(d->err, "cannot wait for command: %pm\n", &status);
-            break;
+            if ((status = apr_proc_wait(proc, &exitcode, &exitwhy, APR_WAIT)) != APR_CHILD_DONE) {
+                apr_file_printf(d->err, "cannot wait for command: %pm\n", &status);
+                break;
+            }
         }
 
         if (exitcode != 0 || exitwhy != APR_PROC_EXIT) {
@@ -2436,6 +3615,26 @@ int main(int argc, const char * const argv[])
         return 1;
     }
 
+    if (APR_SUCCESS != (status = apr_pool_create(&d.cpool, d.pool))) {
+        return 1;
+    }
+
+    d.listings = apr_hash_make(d.cpool);
+    d.paths = apr_hash_make(d.cpool);
+    d.watches = apr_hash_make(d.cpool);
+    d.servers = apr_hash_make(d.cpool);
+    d.memos = apr_hash_make(d.cpool);
+    d.batchless = apr_hash_make(d.cpool);
+    d.reparse = apr_array_make(d.cpool, 16, sizeof(device_reparse_t));
+
+#if HAVE_SYS_INOTIFY_H && HAVE_INOTIFY_INIT1
+    d.notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    apr_pool_cleanup_register(d.cpool, &d, device_notify_cleanup,
+            apr_pool_cleanup_null);
+#else
+    d.notify = -1;
+#endif
+
     apr_file_open_stderr(&d.err, d.pool);
     apr_file_open_stdin(&d.in, d.pool);
     apr_file_open_stdout(&d.out, d.pool);
@@ -24,8 +24,11 @@
 #define DEVICE_H
 
 #include <apr_file_io.h>
+#include <apr_hash.h>
 #include <apr_pools.h>
 #include <apr_tables.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
 
 #define DEVICE_HISTORY ".device_history"
 #define DEVICE_HISTORY_MAXLEN 1000
@@ -37,6 +40,14 @@ typedef struct device_name_t {
     const char *name;
 } device_name_t;
 
+typedef struct device_found_t {
+    const device_name_t *exact;
+    const device_name_t *last;
+    int first;
+    int count;
+    apr_size_t common;
+} device_found_t;
+
 typedef struct device_parse_t device_parse_t;
 
 typedef enum device_type_e {
@@ -75,6 +86,78 @@ typedef struct device_command_t {
     char *sysconf;
 } device_command_t;
 
+/*
+ * A cached listing of a libexec directory, shared between parses.
+ *
+ * Where inotify is available the listing is reused until an event arrives
+ * for the directory, otherwise it is reused for as long as the directory's
+ * device, inode and modification time are unchanged. Each container holding the listing
+ * takes a reference, and a stale listing is freed when the last reference
+ * goes away.
+ */
+typedef struct device_listing_t {
+    apr_pool_t *pool;
+    apr_array_header_t *containers;
+    apr_array_header_t *commands;
+    apr_array_header_t *batches;
+    apr_array_header_t *serves;
+    apr_time_t mtime;
+    apr_time_t scanned;
+    apr_ino_t inode;
+    apr_dev_t device;
+    int watch;
+    int refcount;
+    int stale;
+} device_listing_t;
+
+/*
+ * A libexec directory we have listed, kept for the session so that its
+ * path and inotify watch are reused each time the listing is rescanned.
+ */
+typedef struct device_watch_t {
+    const char *path;
+    int wd;
+} device_watch_t;
+
+/*
+ * A long running "--serve" instance of a command, kept for the session
+ * and used to answer completion requests, or a "--batch" instance used
+ * to run consecutive lines of a script.
+ */
+typedef struct device_server_t {
+    apr_pool_t *pool;
+    apr_proc_t *proc;
+    struct device_proc_reader_t *reader;
+    const char *libexec;
+    int pending;
+} device_server_t;
+
+/*
+ * A remembered completion result for one command and argument list.
+ *
+ * Memos are kept in most recently used order, and like listings are
+ * shared by reference with the parameters that use them.
+ */
+typedef struct device_memo_t device_memo_t;
+
+struct device_memo_t {
+    apr_pool_t *pool;
+    const char *key;
+    device_memo_t *prev;
+    device_memo_t *next;
+    const char *pkey;
+    apr_array_header_t *keys;
+    apr_array_header_t *requires;
+    apr_array_header_t *values;
+    const char *error;
+    char *stderr;
+    apr_size_t stderrlen;
+    apr_time_t created;
+    int required;
+    int refcount;
+    int stale;
+};
+
 typedef struct device_container_t {
     char *libexec;
     char *sysconf;
@@ -119,6 +202,17 @@ typedef struct device_parse_t {
     };
 } device_parse_t;
 
+/*
+ * One token of the previous command line, and what it parsed to.
+ */
+typedef struct device_reparse_t {
+    const char *arg;
+    device_parse_t *parse;
+    int equals;
+    int completion;
+    int owned;
+} device_reparse_t;
+
 typedef struct device_t {
     apr_pool_t *pool;
     apr_pool_t *tpool;
@@ -132,6 +226,26 @@ typedef struct device_t {
     const char *sysconf;
     apr_array_header_t *pathext;
     apr_array_header_t *args;
+    apr_pool_t *cpool;
+    apr_hash_t *listings;
+    apr_hash_t *paths;
+    apr_hash_t *watches;
+    apr_hash_t *servers;
+    apr_hash_t *batchless;
+    device_server_t *batch;
+    apr_hash_t *memos;
+    device_memo_t *mru;
+    device_memo_t *lru;
+    device_parse_t *first;
+    apr_array_header_t *reparse;
+    int generation;
+    int reparse_generation;
+    apr_thread_mutex_t *inflight_mutex;
+    apr_proc_t *inflight;
+    struct apr_pollset_t *inflight_pollset;
+    int cancelled;
+    int batching;
+    int notify;
 } device_t;
 
 typedef enum device_token_escape_e {
@@ -187,6 +301,12 @@ apr_status_t device_tokenize_to_argv(const char *arg_str, const char ***argv_out
 
 const char *device_pescape_shell(apr_pool_t *p, const char *str);
 
+void device_batch_stop(device_t *d);
+
+void device_cancel(device_t *d);
+
+void device_cancel_reset(device_t *d);
+
 void device_save_termios();
 
 void device_restore_termios();
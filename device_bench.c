@@ -0,0 +1,260 @@
+/**
+ *    Copyright (C) 2021 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * device-bench - compare the launch latency of each way we start commands
+ *
+ * Each backend of device_spawn() launches the given program the given
+ * number of times, the program's output piped back as when completing,
+ * and waits for it to exit. The time from launch to exit is reported per
+ * backend. Output is not read, so the program should say little.
+ *
+ * The cost of fork grows with the memory of the parent, so the heap can
+ * first be grown to the size of a long running shell.
+ *
+ * Not installed, run from the build directory.
+ */
+
+#include <apr.h>
+#include <apr_file_io.h>
+#include <apr_general.h>
+#include <apr_getopt.h>
+#include <apr_strings.h>
+#include <apr_thread_proc.h>
+#include <apr_time.h>
+
+#include "config.h"
+#include "device_spawn.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DEVICE_BENCH_COUNT 1000
+#define DEVICE_BENCH_PROGRAM "/bin/true"
+#define DEVICE_BENCH_MB (1024 * 1024)
+
+typedef apr_status_t (*device_bench_launch_f)(apr_proc_t *proc,
+        const char *progname, const char * const *args,
+        const char * const *env, const char *dir, apr_file_t *in,
+        apr_file_t *out, apr_file_t *err, int inpipe, apr_pool_t *pool);
+
+typedef struct device_bench_t {
+    const char *name;
+    device_bench_launch_f launch;
+} device_bench_t;
+
+static const device_bench_t device_benches[] = {
+    { "posix_spawn", device_spawn_posix },
+    { "apr_proc_create", device_spawn_apr },
+    { NULL, NULL }
+};
+
+/*
+ * Launch once, as the shell would, and wait for the exit.
+ */
+static apr_status_t device_bench_launch(const device_bench_t *bench,
+        const char * const *args, apr_pool_t *pool)
+{
+    const char *env[] = { NULL };
+    apr_proc_t proc;
+    apr_exit_why_e exitwhy;
+    apr_status_t status;
+    int exitcode;
+
+    if (APR_SUCCESS != (status = bench->launch(&proc, args[0], args, env,
+            ".", NULL, NULL, NULL, 0, pool))) {
+        return status;
+    }
+
+    status = apr_proc_wait(&proc, &exitcode, &exitwhy, APR_WAIT);
+
+    apr_file_close(proc.out);
+    apr_file_close(proc.err);
+
+    return APR_CHILD_DONE == status ? APR_SUCCESS : status;
+}
+
+static const apr_getopt_option_t
+    cmdline_opts[] =
+{
+    /* commands */
+    { "help", 'h', 0, "  -h, --help\t\t\tDisplay this help message." },
+    { "count", 'n', 1, "  -n, --count=num\t\tLaunch each backend num times. Defaults\n\t\t\t\tto 1000." },
+    { "memory", 'm', 1, "  -m, --memory=mb\t\tGrow the heap by mb megabytes, each page\n\t\t\t\ttouched, before timing. Defaults to 0." },
+    { NULL }
+};
+
+static int help(apr_file_t *out, const char *name, const char *msg, int code,
+        const apr_getopt_option_t opts[])
+{
+    const char *n;
+    int i = 0;
+
+    n = strrchr(name, '/');
+    if (!n) {
+        n = name;
+    }
+    else {
+        n++;
+    }
+
+    apr_file_printf(out,
+            "%s\n"
+            "\n"
+            "NAME\n"
+            "  %s - Compare the launch latency of each backend.\n"
+            "\n"
+            "SYNOPSIS\n"
+            "  %s [-h] [-n num] [-m mb] [program [args...]]\n"
+            "\n"
+            "DESCRIPTION\n"
+            "  Launch the program given, " DEVICE_BENCH_PROGRAM " by default, with\n"
+            "  each backend in turn, and report the mean and fastest time\n"
+            "  from launch to exit. Backends not available are skipped.\n"
+            "\n"
+            "OPTIONS\n", msg ? msg : "", n, n);
+
+    while (opts[i].name) {
+        apr_file_printf(out, "%s\n\n", opts[i].description);
+        i++;
+    }
+
+    return code;
+}
+
+int main(int argc, const char * const argv[])
+{
+    apr_getopt_t *opt;
+    const char *optarg;
+    apr_file_t *out, *err;
+    apr_pool_t *pool;
+    const char * const *args;
+    const char *defaults[] = { DEVICE_BENCH_PROGRAM, NULL };
+    apr_status_t status;
+    apr_int64_t count = DEVICE_BENCH_COUNT, mb = 0;
+    char *heap = NULL;
+    int optch, i, j;
+
+    /* lets get APR off the ground, and make sure it terminates cleanly */
+    if (APR_SUCCESS != (status = apr_app_initialize(&argc, &argv, NULL))) {
+        return 1;
+    }
+    atexit(apr_terminate);
+
+    if (APR_SUCCESS != (status = apr_pool_create(&pool, NULL))) {
+        return 1;
+    }
+
+    apr_file_open_stderr(&err, pool);
+    apr_file_open_stdout(&out, pool);
+
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((status = apr_getopt_long(opt, cmdline_opts, &optch, &optarg))
+            == APR_SUCCESS) {
+
+        switch (optch) {
+        case 'h': {
+            return help(out, argv[0], NULL, 0, cmdline_opts);
+        }
+        case 'n': {
+            char *end;
+
+            count = apr_strtoi64(optarg, &end, 10);
+            if (end[0] || count < 1) {
+                return help(err, argv[0], "The --count must be a positive number.",
+                        EXIT_FAILURE, cmdline_opts);
+            }
+            break;
+        }
+        case 'm': {
+            char *end;
+
+            mb = apr_strtoi64(optarg, &end, 10);
+            if (end[0] || mb < 0) {
+                return help(err, argv[0], "The --memory must be zero or more megabytes.",
+                        EXIT_FAILURE, cmdline_opts);
+            }
+            break;
+        }
+        }
+
+    }
+    if (APR_SUCCESS != status && APR_EOF != status) {
+        return help(err, argv[0], NULL, EXIT_FAILURE, cmdline_opts);
+    }
+
+    args = opt->ind < argc ? argv + opt->ind : defaults;
+
+    /* make the pages resident, as a shell's pools would be */
+    if (mb) {
+        if (!(heap = malloc(mb * DEVICE_BENCH_MB))) {
+            apr_file_printf(err, "cannot grow the heap by %" APR_INT64_T_FMT
+                    "MB.\n", mb);
+            return EXIT_FAILURE;
+        }
+        memset(heap, 1, mb * DEVICE_BENCH_MB);
+    }
+
+    for (i = 0; device_benches[i].name; i++) {
+        apr_interval_time_t total = 0, fastest = 0;
+
+        for (j = 0; j < count; j++) {
+            apr_pool_t *p;
+            apr_time_t start, took;
+
+            apr_pool_create(&p, pool);
+
+            start = apr_time_now();
+
+            status = device_bench_launch(&device_benches[i], args, p);
+
+            if (APR_STATUS_IS_ENOTIMPL(status)) {
+                apr_pool_destroy(p);
+                break;
+            }
+            else if (APR_SUCCESS != status) {
+                apr_file_printf(err, "%s: cannot launch '%s': %pm\n",
+                        device_benches[i].name, args[0], &status);
+                return EXIT_FAILURE;
+            }
+
+            took = apr_time_now() - start;
+
+            total += took;
+            if (!j || took < fastest) {
+                fastest = took;
+            }
+
+            apr_pool_destroy(p);
+        }
+
+        if (j < count) {
+            apr_file_printf(out, "%-16s not available\n",
+                    device_benches[i].name);
+            continue;
+        }
+
+        apr_file_printf(out, "%-16s %" APR_INT64_T_FMT " runs, mean %"
+                APR_INT64_T_FMT "us, fastest %" APR_INT64_T_FMT "us, heap %"
+                APR_INT64_T_FMT "MB\n", device_benches[i].name, count,
+                (apr_int64_t)(total / count), (apr_int64_t)fastest, mb);
+    }
+
+    free(heap);
+
+    return 0;
+}
@@ -30,6 +30,9 @@ int device_read(device_t *d)
 {
     apr_size_t lines = 0;
 
+    /* consecutive lines for the same command share a process */
+    d->batching = 1;
+
     while (1) {
         char result[HUGE_STRING_LEN];
         const char **args;
@@ -64,5 +67,8 @@ int device_read(device_t *d)
         apr_pool_clear(d->tpool);
     }
 
+    device_batch_stop(d);
+    d->batching = 0;
+
     return 0;
 }
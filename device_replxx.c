@@ -27,10 +27,43 @@
 #ifdef HAVE_REPLXX_H
 
 #include <stdlib.h>
+#include <string.h>
 #include <replxx.h>
 
 #include <apr_escape.h>
 #include <apr_strings.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+
+/*
+ * Highlighting runs on a worker thread where we can ask replxx to
+ * repaint once the colours are ready.
+ */
+#define DEVICE_REPLXX_ASYNC (APR_HAS_THREADS && HAVE_REPLXX_BIND_KEY_INTERNAL)
+
+/* a key nobody types, bound to repaint the line */
+#define DEVICE_REPLXX_REPAINT REPLXX_KEY_F24
+
+typedef struct device_replxx_t {
+    device_t *d;
+    Replxx *replxx;
+#if DEVICE_REPLXX_ASYNC
+    apr_pool_t *pool;
+    apr_thread_t *thread;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    char *request;
+    char *latest;
+    char *coloured;
+    ReplxxColor *colours;
+    int size;
+    apr_uint32_t generation;
+    int busy;
+    int exclusive;
+    int shutdown;
+#endif
+} device_replxx_t;
 
 static apr_status_t cleanup_replxx(void *dummy)
 {
@@ -58,10 +91,67 @@ static int utf8str_codepoint_len(char const* s, int utf8len)
     return (codepointLen);
 }
 
+#if DEVICE_REPLXX_ASYNC
+
+/*
+ * Take the device back from the worker, cancelling whatever it was
+ * doing and waiting for it to stop.
+ */
+static void device_replxx_acquire(device_replxx_t *r)
+{
+    if (!r->thread) {
+        return;
+    }
+
+    apr_thread_mutex_lock(r->mutex);
+
+    r->exclusive = 1;
+    r->generation++;
+    free(r->request);
+    r->request = NULL;
+    free(r->latest);
+    r->latest = NULL;
+
+    device_cancel(r->d);
+
+    while (r->busy) {
+        apr_thread_cond_wait(r->cond, r->mutex);
+    }
+
+    device_cancel_reset(r->d);
+
+    apr_thread_mutex_unlock(r->mutex);
+}
+
+/*
+ * Hand the device back to the worker.
+ */
+static void device_replxx_release(device_replxx_t *r)
+{
+    if (!r->thread) {
+        return;
+    }
+
+    apr_thread_mutex_lock(r->mutex);
+
+    r->exclusive = 0;
+    apr_thread_cond_broadcast(r->cond);
+
+    apr_thread_mutex_unlock(r->mutex);
+}
+
+#else
+
+#define device_replxx_acquire(r)
+#define device_replxx_release(r)
+
+#endif
+
 static void device_completion_hook(char const *context, replxx_completions *lc,
         int *contextLen, void *ud)
 {
-    device_t *d = ud;
+    device_replxx_t *r = ud;
+    device_t *d = r->d;
     apr_pool_t *pool = NULL;
     const char **args;
     const char *error;
@@ -72,6 +162,8 @@ static void device_completion_hook(char const *context, replxx_completions *lc,
     apr_status_t status;
     int i;
 
+    device_replxx_acquire(r);
+
     device_save_termios();
 
     if (APR_SUCCESS
@@ -242,11 +334,13 @@ static void device_completion_hook(char const *context, replxx_completions *lc,
     }
 
     device_restore_termios();
+
+    device_replxx_release(r);
 }
 
-static void device_colour_hook(char const *context, ReplxxColor *colours, int size, void *ud)
+static void device_colour_line(device_t *d, char const *context,
+        ReplxxColor *colours, int size)
 {
-    device_t *d = ud;
     apr_pool_t *pool = NULL;
     const char **args;
     const char *buffer;
@@ -259,8 +353,6 @@ static void device_colour_hook(char const *context, ReplxxColor *colours, int si
     apr_status_t status;
     int i;
 
-    device_save_termios();
-
     if (APR_SUCCESS != device_tokenize_to_argv(context, &args, &offsets, &states, &state, &error, d->tpool)) {
 
         /* colourise the error */
@@ -341,6 +433,184 @@ static void device_colour_hook(char const *context, ReplxxColor *colours, int si
     if (pool) {
         apr_pool_destroy(pool);
     }
+}
+
+#if DEVICE_REPLXX_ASYNC
+
+/*
+ * Colour each line handed over by the highlighter, and ask replxx to
+ * repaint if the line is still current once we are done.
+ */
+static void * APR_THREAD_FUNC device_colour_worker(apr_thread_t *thread,
+        void *data)
+{
+    device_replxx_t *r = data;
+
+    apr_thread_mutex_lock(r->mutex);
+
+    while (!r->shutdown) {
+
+        ReplxxColor *colours;
+        char *request;
+        apr_uint32_t generation;
+        int size;
+
+        if (!r->request || r->exclusive) {
+            apr_thread_cond_wait(r->cond, r->mutex);
+            continue;
+        }
+
+        request = r->request;
+        r->request = NULL;
+        generation = r->generation;
+        r->busy = 1;
+
+        device_cancel_reset(r->d);
+
+        apr_thread_mutex_unlock(r->mutex);
+
+        size = utf8str_codepoint_len(request, strlen(request));
+        colours = apr_pcalloc(r->pool, (size + 1) * sizeof(ReplxxColor));
+        for (int i = 0; i < size; i++) {
+            colours[i] = REPLXX_COLOR_DEFAULT;
+        }
+
+        device_colour_line(r->d, request, colours, size);
+
+        apr_thread_mutex_lock(r->mutex);
+
+        r->busy = 0;
+
+        if (generation == r->generation) {
+
+            free(r->coloured);
+            r->coloured = request;
+            r->colours = realloc(r->colours, (size + 1) * sizeof(ReplxxColor));
+            memcpy(r->colours, colours, size * sizeof(ReplxxColor));
+            r->size = size;
+
+            replxx_emulate_key_press(r->replxx, DEVICE_REPLXX_REPAINT);
+        }
+        else {
+            free(request);
+        }
+
+        /* someone may be waiting for us to stop */
+        apr_thread_cond_broadcast(r->cond);
+
+        apr_pool_clear(r->pool);
+    }
+
+    apr_thread_mutex_unlock(r->mutex);
+
+    apr_thread_exit(thread, APR_SUCCESS);
+
+    return NULL;
+}
+
+/*
+ * Return the last known colours straight away, and queue the line for
+ * the worker. Anything the worker was still doing is now stale, and is
+ * cancelled.
+ */
+static void device_colour_hook(char const *context, ReplxxColor *colours, int size, void *ud)
+{
+    device_replxx_t *r = ud;
+
+    apr_thread_mutex_lock(r->mutex);
+
+    /* not coloured, and not already being coloured? */
+    if ((!r->coloured || strcmp(r->coloured, context))
+            && (!r->latest || strcmp(r->latest, context))) {
+
+        r->generation++;
+        free(r->request);
+        r->request = strdup(context);
+        free(r->latest);
+        r->latest = strdup(context);
+
+        device_cancel(r->d);
+
+        apr_thread_cond_broadcast(r->cond);
+    }
+
+    if (r->colours) {
+        memcpy(colours, r->colours,
+                (size < r->size ? size : r->size) * sizeof(ReplxxColor));
+    }
+
+    apr_thread_mutex_unlock(r->mutex);
+}
+
+static apr_status_t device_replxx_cleanup(void *data)
+{
+    device_replxx_t *r = data;
+    apr_status_t status;
+
+    apr_thread_mutex_lock(r->mutex);
+    r->shutdown = 1;
+    apr_thread_cond_broadcast(r->cond);
+    apr_thread_mutex_unlock(r->mutex);
+
+    device_cancel(r->d);
+
+    apr_thread_join(&status, r->thread);
+
+    r->d->inflight_mutex = NULL;
+
+    free(r->request);
+    free(r->latest);
+    free(r->coloured);
+    free(r->colours);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t device_replxx_async(device_replxx_t *r)
+{
+    device_t *d = r->d;
+    apr_status_t status;
+
+    /* the device starts out ours */
+    r->exclusive = 1;
+
+    if (APR_SUCCESS != (status = apr_pool_create(&r->pool, d->pool))
+            || APR_SUCCESS != (status = apr_thread_mutex_create(&r->mutex,
+                    APR_THREAD_MUTEX_DEFAULT, d->pool))
+            || APR_SUCCESS != (status = apr_thread_cond_create(&r->cond,
+                    d->pool))
+            || APR_SUCCESS != (status = apr_thread_mutex_create(
+                    &d->inflight_mutex, APR_THREAD_MUTEX_DEFAULT, d->pool))
+            || APR_SUCCESS != (status = apr_thread_create(&r->thread, NULL,
+                    device_colour_worker, r, d->pool))) {
+        d->inflight_mutex = NULL;
+        r->thread = NULL;
+        return status;
+    }
+
+    apr_pool_cleanup_register(d->pool, r, device_replxx_cleanup,
+            apr_pool_cleanup_null);
+
+    replxx_bind_key_internal(r->replxx, DEVICE_REPLXX_REPAINT, "repaint");
+
+    replxx_set_highlighter_callback(r->replxx, device_colour_hook, r);
+
+    return APR_SUCCESS;
+}
+
+#endif
+
+/*
+ * The worker runs alongside replxx_input(), so the terminal is saved and
+ * restored on the main thread only.
+ */
+static void device_colour_sync_hook(char const *context, ReplxxColor *colours, int size, void *ud)
+{
+    device_replxx_t *r = ud;
+
+    device_save_termios();
+
+    device_colour_line(r->d, context, colours, size);
 
     device_restore_termios();
 }
@@ -355,6 +625,7 @@ static const char *device_prompt(device_t *d)
 
 int device_replxx(device_t *d)
 {
+    device_replxx_t *r;
     apr_size_t lines = 0;
 
     const char *home = getenv("HOME");
@@ -363,11 +634,22 @@ int device_replxx(device_t *d)
 
     apr_pool_cleanup_register(d->pool, replxx, cleanup_replxx, cleanup_replxx);
 
+    r = apr_pcalloc(d->pool, sizeof(device_replxx_t));
+    r->d = d;
+    r->replxx = replxx;
+
     replxx_install_window_change_handler(replxx);
     replxx_set_unique_history(replxx, 1);
     replxx_set_word_break_characters(replxx, " \t\"'=");
-    replxx_set_completion_callback(replxx, device_completion_hook, d);
-    replxx_set_highlighter_callback(replxx, device_colour_hook, d);
+    replxx_set_completion_callback(replxx, device_completion_hook, r);
+    replxx_set_highlighter_callback(replxx, device_colour_sync_hook, r);
+
+#if DEVICE_REPLXX_ASYNC
+    if (APR_SUCCESS != device_replxx_async(r)) {
+        apr_file_printf(d->err, "cannot highlight in the background, "
+                "highlighting as we type\n");
+    }
+#endif
 
     if (home) {
         if (APR_SUCCESS == apr_filepath_set(home, d->pool)) {
@@ -384,7 +666,12 @@ int device_replxx(device_t *d)
         const char *error;
 
         do {
-            result = replxx_input(replxx, device_prompt(d));
+            const char *prompt = device_prompt(d);
+
+            device_replxx_release(r);
+            result = replxx_input(replxx, prompt);
+            device_replxx_acquire(r);
+
         } while ( ( result == NULL ) && ( errno == EAGAIN ) );
 
         if (result == NULL) {
@@ -21,12 +21,15 @@
  */
 
 #include <apr.h>
+#include <apr_atomic.h>
 #include <apr_env.h>
 #include <apr_escape.h>
 #include <apr_file_io.h>
+#include <apr_general.h>
 #include <apr_getopt.h>
 #include <apr_lib.h>
 #include <apr_hash.h>
+#include <apr_mmap.h>
 #include <apr_strings.h>
 #include <apr_thread_proc.h>
 #include <apr_uri.h>
@@ -65,6 +68,15 @@
 #if HAVE_LIBGEN_H
 #include <libgen.h>
 #endif
+#if HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_LIBURING_H
+#include <liburing.h>
+#endif
 
 #define DEVICE_OPTIONAL 257
 #define DEVICE_REQUIRED 258
@@ -137,6 +149,16 @@
 #define DEVICE_SHOW_FLAGS 325
 #define DEVICE_SHOW_TABLE 326
 #define DEVICE_COMMAND 327
+#define DEVICE_SERVE 328
+#define DEVICE_BATCH 329
+#define DEVICE_SCHEMA 330
+#define DEVICE_REBUILD_NAMES 331
+#define DEVICE_INDEX_GAP 332
+#define DEVICE_SYNC 333
+#define DEVICE_TRANSACTION 334
+#define DEVICE_EXPORT_RECORDS 335
+#define DEVICE_IMPORT_RECORDS 336
+#define DEVICE_USER_TTL 337
 
 #define DEVICE_INDEX_SUFFIX ".txt"
 #define DEVICE_TXT_SUFFIX ".txt"
@@ -161,6 +183,9 @@ typedef enum device_mode_e {
     DEVICE_SHOW,
     DEVICE_LIST,
     DEVICE_EXEC,
+    DEVICE_REBUILD,
+    DEVICE_EXPORT,
+    DEVICE_IMPORT,
 } device_mode_e;
 
 typedef struct device_set_t {
@@ -192,11 +217,34 @@ typedef struct device_set_t {
     const char *relation_suffix;
     int relation_suffix_len;
     apr_hash_t *schemes;
+    apr_hash_t *prefetch;
+    apr_array_header_t *staged;
+    apr_array_header_t *renames;
+    apr_hash_t *pending;
     char ** argv;
+    unsigned int sync:1;
     device_mode_e mode;
 } device_set_t;
 
+typedef struct device_prefetch_t {
+    const char *val;
+    apr_off_t len;
+    mode_t mode;
+} device_prefetch_t;
+
 #define DEVICE_ERROR_MAX 80
+
+#define DEVICE_LIST_WORKERS 8
+
+#define DEVICE_PREFETCH_BATCH 256
+#define DEVICE_PREFETCH_MAX 4096
+#define DEVICE_KEYDIR_UNOPENED -2
+
+#define DEVICE_NAMES_DIR ".names"
+#define DEVICE_NAMES_LOCK DEVICE_NAMES_DIR "/.lock"
+#define DEVICE_NAMES_MAGIC "DEVNAME1"
+#define DEVICE_NAMES_MAGIC_LEN 8
+#define DEVICE_CATALOGUE_MAGIC_LEN 8
 #define DEVICE_ID_MAX 255
 #define DEVICE_PORT_MIN 0
 #define DEVICE_PORT_MAX 65535
@@ -206,9 +254,14 @@ typedef struct device_set_t {
 #define DEVICE_HOSTNAME_MAX 63
 #define DEVICE_SELECT_MAX 80
 #define DEVICE_SELECT_NONE "none"
+#define DEVICE_SELECT_MAGIC "DEVSELC1"
+#define DEVICE_SELECTS_DIR ".selects"
 #define DEVICE_SYMLINK_MAX 80
 #define DEVICE_SYMLINK_NONE "none"
 #define DEVICE_SYMLINK_ERROR "[missing]"
+#define DEVICE_SYMLINKS_DIR ".symlinks"
+#define DEVICE_SYMLINKS_MAGIC "DEVSYML1"
+#define DEVICE_SYMLINKS_SEP '\001'
 #define DEVICE_SQL_IDENTIFIER_DEFAULT_MIN 1
 #define DEVICE_SQL_IDENTIFIER_DEFAULT_MAX 63
 #define DEVICE_FILE_UMASK (0x0113)
@@ -219,12 +272,18 @@ typedef struct device_set_t {
 #define DEVICE_HEX_CASE_VAL DEVICE_IS_LOWER
 #define DEVICE_HEX_WIDTH_VAL 0
 #define DEVICE_HEX_WIDTH_MAX 16
+#define DEVICE_INDEX_GAP_DEFAULT 1
 #define DEVICE_TEXT_MIN_DEFAULT 0
 #define DEVICE_TEXT_MAX_DEFAULT 255
 #define DEVICE_TEXT_FORMAT_DEFAULT "UTF-8"
 #define DEVICE_URL_PATH_MAX_DEFAULT 256
 #define DEVICE_URI_MAX_DEFAULT 256
 #define DEVICE_USER_NONE "none"
+#define DEVICE_USER_TTL_DEFAULT 300
+#define DEVICE_USERS_DIR ".users"
+#define DEVICE_USERS_MAGIC "DEVUSER1"
+#define DEVICE_USERS_PASSWD "/etc/passwd"
+#define DEVICE_USERS_GROUP "/etc/group"
 #define DEVICE_ADDRESS_MAX_DEFAULT 256
 #define DEVICE_ADDRESS_NOQUOTES_DEFAULT 1
 #define DEVICE_ADDRESS_FILESAFE_DEFAULT 0
@@ -307,6 +366,10 @@ typedef struct device_pair_selects_t {
     apr_array_header_t *bases;
 } device_pair_selects_t;
 
+typedef struct device_pair_index_t {
+    apr_int64_t gap;
+} device_pair_index_t;
+
 typedef struct device_pair_bytes_t {
     apr_uint64_t min;
     apr_uint64_t max;
@@ -337,6 +400,7 @@ typedef struct device_pair_sqlid_t {
 
 typedef struct device_pair_users_t {
     apr_array_header_t *groups;
+    apr_int64_t ttl;
 } device_pair_users_t;
 
 typedef struct device_pair_polars_t {
@@ -393,6 +457,7 @@ typedef struct device_pair_t {
     device_index_e index;
     device_set_e set;
     union {
+        device_pair_index_t ix;
         device_pair_bytes_t b;
         device_pair_selects_t sl;
         device_pair_symlinks_t s;
@@ -414,7 +479,6 @@ typedef struct device_file_t {
     const char *key;
     char *template;
     const char *dest;
-    const char *backup;
     const char *val;
     const char *link;
     apr_int64_t order;
@@ -422,6 +486,17 @@ typedef struct device_file_t {
     apr_filetype_e type;
 } device_file_t;
 
+/*
+ * A name link to move once the files of a transaction are written, and
+ * the option set whose entry in the names catalogue is to be refreshed.
+ */
+typedef struct device_rename_t {
+    const char *key;
+    const char *keypath;
+    const char *from;
+    const char *to;
+} device_rename_t;
+
 typedef struct device_value_t {
     device_pair_t *pair;
     const char *value;
@@ -458,6 +533,10 @@ static const apr_getopt_option_t
         "  -v, --version\t\t\tDisplay the version number." },
     { "base", 'b', 1, "  -b, --base=path\t\tBase path in which to search for option files." },
     { "complete", 'c', 0, "  -c, --complete\t\tOutput values so the device shell can perform\n\t\t\t\tcommand line completion. Each completion is\n\t\t\t\tprefixed with '-' for optional completions and\n\t\t\t\t'*' for required completions. All non-prefixed\n\t\t\t\tstrings are ignored." },
+    { "serve", DEVICE_SERVE, 0, "  --serve\t\t\tAnswer a series of completion requests read from\n\t\t\t\tstdin, as a persistent alternative to --complete.\n\t\t\t\tEach request is a list of netstring encoded\n\t\t\t\targuments ('len:bytes,') ending with a newline.\n\t\t\t\tEach response is the output of --complete,\n\t\t\t\tfollowed by a line containing a NUL character\n\t\t\t\tand the exit code. An empty response is sent on\n\t\t\t\tstartup. Errors are written to stdout. The shell\n\t\t\t\tuses --serve only for commands with a file\n\t\t\t\t'.<command>.serve' beside them in libexec." },
+    { "batch", DEVICE_BATCH, 0, "  --batch\t\t\tRun a series of requests read from stdin, each as\n\t\t\t\tif passed as arguments to a separate run. Each\n\t\t\t\trequest is a list of netstring encoded arguments\n\t\t\t\t('len:bytes,') ending with a newline. Each\n\t\t\t\tresponse is the output of the run, followed by a\n\t\t\t\tline containing a NUL character and the exit\n\t\t\t\tcode. An empty response is sent on startup, with\n\t\t\t\ta non zero exit code if the mode does not\n\t\t\t\tsupport batches. The shell uses --batch only for\n\t\t\t\tcommands with a file '.<command>.batch' beside\n\t\t\t\tthem in libexec." },
+    { "transaction", DEVICE_TRANSACTION, 0, "  --transaction\t\t\tLike --batch, but for --set only, and with all\n\t\t\t\trequests written as one. Each request is checked\n\t\t\t\tand answered as it arrives, but nothing is\n\t\t\t\twritten until stdin is closed. Then, if every\n\t\t\t\trequest succeeded, all are written at once,\n\t\t\t\totherwise none are. A last response gives the\n\t\t\t\toutcome. Requests are each checked against the\n\t\t\t\toptions as earlier requests left them." },
+    { "schema", DEVICE_SCHEMA, 1, "  --schema=file\t\t\tCache the options declared after this in the\n\t\t\t\tfile given, and read them from the cache on\n\t\t\t\tlater runs with the same declarations. Must be\n\t\t\t\tthe first argument." },
     { "optional", DEVICE_OPTIONAL, 0, "  --optional\t\t\tOptions declared after this are optional. This\n\t\t\t\tis the default." },
     { "required", DEVICE_REQUIRED, 0, "  --required\t\t\tOptions declared after this are required." },
     { "add", 'a', 1, "  -a, --add=name\t\tAdd a new set of options, named by the key\n\t\t\t\tspecified, which becomes required. A file \n\t\t\t\tcalled '" DEVICE_ADD_MARKER "' will be created in the newly\n\t\t\t\tcreated directory to indicate the directory\n\t\t\t\tshould be processed." },
@@ -465,6 +544,10 @@ static const apr_getopt_option_t
     { "mark", 'm', 1, "  -m, --mark=name\t\tMark a set of options for removal, named by the\n\t\t\t\tkey specified. The actual removal is expected\n\t\t\t\tto be done by the script that processes this\n\t\t\t\toption. A file called '" DEVICE_REMOVE_MARKER "' will be created\n\t\t\t\tin the directory to indicate the directory\n\t\t\t\tshould be processed for removal." },
     { "set", 's', 1, "  -s, --set=name\t\tSet an option among a set of options, named by\n\t\t\t\tthe key specified. A file called '" DEVICE_SET_MARKER "' is\n\t\t\t\tcreated to indicate that settings should be\n\t\t\t\tprocessed for update." },
     { "rename", 'n', 1, "  -n, --rename=name\t\tRename an option among a set of options, named by\n\t\t\t\tthe key specified. Other options may be set at\n\t\t\t\tthe same time. A file called '" DEVICE_SET_MARKER "' is\n\t\t\t\tcreated to indicate that settings should be\n\t\t\t\tprocessed for update." },
+    { "sync", DEVICE_SYNC, 0, "  --sync\t\t\tFlush options to stable storage as they are\n\t\t\t\twritten, so that a crash leaves either the old\n\t\t\t\tor the new options in place. All options\n\t\t\t\twritten at once share a single flush." },
+    { "rebuild", DEVICE_REBUILD_NAMES, 1, "  --rebuild=name\t\tRebuild the catalogue used to find each set of\n\t\t\t\toptions by the key specified. The catalogue is\n\t\t\t\tkept up to date as options are changed, and\n\t\t\t\trebuilt when sets are added or removed by other\n\t\t\t\tmeans. Use this to repair it should it drift." },
+    { "export", DEVICE_EXPORT_RECORDS, 1, "  --export=name\t\tWrite every set of options, named by the key\n\t\t\t\tspecified, to stdout as tab separated values.\n\t\t\t\tThe first line names the options, the key first,\n\t\t\t\tand each line after holds one set, in order of\n\t\t\t\tthe key. Backslash, tab, newline and carriage\n\t\t\t\treturn are escaped as \\\\, \\t, \\n and \\r, and\n\t\t\t\toptions that are not set are written as \\N." },
+    { "import", DEVICE_IMPORT_RECORDS, 1, "  --import=name\t\tRead sets of options, named by the key specified,\n\t\t\t\tfrom stdin in the format written by --export.\n\t\t\t\tSets that exist are updated, and others added.\n\t\t\t\tOptions given as \\N, or already holding the\n\t\t\t\tvalue given, are left alone. Indexes are given\n\t\t\t\tonce all sets are in, lowest first, so that each\n\t\t\t\tends up as given." },
     { "reindex", 'r', 1, "  -r, --reindex=name\t\tReindex all options of type index, removing gaps\n\t\t\t\tin numbering. Multiple indexes can be specified\n\t\t\t\tat the same time." },
     { "show", 'g', 1, "  -g, --show=name\t\tShow options in a set of options, named by\n\t\t\t\tthe key specified. To show\n\t\t\t\tunindexed options in the current directory,\n\t\t\t\tspecify '-'." },
 #if 1
@@ -475,6 +558,7 @@ static const apr_getopt_option_t
 #endif
     { "default", DEVICE_DEFAULT, 1, "  --default=value\t\tSet the default value of this option to be\n\t\t\t\tdisplayed when unset. Defaults to 'none'." },
     { "index", DEVICE_INDEX, 1, "  --index=name\t\t\tSet the index of this option within a set of\n\t\t\t\toptions. If set to a positive integer starting\n\t\t\t\tfrom zero, this option will be inserted at the\n\t\t\t\tgiven index and higher options moved one up to\n\t\t\t\tfit. If unset, or if larger than the index of\n\t\t\t\tthe last option, this option will be set as the\n\t\t\t\tlast option and others moved down to fit. If\n\t\t\t\tnegative, the option will be inserted at the\n\t\t\t\tend counting backwards." },
+    { "index-gap", DEVICE_INDEX_GAP, 1, "  --index-gap=gap\t\tSpacing between the indexes given to options by\n\t\t\t\tthe next index option, leaving room to insert\n\t\t\t\twithout moving the options that follow. Inserts\n\t\t\t\tmove options only as far as the next unused\n\t\t\t\tindex. Defaults to one." },
 #if 0
     { "unique", DEVICE_UNIQUE, 1, "  --unique=name[,name]\tForce the set of options to be unique. A search will be performed of the given options, and if found, the attempt to add or set will fail." },
 #endif
@@ -505,6 +589,7 @@ static const apr_getopt_option_t
     { "sql-id-minimum", DEVICE_SQL_IDENTIFIER_MIN, 1, "  --sql-id-minimum=chars\tMinimum length used by the next\n\t\t\t\tsql-id/sql-delimited-id option. Defaults to 1." },
     { "sql-id-maximum", DEVICE_SQL_IDENTIFIER_MAX, 1, "  --sql-id-maximum=chars\tMaximum length used by the next\n\t\t\t\tsql-id/sql-delimited-id option. Defaults to 63." },
     { "user-group", DEVICE_USER_GROUP, 1, "  --unix-group=name\t\tLimit usernames to members of the given group. May\n\t\t\t\tbe specified more than once." },
+    { "user-ttl", DEVICE_USER_TTL, 1, "  --user-ttl=seconds\t\tHow long the next user option may keep a snapshot\n\t\t\t\tof the users and groups before asking the system\n\t\t\t\tagain. Changes to /etc/passwd and /etc/group are\n\t\t\t\tseen at once. Zero disables the snapshot. Defaults\n\t\t\t\tto 300." },
     { "user", DEVICE_USER, 1, "  --user=name\t\t\tParse a user that exists on the system." },
     { "distinguished-name", DEVICE_DISTINGUISHED_NAME, 1, "  --distinguished-name=name\tParse an RFC4514 Distinguished Name." },
     { "relation-base", DEVICE_RELATION_BASE, 1, "  --relation-base=path\t\tBase path containing targets for related indexes.\n\t\t\t\tMore than one path can be specified. In the case\n\t\t\t\tof collision, the earliest match wins." },
@@ -800,14 +885,14 @@ static int files_asc(const void *a, const void *b)
 {
     const device_file_t *fa = a, *fb = b;
 
-    return fa->order - fb->order;
+    return (fa->order > fb->order) - (fa->order < fb->order);
 }
 
 static int files_desc(const void *a, const void *b)
 {
     const device_file_t *fa = a, *fb = b;
 
-    return fb->order - fa->order;
+    return (fb->order > fa->order) - (fb->order < fa->order);
 }
 
 static int values_asc(const void *a, const void *b)
@@ -870,88 +955,454 @@ static const char * device_hash_to_string(apr_pool_t *pool, apr_hash_t *hash)
     return buf;
 }
 
-static apr_status_t device_file_open(device_set_t *ds, apr_pool_t *pool,
-        const char *key, const char *filename, apr_file_t **file,
-        apr_off_t *len)
+/*
+ * Open an option set directory, so that each of its options can be found
+ * by name without walking the path again. Without a directory the current
+ * directory is used. Returns -1 on failure, with errno set.
+ */
+static int device_keydir_open(const char *keypath)
+{
+    return keypath ? open(keypath, O_RDONLY | O_DIRECTORY | O_CLOEXEC) :
+            AT_FDCWD;
+}
+
+static void device_keydir_close(int dirfd)
 {
-    apr_file_t *in;
-    apr_off_t end = 0, start = 0;
+    if (dirfd >= 0) {
+        close(dirfd);
+    }
+}
+
+/*
+ * An option set directory, opened on first use, where dirfd starts out
+ * as DEVICE_KEYDIR_UNOPENED. Close with device_keydir_close().
+ */
+static int device_keydir_get(const char *keypath, int *dirfd)
+{
+    if (*dirfd == DEVICE_KEYDIR_UNOPENED) {
+        *dirfd = device_keydir_open(keypath);
+    }
+
+    return *dirfd;
+}
+
+/*
+ * What device_file_prefetch() found of the option, if anything.
+ *
+ * A mode of zero says the option is missing, and a value is only present
+ * when the option was read.
+ */
+static device_prefetch_t *device_file_prefetched(device_set_t *ds,
+        apr_pool_t *pool, const char *keypath, const char *name)
+{
+    if (!ds->prefetch) {
+        return NULL;
+    }
+
+    return apr_hash_get(ds->prefetch,
+            keypath ? apr_pstrcat(pool, keypath, "/", name, NULL) : name,
+            APR_HASH_KEY_STRING);
+}
+
+/*
+ * Stat a file within the directory, as an apr_status_t.
+ */
+static apr_status_t device_file_statat(int dirfd, const char *name,
+        int flags, struct stat *st)
+{
+    return fstatat(dirfd, name, st, flags) ? apr_get_os_error() : APR_SUCCESS;
+}
+
+/*
+ * Stat an option within the option set, unless device_file_prefetch()
+ * already found its type, in which case only st_mode is filled in. The
+ * directory is opened only when it must be.
+ */
+static apr_status_t device_file_lookupat(device_set_t *ds,
+        const char *keypath, int *dirfd, const char *name, int flags,
+        struct stat *st)
+{
+    device_prefetch_t *pf;
+
+    if ((pf = device_file_prefetched(ds, ds->pool, keypath, name))) {
+        st->st_mode = pf->mode;
+        return pf->mode ? APR_SUCCESS : APR_ENOENT;
+    }
+
+    return device_file_statat(device_keydir_get(keypath, dirfd), name, flags, st);
+}
+
+/*
+ * Read the first line of an option file within the directory, trimmed.
+ *
+ * Anything already read by device_file_prefetch() is used as is, otherwise
+ * the file is found by name relative to dirfd, opened on first use.
+ */
+static apr_status_t device_file_readat(device_set_t *ds, apr_pool_t *pool,
+        const char *key, int *dirfd, const char *keypath, const char *name,
+        const char **value, apr_off_t *len)
+{
+    device_prefetch_t *pf;
+    struct stat st;
+    char *val, *eol;
+    apr_off_t got = 0;
+    apr_ssize_t rv;
+    int fd;
 
     apr_status_t status = APR_SUCCESS;
 
+    /* already read along with its neighbours? */
+    if ((pf = device_file_prefetched(ds, pool, keypath, name)) && pf->val) {
+        const char *eol = memchr(pf->val, '\n', pf->len);
+
+        /* the first line only */
+        val = apr_pstrmemdup(pool, pf->val, eol ? eol - pf->val + 1 : pf->len);
+
+        value[0] = trim(val);
+        len[0] = pf->len;
+
+        return APR_SUCCESS;
+    }
+
     /* open the file */
-    if (APR_SUCCESS
-            != (status = apr_file_open(&in, filename, APR_FOPEN_READ,
-                    APR_FPROT_OS_DEFAULT, pool))) {
+    if ((fd = openat(device_keydir_get(keypath, dirfd), name,
+            O_RDONLY | O_CLOEXEC)) < 0) {
+        status = apr_get_os_error();
         apr_file_printf(ds->err, "cannot open option '%s': %pm\n", key,
                 &status);
+        return status;
     }
 
     /* how long is the key? */
-    else if (APR_SUCCESS
-            != (status = apr_file_seek(in, APR_END, &end))) {
-        apr_file_printf(ds->err, "cannot seek end of option '%s': %pm\n", key,
+    if (fstat(fd, &st)) {
+        status = apr_get_os_error();
+        apr_file_printf(ds->err, "cannot stat option '%s': %pm\n", key,
                 &status);
+        close(fd);
+        return status;
     }
 
-    /* back to the beginning */
-    else if (APR_SUCCESS
-            != (status = apr_file_seek(in, APR_SET, &start))) {
-        apr_file_printf(ds->err, "cannot seek start of option '%s': %pm\n", key,
-                &status);
+    val = apr_palloc(pool, st.st_size + 1);
+
+    while (got < st.st_size) {
+        rv = read(fd, val + got, st.st_size - got);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (rv < 0) {
+            status = apr_get_os_error();
+            apr_file_printf(ds->err, "cannot read option set '%s': %pm\n", key,
+                    &status);
+            close(fd);
+            return status;
+        }
+        else if (!rv) {
+            break;
+        }
+        got += rv;
     }
 
-    else {
-        file[0] = in;
-        len[0] = end;
+    close(fd);
+
+    val[got] = 0;
+
+    /* the first line only */
+    if ((eol = memchr(val, '\n', got))) {
+        eol[1] = 0;
     }
 
-    return status;
+    value[0] = trim(val);
+    len[0] = st.st_size;
+
+    return APR_SUCCESS;
 }
 
-static apr_status_t device_file_read(device_set_t *ds, apr_pool_t *pool,
-        const char *key, const char *filename, const char **value,
-        apr_off_t *len)
+#if HAVE_LIBURING_H
+typedef struct device_prefetch_path_t {
+    const char *dir;
+    const char *name;
+    const char *path;
+    int link;
+} device_prefetch_path_t;
+
+/*
+ * The buffers of a batch, kept apart from any pool so that they can be
+ * left to the kernel should we lose track of what it is doing with them.
+ */
+typedef struct device_prefetch_batch_t {
+    char bufs[DEVICE_PREFETCH_BATCH][DEVICE_PREFETCH_MAX];
+    struct statx stx[DEVICE_PREFETCH_BATCH];
+} device_prefetch_batch_t;
+
+/*
+ * Submit what was prepared, riding out signals. Returns how many the
+ * kernel took.
+ */
+static int device_prefetch_submit(struct io_uring *ring, int prepared)
 {
-    apr_file_t *in;
+    int submitted = 0, rv;
+
+    while (submitted < prepared) {
+        rv = io_uring_submit(ring);
+        if (rv == -EINTR) {
+            continue;
+        }
+        else if (rv <= 0) {
+            break;
+        }
+        submitted += rv;
+    }
 
-    char *val = NULL;
+    return submitted;
+}
 
-    apr_status_t status = APR_SUCCESS;
+/*
+ * Wait for the next completion, riding out signals.
+ */
+static int device_prefetch_wait(struct io_uring *ring,
+        struct io_uring_cqe **cqe)
+{
+    int rv;
 
-    /* open/seek the file */
-    if (APR_SUCCESS
-            != (status = device_file_open(ds, pool, key, filename, &in, len))) {
-        /* error already handled */
+    do {
+        rv = io_uring_wait_cqe(ring, cqe);
+    } while (rv == -EINTR);
+
+    return rv;
+}
+
+static void device_prefetch_set(device_set_t *ds, const char *path,
+        mode_t mode, const char *buf, apr_off_t len)
+{
+    device_prefetch_t *pf = apr_palloc(ds->pool, sizeof(device_prefetch_t));
+
+    pf->val = buf ? apr_pstrmemdup(ds->pool, buf, len) : NULL;
+    pf->len = len;
+    pf->mode = mode;
+
+    apr_hash_set(ds->prefetch, path, APR_HASH_KEY_STRING, pf);
+}
+#endif
+
+/*
+ * Read the option files of the given pairs in each of the given
+ * directories in one go.
+ *
+ * With io_uring the files of a batch are opened in one submission, each
+ * relative to its directory, opened once per batch, with symlinks and
+ * relations stat'ed alongside. What was opened is then read and closed as
+ * linked pairs in a second submission. What was read, and what was found
+ * missing, is kept in ds->prefetch for device_file_readat() and
+ * device_file_lookupat() to pick up. Anything not found here is looked up
+ * one at a time as before, as is everything when io_uring is not
+ * available.
+ *
+ * Every completion of a batch is collected before its buffers are reused,
+ * so the kernel never writes to memory we have let go of.
+ *
+ * The caller clears ds->prefetch once done, before anything is written.
+ */
+static void device_file_prefetch(device_set_t *ds, apr_array_header_t *dirs,
+        apr_array_header_t *pairs)
+{
+#if HAVE_LIBURING_H
+    struct io_uring ring;
+    struct io_uring_sqe *sqe, *next;
+    struct io_uring_cqe *cqe;
+    device_prefetch_batch_t *batch;
+    device_prefetch_path_t *path;
+    apr_array_header_t *paths;
+    int i, j, k;
+
+    paths = apr_array_make(ds->pool, dirs->nelts * pairs->nelts + 1,
+            sizeof(device_prefetch_path_t));
+
+    for (i = 0; i < dirs->nelts; i++) {
+        const char *dir = APR_ARRAY_IDX(dirs, i, const char *);
+
+        for (j = 0; j < pairs->nelts; j++) {
+            device_pair_t *pair = APR_ARRAY_IDX(pairs, j, device_pair_t *);
+
+            path = apr_array_push(paths);
+            path->dir = dir;
+            path->name = apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL);
+            path->path = dir ? apr_pstrcat(ds->pool, dir, "/", path->name,
+                    NULL) : path->name;
+
+            /* symlinks and relations are not read as files */
+            path->link = (pair->type == DEVICE_PAIR_SYMLINK
+                    || pair->type == DEVICE_PAIR_RELATION);
+        }
     }
 
-    else {
-        apr_off_t size = len[0] + 1;
-        val = apr_palloc(pool, size);
-        val[len[0]] = 0;
+    if (!paths->nelts || !(batch = malloc(sizeof(device_prefetch_batch_t)))) {
+        return;
+    }
+
+    if (io_uring_queue_init(DEVICE_PREFETCH_BATCH * 2, &ring, 0) < 0) {
+        free(batch);
+        return;
+    }
+
+    if (!ds->prefetch) {
+        ds->prefetch = apr_hash_make(ds->pool);
+    }
 
-        status = apr_file_gets(val, size, in);
+    for (i = 0; i < paths->nelts; i += DEVICE_PREFETCH_BATCH) {
+        int fds[DEVICE_PREFETCH_BATCH];
+        int dirfds[DEVICE_PREFETCH_BATCH];
+        int ops[DEVICE_PREFETCH_BATCH * 2];
+        int count = paths->nelts - i < DEVICE_PREFETCH_BATCH ?
+                paths->nelts - i : DEVICE_PREFETCH_BATCH;
+        int prepared = 0, submitted, failed;
 
-        if (APR_EOF == status) {
-            status = APR_SUCCESS;
+        /* open or stat the batch, each directory once */
+        for (j = 0; j < count; j++) {
+            path = &APR_ARRAY_IDX(paths, i + j, device_prefetch_path_t);
+
+            fds[j] = -1;
+
+            if (j && path->dir == APR_ARRAY_IDX(paths, i + j - 1,
+                    device_prefetch_path_t).dir) {
+                dirfds[j] = dirfds[j - 1];
+            }
+            else {
+                dirfds[j] = device_keydir_open(path->dir);
+            }
+
+            if (dirfds[j] == -1 || !(sqe = io_uring_get_sqe(&ring))) {
+                continue;
+            }
+
+            if (path->link) {
+                io_uring_prep_statx(sqe, dirfds[j], path->name,
+                        AT_SYMLINK_NOFOLLOW, STATX_TYPE, &batch->stx[j]);
+            }
+            else {
+                io_uring_prep_openat(sqe, dirfds[j], path->name,
+                        O_RDONLY | O_CLOEXEC, 0);
+            }
+            io_uring_sqe_set_data(sqe, (void *)(apr_uintptr_t)j);
+            prepared++;
         }
-        if (APR_SUCCESS == status) {
-            /* short circuit, all good */
-            val = trim(val);
+
+        submitted = device_prefetch_submit(&ring, prepared);
+
+        /* what the kernel would not take stays queued, so stop after this */
+        failed = (submitted < prepared);
+
+        for (k = 0; k < submitted; k++) {
+            if (device_prefetch_wait(&ring, &cqe) < 0) {
+                goto abandon;
+            }
+            j = (int)(apr_uintptr_t)io_uring_cqe_get_data(cqe);
+            path = &APR_ARRAY_IDX(paths, i + j, device_prefetch_path_t);
+
+            if (cqe->res == -ENOENT) {
+                device_prefetch_set(ds, path->path, 0, NULL, 0);
+            }
+            else if (cqe->res < 0) {
+                /* left to the slow path to report */
+            }
+            else if (path->link) {
+                device_prefetch_set(ds, path->path, batch->stx[j].stx_mode,
+                        NULL, 0);
+            }
+            else {
+                fds[j] = cqe->res;
+            }
+            io_uring_cqe_seen(&ring, cqe);
         }
-        else {
-            apr_file_printf(ds->err, "cannot read option set '%s': %pm\n", key,
-                    &status);
+
+        /* the files are open, the directories are done with */
+        for (j = 0; j < count; j++) {
+            if (!j || dirfds[j] != dirfds[j - 1]) {
+                device_keydir_close(dirfds[j]);
+            }
         }
 
-        apr_file_close(in);
-    }
+        /* read and close what we opened, the close runs even if the read fails */
+        prepared = 0;
+        for (j = 0; !failed && j < count; j++) {
+            if (fds[j] < 0) {
+                continue;
+            }
 
-    if (APR_SUCCESS == status) {
-        value[0] = val;
+            if (!(sqe = io_uring_get_sqe(&ring))) {
+                break;
+            }
+            io_uring_prep_read(sqe, fds[j], batch->bufs[j], DEVICE_PREFETCH_MAX,
+                    0);
+            io_uring_sqe_set_data(sqe, (void *)(apr_uintptr_t)j);
+            ops[prepared++] = j;
+
+            /* no room to close alongside, we close it ourselves */
+            if (!(next = io_uring_get_sqe(&ring))) {
+                break;
+            }
+            io_uring_sqe_set_flags(sqe, IOSQE_IO_HARDLINK);
+            io_uring_prep_close(next, fds[j]);
+            io_uring_sqe_set_data(next,
+                    (void *)(apr_uintptr_t)(DEVICE_PREFETCH_BATCH + j));
+            ops[prepared++] = DEVICE_PREFETCH_BATCH + j;
+        }
+
+        submitted = device_prefetch_submit(&ring, prepared);
+
+        if (submitted < prepared) {
+            failed = 1;
+        }
+
+        /* a close the kernel took is the kernel's to do */
+        for (k = 0; k < submitted; k++) {
+            if (ops[k] >= DEVICE_PREFETCH_BATCH) {
+                fds[ops[k] - DEVICE_PREFETCH_BATCH] = -1;
+            }
+        }
+
+        for (k = 0; k < submitted; k++) {
+            if (device_prefetch_wait(&ring, &cqe) < 0) {
+                goto abandon;
+            }
+            j = (int)(apr_uintptr_t)io_uring_cqe_get_data(cqe);
+
+            /* too long to be sure we have it all is left to the slow path */
+            if (j < DEVICE_PREFETCH_BATCH && cqe->res >= 0) {
+                path = &APR_ARRAY_IDX(paths, i + j, device_prefetch_path_t);
+
+                device_prefetch_set(ds, path->path, S_IFREG,
+                        cqe->res < DEVICE_PREFETCH_MAX ? batch->bufs[j] : NULL,
+                        cqe->res);
+            }
+            io_uring_cqe_seen(&ring, cqe);
+        }
+
+        /* anything still open is ours to close */
+        for (j = 0; j < count; j++) {
+            if (fds[j] >= 0) {
+                close(fds[j]);
+            }
+        }
+
+        if (failed) {
+            break;
+        }
     }
 
-    return status;
+    io_uring_queue_exit(&ring);
+
+    free(batch);
+
+    return;
+
+abandon:
+
+    /*
+     * We no longer know what the kernel is doing with the batch, so its
+     * buffers and descriptors are left to it rather than freed beneath it.
+     */
+    io_uring_queue_exit(&ring);
+#endif
 }
 
 /*
@@ -966,9 +1417,12 @@ static apr_status_t device_parse_index(device_set_t *ds, device_pair_t *pair,
     apr_finfo_t dirent;
 
     apr_array_header_t *tfiles = apr_array_make(ds->pool, 16, sizeof(device_file_t));
+    apr_array_header_t *lfiles = apr_array_make(ds->pool, 16, sizeof(device_file_t));
 
     apr_status_t status;
+    apr_int64_t next;
     int found = 0;
+    int i;
 
     /* can an index be optional? */
     if (!arg || !arg[0]) {
@@ -1017,62 +1471,32 @@ static apr_status_t device_parse_index(device_set_t *ds, device_pair_t *pair,
         case APR_DIR: {
 
             apr_pool_t *pool;
-            char *val = NULL;
-            apr_file_t *in;
+            const char *val = NULL;
             const char *indexname;
-            char *indexpath, *path, *linkpath;
-            apr_off_t end = 0, start = 0;
+            char *indexpath, *path;
+            apr_off_t len;
+            int dirfd = DEVICE_KEYDIR_UNOPENED;
 
             apr_pool_create(&pool, ds->pool);
 
             indexname = apr_pstrcat(pool, pair->key, pair->suffix, NULL);
-            if (APR_SUCCESS
-                    != (status = apr_filepath_merge(&indexpath, dirent.name,
-                            indexname, APR_FILEPATH_NOTABSOLUTE, pool))) {
-                apr_file_printf(ds->err, "cannot merge option set key '%s': %pm\n", pair->key,
-                        &status);
-            }
-
-            /* open the index */
-            else if (APR_SUCCESS
-                    != (status = apr_file_open(&in, indexpath, APR_FOPEN_READ,
-                            APR_FPROT_OS_DEFAULT, pool))) {
-                apr_file_printf(ds->err, "cannot open option set '%s': %pm\n", pair->key,
-                        &status);
-            }
-
-            /* how long is the key? */
-            else if (APR_SUCCESS
-                    != (status = apr_file_seek(in, APR_END, &end))) {
-                apr_file_printf(ds->err, "cannot seek end of option set '%s': %pm\n", pair->key,
-                        &status);
-            }
+            indexpath = apr_pstrcat(pool, dirent.name, "/", indexname, NULL);
 
-            /* back to the beginning */
-            else if (APR_SUCCESS
-                    != (status = apr_file_seek(in, APR_SET, &start))) {
-                apr_file_printf(ds->err, "cannot seek start of option set '%s': %pm\n", pair->key,
-                        &status);
+            /* moved by an earlier request of the transaction? */
+            if (ds->pending && (val = apr_hash_get(ds->pending,
+                    indexpath, APR_HASH_KEY_STRING))) {
+                if (!val[0]) {
+                    apr_pool_destroy(pool);
+                    break;
+                }
             }
 
+            /* read the index, relative to its option set */
             else {
-                int size = end + 1;
-                val = apr_palloc(pool, size);
-                val[end] = 0;
-
-                status = apr_file_gets(val, size, in);
+                status = device_file_readat(ds, pool, pair->key, &dirfd,
+                        dirent.name, indexname, &val, &len);
 
-                if (APR_EOF == status) {
-                    status = APR_SUCCESS;
-                }
-                if (APR_SUCCESS == status) {
-                    /* short circuit, all good */
-                    val = trim(val);
-                }
-                else {
-                    apr_file_printf(ds->err, "cannot read option set '%s': %pm\n", pair->key,
-                            &status);
-                }
+                device_keydir_close(dirfd);
             }
 
             if (status != APR_SUCCESS) {
@@ -1099,18 +1523,10 @@ static apr_status_t device_parse_index(device_set_t *ds, device_pair_t *pair,
                     return APR_EGENERAL;
                 }
 
-                /* nothing counts until we find a match */
-                if (order == ind) {
-                    found = 1;
-                }
-
-                if (order >= ind) {
+                /* a candidate to move up */
+                else if (order >= ind) {
 
-                    device_file_t *file, *link;
-
-                    order++;
-
-                    val = apr_psprintf(ds->pool, "%" APR_INT64_T_FMT, order);
+                    device_file_t *file;
 
                     if (APR_SUCCESS
                             != (status = apr_filepath_merge(&path, "..",
@@ -1120,38 +1536,15 @@ static apr_status_t device_parse_index(device_set_t *ds, device_pair_t *pair,
                         return status;
                     }
 
-                    if (APR_SUCCESS
-                            != (status = apr_filepath_merge(&linkpath, "..",
-                                    val, APR_FILEPATH_NOTABSOLUTE, pool))) {
-                        apr_file_printf(ds->err, "cannot merge option set key '%s': %pm\n", pair->key,
-                                &status);
-                        return status;
-                    }
-
-                    /* add index */
                     file = apr_array_push(tfiles);
                     file->type = APR_REG;
                     file->order = order;
 
-                    file->dest = path;
+                    file->dest = apr_pstrdup(ds->pool, path);
                     file->template = apr_pstrcat(ds->pool, file->dest, ".XXXXXX", NULL);
                     file->key = pair->key;
-                    file->val = val;
+                    file->link = apr_pstrdup(ds->pool, dirent.name);
                     file->index = pair->index;
-
-                    if (pair->index == DEVICE_IS_INDEXED) {
-
-                        /* add symlink */
-                        link = apr_array_push(tfiles);
-                        link->type = APR_LNK;
-                        link->order = order;
-
-                        link->dest = linkpath;
-                        link->key = pair->key;
-                        link->val = apr_pstrdup(ds->pool, dirent.name);
-                        link->index = DEVICE_IS_NORMAL;
-                    }
-
                 }
             }
 
@@ -1179,21 +1572,79 @@ static apr_status_t device_parse_index(device_set_t *ds, device_pair_t *pair,
         return status;
     }
 
-    if (found) {
+    /*
+     * Only the run of indexes up to the first unused index need move up
+     * to fit, those past the gap stay where they are.
+     */
+    qsort(tfiles->elts, tfiles->nelts, tfiles->elt_size, files_asc);
 
-        /* sort tfiles large to small so reindex doesn't stomp on files */
-        qsort(tfiles->elts, tfiles->nelts, tfiles->elt_size, files_desc);
+    for (i = 0, next = ind; i < tfiles->nelts; i++) {
 
-        apr_array_cat(files, tfiles);
-        tfiles = files;
+        device_file_t *file = &APR_ARRAY_IDX(tfiles, i, device_file_t);
 
-        /* suppress the unique check */
-        pair->unique = DEVICE_IS_REPEATED;
-    }
+        if (file->order > next) {
+            break;
+        }
 
-    if (option) {
-        *option = apr_psprintf(ds->pool, "%" APR_INT64_T_FMT, ind);
-    }
+        /* nothing counts until we find a match */
+        if (file->order == ind) {
+            found = 1;
+        }
+
+        file->order++;
+        file->val = apr_psprintf(ds->pool, "%" APR_INT64_T_FMT, file->order);
+
+        if (file->order > next) {
+            next = file->order;
+        }
+
+        if (pair->index == DEVICE_IS_INDEXED) {
+
+            device_file_t *link;
+            char *linkpath;
+
+            if (APR_SUCCESS
+                    != (status = apr_filepath_merge(&linkpath, "..",
+                            file->val, APR_FILEPATH_NOTABSOLUTE, ds->pool))) {
+                apr_file_printf(ds->err, "cannot merge option set key '%s': %pm\n", pair->key,
+                        &status);
+                return status;
+            }
+
+            /* add symlink */
+            link = apr_array_push(lfiles);
+            link->type = APR_LNK;
+            link->order = file->order;
+
+            link->dest = linkpath;
+            link->key = pair->key;
+            link->val = file->link;
+            link->link = file->link;
+            link->index = DEVICE_IS_NORMAL;
+        }
+
+        file->link = NULL;
+    }
+
+    tfiles->nelts = i;
+
+    if (found) {
+
+        apr_array_cat(tfiles, lfiles);
+
+        /* sort tfiles large to small so reindex doesn't stomp on files */
+        qsort(tfiles->elts, tfiles->nelts, tfiles->elt_size, files_desc);
+
+        apr_array_cat(files, tfiles);
+        tfiles = files;
+
+        /* suppress the unique check */
+        pair->unique = DEVICE_IS_REPEATED;
+    }
+
+    if (option) {
+        *option = apr_psprintf(ds->pool, "%" APR_INT64_T_FMT, ind);
+    }
     return APR_SUCCESS;
 }
 
@@ -1443,832 +1894,778 @@ static apr_status_t device_parse_fqdn(device_set_t *ds, device_pair_t *pair,
     return APR_SUCCESS;
 }
 
-/**
- * Select is a string which must match one of a series of strings read line
- * by line from a file containing a fixed set of possible options.
+/*
+ * The names catalogue maps the name of each option set to the directory
+ * holding it, so that an option set can be found without opening every
+ * directory in turn.
+ *
+ * The catalogue lives in a hidden directory alongside the option sets,
+ * one file per key, sorted by name and mapped in one go. It is stamped
+ * with the modification time of the option set directory, and is rebuilt
+ * when the stamp no longer matches, such as when an option set has been
+ * added or removed behind our back. Changes made by device_files and
+ * device_remove are applied to the catalogue directly.
+ *
+ * A catalogue file is a magic number, the stamp, the number of entries,
+ * the offset of each entry, and then each entry as a name and directory,
+ * both NUL terminated.
  */
-static apr_status_t device_parse_select(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
+typedef struct device_names_t {
+    const char *buf;
+    apr_size_t size;
+    apr_int64_t count;
+    apr_time_t stamp;
+} device_names_t;
+
+typedef struct device_names_entry_t {
+    const char *name;
+    const char *dir;
+} device_names_entry_t;
+
+#define DEVICE_NAMES_HEADER (DEVICE_NAMES_MAGIC_LEN + 2 * sizeof(apr_int64_t))
+
+static int device_names_entry_cmp(const void *a, const void *b)
 {
-    const char *none = NULL;
-    apr_file_t *in;
-    apr_off_t end = 0, start = 0;
-    apr_status_t status;
-    apr_size_t arglen = arg ? strlen(arg) : 0;
+    const device_names_entry_t *ea = a;
+    const device_names_entry_t *eb = b;
+    int cmp = strcmp(ea->name, eb->name);
 
-    apr_array_header_t *possibles = apr_array_make(ds->pool, 10, sizeof(char *));
+    return cmp ? cmp : strcmp(ea->dir, eb->dir);
+}
 
-    int i;
+/*
+ * Path of the catalogue beneath the given directory, named after the file
+ * holding each name, so that relations into a set of option sets share
+ * the catalogue kept by the option sets themselves.
+ */
+static const char *device_names_path(apr_pool_t *pool, const char *base,
+        const char *file)
+{
+    const char *path = apr_pstrcat(pool, DEVICE_NAMES_DIR "/",
+            device_safename(pool, file), NULL);
 
-    if (option) {
-        option[0] = NULL; /* until further notice */
-    }
+    return base ? apr_pstrcat(pool, base, "/", path, NULL) : path;
+}
 
-    if (!pair->sl.bases) {
-        apr_file_printf(ds->err, "no base directory specified for '%s'\n", pair->key);
-        return APR_EGENERAL;
-    }
+static const char *device_names_name(const device_names_t *names, apr_int64_t i)
+{
+    apr_int64_t off;
 
-    if (pair->optional == DEVICE_IS_OPTIONAL) {
-        if (pair->unset) {
-            none = pair->unset;
-        }
-        else {
-            none = DEVICE_SELECT_NONE;
-        }
+    memcpy(&off, names->buf + DEVICE_NAMES_HEADER + i * sizeof(apr_int64_t),
+            sizeof(apr_int64_t));
+
+    if (off < DEVICE_NAMES_HEADER || off >= (apr_int64_t)names->size) {
+        return "";
     }
 
-    for (i = 0; i < pair->sl.bases->nelts; i++) {
+    return names->buf + off;
+}
 
-        const char *base = APR_ARRAY_IDX(pair->sl.bases, i, const char *);
+static const char *device_names_dir(const device_names_t *names, apr_int64_t i)
+{
+    const char *name = device_names_name(names, i);
+    const char *dir = name + strlen(name) + 1;
 
-        /* open the options */
-        if (APR_SUCCESS
-                != (status = apr_file_open(&in, base, APR_FOPEN_READ,
-                        APR_FPROT_OS_DEFAULT, ds->pool))) {
-            apr_file_printf(ds->err, "cannot open options '%s': %pm\n", pair->key,
-                    &status);
-        }
+    return dir < names->buf + names->size ? dir : "";
+}
 
-        /* how long are the options? */
-        else if (APR_SUCCESS
-                != (status = apr_file_seek(in, APR_END, &end))) {
-            apr_file_printf(ds->err, "cannot seek end of options '%s': %pm\n", pair->key,
-                    &status);
-        }
+/*
+ * Index of the first name not less than the one given.
+ */
+static apr_int64_t device_names_lower(const device_names_t *names,
+        const char *search)
+{
+    apr_int64_t lo = 0, hi = names->count, mid;
 
-        /* back to the beginning */
-        else if (APR_SUCCESS
-                != (status = apr_file_seek(in, APR_SET, &start))) {
-            apr_file_printf(ds->err, "cannot seek start of options '%s': %pm\n", pair->key,
-                    &status);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (strcmp(device_names_name(names, mid), search) < 0) {
+            lo = mid + 1;
         }
-
         else {
-            int size = end + 1;
-            char *buffer = apr_palloc(ds->pool, size);
+            hi = mid;
+        }
+    }
 
-            apr_array_header_t *possibles = apr_array_make(ds->pool, 10, sizeof(char *));
+    return lo;
+}
 
-            do {
+/*
+ * Map the catalogue, if present and stamped as given.
+ *
+ * A catalogue saved within a second of its stamp is not trusted, as the
+ * mtime granularity may have hidden a later change in the same tick, and
+ * is rebuilt by the next lookup.
+ */
+static apr_status_t device_names_load(device_set_t *ds, const char *path,
+        apr_time_t stamp, device_names_t *names)
+{
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+    apr_int64_t val;
+    apr_status_t status;
 
-                const char **possible;
-                apr_size_t optlen;
-                int exact;
+    if (APR_SUCCESS != (status = apr_file_open(&file, path, APR_FOPEN_READ,
+            APR_FPROT_OS_DEFAULT, ds->pool))) {
+        return status;
+    }
 
-                if (none) {
-                    strcpy(buffer, none);
-                } else {
-                    status = apr_file_gets(buffer, size, in);
-                    if (status != APR_SUCCESS) {
-                        break;
-                    }
-                }
-                optlen = strlen(buffer);
+    if (APR_SUCCESS != (status = apr_file_info_get(&finfo,
+            APR_FINFO_SIZE | APR_FINFO_MTIME, file))
+            || finfo.size < (apr_off_t)DEVICE_NAMES_HEADER
+            || APR_SUCCESS != (status = apr_mmap_create(&mm, file, 0,
+                    finfo.size, APR_MMAP_READ, ds->pool))) {
+        apr_file_close(file);
+        return status ? status : APR_EINVAL;
+    }
 
-                /* chop trailing newline */
-                if (optlen && buffer[optlen - 1] == '\n') {
-                    optlen--;
-                    buffer[optlen] = 0;
-                }
+    apr_file_close(file);
 
-                if (!buffer[0] || buffer[0] == '#' || apr_isspace(buffer[0])) {
-                    continue;
-                }
+    names->buf = mm->mm;
+    names->size = mm->size;
 
-                possible = apr_array_push(possibles);
-                possible[0] = apr_pstrdup(ds->pool, buffer);
+    if (memcmp(names->buf, DEVICE_NAMES_MAGIC, DEVICE_NAMES_MAGIC_LEN)) {
+        return APR_EINVAL;
+    }
 
-                exact = (0 == strcmp(arg, buffer));
+    memcpy(&val, names->buf + DEVICE_NAMES_MAGIC_LEN, sizeof(apr_int64_t));
+    names->stamp = val;
 
-                if (!strncmp(arg, buffer, arglen)) {
+    memcpy(&val, names->buf + DEVICE_NAMES_MAGIC_LEN + sizeof(apr_int64_t),
+            sizeof(apr_int64_t));
+    names->count = val;
 
-                    const char **opt;
+    if (names->stamp != stamp || names->count < 0
+            || names->count > (apr_int64_t)((names->size - DEVICE_NAMES_HEADER)
+                    / sizeof(apr_int64_t))
+            || names->buf[names->size - 1]) {
+        return APR_EINVAL;
+    }
 
-                    if (exact) {
-                        apr_array_clear(options);
-                    }
+    if (finfo.mtime - names->stamp <= apr_time_from_sec(1)) {
+        return APR_EINVAL;
+    }
 
-                    opt = apr_array_push(options);
-                    opt[0] = apr_pstrcat(ds->pool,
-                            pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
-                            device_pescape_shell(ds->pool, pair->key), "=",
-                            device_pescape_shell(ds->pool, buffer),
-                            NULL);
-
-                    if (option) {
-                        if (none) {
-                            option[0] = NULL;
-                        }
-                        else {
-                            option[0] = possible[0];
-                        }
-                    }
-                }
+    return APR_SUCCESS;
+}
 
-                if (exact) {
-                    /* exact matches short circuit */
-                    break;
-                }
+/*
+ * Create a temporary file beside the given catalogue path, making the
+ * hidden directory that holds it on first save, and not before.
+ */
+static apr_status_t device_catalogue_mktemp(apr_pool_t *pool,
+        const char *path, apr_file_t **out, char **tmp)
+{
+    const char *slash = strrchr(path, '/');
+    apr_status_t status;
 
-                none = NULL;
+    *tmp = apr_pstrcat(pool, path, ".XXXXXX", NULL);
 
-            } while (1);
+    status = apr_file_mktemp(out, *tmp,
+            APR_FOPEN_CREATE | APR_FOPEN_WRITE | APR_FOPEN_EXCL, pool);
 
-            apr_file_close(in);
+    if (APR_STATUS_IS_ENOENT(status) && slash) {
 
-            if (APR_SUCCESS == status) {
-                /* short circuit, all good */
-                break;
-            }
-            else if (APR_EOF == status) {
-                /* loop around */
-                status = APR_SUCCESS;
-            }
-            else {
-                apr_file_printf(ds->err, "cannot read option '%s': %pm\n", pair->key,
-                        &status);
-                return status;
-            }
+        status = apr_dir_make(apr_pstrndup(pool, path, slash - path),
+                APR_FPROT_OS_DEFAULT, pool);
+        if (APR_SUCCESS != status && !APR_STATUS_IS_EEXIST(status)) {
+            return status;
         }
 
-    }
+        *tmp = apr_pstrcat(pool, path, ".XXXXXX", NULL);
 
-    if (option && option[0]) {
-        if (options->nelts == 1) {
-            /* all ok */
-        }
-        else {
-            device_error_possibles(ds, pair->key, possibles);
-            return APR_INCOMPLETE;
-        }
+        status = apr_file_mktemp(out, *tmp,
+                APR_FOPEN_CREATE | APR_FOPEN_WRITE | APR_FOPEN_EXCL, pool);
     }
 
     return status;
 }
 
 /*
- * Bytes is a positive integer.
- *
- * We understand the modifiers K(1024), M(1024)
+ * Serialise a change to the option set along with the update of the
+ * names catalogue that follows it, so that one run does not lose the
+ * update of another. A lock that cannot be taken, as on a read only
+ * option set, is done without.
  */
-static apr_status_t device_parse_bytes(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
+static apr_file_t *device_names_lock(device_set_t *ds)
 {
-    char *end;
-    char *result = NULL;
-    apr_int64_t bytes;
+    apr_file_t *lock;
+    apr_status_t status;
 
-    apr_array_header_t *possibles = apr_array_make(ds->pool, 10, sizeof(char *));
+    status = apr_file_open(&lock, DEVICE_NAMES_LOCK,
+            APR_FOPEN_CREATE | APR_FOPEN_WRITE, APR_FPROT_OS_DEFAULT, ds->pool);
 
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
-    }
+    if (APR_STATUS_IS_ENOENT(status)) {
+        apr_dir_make(DEVICE_NAMES_DIR, APR_FPROT_OS_DEFAULT, ds->pool);
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
-    }
-    else if (!arg[0]) {
-        if (option) {
-            option[0] = NULL;
-        }
-        return APR_SUCCESS;
+        status = apr_file_open(&lock, DEVICE_NAMES_LOCK,
+                APR_FOPEN_CREATE | APR_FOPEN_WRITE, APR_FPROT_OS_DEFAULT,
+                ds->pool);
     }
 
-    if (arg[0] == '-') {
-        apr_file_printf(ds->err, "argument '%s': number must be positive.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_EINVAL;
+    if (APR_SUCCESS != status) {
+        return NULL;
     }
 
-    if (!apr_isdigit(arg[0])) {
-        apr_file_printf(ds->err, "argument '%s': is not a number.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_EINVAL;
+    if (APR_SUCCESS != apr_file_lock(lock, APR_FLOCK_EXCLUSIVE)) {
+        apr_file_close(lock);
+        return NULL;
     }
 
-    bytes = apr_strtoi64(arg, &end, 10);
+    return lock;
+}
 
-    if (end - arg > 18) {
-        apr_file_printf(ds->err, "argument '%s': number is too long.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_EINVAL;
+static void device_names_unlock(apr_file_t *lock)
+{
+    if (lock) {
+        apr_file_unlock(lock);
+        apr_file_close(lock);
     }
+}
 
-    /* zero - short circuit the suffixes */
-    if (!end[0] && bytes == 0) {
-        if (pair->b.min > 0) {
-            apr_file_printf(ds->err, "argument '%s': too small.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1));
-            return APR_EINVAL;
-        }
-        if (option) {
-            option[0] = arg;
-        }
-        return APR_SUCCESS;
-    }
+/*
+ * Lay out the given entries as a catalogue, and try to save it. A
+ * catalogue that cannot be saved is still returned for use by this run.
+ */
+static apr_status_t device_names_save(device_set_t *ds, const char *path,
+        apr_array_header_t *entries, apr_time_t stamp, device_names_t *names)
+{
+    apr_file_t *out;
+    apr_pool_t *pool;
+    char *tmp, *buf;
+    apr_size_t size = DEVICE_NAMES_HEADER, off;
+    apr_int64_t val;
+    apr_status_t status;
+    int i;
 
+    qsort(entries->elts, entries->nelts, entries->elt_size,
+            device_names_entry_cmp);
 
-#define DEVICE_SET_BYTES(unit,expanded,limit) \
-    if (!strncmp(end, unit, strlen(end)) && (limit)) { \
-        if (!((pair->b.min && expanded < pair->b.min) || (pair->b.max && expanded > pair->b.max))) { \
-            const char **opt = apr_array_push(options); \
-            const char **possible = apr_array_push(possibles); \
-            opt[0] = apr_psprintf(ds->pool, "%c%s=%.*s%s", \
-                    pair->optional == DEVICE_IS_OPTIONAL ? '-' : '*', \
-                            device_pescape_shell(ds->pool, pair->key), \
-                            (int)(end - arg), arg, unit); \
-            possible[0] = apr_psprintf(ds->pool, "%.*s%s", (int)(end - arg), arg, unit); \
-            result = apr_psprintf(ds->pool, "%" APR_INT64_T_FMT, (apr_int64_t)expanded); \
-        } \
-    } /* last line of macro... */
+    for (i = 0; i < entries->nelts; i++) {
+        device_names_entry_t *entry = &APR_ARRAY_IDX(entries, i, device_names_entry_t);
 
+        size += sizeof(apr_int64_t) + strlen(entry->name) + strlen(entry->dir) + 2;
+    }
 
-#define BYTE1024POW1 1024
-#define BYTE1024POW2 1048576
-#define BYTE1024POW3 1073741824
-#define BYTE1024POW4 1099511627776
-#define BYTE1024POW5 1125899906842624
-#define BYTE1024POW6 1152921504606846976
-#define BYTE1024POW7 1180591620717411303424
-#define BYTE1024POW8 1208925819614629174706176
+    buf = apr_palloc(ds->pool, size);
 
-#define BYTE1000POW1 1000
-#define BYTE1000POW2 1000000
-#define BYTE1000POW3 1000000000
-#define BYTE1000POW4 1000000000000
-#define BYTE1000POW5 1000000000000000
-#define BYTE1000POW6 1000000000000000000
-#define BYTE1000POW7 1000000000000000000000
-#define BYTE1000POW8 1000000000000000000000000
+    memcpy(buf, DEVICE_NAMES_MAGIC, DEVICE_NAMES_MAGIC_LEN);
+    val = stamp;
+    memcpy(buf + DEVICE_NAMES_MAGIC_LEN, &val, sizeof(apr_int64_t));
+    val = entries->nelts;
+    memcpy(buf + DEVICE_NAMES_MAGIC_LEN + sizeof(apr_int64_t), &val,
+            sizeof(apr_int64_t));
 
-    /* bytes */
-    DEVICE_SET_BYTES("B",
-            (bytes), bytes < (apr_int64_t)4*(BYTE1024POW6));
+    off = DEVICE_NAMES_HEADER + entries->nelts * sizeof(apr_int64_t);
 
-    /* 1000    kB    kilobyte */
-    DEVICE_SET_BYTES("kB",
-            (bytes * BYTE1000POW1), bytes < (apr_int64_t)4*(BYTE1000POW5));
+    for (i = 0; i < entries->nelts; i++) {
+        device_names_entry_t *entry = &APR_ARRAY_IDX(entries, i, device_names_entry_t);
+        apr_size_t nlen = strlen(entry->name) + 1;
+        apr_size_t dlen = strlen(entry->dir) + 1;
 
-    /* 1024    KiB    kibibyte */
-    DEVICE_SET_BYTES("KiB",
-            (bytes * BYTE1024POW1), bytes < (apr_int64_t)4*(BYTE1024POW5));
+        val = off;
+        memcpy(buf + DEVICE_NAMES_HEADER + i * sizeof(apr_int64_t), &val,
+                sizeof(apr_int64_t));
 
-    /* 1000^2    MB    megabyte 1000000 */
-    DEVICE_SET_BYTES("MB",
-            (bytes * BYTE1000POW2), bytes < (apr_int64_t)4*(BYTE1000POW4));
+        memcpy(buf + off, entry->name, nlen);
+        memcpy(buf + off + nlen, entry->dir, dlen);
+        off += nlen + dlen;
+    }
 
-    /* 1024^2    MiB    mebibyte 1048576 */
-    DEVICE_SET_BYTES("MiB",
-            (bytes * BYTE1024POW2), bytes < (apr_int64_t)4*(BYTE1024POW4));
+    names->buf = buf;
+    names->size = size;
+    names->count = entries->nelts;
+    names->stamp = stamp;
 
-    /* 1000^3    GB    gigabyte 1000000000 */
-    DEVICE_SET_BYTES("GB",
-            (bytes * BYTE1000POW3), bytes < (apr_int64_t)4*(BYTE1000POW3));
+    apr_pool_create(&pool, ds->pool);
 
-    /* 1024^3    GiB    gibibyte 1073741824 */
-    DEVICE_SET_BYTES("GiB",
-            (bytes * BYTE1024POW3), bytes < (apr_int64_t)4*(BYTE1024POW3));
+    if (APR_SUCCESS != (status = device_catalogue_mktemp(pool, path, &out,
+            &tmp))) {
+        apr_pool_destroy(pool);
+        return status;
+    }
 
-    /* 1000^4    TB    terabyte 1000000000000 */
-    DEVICE_SET_BYTES("TB",
-            (bytes * BYTE1000POW4), bytes < (apr_int64_t)4*(BYTE1000POW2));
+    if (APR_SUCCESS != (status = apr_file_write_full(out, buf, size, NULL))
+            || APR_SUCCESS != (status = apr_file_close(out))
+            || APR_SUCCESS != (status = apr_file_perms_set(tmp,
+                    APR_FPROT_OS_DEFAULT & ~DEVICE_FILE_UMASK))
+            || APR_SUCCESS != (status = apr_file_rename(tmp, path, pool))) {
+        apr_file_remove(tmp, pool);
+    }
 
-    /* 1024^4    TiB    tebibyte 1099511627776 */
-    DEVICE_SET_BYTES("TiB",
-            (bytes * BYTE1024POW4), bytes < (apr_int64_t)4*(BYTE1024POW2));
+    apr_pool_destroy(pool);
 
-    /* 1000^5    PB    petabyte 1000000000000000 */
-    DEVICE_SET_BYTES("PB",
-            (bytes * BYTE1000POW5), bytes < (apr_int64_t)4*BYTE1000POW1);
+    return status;
+}
 
-    /* 1024^5    PiB    pebibyte 1125899906842624 */
-    DEVICE_SET_BYTES("PiB",
-            (bytes * BYTE1024POW5), bytes < (apr_int64_t)4*BYTE1024POW1);
+/*
+ * Stamp for the catalogue, being the modification time of the given
+ * directory, or the current directory if none.
+ */
+static apr_status_t device_names_stamp(device_set_t *ds, const char *base,
+        apr_time_t *stamp)
+{
+    apr_finfo_t finfo;
+    apr_status_t status;
 
-    /* 1000^6    EB    exabyte 1000000000000000000 */
-    DEVICE_SET_BYTES("EB",
-            (bytes * BYTE1000POW6), bytes < 4);
+    if (APR_SUCCESS != (status = apr_stat(&finfo, base ? base : ".",
+            APR_FINFO_MTIME, ds->pool))) {
+        if (!base) {
+            apr_file_printf(ds->err, "could not open current directory: %pm\n", &status);
+        }
+        return status;
+    }
 
-    /* 1024^6    EiB    exbibyte 1152921504606846976 */
-    DEVICE_SET_BYTES("EiB",
-            (bytes * BYTE1024POW6), bytes < 4);
+    *stamp = finfo.mtime;
 
-    /* not until 128 bit integers */
-#if 0
-    /* 1000^7    ZB    zettabyte 1000000000000000000000 */
-    DEVICE_SET_BYTES("ZB",
-            (bytes * BYTE1000POW7), bytes < 1);
+    return APR_SUCCESS;
+}
 
-    /* 1024^7    ZiB    zebibyte 1180591620717411303424 */
-    DEVICE_SET_BYTES("ZiB",
-            (bytes * BYTE1024POW7), bytes < 1);
+/*
+ * A catalogue is a sorted, deduplicated table of strings, so that a string
+ * can be found without reading and comparing every possibility in turn.
+ *
+ * Catalogues are saved to hidden files and mapped in one go. Each carries
+ * two stamps describing the source it was built from, and is rebuilt when
+ * the stamps no longer match. A catalogue that cannot be saved is used from
+ * memory for the duration of this run.
+ *
+ * A catalogue file is a magic number, the two stamps, the number of
+ * entries, the offset of each entry, and then each entry NUL terminated.
+ */
+typedef struct device_catalogue_t {
+    const char *buf;
+    apr_size_t size;
+    apr_int64_t count;
+    apr_int64_t stamp[2];
+} device_catalogue_t;
 
-    /* 1000^8    YB    yottabyte 1000000000000000000000000 */
-    DEVICE_SET_BYTES("YB",
-            (bytes * BYTE1000POW8), bytes < 1);
+#define DEVICE_CATALOGUE_HEADER (DEVICE_CATALOGUE_MAGIC_LEN + 3 * sizeof(apr_int64_t))
 
-    /* 1024^8    YiB    yobibyte  1208925819614629174706176 */
-    DEVICE_SET_BYTES("YiB",
-            (bytes * BYTE1024POW18), bytes < 1);
-#endif
+static int device_catalogue_cmp(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
 
-    /* no trailing characters, we are ok */
-    if (!end[0]) {
-        if (pair->b.min && pair->b.max && (bytes < pair->b.min || bytes > pair->b.max)) {
-            apr_file_printf(ds->err, "argument '%s': number must be from %" APR_INT64_T_FMT " to %" APR_INT64_T_FMT ".\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1),
-                    pair->b.min, pair->b.max);
-            return APR_EINVAL;
-        }
-        else if (pair->b.min && bytes < pair->b.min) {
-            apr_file_printf(ds->err, "argument '%s': number must be %" APR_INT64_T_FMT " or higher.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1),
-                    pair->b.min);
-            return APR_EINVAL;
-        }
-        else if (pair->b.max && bytes > pair->b.max) {
-            apr_file_printf(ds->err, "argument '%s': number must be %" APR_INT64_T_FMT " or lower.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1),
-                    pair->b.max);
-            return APR_EINVAL;
-        }
-        if (option) {
-            option[0] = arg;
-        }
-        return APR_SUCCESS;
-    }
+static const char *device_catalogue_name(const device_catalogue_t *cat,
+        apr_int64_t i)
+{
+    apr_int64_t off;
 
-    /* trailing characters, but no possible options - we're invalid */
-    if (options->nelts == 0) {
-        if (pair->b.min && pair->b.max) {
-            apr_file_printf(ds->err, "argument '%s': number must be from %" APR_INT64_T_FMT " to %" APR_INT64_T_FMT ".\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1),
-                    pair->b.min, pair->b.max);
-        }
-        else if (pair->b.min) {
-            apr_file_printf(ds->err, "argument '%s': number must be %" APR_INT64_T_FMT " or higher.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1),
-                    pair->b.min);
-        }
-        else if (pair->b.max) {
-            apr_file_printf(ds->err, "argument '%s': number must be %" APR_INT64_T_FMT " or lower.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1),
-                    pair->b.max);
-        }
-        else {
-            apr_file_printf(ds->err, "argument '%s': suffix not recognised.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1));
-        }
-        return APR_EINVAL;
-    }
+    memcpy(&off, cat->buf + DEVICE_CATALOGUE_HEADER + i * sizeof(apr_int64_t),
+            sizeof(apr_int64_t));
 
-    /* just one option, success */
-    else if (options->nelts == 1) {
-        if (option) {
-            option[0] = result;
-        }
-        return APR_SUCCESS;
+    if (off < DEVICE_CATALOGUE_HEADER || off >= (apr_int64_t)cat->size) {
+        return "";
     }
 
-    /* more than one option, we're incomplete */
-    device_error_possibles(ds, pair->key, possibles);
-
-    return APR_INCOMPLETE;
+    return cat->buf + off;
 }
 
-/**
- * Symlink is a name that will be linked to a series of files or directories at
- * a target path.
+/*
+ * Index of the first entry not less than the one given.
  */
-static apr_status_t device_parse_symlink(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option,
-        const char **link)
+static apr_int64_t device_catalogue_lower(const device_catalogue_t *cat,
+        const char *search)
 {
-    const char *none = NULL, *dirname, *basename;
-    apr_status_t status;
-    apr_size_t baselen;
-
-    apr_array_header_t *possibles = apr_array_make(ds->pool, 10, sizeof(char *));
-
-    int i;
+    apr_int64_t lo = 0, hi = cat->count, mid;
 
-    if (option) {
-        option[0] = NULL; /* until further notice */
-    }
-
-    if (pair->optional == DEVICE_IS_OPTIONAL) {
-        if (pair->unset) {
-            none = pair->unset;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (strcmp(device_catalogue_name(cat, mid), search) < 0) {
+            lo = mid + 1;
         }
         else {
-            none = DEVICE_SYMLINK_NONE;
+            hi = mid;
         }
     }
 
-    /* find the base path, up to depth */
-    if (none && !strcmp(arg, none)) {
-        basename = arg;
-        dirname = NULL;
-    }
-
-    else if (pair->s.symlink_recursive) {
+    return lo;
+}
 
-        if (arg[0] != '/') {
-            apr_file_printf(ds->err, "'%s' must start with a '/'.\n", pair->key);
-            return APR_EINVAL;
-        }
+/*
+ * Map the catalogue, if present and well formed. The caller checks the
+ * stamps.
+ */
+static apr_status_t device_catalogue_load(device_set_t *ds, const char *path,
+        const char *magic, device_catalogue_t *cat)
+{
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+    apr_int64_t val;
+    apr_status_t status;
 
-        else {
-            basename = strrchr(arg + 1, '/');
-            if (!basename) {
-                dirname = "";
-                basename = arg + 1;
-            }
-            else {
-                dirname = apr_pstrndup(ds->pool, arg + 1, basename - arg - 1);
-                basename++;
-            }
-        }
+    if (APR_SUCCESS != (status = apr_file_open(&file, path, APR_FOPEN_READ,
+            APR_FPROT_OS_DEFAULT, ds->pool))) {
+        return status;
+    }
 
+    if (APR_SUCCESS != (status = apr_file_info_get(&finfo, APR_FINFO_SIZE, file))
+            || finfo.size < (apr_off_t)DEVICE_CATALOGUE_HEADER
+            || APR_SUCCESS != (status = apr_mmap_create(&mm, file, 0,
+                    finfo.size, APR_MMAP_READ, ds->pool))) {
+        apr_file_close(file);
+        return status ? status : APR_EINVAL;
     }
-    else {
 
-        if (arg[0] == '/') {
-            apr_file_printf(ds->err, "'%s' must not start with a '/'.\n", pair->key);
-            return APR_EINVAL;
-        }
+    apr_file_close(file);
 
-        basename = arg;
-        dirname = NULL;
+    cat->buf = mm->mm;
+    cat->size = mm->size;
 
+    if (memcmp(cat->buf, magic, DEVICE_CATALOGUE_MAGIC_LEN)) {
+        return APR_EINVAL;
     }
 
-    baselen = strlen(basename);
+    memcpy(cat->stamp, cat->buf + DEVICE_CATALOGUE_MAGIC_LEN,
+            2 * sizeof(apr_int64_t));
 
-    if (!pair->s.bases) {
-        apr_file_printf(ds->err, "no base directory specified for '%s'\n", pair->key);
-        return APR_EGENERAL;
+    memcpy(&val, cat->buf + DEVICE_CATALOGUE_MAGIC_LEN + 2 * sizeof(apr_int64_t),
+            sizeof(apr_int64_t));
+    cat->count = val;
+
+    if (cat->count < 0
+            || cat->count > (apr_int64_t)((cat->size - DEVICE_CATALOGUE_HEADER)
+                    / sizeof(apr_int64_t))
+            || (cat->count && cat->buf[cat->size - 1])) {
+        return APR_EINVAL;
     }
 
-    for (i = 0; i < pair->s.bases->nelts; i++) {
+    return APR_SUCCESS;
+}
 
-        apr_dir_t *thedir;
-        apr_finfo_t dirent;
+/*
+ * Sort and deduplicate the given entries into a catalogue, and try to save
+ * it. A catalogue that cannot be saved is still returned for use by this
+ * run. A NULL path saves nothing.
+ */
+static apr_status_t device_catalogue_save(device_set_t *ds, const char *path,
+        const char *magic, apr_array_header_t *entries, apr_int64_t stamp0,
+        apr_int64_t stamp1, device_catalogue_t *cat)
+{
+    apr_file_t *out;
+    apr_pool_t *pool;
+    char *tmp, *buf;
+    apr_size_t size = DEVICE_CATALOGUE_HEADER, off;
+    apr_int64_t val;
+    apr_status_t status;
+    int i, count = 0;
 
-        char *base = APR_ARRAY_IDX(pair->s.bases, i, char *);
+    qsort(entries->elts, entries->nelts, entries->elt_size, device_catalogue_cmp);
 
-        if (dirname && dirname[0] && APR_SUCCESS
-                != (status = apr_filepath_merge(&base, base,
-                        dirname,
-                        APR_FILEPATH_SECUREROOT, ds->pool))) {
-            apr_file_printf(ds->err, "cannot merge directory for '%s': %pm\n", pair->key,
-                    &status);
-            return status;
-        }
+    /* drop the duplicates */
+    for (i = 0; i < entries->nelts; i++) {
+        const char *entry = APR_ARRAY_IDX(entries, i, const char *);
 
-        if ((status = apr_dir_open(&thedir, base, ds->pool)) != APR_SUCCESS) {
-            /* could not open directory, skip */
+        if (count && !strcmp(entry, APR_ARRAY_IDX(entries, count - 1, const char *))) {
             continue;
         }
 
-        do {
-            const char **possible;
-            char *name;
-
-            if (none) {
-                dirent.name = none;
-                dirent.filetype = APR_REG;
+        APR_ARRAY_IDX(entries, count++, const char *) = entry;
+        size += sizeof(apr_int64_t) + strlen(entry) + 1;
+    }
+    entries->nelts = count;
 
-                name = apr_pstrdup(ds->pool, dirent.name);
-            } else {
+    buf = apr_palloc(ds->pool, size);
 
-                status = apr_dir_read(&dirent,
-                        APR_FINFO_TYPE | APR_FINFO_NAME | APR_FINFO_WPROT, thedir);
-                if (APR_STATUS_IS_INCOMPLETE(status)) {
-                    continue; /* ignore un-stat()able files */
-                } else if (status != APR_SUCCESS) {
-                    break;
-                }
+    cat->stamp[0] = stamp0;
+    cat->stamp[1] = stamp1;
 
-                /* hidden files are ignored */
-                if (dirent.name[0] == '.') {
-                    continue;
-                }
+    memcpy(buf, magic, DEVICE_CATALOGUE_MAGIC_LEN);
+    memcpy(buf + DEVICE_CATALOGUE_MAGIC_LEN, cat->stamp, 2 * sizeof(apr_int64_t));
+    val = entries->nelts;
+    memcpy(buf + DEVICE_CATALOGUE_MAGIC_LEN + 2 * sizeof(apr_int64_t), &val,
+            sizeof(apr_int64_t));
 
-#if HAVE_SELINUX_SELINUX_H
-                /* check selinux context */
-                if (pair->s.symlink_context_type) {
-                    char *raw = NULL;
-                    char *target;
-                    int len;
+    off = DEVICE_CATALOGUE_HEADER + entries->nelts * sizeof(apr_int64_t);
 
-                    if (APR_SUCCESS
-                            != (status = apr_filepath_merge(&target, base,
-                                    dirent.name,
-                                    APR_FILEPATH_NATIVE, ds->pool))) {
-                        apr_file_printf(ds->err, "cannot merge for context '%s': %pm\n", pair->key,
-                                &status);
-                        continue;
-                    }
+    for (i = 0; i < entries->nelts; i++) {
+        const char *entry = APR_ARRAY_IDX(entries, i, const char *);
+        apr_size_t elen = strlen(entry) + 1;
 
-                    len = getfilecon(target, &raw);
+        val = off;
+        memcpy(buf + DEVICE_CATALOGUE_HEADER + i * sizeof(apr_int64_t), &val,
+                sizeof(apr_int64_t));
 
-                    if (len < 0) {
+        memcpy(buf + off, entry, elen);
+        off += elen;
+    }
 
-                        switch (errno) {
-                        case ENOTSUP:
-                            /* not supported - allow through */
-                            break;
-                        default:
-                            /* all other errors - ignore file */
-                            continue;
-                        }
+    cat->buf = buf;
+    cat->size = size;
+    cat->count = entries->nelts;
 
-                    }
-                    else {
-                        context_t con = context_new(raw);
+    if (!path) {
+        return APR_SUCCESS;
+    }
 
-                        const char *type = context_type_get(con);
+    apr_pool_create(&pool, ds->pool);
 
-                        if (strcmp(pair->s.symlink_context_type, type)) {
-                            context_free(con);
-                            freecon(raw);
-                            /* no match - ignore file */
-                            continue;
-                        }
+    if (APR_SUCCESS != (status = device_catalogue_mktemp(pool, path, &out,
+            &tmp))) {
+        apr_pool_destroy(pool);
+        return status;
+    }
 
-                        context_free(con);
-                        freecon(raw);
-                    }
-                }
-#endif
+    if (APR_SUCCESS != (status = apr_file_write_full(out, buf, size, NULL))
+            || APR_SUCCESS != (status = apr_file_close(out))
+            || APR_SUCCESS != (status = apr_file_perms_set(tmp,
+                    APR_FPROT_OS_DEFAULT & ~DEVICE_FILE_UMASK))
+            || APR_SUCCESS != (status = apr_file_rename(tmp, path, pool))) {
+        apr_file_remove(tmp, pool);
+    }
 
-                /* suffixes? */
-                if (pair->s.symlink_suffix) {
-                    int len = strlen(dirent.name);
-                    if (len < pair->s.symlink_suffix_len
-                            || strcmp(pair->s.symlink_suffix,
-                                    dirent.name + len - pair->s.symlink_suffix_len)) {
-                        continue;
-                    }
-                    name = apr_pstrndup(ds->pool, dirent.name,
-                            len - pair->s.symlink_suffix_len);
-                }
-                else {
-                    name = apr_pstrdup(ds->pool, dirent.name);
-                }
-            }
+    apr_pool_destroy(pool);
 
-            switch (dirent.filetype) {
-            case APR_LNK:
-            case APR_REG:
-            case APR_DIR: {
+    return status;
+}
 
-                int exact = (0 == strcmp(basename, name));
+/*
+ * Offer the catalogue entries starting with the given prefix as options,
+ * returning non zero if an exact match was found. The value none, when
+ * present, is offered ahead of the catalogue, and is consumed.
+ */
+static int device_catalogue_match(device_set_t *ds, device_pair_t *pair,
+        const device_catalogue_t *cat, const char **none, const char *arg,
+        apr_array_header_t *options, const char **option)
+{
+    apr_size_t arglen = strlen(arg);
+    apr_int64_t j;
+    int exact = 0;
 
-                const char *path;
+    if (*none) {
 
-                if (none) {
-                    path = none;
-                }
-                else if (dirname) {
-                    if (dirname[0]) {
-                        path = apr_pstrcat(ds->pool, "/", dirname, "/", name, NULL);
-                    }
-                    else {
-                        path = apr_pstrcat(ds->pool, "/", name, NULL);
-                    }
-                }
-                else {
-                    path = name;
-                }
+        exact = (0 == strcmp(arg, *none));
 
-                possible = apr_array_push(possibles);
-                possible[0] = name;
+        if (!strncmp(arg, *none, arglen)) {
 
-                if (!strncmp(basename, name, baselen)) {
+            const char **opt;
 
-                    const char **opt;
+            if (exact) {
+                apr_array_clear(options);
+            }
 
-                    if (exact) {
-                        apr_array_clear(options);
-                    }
+            opt = apr_array_push(options);
+            opt[0] = apr_pstrcat(ds->pool, "-",
+                    device_pescape_shell(ds->pool, pair->key), "=",
+                    device_pescape_shell(ds->pool, *none),
+                    NULL);
 
-                    opt = apr_array_push(options);
-                    opt[0] = apr_pstrcat(ds->pool,
-                            pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
-                            device_pescape_shell(ds->pool, pair->key), "=",
-                            device_pescape_shell(ds->pool, path),
-                            NULL);
-
-                    if (option) {
-
-                        char *target;
-
-                        if (none) {
-                            option[0] = NULL;
-                            link[0] = NULL;
-                        }
-                        else if (APR_SUCCESS
-                                != (status = apr_filepath_merge(&target, base,
-                                        apr_pstrcat(ds->pool, name, pair->suffix, NULL),
-                                        APR_FILEPATH_NATIVE, ds->pool))) {
-                            apr_file_printf(ds->err, "cannot merge links '%s': %pm\n", pair->key,
-                                    &status);
-                        }
-                        else {
-                            option[0] = apr_pstrdup(ds->pool, name);
-                            link[0] = target;
-                        }
+            if (option) {
+                option[0] = NULL;
+            }
+        }
 
-                    }
-                }
+        *none = NULL;
 
-                if (exact) {
+        if (exact) {
+            /* exact matches short circuit */
+            return exact;
+        }
+    }
 
-                    /* exact matches short circuit */
-                    apr_dir_close(thedir);
+    j = device_catalogue_lower(cat, arg);
 
-                    goto done;
-                }
+    /* exact matches short circuit */
+    if (j < cat->count && !strcmp(device_catalogue_name(cat, j), arg)) {
+        apr_array_clear(options);
+        exact = 1;
+    }
 
-                break;
-            }
-            default:
-                break;
-            }
+    /* walk the entries sharing our prefix */
+    for (; j < cat->count; j++) {
 
-            none = NULL;
+        const char *possible = device_catalogue_name(cat, j);
+        const char **opt;
 
-        } while (1);
-
-        apr_dir_close(thedir);
-
-    }
-done:
+        if (strncmp(arg, possible, arglen)) {
+            break;
+        }
 
-    if (APR_SUCCESS == status) {
-        /* short circuit, all good */
-    }
-    else if (APR_STATUS_IS_ENOENT(status)) {
+        opt = apr_array_push(options);
+        opt[0] = apr_pstrcat(ds->pool,
+                pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
+                device_pescape_shell(ds->pool, pair->key), "=",
+                device_pescape_shell(ds->pool, possible),
+                NULL);
 
         if (option) {
-            if (options->nelts == 1) {
-                /* all ok */
-            }
-            else {
-                device_error_possibles(ds, pair->key, possibles);
-
-                return APR_INCOMPLETE;
-            }
+            option[0] = possible;
         }
 
-        status = APR_SUCCESS;
-    }
-    else {
-        apr_file_printf(ds->err, "cannot read option '%s': %pm\n", pair->key,
-                &status);
+        if (exact) {
+            break;
+        }
     }
 
-    return status;
+    return exact;
 }
 
 /*
- * Parse a positive integer.
+ * The select catalogue lives in a hidden directory of the option set, named
+ * after the base, and is stamped with the modification time and size of the
+ * base. Comments and blank lines are left out.
  */
-static apr_status_t device_parse_uint64(device_set_t *ds, const char *arg,
-        apr_uint64_t *result)
+static const char *device_select_path(apr_pool_t *pool, const char *base)
 {
-    char *end;
-    apr_int64_t bytes;
+    return apr_pstrcat(pool, DEVICE_SELECTS_DIR "/",
+            device_safename(pool, base), NULL);
+}
 
-    if (!arg || !arg[0]) {
-        apr_file_printf(ds->err, "number is empty.\n");
-        return APR_INCOMPLETE;
-    }
+/*
+ * Return the catalogue for the given base, rebuilding it from the base when
+ * missing or out of date.
+ */
+static apr_status_t device_select_open(device_set_t *ds, device_pair_t *pair,
+        const char *base, device_catalogue_t *cat)
+{
+    apr_array_header_t *entries;
+    apr_file_t *in;
+    apr_finfo_t finfo;
+    const char *path;
+    char *lines, *line, *next;
+    apr_status_t status;
 
-    if (arg[0] == '-') {
-        apr_file_printf(ds->err, "number '%s' must be positive.\n",
-                apr_pescape_echo(ds->pool, arg, 1));
-        return APR_EINVAL;
+    /* open the options */
+    if (APR_SUCCESS
+            != (status = apr_file_open(&in, base, APR_FOPEN_READ,
+                    APR_FPROT_OS_DEFAULT, ds->pool))) {
+        apr_file_printf(ds->err, "cannot open options '%s': %pm\n", pair->key,
+                &status);
+        return status;
     }
 
-    if (!strcmp(arg, "min")) {
-        bytes = 0;
-    }
-    else if (!strcmp(arg, "max")) {
-        bytes = APR_INT64_MAX;
+    /* how long are the options, and when were they changed? */
+    if (APR_SUCCESS
+            != (status = apr_file_info_get(&finfo,
+                    APR_FINFO_MTIME | APR_FINFO_SIZE, in))) {
+        apr_file_printf(ds->err, "cannot stat options '%s': %pm\n", pair->key,
+                &status);
+        apr_file_close(in);
+        return status;
     }
-    else {
-
-        bytes = apr_strtoi64(arg, &end, 10);
 
-        if (end[0]) {
-            apr_file_printf(ds->err, "number '%s' is not a number.\n",
-                    apr_pescape_echo(ds->pool, arg, 1));
-            return APR_EINVAL;
-        }
+    path = device_select_path(ds->pool, base);
 
+    if (APR_SUCCESS == device_catalogue_load(ds, path, DEVICE_SELECT_MAGIC, cat)
+            && cat->stamp[0] == finfo.mtime && cat->stamp[1] == finfo.size) {
+        apr_file_close(in);
+        return APR_SUCCESS;
     }
 
-    *result = bytes;
+    lines = apr_palloc(ds->pool, finfo.size + 1);
 
-    return APR_SUCCESS;
-}
+    if (APR_SUCCESS
+            != (status = apr_file_read_full(in, lines, finfo.size, NULL))) {
+        apr_file_printf(ds->err, "cannot read option '%s': %pm\n", pair->key,
+                &status);
+        apr_file_close(in);
+        return status;
+    }
+    lines[finfo.size] = 0;
 
-/*
- * Parse a signed integer.
- */
-static apr_status_t device_parse_int64(device_set_t *ds, const char *arg,
-        apr_int64_t *result)
-{
-    char *end;
-    apr_int64_t bytes;
+    apr_file_close(in);
 
-    if (!arg || !arg[0]) {
-        apr_file_printf(ds->err, "number is empty.\n");
-        return APR_INCOMPLETE;
-    }
+    entries = apr_array_make(ds->pool, 64, sizeof(const char *));
 
-    if (!strcmp(arg, "min")) {
-        bytes = 0;
-    }
-    else if (!strcmp(arg, "max")) {
-        bytes = APR_INT64_MAX;
-    }
-    else {
+    for (line = lines; line; line = next) {
 
-        bytes = apr_strtoi64(arg, &end, 10);
+        next = strchr(line, '\n');
+        if (next) {
+            *next++ = 0;
+        }
 
-        if (end[0]) {
-            apr_file_printf(ds->err, "number '%s' is not a number.\n",
-                    apr_pescape_echo(ds->pool, arg, 1));
-            return APR_EINVAL;
+        if (!line[0] || line[0] == '#' || apr_isspace(line[0])) {
+            continue;
         }
 
+        APR_ARRAY_PUSH(entries, const char *) = line;
     }
 
-    *result = bytes;
+    if (APR_SUCCESS != device_catalogue_save(ds, path, DEVICE_SELECT_MAGIC,
+            entries, finfo.mtime, finfo.size, cat)) {
+        /* read only, we get by without saving */
+    }
 
     return APR_SUCCESS;
 }
 
-/*
- * Parse a signed hex integer.
+/**
+ * Select is a string which must match one of a series of strings read line
+ * by line from a file containing a fixed set of possible options.
  */
-static apr_status_t device_parse_hex64(device_set_t *ds, const char *arg,
-        apr_uint64_t *result)
+static apr_status_t device_parse_select(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
 {
-    char *end;
-    apr_uint64_t hex;
+    const char *none = NULL;
+    apr_status_t status = APR_SUCCESS;
 
-    if (!arg || !arg[0]) {
-        apr_file_printf(ds->err, "number is empty.\n");
-        return APR_INCOMPLETE;
+    apr_array_header_t *possibles = apr_array_make(ds->pool, 10, sizeof(char *));
+
+    int i;
+
+    if (option) {
+        option[0] = NULL; /* until further notice */
     }
 
-    if (!strcmp(arg, "min")) {
-        hex = 0;
+    if (!pair->sl.bases) {
+        apr_file_printf(ds->err, "no base directory specified for '%s'\n", pair->key);
+        return APR_EGENERAL;
     }
-    else if (!strcmp(arg, "max")) {
-        hex = APR_UINT64_MAX;
+
+    if (pair->optional == DEVICE_IS_OPTIONAL) {
+        if (pair->unset) {
+            none = pair->unset;
+        }
+        else {
+            none = DEVICE_SELECT_NONE;
+        }
     }
-    else {
 
-        hex = device_strtoui64(arg, &end, 16);
+    for (i = 0; i < pair->sl.bases->nelts; i++) {
 
-        if (end[0]) {
-            apr_file_printf(ds->err, "number '%s' is not a hex number.\n",
-                    apr_pescape_echo(ds->pool, arg, 1));
-            return APR_EINVAL;
+        const char *base = APR_ARRAY_IDX(pair->sl.bases, i, const char *);
+        device_catalogue_t cat;
+
+        if (APR_SUCCESS != (status = device_select_open(ds, pair, base, &cat))) {
+            continue;
+        }
+
+        if (device_catalogue_match(ds, pair, &cat, &none, arg, options, option)) {
+            /* exact matches short circuit */
+            break;
         }
 
     }
 
-    *result = hex;
+    if (option && option[0]) {
+        if (options->nelts == 1) {
+            /* all ok */
+        }
+        else {
+            device_error_possibles(ds, pair->key, possibles);
+            return APR_INCOMPLETE;
+        }
+    }
 
-    return APR_SUCCESS;
+    return status;
 }
 
 /*
- * SQL identifier in regular format. Regular identifiers start with a letter (a-z, but
- * also letters with diacritical marks and non-Latin letters) or an underscore (_).
- * Subsequent characters in an identifier can be letters, underscores, or digits (0-9).
- * The resulting value does not need to be SQL escaped before use.
+ * Bytes is a positive integer.
+ *
+ * We understand the modifiers K(1024), M(1024)
  */
-static apr_status_t device_parse_sql_identifier(device_set_t *ds, device_pair_t *pair,
-        const char *arg, const char **translated)
+static apr_status_t device_parse_bytes(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
 {
-    apr_xlate_t* convset;
-    apr_status_t status;
-    char *out;
-    apr_size_t inbytes, outbytes;
+    char *end;
+    char *result = NULL;
+    apr_int64_t bytes;
 
-    int len = 0;
+    apr_array_header_t *possibles = apr_array_make(ds->pool, 10, sizeof(char *));
 
     if (!arg) {
         apr_file_printf(ds->err, "argument '%s': is empty.\n",
@@ -2281,200 +2678,567 @@ static apr_status_t device_parse_sql_identifier(device_set_t *ds, device_pair_t
         return APR_EGENERAL;
     }
     else if (!arg[0]) {
-        if (translated) {
-            translated[0] = NULL;
+        if (option) {
+            option[0] = NULL;
         }
         return APR_SUCCESS;
     }
 
-    status = apr_xlate_open(&convset, "UTF-8", APR_LOCALE_CHARSET, ds->pool);
-    if (APR_SUCCESS != status) {
-        /* could not open xlate, fail */
-        apr_file_printf(ds->err, "could not open conversion from current locale: %pm\n",
-                &status);
-        return status;
+    if (arg[0] == '-') {
+        apr_file_printf(ds->err, "argument '%s': number must be positive.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_EINVAL;
     }
 
-    inbytes = strlen(arg);
-    outbytes = inbytes * 4 + 1;
-    out = apr_palloc(ds->pool, outbytes);
-
-    status = apr_xlate_conv_buffer(convset, arg, &inbytes, out, &outbytes);
-    if (APR_SUCCESS != status) {
-        /* could not open xlate, fail */
-        apr_file_printf(ds->err, "could not convert from current locale: %pm\n",
-                &status);
-        return status;
+    if (!apr_isdigit(arg[0])) {
+        apr_file_printf(ds->err, "argument '%s': is not a number.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_EINVAL;
     }
 
-    outbytes = strlen(out);
+    bytes = apr_strtoi64(arg, &end, 10);
 
-    if (outbytes < pair->q.min) {
-        /* not ok */
-        apr_file_printf(ds->err,
-                "argument '%s': sql identifier is shorter than %"
-                APR_INT64_T_FMT " characters.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1), pair->q.min);
+    if (end - arg > 18) {
+        apr_file_printf(ds->err, "argument '%s': number is too long.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
         return APR_EINVAL;
     }
 
-    if (outbytes > pair->q.max) {
-        /* not ok */
-        apr_file_printf(ds->err,
-                "argument '%s': sql identifier is longer than %"
-                APR_INT64_T_FMT " characters.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1), pair->q.max);
-        return APR_EINVAL;
+    /* zero - short circuit the suffixes */
+    if (!end[0] && bytes == 0) {
+        if (pair->b.min > 0) {
+            apr_file_printf(ds->err, "argument '%s': too small.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1));
+            return APR_EINVAL;
+        }
+        if (option) {
+            option[0] = arg;
+        }
+        return APR_SUCCESS;
     }
 
-    while (len < outbytes) {
-        char c = out[len++];
 
-        if (c >= '0' && c <= '9') {
-            if (len == 1) {
-                /* first character cannot be a number */
-                apr_file_printf(ds->err, "argument '%s': first character cannot be a number.\n",
-                        apr_pescape_echo(ds->pool, pair->key, 1));
-                return APR_EINVAL;
-            }
-            else {
-                /* ok */
-            }
+#define DEVICE_SET_BYTES(unit,expanded,limit) \
+    if (!strncmp(end, unit, strlen(end)) && (limit)) { \
+        if (!((pair->b.min && expanded < pair->b.min) || (pair->b.max && expanded > pair->b.max))) { \
+            const char **opt = apr_array_push(options); \
+            const char **possible = apr_array_push(possibles); \
+            opt[0] = apr_psprintf(ds->pool, "%c%s=%.*s%s", \
+                    pair->optional == DEVICE_IS_OPTIONAL ? '-' : '*', \
+                            device_pescape_shell(ds->pool, pair->key), \
+                            (int)(end - arg), arg, unit); \
+            possible[0] = apr_psprintf(ds->pool, "%.*s%s", (int)(end - arg), arg, unit); \
+            result = apr_psprintf(ds->pool, "%" APR_INT64_T_FMT, (apr_int64_t)expanded); \
+        } \
+    } /* last line of macro... */
+
+
+#define BYTE1024POW1 1024
+#define BYTE1024POW2 1048576
+#define BYTE1024POW3 1073741824
+#define BYTE1024POW4 1099511627776
+#define BYTE1024POW5 1125899906842624
+#define BYTE1024POW6 1152921504606846976
+#define BYTE1024POW7 1180591620717411303424
+#define BYTE1024POW8 1208925819614629174706176
+
+#define BYTE1000POW1 1000
+#define BYTE1000POW2 1000000
+#define BYTE1000POW3 1000000000
+#define BYTE1000POW4 1000000000000
+#define BYTE1000POW5 1000000000000000
+#define BYTE1000POW6 1000000000000000000
+#define BYTE1000POW7 1000000000000000000000
+#define BYTE1000POW8 1000000000000000000000000
+
+    /* bytes */
+    DEVICE_SET_BYTES("B",
+            (bytes), bytes < (apr_int64_t)4*(BYTE1024POW6));
+
+    /* 1000    kB    kilobyte */
+    DEVICE_SET_BYTES("kB",
+            (bytes * BYTE1000POW1), bytes < (apr_int64_t)4*(BYTE1000POW5));
+
+    /* 1024    KiB    kibibyte */
+    DEVICE_SET_BYTES("KiB",
+            (bytes * BYTE1024POW1), bytes < (apr_int64_t)4*(BYTE1024POW5));
+
+    /* 1000^2    MB    megabyte 1000000 */
+    DEVICE_SET_BYTES("MB",
+            (bytes * BYTE1000POW2), bytes < (apr_int64_t)4*(BYTE1000POW4));
+
+    /* 1024^2    MiB    mebibyte 1048576 */
+    DEVICE_SET_BYTES("MiB",
+            (bytes * BYTE1024POW2), bytes < (apr_int64_t)4*(BYTE1024POW4));
+
+    /* 1000^3    GB    gigabyte 1000000000 */
+    DEVICE_SET_BYTES("GB",
+            (bytes * BYTE1000POW3), bytes < (apr_int64_t)4*(BYTE1000POW3));
+
+    /* 1024^3    GiB    gibibyte 1073741824 */
+    DEVICE_SET_BYTES("GiB",
+            (bytes * BYTE1024POW3), bytes < (apr_int64_t)4*(BYTE1024POW3));
+
+    /* 1000^4    TB    terabyte 1000000000000 */
+    DEVICE_SET_BYTES("TB",
+            (bytes * BYTE1000POW4), bytes < (apr_int64_t)4*(BYTE1000POW2));
+
+    /* 1024^4    TiB    tebibyte 1099511627776 */
+    DEVICE_SET_BYTES("TiB",
+            (bytes * BYTE1024POW4), bytes < (apr_int64_t)4*(BYTE1024POW2));
+
+    /* 1000^5    PB    petabyte 1000000000000000 */
+    DEVICE_SET_BYTES("PB",
+            (bytes * BYTE1000POW5), bytes < (apr_int64_t)4*BYTE1000POW1);
+
+    /* 1024^5    PiB    pebibyte 1125899906842624 */
+    DEVICE_SET_BYTES("PiB",
+            (bytes * BYTE1024POW5), bytes < (apr_int64_t)4*BYTE1024POW1);
+
+    /* 1000^6    EB    exabyte 1000000000000000000 */
+    DEVICE_SET_BYTES("EB",
+            (bytes * BYTE1000POW6), bytes < 4);
+
+    /* 1024^6    EiB    exbibyte 1152921504606846976 */
+    DEVICE_SET_BYTES("EiB",
+            (bytes * BYTE1024POW6), bytes < 4);
+
+    /* not until 128 bit integers */
+#if 0
+    /* 1000^7    ZB    zettabyte 1000000000000000000000 */
+    DEVICE_SET_BYTES("ZB",
+            (bytes * BYTE1000POW7), bytes < 1);
+
+    /* 1024^7    ZiB    zebibyte 1180591620717411303424 */
+    DEVICE_SET_BYTES("ZiB",
+            (bytes * BYTE1024POW7), bytes < 1);
+
+    /* 1000^8    YB    yottabyte 1000000000000000000000000 */
+    DEVICE_SET_BYTES("YB",
+            (bytes * BYTE1000POW8), bytes < 1);
+
+    /* 1024^8    YiB    yobibyte  1208925819614629174706176 */
+    DEVICE_SET_BYTES("YiB",
+            (bytes * BYTE1024POW18), bytes < 1);
+#endif
+
+    /* no trailing characters, we are ok */
+    if (!end[0]) {
+        if (pair->b.min && pair->b.max && (bytes < pair->b.min || bytes > pair->b.max)) {
+            apr_file_printf(ds->err, "argument '%s': number must be from %" APR_INT64_T_FMT " to %" APR_INT64_T_FMT ".\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1),
+                    pair->b.min, pair->b.max);
+            return APR_EINVAL;
         }
-        else if (c >= 'a' && c <= 'z') {
-            /* ok */
+        else if (pair->b.min && bytes < pair->b.min) {
+            apr_file_printf(ds->err, "argument '%s': number must be %" APR_INT64_T_FMT " or higher.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1),
+                    pair->b.min);
+            return APR_EINVAL;
         }
-        else if (c == '_') {
-            /* ok */
+        else if (pair->b.max && bytes > pair->b.max) {
+            apr_file_printf(ds->err, "argument '%s': number must be %" APR_INT64_T_FMT " or lower.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1),
+                    pair->b.max);
+            return APR_EINVAL;
         }
-        else if (c > 0x7F) {
-            /* ok */
+        if (option) {
+            option[0] = arg;
+        }
+        return APR_SUCCESS;
+    }
+
+    /* trailing characters, but no possible options - we're invalid */
+    if (options->nelts == 0) {
+        if (pair->b.min && pair->b.max) {
+            apr_file_printf(ds->err, "argument '%s': number must be from %" APR_INT64_T_FMT " to %" APR_INT64_T_FMT ".\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1),
+                    pair->b.min, pair->b.max);
+        }
+        else if (pair->b.min) {
+            apr_file_printf(ds->err, "argument '%s': number must be %" APR_INT64_T_FMT " or higher.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1),
+                    pair->b.min);
+        }
+        else if (pair->b.max) {
+            apr_file_printf(ds->err, "argument '%s': number must be %" APR_INT64_T_FMT " or lower.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1),
+                    pair->b.max);
         }
         else {
-            /* not ok */
-            apr_file_printf(ds->err, "argument '%s': '%c' is an invalid character.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1), c);
-            return APR_EINVAL;
+            apr_file_printf(ds->err, "argument '%s': suffix not recognised.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1));
         }
-
+        return APR_EINVAL;
     }
 
-    if (translated) {
-        *translated = out;
+    /* just one option, success */
+    else if (options->nelts == 1) {
+        if (option) {
+            option[0] = result;
+        }
+        return APR_SUCCESS;
     }
 
-    return APR_SUCCESS;
+    /* more than one option, we're incomplete */
+    device_error_possibles(ds, pair->key, possibles);
+
+    return APR_INCOMPLETE;
 }
 
 /*
- * SQL identifier in delimited format. Delimited identifiers consist of any UTF8 non-zero
- * character. The resulting value must be SQL escaped separately before use.
+ * The symlinks catalogue is an index of the files and directories beneath
+ * a symlink base, kept in a hidden directory alongside the option sets so
+ * that the base need not be read on every lookup.
+ *
+ * Each entry is the directory relative to the base, the name, the type and
+ * modification time, and the SELinux context type where asked for, all
+ * separated by DEVICE_SYMLINKS_SEP. The entries of a directory sort
+ * together, so that a prefix within any one directory is a range.
+ *
+ * The base is stamped with its modification time, and each directory entry
+ * carries its own. Only directories whose time has moved are read again, so
+ * an unchanged tree costs one stat per directory. Changes to the contexts
+ * of files that leave their directory untouched are not seen until the
+ * directory next changes.
  */
-static apr_status_t device_parse_sql_delimited_identifier(device_set_t *ds, device_pair_t *pair,
-        const char *arg, const char **translated)
+typedef struct device_symlinks_entry_t {
+    const char *name;
+    apr_size_t namelen;
+    char type;
+    apr_time_t mtime;
+    const char *context;
+} device_symlinks_entry_t;
+
+typedef struct device_symlinks_dir_t {
+    const char *dir;
+    apr_time_t mtime;
+    apr_time_t prior;
+} device_symlinks_dir_t;
+
+static const char *device_symlinks_encode(apr_pool_t *pool, const char *dir,
+        const char *name, apr_size_t namelen, char type, apr_time_t mtime,
+        const char *context)
 {
-    apr_xlate_t* convset;
-    apr_status_t status;
-    char *out;
-    apr_size_t inbytes, outbytes;
+    return apr_psprintf(pool, "%s%c%.*s%c%c%" APR_TIME_T_FMT "%c%s", dir,
+            DEVICE_SYMLINKS_SEP, (int)namelen, name, DEVICE_SYMLINKS_SEP, type,
+            mtime, DEVICE_SYMLINKS_SEP, context);
+}
 
-    int len = 0;
+static int device_symlinks_decode(const char *entry, device_symlinks_entry_t *e)
+{
+    const char *sep;
 
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
+    if (!(sep = strchr(entry, DEVICE_SYMLINKS_SEP))) {
+        return 0;
     }
+    e->name = sep + 1;
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
-    }
-    else if (!arg[0]) {
-        if (translated) {
-            translated[0] = NULL;
-        }
-        return APR_SUCCESS;
+    if (!(sep = strchr(e->name, DEVICE_SYMLINKS_SEP)) || !sep[1]) {
+        return 0;
     }
+    e->namelen = sep - e->name;
+    e->type = sep[1];
+    e->mtime = apr_atoi64(sep + 2);
 
-    status = apr_xlate_open(&convset, "UTF-8", APR_LOCALE_CHARSET, ds->pool);
-    if (APR_SUCCESS != status) {
-        /* could not open xlate, fail */
-        apr_file_printf(ds->err, "could not open conversion from current locale: %pm\n",
-                &status);
-        return status;
+    if (!(sep = strchr(sep + 1, DEVICE_SYMLINKS_SEP))) {
+        return 0;
     }
+    e->context = sep + 1;
 
-    inbytes = strlen(arg);
-    outbytes = inbytes * 4 + 1;
-    out = apr_palloc(ds->pool, outbytes);
+    return 1;
+}
 
-    status = apr_xlate_conv_buffer(convset, arg, &inbytes, out, &outbytes);
-    if (APR_SUCCESS != status) {
-        /* could not open xlate, fail */
-        apr_file_printf(ds->err, "could not convert from current locale: %pm\n",
-                &status);
-        return status;
-    }
+/*
+ * Find the entry for the given name within the given directory.
+ */
+static int device_symlinks_find(apr_pool_t *pool, const device_catalogue_t *cat,
+        const char *dir, const char *name, device_symlinks_entry_t *e)
+{
+    const char *key = apr_psprintf(pool, "%s%c%s%c", dir, DEVICE_SYMLINKS_SEP,
+            name, DEVICE_SYMLINKS_SEP);
+    apr_size_t keylen = strlen(key);
+    apr_int64_t j = device_catalogue_lower(cat, key);
+
+    return j < cat->count
+            && !strncmp(device_catalogue_name(cat, j), key, keylen)
+            && device_symlinks_decode(device_catalogue_name(cat, j), e);
+}
 
-    outbytes = strlen(out);
+/*
+ * Read the given directory beneath the base, adding an entry for each file
+ * and directory within. Subdirectories are added to dirs, if given.
+ */
+static apr_status_t device_symlinks_read(device_set_t *ds, device_pair_t *pair,
+        const char *base, const char *dir, apr_array_header_t *entries,
+        apr_array_header_t *dirs)
+{
+    apr_dir_t *thedir;
+    apr_finfo_t dirent;
+    char *path = (char *)base;
+    apr_status_t status;
 
-    if (outbytes < pair->q.min) {
-        /* not ok */
-        apr_file_printf(ds->err,
-                "argument '%s': sql identifier is shorter than %"
-                APR_INT64_T_FMT " characters.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1), pair->q.min);
-        return APR_EINVAL;
+    if (dir[0] && APR_SUCCESS
+            != (status = apr_filepath_merge(&path, base, dir,
+                    APR_FILEPATH_SECUREROOT, ds->pool))) {
+        apr_file_printf(ds->err, "cannot merge directory for '%s': %pm\n", pair->key,
+                &status);
+        return status;
     }
 
-    if (outbytes > pair->q.max) {
-        /* not ok */
-        apr_file_printf(ds->err,
-                "argument '%s': sql identifier is longer than %"
-                APR_INT64_T_FMT " characters.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1), pair->q.max);
-        return APR_EINVAL;
+    if ((status = apr_dir_open(&thedir, path, ds->pool)) != APR_SUCCESS) {
+        return status;
     }
 
-    while (len < outbytes) {
-        char c = out[len++];
+    do {
+        const char *context = "";
+        char type;
 
-        if (c > 0) {
-            /* ok */
+        status = apr_dir_read(&dirent,
+                APR_FINFO_TYPE | APR_FINFO_NAME | APR_FINFO_MTIME, thedir);
+        if (APR_STATUS_IS_INCOMPLETE(status)) {
+            continue; /* ignore un-stat()able files */
+        } else if (status != APR_SUCCESS) {
+            break;
         }
-        else {
-            /* not ok */
-            apr_file_printf(ds->err, "argument '%s': '%c' is an invalid character.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1), c);
-            return APR_EINVAL;
+
+        /* hidden files are ignored, as are names we cannot index */
+        if (dirent.name[0] == '.' || strchr(dirent.name, DEVICE_SYMLINKS_SEP)) {
+            continue;
+        }
+
+        switch (dirent.filetype) {
+        case APR_LNK:
+            type = 'l';
+            break;
+        case APR_REG:
+            type = 'f';
+            break;
+        case APR_DIR:
+            type = 'd';
+            break;
+        default:
+            continue;
+        }
+
+#if HAVE_SELINUX_SELINUX_H
+        /* record selinux context */
+        if (pair->s.symlink_context_type) {
+            char *raw = NULL;
+            char *target;
+            int len;
+
+            if (APR_SUCCESS
+                    != (status = apr_filepath_merge(&target, path,
+                            dirent.name,
+                            APR_FILEPATH_NATIVE, ds->pool))) {
+                apr_file_printf(ds->err, "cannot merge for context '%s': %pm\n", pair->key,
+                        &status);
+                continue;
+            }
+
+            len = getfilecon(target, &raw);
+
+            if (len < 0) {
+
+                switch (errno) {
+                case ENOTSUP:
+                    /* not supported - allow through */
+                    break;
+                default:
+                    /* all other errors - ignore file */
+                    continue;
+                }
+
+            }
+            else {
+                context_t con = context_new(raw);
+
+                context = apr_pstrdup(ds->pool, context_type_get(con));
+
+                context_free(con);
+                freecon(raw);
+            }
+        }
+#endif
+
+        APR_ARRAY_PUSH(entries, const char *) = device_symlinks_encode(ds->pool,
+                dir, dirent.name, strlen(dirent.name), type, dirent.mtime,
+                context);
+
+        if (dirs && type == 'd') {
+            device_symlinks_dir_t *d = apr_array_push(dirs);
+
+            d->dir = dir[0] ? apr_pstrcat(ds->pool, dir, "/", dirent.name, NULL) :
+                    apr_pstrdup(ds->pool, dirent.name);
+            d->mtime = dirent.mtime;
+            d->prior = -1;
         }
 
+    } while (1);
+
+    apr_dir_close(thedir);
+
+    return APR_STATUS_IS_ENOENT(status) ? APR_SUCCESS : status;
+}
+
+/*
+ * Bring the entries for the given directory, and when recursive the
+ * directories beneath it, up to date. Entries are taken from the old
+ * catalogue while the modification time of the directory is unchanged.
+ */
+static void device_symlinks_walk(device_set_t *ds, device_pair_t *pair,
+        const char *base, const device_catalogue_t *old, const char *dir,
+        apr_time_t mtime, apr_time_t prior, apr_array_header_t *entries,
+        int *changed)
+{
+    apr_array_header_t *dirs = NULL;
+    int i;
+
+    if (pair->s.symlink_recursive) {
+        dirs = apr_array_make(ds->pool, 4, sizeof(device_symlinks_dir_t));
     }
 
-    if (translated) {
-        *translated = out;
+    if (old && mtime == prior) {
+
+        const char *key = apr_psprintf(ds->pool, "%s%c", dir, DEVICE_SYMLINKS_SEP);
+        apr_size_t keylen = strlen(key);
+        apr_int64_t j;
+
+        for (j = device_catalogue_lower(old, key); j < old->count; j++) {
+
+            const char *entry = device_catalogue_name(old, j);
+            device_symlinks_entry_t e;
+
+            if (strncmp(entry, key, keylen)) {
+                break;
+            }
+
+            if (dirs && device_symlinks_decode(entry, &e) && e.type == 'd') {
+
+                device_symlinks_dir_t *d = apr_array_push(dirs);
+                apr_finfo_t finfo;
+                char *path;
+
+                d->dir = dir[0] ?
+                        apr_psprintf(ds->pool, "%s/%.*s", dir, (int)e.namelen, e.name) :
+                        apr_pstrndup(ds->pool, e.name, e.namelen);
+                d->prior = e.mtime;
+                d->mtime = -1;
+
+                if (APR_SUCCESS == apr_filepath_merge(&path, base, d->dir,
+                        APR_FILEPATH_SECUREROOT, ds->pool)
+                        && APR_SUCCESS == apr_stat(&finfo, path, APR_FINFO_MTIME,
+                                ds->pool)) {
+                    d->mtime = finfo.mtime;
+                }
+
+                if (d->mtime != d->prior) {
+                    entry = device_symlinks_encode(ds->pool, dir, e.name,
+                            e.namelen, e.type, d->mtime, e.context);
+                    *changed = 1;
+                }
+            }
+
+            APR_ARRAY_PUSH(entries, const char *) = entry;
+        }
+
+    }
+    else {
+
+        *changed = 1;
+
+        if (APR_SUCCESS != device_symlinks_read(ds, pair, base, dir, entries, dirs)) {
+            /* directory gone, leave it empty */
+            return;
+        }
+
+        for (i = 0; old && dirs && i < dirs->nelts; i++) {
+
+            device_symlinks_dir_t *d = &APR_ARRAY_IDX(dirs, i, device_symlinks_dir_t);
+            const char *name = strrchr(d->dir, '/');
+            device_symlinks_entry_t e;
+
+            if (device_symlinks_find(ds->pool, old, dir, name ? name + 1 : d->dir, &e)
+                    && e.type == 'd') {
+                d->prior = e.mtime;
+            }
+        }
+
+    }
+
+    for (i = 0; dirs && i < dirs->nelts; i++) {
+
+        device_symlinks_dir_t *d = &APR_ARRAY_IDX(dirs, i, device_symlinks_dir_t);
+
+        device_symlinks_walk(ds, pair, base, old, d->dir, d->mtime, d->prior,
+                entries, changed);
+    }
+
+}
+
+/*
+ * Return the catalogue for the given base, bringing it up to date with the
+ * base first.
+ */
+static apr_status_t device_symlinks_open(device_set_t *ds, device_pair_t *pair,
+        const char *base, device_catalogue_t *cat)
+{
+    apr_array_header_t *entries;
+    device_catalogue_t old;
+    apr_finfo_t finfo;
+    const char *path;
+    apr_status_t status;
+    int valid, changed = 0;
+
+    if (APR_SUCCESS != (status = apr_stat(&finfo, base, APR_FINFO_MTIME, ds->pool))) {
+        return status;
+    }
+
+    path = apr_pstrcat(ds->pool, DEVICE_SYMLINKS_DIR "/",
+            device_safename(ds->pool, base),
+            pair->s.symlink_recursive ? ":recursive" : "",
+#if HAVE_SELINUX_SELINUX_H
+            pair->s.symlink_context_type ? ":context" : "",
+#endif
+            NULL);
+
+    valid = (APR_SUCCESS == device_catalogue_load(ds, path, DEVICE_SYMLINKS_MAGIC,
+            &old));
+
+    entries = apr_array_make(ds->pool, 64, sizeof(const char *));
+
+    device_symlinks_walk(ds, pair, base, valid ? &old : NULL, "", finfo.mtime,
+            valid ? old.stamp[0] : -1, entries, &changed);
+
+    if (!changed) {
+        *cat = old;
+        return APR_SUCCESS;
+    }
+
+    if (APR_SUCCESS != device_catalogue_save(ds, path, DEVICE_SYMLINKS_MAGIC,
+            entries, finfo.mtime, 0, cat)) {
+        /* read only, we get by without saving */
     }
 
     return APR_SUCCESS;
 }
 
 /**
- * User is a string which must match one of a series of existing users,
- * potentially limited to one or more groups.
+ * Symlink is a name that will be linked to a series of files or directories at
+ * a target path.
  */
-static apr_status_t device_parse_user(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
+static apr_status_t device_parse_symlink(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option,
+        const char **link)
 {
-    const char *none = NULL;
-    apr_status_t status;
-    apr_size_t arglen = arg ? strlen(arg) : 0;
+    const char *none = NULL, *dirname, *basename, *key;
+    apr_status_t status = APR_SUCCESS;
+    apr_size_t baselen, keylen;
 
     apr_array_header_t *possibles = apr_array_make(ds->pool, 10, sizeof(char *));
 
-    int i, j;
-
-    int exact = 0;
+    int i;
 
     if (option) {
         option[0] = NULL; /* until further notice */
@@ -2485,50 +3249,110 @@ static apr_status_t device_parse_user(device_set_t *ds, device_pair_t *pair,
             none = pair->unset;
         }
         else {
-            none = DEVICE_USER_NONE;
+            none = DEVICE_SYMLINK_NONE;
         }
     }
 
-    if (!pair->u.groups) {
+    /* find the base path, up to depth */
+    if (none && !strcmp(arg, none)) {
+        basename = arg;
+        dirname = NULL;
+    }
 
-        struct passwd *pwd;
+    else if (pair->s.symlink_recursive) {
 
-        setpwent();
+        if (arg[0] != '/') {
+            apr_file_printf(ds->err, "'%s' must start with a '/'.\n", pair->key);
+            return APR_EINVAL;
+        }
 
-        do {
+        else {
+            basename = strrchr(arg + 1, '/');
+            if (!basename) {
+                dirname = "";
+                basename = arg + 1;
+            }
+            else {
+                dirname = apr_pstrndup(ds->pool, arg + 1, basename - arg - 1);
+                basename++;
+            }
+        }
+
+    }
+    else {
+
+        if (arg[0] == '/') {
+            apr_file_printf(ds->err, "'%s' must not start with a '/'.\n", pair->key);
+            return APR_EINVAL;
+        }
 
-            const char *user;
-            const char **possible;
+        basename = arg;
+        dirname = NULL;
 
-            if (none) {
+    }
 
-                user = none;
+    baselen = strlen(basename);
 
-            } else {
+    key = apr_psprintf(ds->pool, "%s%c%s", dirname ? dirname : "",
+            DEVICE_SYMLINKS_SEP, basename);
+    keylen = strlen(key);
 
-                apr_set_os_error(0);
-                pwd = getpwent();
-                status = apr_get_os_error();
+    if (!pair->s.bases) {
+        apr_file_printf(ds->err, "no base directory specified for '%s'\n", pair->key);
+        return APR_EGENERAL;
+    }
 
-                if (APR_SUCCESS != status) {
-                    apr_file_printf(ds->err, "cannot read users '%s': %pm\n", pair->key,
-                            &status);
-                    break;
-                }
+    for (i = 0; i < pair->s.bases->nelts; i++) {
 
-                if (!pwd) {
-                    break;
+        device_catalogue_t cat;
+        device_symlinks_entry_t e;
+        apr_int64_t j;
+
+        char *base = APR_ARRAY_IDX(pair->s.bases, i, char *);
+        char *dir = base;
+
+        if ((status = device_symlinks_open(ds, pair, base, &cat)) != APR_SUCCESS) {
+            /* could not open directory, skip */
+            continue;
+        }
+
+        if (dirname && dirname[0]) {
+
+            const char *parent = strrchr(dirname, '/');
+
+            if (APR_SUCCESS
+                    != (status = apr_filepath_merge(&dir, base,
+                            dirname,
+                            APR_FILEPATH_SECUREROOT, ds->pool))) {
+                apr_file_printf(ds->err, "cannot merge directory for '%s': %pm\n", pair->key,
+                        &status);
+                return status;
+            }
+
+            /* directories reached through links are read as we go */
+            if (!device_symlinks_find(ds->pool, &cat,
+                    parent ? apr_pstrndup(ds->pool, dirname, parent - dirname) : "",
+                    parent ? parent + 1 : dirname, &e) || e.type != 'd') {
+
+                apr_array_header_t *entries = apr_array_make(ds->pool, 16,
+                        sizeof(const char *));
+
+                if ((status = device_symlinks_read(ds, pair, base, dirname,
+                        entries, NULL)) != APR_SUCCESS) {
+                    /* could not open directory, skip */
+                    continue;
                 }
 
-                user = pwd->pw_name;
+                device_catalogue_save(ds, NULL, DEVICE_SYMLINKS_MAGIC, entries,
+                        0, 0, &cat);
             }
+        }
 
-            possible = apr_array_push(possibles);
-            possible[0] = apr_pstrdup(ds->pool, user);
+        if (none) {
 
-            exact = (0 == strcmp(arg, user));
+            int exact = (0 == strcmp(basename, none));
 
-            if (!strncmp(arg, user, arglen)) {
+            if (!strncmp(basename, none, baselen)) {
 
                 const char **opt;
 
@@ -2540,890 +3364,2773 @@ static apr_status_t device_parse_user(device_set_t *ds, device_pair_t *pair,
                 opt[0] = apr_pstrcat(ds->pool,
                         pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
                         device_pescape_shell(ds->pool, pair->key), "=",
-                        device_pescape_shell(ds->pool, user),
+                        device_pescape_shell(ds->pool, none),
                         NULL);
 
                 if (option) {
-                    if (none) {
-                        option[0] = NULL;
-                    }
-                    else {
-                        option[0] = possible[0];
-                    }
+                    option[0] = NULL;
+                    link[0] = NULL;
                 }
-            }
 
-            if (exact) {
-                /* exact matches short circuit */
-                break;
+                APR_ARRAY_PUSH(possibles, const char *) = none;
             }
 
             none = NULL;
 
-        } while (1);
+            if (exact) {
+                /* exact matches short circuit */
+                goto done;
+            }
+        }
 
-        endpwent();
+        /* walk the entries of the directory sharing our prefix */
+        for (j = device_catalogue_lower(&cat, key); j < cat.count; j++) {
 
-    }
-    else {
+            const char *entry = device_catalogue_name(&cat, j);
+            const char *name, *path;
+            const char **opt;
+            apr_size_t namelen;
+            int exact;
 
-        for (i = 0; i < pair->u.groups->nelts; i++) {
+            if (strncmp(entry, key, keylen)) {
+                break;
+            }
 
-            struct group *gr;
+            if (!device_symlinks_decode(entry, &e)) {
+                continue;
+            }
 
-            const char *group = APR_ARRAY_IDX(pair->u.groups, i, const char *);
+#if HAVE_SELINUX_SELINUX_H
+            /* check selinux context, unsupported is allowed through */
+            if (pair->s.symlink_context_type && e.context[0]
+                    && strcmp(pair->s.symlink_context_type, e.context)) {
+                continue;
+            }
+#endif
 
-            apr_set_os_error(0);
-            gr = getgrnam(group);
-            status = apr_get_os_error();
+            /* suffixes? */
+            namelen = e.namelen;
+            if (pair->s.symlink_suffix) {
+                if (namelen < pair->s.symlink_suffix_len
+                        || strncmp(pair->s.symlink_suffix,
+                                e.name + namelen - pair->s.symlink_suffix_len,
+                                pair->s.symlink_suffix_len)) {
+                    continue;
+                }
+                namelen -= pair->s.symlink_suffix_len;
+            }
 
-            if (APR_SUCCESS != status) {
-                apr_file_printf(ds->err, "cannot read groups '%s': %pm\n", pair->key,
-                        &status);
+            if (namelen < baselen) {
+                continue;
             }
-            else if (gr && gr->gr_mem) {
 
-                j = 0;
+            name = apr_pstrndup(ds->pool, e.name, namelen);
 
-                do {
+            exact = (0 == strcmp(basename, name));
 
-                    const char *user;
-                    const char **possible;
+            if (dirname) {
+                if (dirname[0]) {
+                    path = apr_pstrcat(ds->pool, "/", dirname, "/", name, NULL);
+                }
+                else {
+                    path = apr_pstrcat(ds->pool, "/", name, NULL);
+                }
+            }
+            else {
+                path = name;
+            }
 
-                    if (none) {
-                        user = none;
-                    } else {
-                        user = gr->gr_mem[j++];
-                    }
+            APR_ARRAY_PUSH(possibles, const char *) = name;
 
-                    if (!user) {
-                        break;
-                    }
+            if (exact) {
+                apr_array_clear(options);
+            }
 
-                    possible = apr_array_push(possibles);
-                    possible[0] = apr_pstrdup(ds->pool, user);
+            opt = apr_array_push(options);
+            opt[0] = apr_pstrcat(ds->pool,
+                    pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
+                    device_pescape_shell(ds->pool, pair->key), "=",
+                    device_pescape_shell(ds->pool, path),
+                    NULL);
 
-                    exact = (0 == strcmp(arg, user));
+            if (option) {
 
-                    if (!strncmp(arg, user, arglen)) {
+                char *target;
 
-                        const char **opt;
+                if (APR_SUCCESS
+                        != (status = apr_filepath_merge(&target, dir,
+                                apr_pstrcat(ds->pool, name, pair->suffix, NULL),
+                                APR_FILEPATH_NATIVE, ds->pool))) {
+                    apr_file_printf(ds->err, "cannot merge links '%s': %pm\n", pair->key,
+                            &status);
+                }
+                else {
+                    option[0] = name;
+                    link[0] = target;
+                }
 
-                        if (exact) {
-                            apr_array_clear(options);
-                        }
+            }
 
-                        opt = apr_array_push(options);
-                        opt[0] = apr_pstrcat(ds->pool,
-                                pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
-                                device_pescape_shell(ds->pool, pair->key), "=",
-                                device_pescape_shell(ds->pool, user),
-                                NULL);
+            if (exact) {
+                /* exact matches short circuit */
+                goto done;
+            }
 
-                        if (option) {
-                            if (none) {
-                                option[0] = NULL;
-                            }
-                            else {
-                                option[0] = possible[0];
-                            }
-                        }
-                    }
+        }
 
-                    if (exact) {
-                        /* exact matches short circuit */
-                        break;
-                    }
+        status = APR_ENOENT;
 
-                    none = NULL;
+    }
 
-                } while (1);
+    if (APR_SUCCESS == status || APR_STATUS_IS_ENOENT(status)) {
 
+        if (option) {
+            if (options->nelts == 1) {
+                /* all ok */
             }
+            else {
+                device_error_possibles(ds, pair->key, possibles);
 
-            endgrent();
-
-            if (exact) {
-                /* exact matches short circuit */
-                break;
-            }
-
+                return APR_INCOMPLETE;
+            }
         }
 
+        status = APR_SUCCESS;
     }
-
-
-    if (option && option[0]) {
-        if (options->nelts == 1) {
-            /* all ok */
-        }
-        else {
-            device_error_possibles(ds, pair->key, possibles);
-            return APR_INCOMPLETE;
-        }
+    else {
+        apr_file_printf(ds->err, "cannot read option '%s': %pm\n", pair->key,
+                &status);
     }
 
+done:
+
     return status;
 }
 
-enum dn_state {
-    DN_DN_START,
-    DN_RDN_START,
-    DN_ATAV_START,
-    DN_AT_START,
-    DN_DESCR,
-    DN_NUMERICOID_N_START,
-    DN_NUMERICOID_N,
-    DN_V_START,
-    DN_HEX_START,
-    DN_HEX_LEFT,
-    DN_HEX_RIGHT,
-    DN_STRING_START,
-    DN_STRING,
-    DN_STRING_ESC,
-    DN_STRING_HEX,
-};
-
-/**
- * Distinguished name is a string described by RFC4514, containing a series
- * of name value pairs.
+/*
+ * Parse a positive integer.
  */
-static apr_status_t device_parse_distinguished_name(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
+static apr_status_t device_parse_uint64(device_set_t *ds, const char *arg,
+        apr_uint64_t *result)
 {
-    apr_size_t arglen = arg ? strlen(arg) : 0;
+    char *end;
+    apr_int64_t bytes;
 
-//    apr_array_header_t *possibles = apr_array_make(ds->pool, 10, sizeof(char *));
+    if (!arg || !arg[0]) {
+        apr_file_printf(ds->err, "number is empty.\n");
+        return APR_INCOMPLETE;
+    }
 
-    const char *cp;
+    if (arg[0] == '-') {
+        apr_file_printf(ds->err, "number '%s' must be positive.\n",
+                apr_pescape_echo(ds->pool, arg, 1));
+        return APR_EINVAL;
+    }
 
-    enum dn_state state = DN_DN_START;
+    if (!strcmp(arg, "min")) {
+        bytes = 0;
+    }
+    else if (!strcmp(arg, "max")) {
+        bytes = APR_INT64_MAX;
+    }
+    else {
 
-    char ch = 0, prev;
+        bytes = apr_strtoi64(arg, &end, 10);
 
-    if (option) {
-        option[0] = NULL; /* until further notice */
-    }
+        if (end[0]) {
+            apr_file_printf(ds->err, "number '%s' is not a number.\n",
+                    apr_pescape_echo(ds->pool, arg, 1));
+            return APR_EINVAL;
+        }
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arglen) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
     }
 
-    cp = arg;
-
-    while (*cp) {
+    *result = bytes;
 
-        prev = ch;
-        ch = *cp;
+    return APR_SUCCESS;
+}
 
-        switch (state) {
-        case DN_DN_START:
-            if (ch == ',') {
-                apr_file_printf(ds->err, "'%s' has a stray '%c'\n", pair->key, ch);
-                return APR_EINVAL;
-            }
+/*
+ * Parse a signed integer.
+ */
+static apr_status_t device_parse_int64(device_set_t *ds, const char *arg,
+        apr_int64_t *result)
+{
+    char *end;
+    apr_int64_t bytes;
 
-            state = DN_RDN_START;
-            continue;
-        case DN_RDN_START:
-            if (ch == '+') {
-                apr_file_printf(ds->err, "'%s' has a stray '%c'\n", pair->key, ch);
-                return APR_EINVAL;
-            }
+    if (!arg || !arg[0]) {
+        apr_file_printf(ds->err, "number is empty.\n");
+        return APR_INCOMPLETE;
+    }
 
-            state = DN_ATAV_START;
-            continue;
-        case DN_ATAV_START:
+    if (!strcmp(arg, "min")) {
+        bytes = 0;
+    }
+    else if (!strcmp(arg, "max")) {
+        bytes = APR_INT64_MAX;
+    }
+    else {
 
-            state = DN_AT_START;
-            continue;
-        case DN_AT_START:
-            /* keystring = leadkeychar *keychar
-             * leadkeychar = ALPHA
-             * keychar = ALPHA / DIGIT / HYPHEN
-             * descr = keystring
-             * numericoid = number 1*( DOT number )
-             * oid = descr / numericoid
-             */
-            if (ch == '=') {
-                apr_file_printf(ds->err, "'%s' attribute type is empty\n", pair->key);
-                return APR_EINVAL;
-            }
-            else if (apr_isalpha(ch)) {
-                state = DN_DESCR;
-                continue;
-            }
-            else if (apr_isdigit(ch)) {
-                state = DN_NUMERICOID_N_START;
-                continue;
-            }
+        bytes = apr_strtoi64(arg, &end, 10);
 
-            apr_file_printf(ds->err, "'%s' attribute type character %c is not alphanumeric\n", pair->key, ch);
+        if (end[0]) {
+            apr_file_printf(ds->err, "number '%s' is not a number.\n",
+                    apr_pescape_echo(ds->pool, arg, 1));
             return APR_EINVAL;
+        }
 
-        case DN_DESCR:
-            /* keystring = leadkeychar *keychar
-             * leadkeychar = ALPHA
-             * keychar = ALPHA / DIGIT / HYPHEN
-             * descr = keystring
-             */
-            if (ch == '=') {
-                state = DN_V_START;
-                cp++;
-                continue;
-            }
-            else if (ch != '-' && !apr_isalnum(ch)) {
-                apr_file_printf(ds->err, "'%s' attribute type character %c is not alphanumeric/hyphen\n", pair->key, ch);
-                return APR_EINVAL;
-            }
+    }
 
-            break;
-        case DN_NUMERICOID_N_START:
-            /* numericoid = number 1*( DOT number )
-             */
-            if (!apr_isdigit(ch)) {
-                apr_file_printf(ds->err, "'%s' attribute type character %c is not numeric\n", pair->key, ch);
-                return APR_EINVAL;
-            }
+    *result = bytes;
 
-            state = DN_NUMERICOID_N;
-            cp++;
-            continue;
-        case DN_NUMERICOID_N:
-            /* numericoid = number 1*( DOT number )
-             */
-            if (ch == '=') {
-                state = DN_V_START;
-                cp++;
-                continue;
-            }
-            if (ch == '.') {
-                state = DN_NUMERICOID_N_START;
-                cp++;
-                continue;
-            }
-            if (!apr_isdigit(ch)) {
-                apr_file_printf(ds->err, "'%s' attribute type character %c is not numeric\n", pair->key, ch);
-                return APR_EINVAL;
-            }
+    return APR_SUCCESS;
+}
 
-            break;
-        case DN_V_START:
-            /* attributeValue = string / hexstring
-             * hexstring = SHARP 1*hexpair
-             * hexpair = HEX HEX
-             */
-            if (ch == ',' || ch == '+') {
-                state = DN_RDN_START;
-                cp++;
-                continue;
-            }
-            else if (ch == '#') {
-                state = DN_HEX_START;
-                cp++;
-                continue;
-            }
+/*
+ * Parse a signed hex integer.
+ */
+static apr_status_t device_parse_hex64(device_set_t *ds, const char *arg,
+        apr_uint64_t *result)
+{
+    char *end;
+    apr_uint64_t hex;
 
-            state = DN_STRING_START;
-            continue;
+    if (!arg || !arg[0]) {
+        apr_file_printf(ds->err, "number is empty.\n");
+        return APR_INCOMPLETE;
+    }
 
-        case DN_HEX_START:
-            /* attributeValue = string / hexstring
-             * hexstring = SHARP 1*hexpair
-             * hexpair = HEX HEX
-             */
-            if (!apr_isxdigit(ch)) {
-                apr_file_printf(ds->err, "'%s' attribute type character %c is not a hex digit\n", pair->key, ch);
-                return APR_EINVAL;
-            }
+    if (!strcmp(arg, "min")) {
+        hex = 0;
+    }
+    else if (!strcmp(arg, "max")) {
+        hex = APR_UINT64_MAX;
+    }
+    else {
 
-            state = DN_HEX_RIGHT;
-            cp++;
-            continue;
+        hex = device_strtoui64(arg, &end, 16);
 
-        case DN_HEX_LEFT:
-            /* attributeValue = string / hexstring
-             * hexstring = SHARP 1*hexpair
-             * hexpair = HEX HEX
-             */
-            if (ch == ',' || ch == '+') {
-                state = DN_RDN_START;
-                cp++;
-                continue;
-            }
-            else if (!apr_isxdigit(ch)) {
-                apr_file_printf(ds->err, "'%s' attribute type character %c is not a hex digit\n", pair->key, ch);
-                return APR_EINVAL;
-            }
+        if (end[0]) {
+            apr_file_printf(ds->err, "number '%s' is not a hex number.\n",
+                    apr_pescape_echo(ds->pool, arg, 1));
+            return APR_EINVAL;
+        }
 
-            state = DN_HEX_RIGHT;
-            cp++;
-            continue;
+    }
 
-        case DN_HEX_RIGHT:
-            /* attributeValue = string / hexstring
-             * hexstring = SHARP 1*hexpair
-             * hexpair = HEX HEX
-             */
-            if (!apr_isxdigit(ch)) {
-                apr_file_printf(ds->err, "'%s' attribute type character %c is not a hex digit\n", pair->key, ch);
-                return APR_EINVAL;
-            }
+    *result = hex;
 
-            state = DN_HEX_LEFT;
-            cp++;
-            continue;
+    return APR_SUCCESS;
+}
 
-        case DN_STRING_START:
-            /* ; The following characters are to be escaped when they appear
-             * ; in the value to be encoded: ESC, one of <escaped>, leading
-             * ; SHARP or SPACE, trailing SPACE, and NULL.
-             * string =   [ ( leadchar / pair ) [ *( stringchar / pair )
-             *            ( trailchar / pair ) ] ]
-             *
-             * leadchar = LUTF1 / UTFMB
-             * LUTF1 = %x01-1F / %x21 / %x24-2A / %x2D-3A /
-             *         %x3D / %x3F-5B / %x5D-7F
-             *
-             * trailchar  = TUTF1 / UTFMB
-             * TUTF1 = %x01-1F / %x21 / %x23-2A / %x2D-3A /
-             *         %x3D / %x3F-5B / %x5D-7F
-             *
-             * stringchar = SUTF1 / UTFMB
-             * SUTF1 = %x01-21 / %x23-2A / %x2D-3A /
-             *         %x3D / %x3F-5B / %x5D-7F
-             *
-             * pair = ESC ( ESC / special / hexpair )
-             * special = escaped / SPACE / SHARP / EQUALS
-             * escaped = DQUOTE / PLUS / COMMA / SEMI / LANGLE / RANGLE
-             */
+/*
+ * SQL identifier in regular format. Regular identifiers start with a letter (a-z, but
+ * also letters with diacritical marks and non-Latin letters) or an underscore (_).
+ * Subsequent characters in an identifier can be letters, underscores, or digits (0-9).
+ * The resulting value does not need to be SQL escaped before use.
+ */
+static apr_status_t device_parse_sql_identifier(device_set_t *ds, device_pair_t *pair,
+        const char *arg, const char **translated)
+{
+    apr_xlate_t* convset;
+    apr_status_t status;
+    char *out;
+    apr_size_t inbytes, outbytes;
 
-            /* leadchar: has no [space]"#,+;<>\
-             * stringchar: has no ",+;<>\
-             * trailchar: has no [space]",+;<>\
-             */
+    int len = 0;
 
-            /* %x20 */
-            if (ch == ' ') {
-                apr_file_printf(ds->err, "'%s' value cannot start with a space\n", pair->key);
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
+    }
+
+    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+    else if (!arg[0]) {
+        if (translated) {
+            translated[0] = NULL;
+        }
+        return APR_SUCCESS;
+    }
+
+    status = apr_xlate_open(&convset, "UTF-8", APR_LOCALE_CHARSET, ds->pool);
+    if (APR_SUCCESS != status) {
+        /* could not open xlate, fail */
+        apr_file_printf(ds->err, "could not open conversion from current locale: %pm\n",
+                &status);
+        return status;
+    }
+
+    inbytes = strlen(arg);
+    outbytes = inbytes * 4 + 1;
+    out = apr_palloc(ds->pool, outbytes);
+
+    status = apr_xlate_conv_buffer(convset, arg, &inbytes, out, &outbytes);
+    if (APR_SUCCESS != status) {
+        /* could not open xlate, fail */
+        apr_file_printf(ds->err, "could not convert from current locale: %pm\n",
+                &status);
+        return status;
+    }
+
+    outbytes = strlen(out);
+
+    if (outbytes < pair->q.min) {
+        /* not ok */
+        apr_file_printf(ds->err,
+                "argument '%s': sql identifier is shorter than %"
+                APR_INT64_T_FMT " characters.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1), pair->q.min);
+        return APR_EINVAL;
+    }
+
+    if (outbytes > pair->q.max) {
+        /* not ok */
+        apr_file_printf(ds->err,
+                "argument '%s': sql identifier is longer than %"
+                APR_INT64_T_FMT " characters.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1), pair->q.max);
+        return APR_EINVAL;
+    }
+
+    while (len < outbytes) {
+        char c = out[len++];
+
+        if (c >= '0' && c <= '9') {
+            if (len == 1) {
+                /* first character cannot be a number */
+                apr_file_printf(ds->err, "argument '%s': first character cannot be a number.\n",
+                        apr_pescape_echo(ds->pool, pair->key, 1));
                 return APR_EINVAL;
             }
+            else {
+                /* ok */
+            }
+        }
+        else if (c >= 'a' && c <= 'z') {
+            /* ok */
+        }
+        else if (c == '_') {
+            /* ok */
+        }
+        else if (c > 0x7F) {
+            /* ok */
+        }
+        else {
+            /* not ok */
+            apr_file_printf(ds->err, "argument '%s': '%c' is an invalid character.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1), c);
+            return APR_EINVAL;
+        }
 
-            state = DN_STRING;
-            continue;
+    }
 
-        case DN_STRING:
+    if (translated) {
+        *translated = out;
+    }
 
-               /* stringchar: has no ",+;<>\ */
+    return APR_SUCCESS;
+}
 
-            if (ch == '"' || ch == ';' || ch == '<' || ch == '>') {
-                apr_file_printf(ds->err, "'%s' value character %c is not escaped\n", pair->key, ch);
+/*
+ * SQL identifier in delimited format. Delimited identifiers consist of any UTF8 non-zero
+ * character. The resulting value must be SQL escaped separately before use.
+ */
+static apr_status_t device_parse_sql_delimited_identifier(device_set_t *ds, device_pair_t *pair,
+        const char *arg, const char **translated)
+{
+    apr_xlate_t* convset;
+    apr_status_t status;
+    char *out;
+    apr_size_t inbytes, outbytes;
+
+    int len = 0;
+
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
+    }
+
+    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+    else if (!arg[0]) {
+        if (translated) {
+            translated[0] = NULL;
+        }
+        return APR_SUCCESS;
+    }
+
+    status = apr_xlate_open(&convset, "UTF-8", APR_LOCALE_CHARSET, ds->pool);
+    if (APR_SUCCESS != status) {
+        /* could not open xlate, fail */
+        apr_file_printf(ds->err, "could not open conversion from current locale: %pm\n",
+                &status);
+        return status;
+    }
+
+    inbytes = strlen(arg);
+    outbytes = inbytes * 4 + 1;
+    out = apr_palloc(ds->pool, outbytes);
+
+    status = apr_xlate_conv_buffer(convset, arg, &inbytes, out, &outbytes);
+    if (APR_SUCCESS != status) {
+        /* could not open xlate, fail */
+        apr_file_printf(ds->err, "could not convert from current locale: %pm\n",
+                &status);
+        return status;
+    }
+
+    outbytes = strlen(out);
+
+    if (outbytes < pair->q.min) {
+        /* not ok */
+        apr_file_printf(ds->err,
+                "argument '%s': sql identifier is shorter than %"
+                APR_INT64_T_FMT " characters.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1), pair->q.min);
+        return APR_EINVAL;
+    }
+
+    if (outbytes > pair->q.max) {
+        /* not ok */
+        apr_file_printf(ds->err,
+                "argument '%s': sql identifier is longer than %"
+                APR_INT64_T_FMT " characters.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1), pair->q.max);
+        return APR_EINVAL;
+    }
+
+    while (len < outbytes) {
+        char c = out[len++];
+
+        if (c > 0) {
+            /* ok */
+        }
+        else {
+            /* not ok */
+            apr_file_printf(ds->err, "argument '%s': '%c' is an invalid character.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1), c);
+            return APR_EINVAL;
+        }
+
+    }
+
+    if (translated) {
+        *translated = out;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * The users catalogue is a snapshot of the users on the system, or of the
+ * members of a group, kept in a hidden directory alongside the option sets
+ * so that the user and group databases are not walked on every lookup.
+ *
+ * A snapshot is stamped with the modification time of the passwd or group
+ * file, and with the time it was taken. It is rebuilt when the file changes,
+ * or when older than the time to live of the option, which covers users and
+ * groups served from elsewhere by NSS. A time to live of zero disables the
+ * snapshot.
+ */
+static apr_status_t device_users_open(device_set_t *ds, device_pair_t *pair,
+        const char *group, device_catalogue_t *cat)
+{
+    apr_array_header_t *entries;
+    apr_finfo_t finfo;
+    const char *path = NULL;
+    apr_time_t mtime = 0, now = apr_time_now();
+    apr_status_t status;
+
+    if (pair->u.ttl > 0) {
+
+        if (APR_SUCCESS == apr_stat(&finfo,
+                group ? DEVICE_USERS_GROUP : DEVICE_USERS_PASSWD,
+                APR_FINFO_MTIME, ds->pool)) {
+            mtime = finfo.mtime;
+        }
+
+        path = group ? apr_pstrcat(ds->pool, DEVICE_USERS_DIR "/group:",
+                device_safename(ds->pool, group), NULL) :
+                DEVICE_USERS_DIR "/passwd";
+
+        if (APR_SUCCESS == device_catalogue_load(ds, path, DEVICE_USERS_MAGIC, cat)
+                && cat->stamp[0] == mtime && cat->stamp[1] <= now
+                && now - cat->stamp[1] < apr_time_from_sec(pair->u.ttl)) {
+            return APR_SUCCESS;
+        }
+
+    }
+
+    entries = apr_array_make(ds->pool, 64, sizeof(const char *));
+
+    if (!group) {
+
+        struct passwd *pwd;
+
+        setpwent();
+
+        do {
+
+            apr_set_os_error(0);
+            pwd = getpwent();
+            status = apr_get_os_error();
+
+            if (APR_SUCCESS != status) {
+                apr_file_printf(ds->err, "cannot read users '%s': %pm\n", pair->key,
+                        &status);
+                endpwent();
+                return status;
+            }
+
+            if (!pwd) {
+                break;
+            }
+
+            APR_ARRAY_PUSH(entries, const char *) = apr_pstrdup(ds->pool,
+                    pwd->pw_name);
+
+        } while (1);
+
+        endpwent();
+
+    }
+    else {
+
+        struct group *gr;
+
+        apr_set_os_error(0);
+        gr = getgrnam(group);
+        status = apr_get_os_error();
+
+        if (APR_SUCCESS != status) {
+            apr_file_printf(ds->err, "cannot read groups '%s': %pm\n", pair->key,
+                    &status);
+            endgrent();
+            return status;
+        }
+
+        if (gr && gr->gr_mem) {
+
+            int j;
+
+            for (j = 0; gr->gr_mem[j]; j++) {
+                APR_ARRAY_PUSH(entries, const char *) = apr_pstrdup(ds->pool,
+                        gr->gr_mem[j]);
+            }
+
+        }
+
+        endgrent();
+
+    }
+
+    if (APR_SUCCESS != device_catalogue_save(ds, path, DEVICE_USERS_MAGIC,
+            entries, mtime, now, cat)) {
+        /* read only, we get by without saving */
+    }
+
+    return APR_SUCCESS;
+}
+
+/**
+ * User is a string which must match one of a series of existing users,
+ * potentially limited to one or more groups.
+ */
+static apr_status_t device_parse_user(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    const char *none = NULL;
+    apr_status_t status = APR_SUCCESS;
+
+    apr_array_header_t *possibles = apr_array_make(ds->pool, 10, sizeof(char *));
+
+    int i;
+
+    if (option) {
+        option[0] = NULL; /* until further notice */
+    }
+
+    if (pair->optional == DEVICE_IS_OPTIONAL) {
+        if (pair->unset) {
+            none = pair->unset;
+        }
+        else {
+            none = DEVICE_USER_NONE;
+        }
+    }
+
+    for (i = 0; i < (pair->u.groups ? pair->u.groups->nelts : 1); i++) {
+
+        const char *group = pair->u.groups ?
+                APR_ARRAY_IDX(pair->u.groups, i, const char *) : NULL;
+        device_catalogue_t cat;
+
+        if (APR_SUCCESS != (status = device_users_open(ds, pair, group, &cat))) {
+            continue;
+        }
+
+        if (device_catalogue_match(ds, pair, &cat, &none, arg, options, option)) {
+            /* exact matches short circuit */
+            break;
+        }
+
+    }
+
+    if (option && option[0]) {
+        if (options->nelts == 1) {
+            /* all ok */
+        }
+        else {
+            device_error_possibles(ds, pair->key, possibles);
+            return APR_INCOMPLETE;
+        }
+    }
+
+    return status;
+}
+
+enum dn_state {
+    DN_DN_START,
+    DN_RDN_START,
+    DN_ATAV_START,
+    DN_AT_START,
+    DN_DESCR,
+    DN_NUMERICOID_N_START,
+    DN_NUMERICOID_N,
+    DN_V_START,
+    DN_HEX_START,
+    DN_HEX_LEFT,
+    DN_HEX_RIGHT,
+    DN_STRING_START,
+    DN_STRING,
+    DN_STRING_ESC,
+    DN_STRING_HEX,
+};
+
+/**
+ * Distinguished name is a string described by RFC4514, containing a series
+ * of name value pairs.
+ */
+static apr_status_t device_parse_distinguished_name(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    apr_size_t arglen = arg ? strlen(arg) : 0;
+
+//    apr_array_header_t *possibles = apr_array_make(ds->pool, 10, sizeof(char *));
+
+    const char *cp;
+
+    enum dn_state state = DN_DN_START;
+
+    char ch = 0, prev;
+
+    if (option) {
+        option[0] = NULL; /* until further notice */
+    }
+
+    if (pair->optional == DEVICE_IS_REQUIRED && !arglen) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+
+    cp = arg;
+
+    while (*cp) {
+
+        prev = ch;
+        ch = *cp;
+
+        switch (state) {
+        case DN_DN_START:
+            if (ch == ',') {
+                apr_file_printf(ds->err, "'%s' has a stray '%c'\n", pair->key, ch);
+                return APR_EINVAL;
+            }
+
+            state = DN_RDN_START;
+            continue;
+        case DN_RDN_START:
+            if (ch == '+') {
+                apr_file_printf(ds->err, "'%s' has a stray '%c'\n", pair->key, ch);
+                return APR_EINVAL;
+            }
+
+            state = DN_ATAV_START;
+            continue;
+        case DN_ATAV_START:
+
+            state = DN_AT_START;
+            continue;
+        case DN_AT_START:
+            /* keystring = leadkeychar *keychar
+             * leadkeychar = ALPHA
+             * keychar = ALPHA / DIGIT / HYPHEN
+             * descr = keystring
+             * numericoid = number 1*( DOT number )
+             * oid = descr / numericoid
+             */
+            if (ch == '=') {
+                apr_file_printf(ds->err, "'%s' attribute type is empty\n", pair->key);
+                return APR_EINVAL;
+            }
+            else if (apr_isalpha(ch)) {
+                state = DN_DESCR;
+                continue;
+            }
+            else if (apr_isdigit(ch)) {
+                state = DN_NUMERICOID_N_START;
+                continue;
+            }
+
+            apr_file_printf(ds->err, "'%s' attribute type character %c is not alphanumeric\n", pair->key, ch);
+            return APR_EINVAL;
+
+        case DN_DESCR:
+            /* keystring = leadkeychar *keychar
+             * leadkeychar = ALPHA
+             * keychar = ALPHA / DIGIT / HYPHEN
+             * descr = keystring
+             */
+            if (ch == '=') {
+                state = DN_V_START;
+                cp++;
+                continue;
+            }
+            else if (ch != '-' && !apr_isalnum(ch)) {
+                apr_file_printf(ds->err, "'%s' attribute type character %c is not alphanumeric/hyphen\n", pair->key, ch);
+                return APR_EINVAL;
+            }
+
+            break;
+        case DN_NUMERICOID_N_START:
+            /* numericoid = number 1*( DOT number )
+             */
+            if (!apr_isdigit(ch)) {
+                apr_file_printf(ds->err, "'%s' attribute type character %c is not numeric\n", pair->key, ch);
+                return APR_EINVAL;
+            }
+
+            state = DN_NUMERICOID_N;
+            cp++;
+            continue;
+        case DN_NUMERICOID_N:
+            /* numericoid = number 1*( DOT number )
+             */
+            if (ch == '=') {
+                state = DN_V_START;
+                cp++;
+                continue;
+            }
+            if (ch == '.') {
+                state = DN_NUMERICOID_N_START;
+                cp++;
+                continue;
+            }
+            if (!apr_isdigit(ch)) {
+                apr_file_printf(ds->err, "'%s' attribute type character %c is not numeric\n", pair->key, ch);
+                return APR_EINVAL;
+            }
+
+            break;
+        case DN_V_START:
+            /* attributeValue = string / hexstring
+             * hexstring = SHARP 1*hexpair
+             * hexpair = HEX HEX
+             */
+            if (ch == ',' || ch == '+') {
+                state = DN_RDN_START;
+                cp++;
+                continue;
+            }
+            else if (ch == '#') {
+                state = DN_HEX_START;
+                cp++;
+                continue;
+            }
+
+            state = DN_STRING_START;
+            continue;
+
+        case DN_HEX_START:
+            /* attributeValue = string / hexstring
+             * hexstring = SHARP 1*hexpair
+             * hexpair = HEX HEX
+             */
+            if (!apr_isxdigit(ch)) {
+                apr_file_printf(ds->err, "'%s' attribute type character %c is not a hex digit\n", pair->key, ch);
+                return APR_EINVAL;
+            }
+
+            state = DN_HEX_RIGHT;
+            cp++;
+            continue;
+
+        case DN_HEX_LEFT:
+            /* attributeValue = string / hexstring
+             * hexstring = SHARP 1*hexpair
+             * hexpair = HEX HEX
+             */
+            if (ch == ',' || ch == '+') {
+                state = DN_RDN_START;
+                cp++;
+                continue;
+            }
+            else if (!apr_isxdigit(ch)) {
+                apr_file_printf(ds->err, "'%s' attribute type character %c is not a hex digit\n", pair->key, ch);
+                return APR_EINVAL;
+            }
+
+            state = DN_HEX_RIGHT;
+            cp++;
+            continue;
+
+        case DN_HEX_RIGHT:
+            /* attributeValue = string / hexstring
+             * hexstring = SHARP 1*hexpair
+             * hexpair = HEX HEX
+             */
+            if (!apr_isxdigit(ch)) {
+                apr_file_printf(ds->err, "'%s' attribute type character %c is not a hex digit\n", pair->key, ch);
+                return APR_EINVAL;
+            }
+
+            state = DN_HEX_LEFT;
+            cp++;
+            continue;
+
+        case DN_STRING_START:
+            /* ; The following characters are to be escaped when they appear
+             * ; in the value to be encoded: ESC, one of <escaped>, leading
+             * ; SHARP or SPACE, trailing SPACE, and NULL.
+             * string =   [ ( leadchar / pair ) [ *( stringchar / pair )
+             *            ( trailchar / pair ) ] ]
+             *
+             * leadchar = LUTF1 / UTFMB
+             * LUTF1 = %x01-1F / %x21 / %x24-2A / %x2D-3A /
+             *         %x3D / %x3F-5B / %x5D-7F
+             *
+             * trailchar  = TUTF1 / UTFMB
+             * TUTF1 = %x01-1F / %x21 / %x23-2A / %x2D-3A /
+             *         %x3D / %x3F-5B / %x5D-7F
+             *
+             * stringchar = SUTF1 / UTFMB
+             * SUTF1 = %x01-21 / %x23-2A / %x2D-3A /
+             *         %x3D / %x3F-5B / %x5D-7F
+             *
+             * pair = ESC ( ESC / special / hexpair )
+             * special = escaped / SPACE / SHARP / EQUALS
+             * escaped = DQUOTE / PLUS / COMMA / SEMI / LANGLE / RANGLE
+             */
+
+            /* leadchar: has no [space]"#,+;<>\
+             * stringchar: has no ",+;<>\
+             * trailchar: has no [space]",+;<>\
+             */
+
+            /* %x20 */
+            if (ch == ' ') {
+                apr_file_printf(ds->err, "'%s' value cannot start with a space\n", pair->key);
+                return APR_EINVAL;
+            }
+
+            state = DN_STRING;
+            continue;
+
+        case DN_STRING:
+
+               /* stringchar: has no ",+;<>\ */
+
+            if (ch == '"' || ch == ';' || ch == '<' || ch == '>') {
+                apr_file_printf(ds->err, "'%s' value character %c is not escaped\n", pair->key, ch);
+                return APR_EINVAL;
+            }
+
+            /* %x2B %x2C */
+            else if (ch == ',' || ch == '+') {
+
+                if (prev == ' ') {
+                    apr_file_printf(ds->err, "'%s' value cannot end with a space\n", pair->key);
+                    return APR_EINVAL;
+                }
+
+                state = DN_RDN_START;
+                cp++;
+                continue;
+            }
+
+            else if (ch == '\\') {
+                state = DN_STRING_ESC;
+                cp++;
+                continue;
+            }
+
+            break;
+
+        case DN_STRING_ESC:
+            /*
+             * pair = ESC ( ESC / special / hexpair )
+             * special = escaped / SPACE / SHARP / EQUALS
+             * escaped = DQUOTE / PLUS / COMMA / SEMI / LANGLE / RANGLE
+             */
+
+            switch (ch) {
+            case '\\':
+            case '"':
+            case '+':
+            case ',':
+            case ';':
+            case '<':
+            case '>':
+            case ' ':
+            case '#':
+            case '=':
+                /* ESC / special */
+
+                state = DN_STRING;
+                cp++;
+                ch = 0; /* previous character is always fine */
+                continue;
+
+            default:
+
+                if (apr_isxdigit(ch)) {
+                    state = DN_STRING_HEX;
+                    cp++;
+                    continue;
+                }
+            }
+
+            apr_file_printf(ds->err, "'%s' value character %c is not a valid escape character (\\\"+,;<> #=[hex])\n", pair->key, ch);
+            return APR_EINVAL;
+
+        case DN_STRING_HEX:
+
+            if (apr_isxdigit(ch)) {
+                state = DN_STRING;
+                cp++;
+                continue;
+            }
+
+            apr_file_printf(ds->err, "'%s' value character %c is not a valid escape hex character\n", pair->key, ch);
+            return APR_EINVAL;
+        }
+
+        cp++;
+    }
+
+    switch (state) {
+    case DN_V_START:
+    case DN_HEX_LEFT:
+    case DN_STRING:
+    case DN_STRING_START:
+        /* if we're parsing the last string, it's valid to be done */
+
+        if (ch == ' ') {
+            apr_file_printf(ds->err, "'%s' value cannot end with a space\n", pair->key);
+            return APR_EINVAL;
+        }
+
+        if (option) {
+            option[0] = arg;
+        }
+
+        return APR_SUCCESS;
+
+    case DN_HEX_START:
+    case DN_HEX_RIGHT:
+    case DN_STRING_HEX:
+
+        apr_file_printf(ds->err, "'%s' ends too early (expecting hex digit)\n", pair->key);
+        return APR_EINVAL;
+
+    case DN_RDN_START:
+
+        apr_file_printf(ds->err, "'%s' ends too early (expecting relative distinguished name)\n", pair->key);
+        return APR_EINVAL;
+
+    case DN_STRING_ESC:
+
+        apr_file_printf(ds->err, "'%s' ends too early (expecting escape)\n", pair->key);
+        return APR_EINVAL;
+
+    case DN_DESCR:
+    case DN_NUMERICOID_N:
+
+        apr_file_printf(ds->err, "'%s' ends too early (attribute needs value)\n", pair->key);
+        return APR_EINVAL;
+
+    case DN_DN_START:
+    case DN_ATAV_START:
+    case DN_AT_START:
+    case DN_NUMERICOID_N_START:
+
+        apr_file_printf(ds->err, "'%s' ends too early %d\n", pair->key, state);
+        return APR_EINVAL;
+
+    }
+
+    /* we should never reach here */
+    return APR_EGENERAL;
+}
+
+/*
+ * Return the names catalogue of the option sets beneath the given relation
+ * base, rebuilding it when missing or out of date.
+ *
+ * This is the catalogue the option sets keep for their own key, under the
+ * same stamp, so a rename made through them is seen here at once. A
+ * relation through a prefix names a file they do not catalogue, and is
+ * kept beside theirs under the same stamp.
+ */
+static apr_status_t device_relation_open(device_set_t *ds, device_pair_t *pair,
+        const char *base, device_names_t *names)
+{
+    apr_dir_t *thedir;
+    apr_finfo_t dirent;
+    apr_array_header_t *entries;
+    apr_pool_t *pool;
+    const char *keyname, *path;
+    apr_time_t stamp;
+    apr_status_t status;
+
+    if (APR_SUCCESS != (status = device_names_stamp(ds, base, &stamp))) {
+        return status;
+    }
+
+    keyname = apr_pstrcat(ds->pool, pair->r.relation_name, pair->r.relation_suffix, NULL);
+    path = device_names_path(ds->pool, base, apr_pstrcat(ds->pool,
+            pair->r.relation_prefix ? pair->r.relation_prefix : "",
+            pair->r.relation_prefix ? "/" : "", keyname, NULL));
+
+    if (APR_SUCCESS == device_names_load(ds, path, stamp, names)) {
+        return APR_SUCCESS;
+    }
+
+    if ((status = apr_dir_open(&thedir, base, ds->pool)) != APR_SUCCESS) {
+        return status;
+    }
+
+    entries = apr_array_make(ds->pool, 64, sizeof(device_names_entry_t));
+
+    apr_pool_create(&pool, ds->pool);
+
+    do {
+        device_names_entry_t *entry;
+        const char *name;
+        apr_off_t len;
+        int dirfd = DEVICE_KEYDIR_UNOPENED;
+
+        status = apr_dir_read(&dirent,
+                APR_FINFO_TYPE | APR_FINFO_NAME | APR_FINFO_WPROT, thedir);
+        if (APR_STATUS_IS_INCOMPLETE(status)) {
+            continue; /* ignore un-stat()able files */
+        } else if (status != APR_SUCCESS) {
+            break;
+        }
+
+        /* hidden files are ignored */
+        if (dirent.name[0] == '.' || dirent.filetype != APR_DIR) {
+            continue;
+        }
+
+        apr_pool_clear(pool);
+
+        /* open/read the key, relative to its option set */
+        status = device_file_readat(ds, pool, pair->key, &dirfd,
+                apr_pstrcat(pool, base, "/", dirent.name,
+                        pair->r.relation_prefix ? "/" : "",
+                        pair->r.relation_prefix ? pair->r.relation_prefix : "",
+                        NULL), keyname, &name, &len);
+
+        device_keydir_close(dirfd);
+
+        if (APR_SUCCESS != status) {
+            /* error already handled */
+            continue;
+        }
+
+        entry = apr_array_push(entries);
+
+        entry->name = apr_pstrdup(ds->pool, name);
+        entry->dir = apr_pstrdup(ds->pool, dirent.name);
+
+    } while (1);
+
+    apr_pool_destroy(pool);
+
+    apr_dir_close(thedir);
+
+    device_names_save(ds, path, entries, stamp, names);
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Relation is a name that will be linked to a given file beneath directories at
+ * a target path.
+ */
+static apr_status_t device_parse_relation(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option,
+        const char **link)
+{
+    const char *none = NULL;
+    apr_status_t status = APR_SUCCESS;
+    apr_size_t arglen = arg ? strlen(arg) : 0;
+
+    apr_array_header_t *possibles = apr_array_make(ds->pool, 10, sizeof(char *));
+
+    int i;
+
+    if (option) {
+        option[0] = NULL; /* until further notice */
+    }
+
+    if (!pair->r.relation_name) {
+        apr_file_printf(ds->err, "no relation name specified for '%s'\n", pair->key);
+        return APR_EGENERAL;
+    }
+
+    if (!pair->r.bases) {
+        apr_file_printf(ds->err, "no base directory specified for '%s'\n", pair->key);
+        return APR_EGENERAL;
+    }
+
+    if (pair->optional == DEVICE_IS_OPTIONAL) {
+        if (pair->unset) {
+            none = pair->unset;
+        }
+        else {
+            none = DEVICE_RELATION_NONE;
+        }
+    }
+
+    for (i = 0; i < pair->r.bases->nelts; i++) {
+
+        device_names_t names;
+        apr_int64_t j;
+
+        const char *base = APR_ARRAY_IDX(pair->r.bases, i, const char *);
+
+        if ((status = device_relation_open(ds, pair, base, &names)) != APR_SUCCESS) {
+            /* could not open directory, skip */
+            continue;
+        }
+
+        if (none) {
+
+            int exact = (0 == strcmp(arg, none));
+
+            if (!strncmp(arg, none, arglen)) {
+
+                const char **opt;
+
+                if (exact) {
+                    apr_array_clear(options);
+                }
+
+                opt = apr_array_push(options);
+                opt[0] = apr_pstrcat(ds->pool,
+                        pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
+                        device_pescape_shell(ds->pool, pair->key), "=",
+                        device_pescape_shell(ds->pool, none),
+                        NULL);
+
+                if (option) {
+                    option[0] = NULL;
+                    link[0] = NULL;
+                }
+
+                APR_ARRAY_PUSH(possibles, const char *) = none;
+            }
+
+            none = NULL;
+
+            if (exact) {
+                /* exact matches short circuit */
+                goto done;
+            }
+        }
+
+        /* names sharing the prefix sort together */
+        for (j = device_names_lower(&names, arg); j < names.count; j++) {
+
+            const char *name = device_names_name(&names, j);
+            const char **opt;
+            char *keypath;
+
+            int exact;
+
+            if (strncmp(arg, name, arglen)) {
+                break;
+            }
+
+            exact = (0 == strcmp(arg, name));
+
+            APR_ARRAY_PUSH(possibles, const char *) = name;
+
+            if (exact) {
+                apr_array_clear(options);
+            }
+
+            opt = apr_array_push(options);
+            opt[0] = apr_pstrcat(ds->pool,
+                    pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
+                    device_pescape_shell(ds->pool, pair->key), "=",
+                    device_pescape_shell(ds->pool, name),
+                    NULL);
+
+            if (option) {
+
+                if (APR_SUCCESS
+                        != (status = apr_filepath_merge(&keypath, base,
+                                device_names_dir(&names, j),
+                                APR_FILEPATH_NATIVE, ds->pool))) {
+                    apr_file_printf(ds->err, "cannot merge option set key '%s' (base): %pm\n", pair->key,
+                            &status);
+                }
+                else if (pair->r.relation_prefix && APR_SUCCESS
+                        != (status = apr_filepath_merge(&keypath, keypath,
+                                pair->r.relation_prefix, APR_FILEPATH_NATIVE,
+                                ds->pool))) {
+                    apr_file_printf(ds->err, "cannot merge option set key '%s' (prefix): %pm\n", pair->key,
+                            &status);
+                }
+                else {
+                    option[0] = name;
+                    link[0] = keypath;
+                }
+
+            }
+
+            if (exact) {
+                /* exact matches short circuit */
+                goto done;
+            }
+
+        }
+
+        status = APR_ENOENT;
+
+    }
+
+    if (APR_SUCCESS == status || APR_STATUS_IS_ENOENT(status)) {
+
+        status = APR_SUCCESS;
+
+        if (option) {
+            if (options->nelts == 1) {
+                /* all ok */
+            }
+            else {
+                device_error_possibles(ds, pair->key, possibles);
+
+                status = APR_INCOMPLETE;
+            }
+        }
+    }
+    else {
+        apr_file_printf(ds->err, "cannot read option '%s': %pm\n", pair->key,
+                &status);
+    }
+
+done:
+
+    return status;
+}
+
+/**
+ * Polar is a string containing either the value "yes" or "no".
+ */
+static apr_status_t device_parse_polar(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    apr_size_t arglen = arg ? strlen(arg) : 0;
+
+    const char **opt;
+
+    if (option) {
+        option[0] = NULL; /* until further notice */
+    }
+
+    if (!strncmp(arg, "yes", arglen)) {
+
+        if (!strcmp(arg, "yes")) {
+            apr_array_clear(options);
+        }
+
+        opt = apr_array_push(options);
+        opt[0] = apr_pstrcat(ds->pool,
+                pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
+                device_pescape_shell(ds->pool, pair->key), "=",
+                device_pescape_shell(ds->pool, "yes"),
+                NULL);
+
+        if (option) {
+            option[0] = ""; /* file exists and is empty */
+        }
+    }
+
+    if (!strncmp(arg, "no", arglen)) {
+
+        if (!strcmp(arg, "no")) {
+            apr_array_clear(options);
+        }
+
+        opt = apr_array_push(options);
+        opt[0] = apr_pstrcat(ds->pool,
+                pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
+                device_pescape_shell(ds->pool, pair->key), "=",
+                device_pescape_shell(ds->pool, "no"),
+                NULL);
+
+        if (option) {
+            option[0] = NULL; /* file does not exist */
+        }
+    }
+
+    if (option) {
+        if (options->nelts == 1) {
+            /* all ok */
+        }
+        else {
+            apr_file_printf(ds->err, "%s: must be 'yes' or 'no'.\n",
+                apr_pescape_echo(ds->pool, arg, 1));
+            return APR_INCOMPLETE;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Switch is a string containing either the value "on" or "off".
+ */
+static apr_status_t device_parse_switch(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    apr_size_t arglen = arg ? strlen(arg) : 0;
+
+    const char **opt;
+
+    if (option) {
+        option[0] = NULL; /* until further notice */
+    }
+
+    if (!strncmp(arg, "on", arglen)) {
+
+        if (!strcmp(arg, "on")) {
+            apr_array_clear(options);
+        }
+
+        opt = apr_array_push(options);
+        opt[0] = apr_pstrcat(ds->pool,
+                pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
+                device_pescape_shell(ds->pool, pair->key), "=",
+                device_pescape_shell(ds->pool, "on"),
+                NULL);
+
+        if (option) {
+            option[0] = ""; /* file exists and is empty */
+        }
+    }
+
+    if (!strncmp(arg, "off", arglen)) {
+
+        if (!strcmp(arg, "off")) {
+            apr_array_clear(options);
+        }
+
+        opt = apr_array_push(options);
+        opt[0] = apr_pstrcat(ds->pool,
+                pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
+                device_pescape_shell(ds->pool, pair->key), "=",
+                device_pescape_shell(ds->pool, "off"),
+                NULL);
+
+        if (option) {
+            option[0] = NULL; /* file does not exist */
+        }
+    }
+
+    if (option) {
+        if (options->nelts == 1) {
+            /* all ok */
+        }
+        else {
+            apr_file_printf(ds->err, "%s: must be 'on' or 'off'.\n",
+                apr_pescape_echo(ds->pool, arg, 1));
+            return APR_INCOMPLETE;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Integer is a signed 64 bit whole number.
+ */
+static apr_status_t device_parse_integer(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    apr_int64_t result;
+
+    apr_status_t status;
+
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
+    }
+
+    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+    else if (!arg[0]) {
+        if (option) {
+            option[0] = NULL;
+        }
+        return APR_SUCCESS;
+    }
+
+    status = device_parse_int64(ds, arg, &result);
+
+    if (APR_SUCCESS == status) {
+
+        if (!strcmp(arg, "min")) {
+            result = pair->i.min;
+        }
+        else if (!strcmp(arg, "max")) {
+            result = pair->i.max;
+        }
+
+        if (result < pair->i.min || result > pair->i.max) {
+            apr_file_printf(ds->err, "%s: must be between %"
+                APR_INT64_T_FMT " and %" APR_INT64_T_FMT ".\n",
+                apr_pescape_echo(ds->pool, arg, 1),
+                    pair->i.min, pair->i.max);
+            return APR_ERANGE;
+        }
+
+        if (option) {
+            option[0] = apr_ltoa(ds->pool, result);
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Hex is a signed 64 bit base 16 whole number.
+ */
+static apr_status_t device_parse_hex(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    apr_uint64_t result;
+
+    apr_status_t status;
+
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
+    }
+
+    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+    else if (!arg[0]) {
+        if (option) {
+            option[0] = NULL;
+        }
+        return APR_SUCCESS;
+    }
+
+    status = device_parse_hex64(ds, arg, &result);
+
+    if (APR_SUCCESS == status) {
+
+        if (!strcmp(arg, "min")) {
+            result = pair->h.min;
+        }
+        else if (!strcmp(arg, "max")) {
+            result = pair->h.max;
+        }
+
+        if (result < pair->h.min || result > pair->h.max) {
+            apr_file_printf(ds->err, "%s: must be between %"
+                APR_UINT64_T_HEX_FMT " and %" APR_UINT64_T_HEX_FMT ".\n",
+                apr_pescape_echo(ds->pool, arg, 1),
+                    pair->i.min, pair->i.max);
+            return APR_ERANGE;
+        }
+
+        if (option) {
+
+            char fmt[16] = "%.*" APR_UINT64_T_HEX_FMT;
+
+            if (pair->h.cs == DEVICE_IS_UPPER) {
+                char *x = strchr(fmt, 'x');
+                if (x) {
+                    *x = 'X';
+                }
+            }
+
+            option[0] = apr_psprintf(ds->pool, fmt, pair->h.width, result);
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Text is a string to be converted to the defined character set.
+ */
+static apr_status_t device_parse_text(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    char *inbuf, *outbuf;
+    apr_size_t inbytesleft, outbytesleft, nchars, outlen;
+    apr_status_t status = APR_SUCCESS;
+
+    char *out;
+
+    const char *from = nl_langinfo(CODESET);
+
+    iconv_t ic = iconv_open(pair->t.format, from);
+
+    if ((iconv_t)(-1) == ic) {
+        status = errno;
+        apr_file_printf(ds->err, "%s: cannot convert '%s' to '%s': %pm\n",
+                device_pescape_shell(ds->pool, pair->key), from, pair->t.format,
+                &status);
+        return status;
+    }
+
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
+    }
+
+    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+    else if (!arg[0]) {
+        if (option) {
+            option[0] = NULL;
+        }
+        return APR_SUCCESS;
+    }
+
+    inbuf = (char *)arg;
+    inbytesleft = strlen(arg);
+    outbytesleft = 0;
+
+    out = NULL;
+    outlen = 0;
+
+    do {
+
+        out = realloc(out, outlen + 256);
+        if (!out) {
+            iconv_close(ic);
+            return APR_ENOMEM;
+        }
+
+        outbuf = out + outlen - outbytesleft;
+        outlen += 256;
+        outbytesleft += 256;
+
+        nchars = iconv(ic, &inbuf, &inbytesleft, &outbuf, &outbytesleft);
+
+    } while (nchars == (apr_size_t)-1 && errno == E2BIG);
+
+    if (nchars == (apr_size_t) -1) {
+        status = errno;
+        if (errno == EILSEQ) {
+            apr_file_printf(ds->err, "%s: contains an invalid '%s' character: %pm\n",
+                    device_pescape_shell(ds->pool, pair->key), from, &status);
+            goto end;
+        } else if (errno == EINVAL) {
+            apr_file_printf(ds->err, "%s: ends with a truncated '%s' character: %pm\n",
+                    device_pescape_shell(ds->pool, pair->key), from, &status);
+            goto end;
+        } else {
+            apr_file_printf(ds->err, "%s: cannot convert a '%s' character: %pm\n",
+                    device_pescape_shell(ds->pool, pair->key), from, &status);
+            goto end;
+        }
+    }
+
+    outlen -= outbytesleft;
+
+    if (outlen < pair->t.min) {
+        apr_file_printf(ds->err, "%s: text is too short (%" APR_SIZE_T_FMT " converted bytes)\n",
+                device_pescape_shell(ds->pool, pair->key), outlen);
+        status = APR_ERANGE;
+        goto end;
+    }
+    else if (outlen > pair->t.max) {
+        apr_file_printf(ds->err, "%s: text is too long (%" APR_SIZE_T_FMT " converted bytes)\n",
+                device_pescape_shell(ds->pool, pair->key), outlen);
+        status = APR_ERANGE;
+        goto end;
+    }
+
+    if (option) {
+        *option = apr_pstrndup(ds->pool, out, outlen);
+    }
+
+end:
+
+    free(out);
+
+    iconv_close(ic);
+
+    return status;
+}
+
+typedef struct device_url_path_state_t {
+    unsigned int abempty:1;
+    unsigned int absolute:1;
+    unsigned int noscheme:1;
+    unsigned int rootless:1;
+    unsigned int empty:1;
+    unsigned int percent:2;
+    int segments;
+    int last_slash;
+} device_url_path_state_t;
+
+/*
+ * URL path is a URL encoded string limited by section 3.3 of RFC3986.
+ */
+static apr_status_t device_parse_url_path_ex(device_set_t *ds, device_pair_t *pair,
+        const char *arg, device_url_path_state_t *cur, apr_uint64_t max)
+{
+    apr_size_t len = 0;
+
+    /* we begin with all path types possible, and eliminate as we go */
+    cur->abempty = 1;
+    cur->absolute = 1;
+    cur->noscheme = 1;
+    cur->rootless = 1;
+    cur->empty = 1;
+    cur->segments = 0;
+    cur->last_slash = 0;
+    cur->percent = 0;
+
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is missing.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
+    }
+
+    while (1) {
+        char c = arg[len++];
+
+        /* not too long? */
+        if (len >= max) {
+            /* not ok */
+            apr_file_printf(ds->err, "argument '%s': '%s' is too long (%" APR_SIZE_T_FMT " character limit).\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1),
+                    apr_pescape_echo(ds->pool,
+                            apr_pstrcat(ds->pool,
+                                    apr_pstrndup(ds->pool, arg, 64), "...",
+                                    NULL), 1), max);
+            return APR_EINVAL;
+        }
+
+        /* hexdig expected */
+        if (cur->percent) {
+
+            /* but only two hexdigs */
+            if (cur->percent == 3) {
+                cur->percent = 0;
+                /* drop through */
+            }
+
+            /* hexdig is good */
+            else if ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') || (c >= '0' && c <= '9')) {
+                cur->percent++;
+                continue;
+            }
+
+            /* not hexdig is bad */
+            else {
+                apr_file_printf(ds->err, "argument '%s': percent encoding cut short.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1));
+                return APR_EINVAL;
+            }
+        }
+
+        /* end of path */
+        if (c == 0) {
+            if (len == 1) {
+                /* empty path detected */
+                cur->absolute = 0;
+                cur->noscheme = 0;
+                cur->rootless = 0;
+            }
+
+            break;
+        }
+
+        /* slash detected */
+        if (c == '/') {
+            if (len == 1) {
+                /* absolute path detected */
+                cur->noscheme = 0;
+                cur->rootless = 0;
+                cur->empty = 0;
+            }
+
+            if (len == 2 && cur->last_slash == 1) {
+                /* double slash detected */
+                apr_file_printf(ds->err, "argument '%s': second character cannot be a slash.\n",
+                        apr_pescape_echo(ds->pool, pair->key, 1));
+                return APR_EINVAL;
+            }
+
+            cur->segments++;
+            cur->last_slash = len;
+            continue;
+        }
+
+        /* unreserved detected */
+        /* unreserved  = ALPHA / DIGIT / "-" / "." / "_" / "~" */
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' || c == '~') {
+
+            if (len == 1) {
+                cur->absolute = 0;
+                cur->abempty = 0;
+                cur->empty = 0;
+            }
+
+            /* ok */
+            continue;
+        }
+
+        /* pct-encoded detected */
+        if (c == '%') {
+
+            if (len == 1) {
+                cur->absolute = 0;
+                cur->abempty = 0;
+                cur->empty = 0;
+            }
+
+            cur->percent++;
+            continue;
+        }
+
+        /* sub-delims detected */
+        if (c == '!' || c == '$' || c == '&' || c == '\'' || c == '(' || c == ')'
+                || c == '*' || c == '+' || c == ',' || c == ';' || c == '=') {
+
+            if (len == 1) {
+                cur->absolute = 0;
+                cur->abempty = 0;
+                cur->empty = 0;
+            }
+
+            /* ok */
+            continue;
+        }
+
+        /* colon detected */
+        if (c == ':') {
+
+            if (len == 1) {
+                cur->absolute = 0;
+                cur->abempty = 0;
+                cur->empty = 0;
+            }
+
+            if (cur->segments == 0) {
+                cur->noscheme = 0;
+            }
+
+            continue;
+        }
+
+        /* "@" detected */
+        if (c == '@') {
+
+            if (len == 1) {
+                cur->absolute = 0;
+                cur->abempty = 0;
+                cur->empty = 0;
+            }
+
+            /* ok */
+            continue;
+        }
+
+        /* anything else is a no */
+        else {
+            apr_file_printf(ds->err, "argument '%s': '%c' is an invalid character.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1), c);
+            return APR_EINVAL;
+        }
+
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t device_parse_url_path(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    device_url_path_state_t cur = { 0 };
+    apr_status_t status;
+
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
+    }
+
+    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+    else if (!arg[0]) {
+        if (option) {
+            option[0] = NULL;
+        }
+        return APR_SUCCESS;
+    }
+
+    status = device_parse_url_path_ex(ds, pair, arg, &cur, pair->up.max);
+    if (APR_SUCCESS != status) {
+        return status;
+    }
+
+    if (option) {
+        option[0] = arg;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t device_parse_url_path_abempty(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    device_url_path_state_t cur = { 0 };
+    apr_status_t status;
+
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
+    }
+
+    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+    else if (!arg[0]) {
+        if (option) {
+            option[0] = NULL;
+        }
+        return APR_SUCCESS;
+    }
+
+    status = device_parse_url_path_ex(ds, pair, arg, &cur, pair->up.max);
+    if (APR_SUCCESS != status) {
+        return status;
+    }
+
+    if (!cur.abempty) {
+        apr_file_printf(ds->err, "argument '%s': path not absolute or empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_EINVAL;
+    }
+
+    if (option) {
+        option[0] = arg;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t device_parse_url_path_absolute(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    device_url_path_state_t cur = { 0 };
+    apr_status_t status;
+
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
+    }
+
+    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+    else if (!arg[0]) {
+        if (option) {
+            option[0] = NULL;
+        }
+        return APR_SUCCESS;
+    }
+
+    status = device_parse_url_path_ex(ds, pair, arg, &cur, pair->up.max);
+    if (APR_SUCCESS != status) {
+        return status;
+    }
+
+    if (!cur.absolute) {
+        apr_file_printf(ds->err, "argument '%s': path not absolute.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_EINVAL;
+    }
+
+    if (option) {
+        option[0] = arg;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t device_parse_url_path_noscheme(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    device_url_path_state_t cur = { 0 };
+    apr_status_t status;
+
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
+    }
+
+    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+    else if (!arg[0]) {
+        if (option) {
+            option[0] = NULL;
+        }
+        return APR_SUCCESS;
+    }
+
+    status = device_parse_url_path_ex(ds, pair, arg, &cur, pair->up.max);
+    if (APR_SUCCESS != status) {
+        return status;
+    }
+
+    if (!cur.noscheme) {
+        apr_file_printf(ds->err, "argument '%s': path contains a scheme\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_EINVAL;
+    }
+
+    if (option) {
+        option[0] = arg;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t device_parse_url_path_rootless(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    device_url_path_state_t cur = { 0 };
+    apr_status_t status;
+
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
+    }
+
+    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+    else if (!arg[0]) {
+        if (option) {
+            option[0] = NULL;
+        }
+        return APR_SUCCESS;
+    }
+
+    status = device_parse_url_path_ex(ds, pair, arg, &cur, pair->up.max);
+    if (APR_SUCCESS != status) {
+        return status;
+    }
+
+    if (!cur.rootless) {
+        apr_file_printf(ds->err, "argument '%s': path is not rootless\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_EINVAL;
+    }
+
+    if (option) {
+        option[0] = arg;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t device_parse_url_path_empty(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    device_url_path_state_t cur = { 0 };
+    apr_status_t status;
+
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
+    }
+
+    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+    else if (!arg[0]) {
+        if (option) {
+            option[0] = NULL;
+        }
+        return APR_SUCCESS;
+    }
+
+    status = device_parse_url_path_ex(ds, pair, arg, &cur, pair->up.max);
+    if (APR_SUCCESS != status) {
+        return status;
+    }
+
+    if (!cur.empty) {
+        apr_file_printf(ds->err, "argument '%s': path is not empty\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_EINVAL;
+    }
+
+    if (option) {
+        option[0] = arg;
+    }
+
+    return APR_SUCCESS;
+}
+
+typedef enum device_uri_target_e {
+    DEVICE_URI_TARGET = 0,
+    DEVICE_URI_TARGET_ABSOLUTE,
+    DEVICE_URI_TARGET_RELATIVE
+} device_uri_target_e;
+
+/*
+ * Parse a URI.
+ */
+static apr_status_t device_parse_uri_ex(device_set_t *ds, device_pair_t *pair,
+        const char *arg, device_uri_target_e target, apr_array_header_t *options, const char **option)
+{
+    apr_uri_t uri;
+    apr_status_t status;
+
+    if (!arg) {
+        apr_file_printf(ds->err, "'%s': is empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
+    }
+
+    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+    else if (!arg[0]) {
+        if (option) {
+            option[0] = NULL;
+        }
+        return APR_SUCCESS;
+    }
+
+    status = apr_uri_parse(ds->pool, arg, &uri);
+
+    if (APR_SUCCESS != status) {
+        apr_file_printf(ds->err, "uri '%s' is not a valid uri.\n",
+                apr_pescape_echo(ds->pool, arg, 1));
+        return APR_EINVAL;
+    }
+
+    if (pair->uri.schemes) {
+        if (!uri.scheme
+                || !apr_hash_get(pair->uri.schemes, uri.scheme,
+                        APR_HASH_KEY_STRING)) {
+            apr_file_printf(ds->err, "scheme '%s' must be one of: %s\n",
+                    apr_pescape_echo(ds->pool, uri.scheme, 1), device_hash_to_string(ds->pool, pair->uri.schemes));
+            return APR_EINVAL;
+        }
+    }
+
+    if (option) {
+        option[0] = arg;
+    }
+
+    switch (target) {
+    case DEVICE_URI_TARGET: {
+        /* all uris accepted */
+        if (uri.path) {
+            device_url_path_state_t cur = { 0 };
+
+            status = device_parse_url_path_ex(ds, pair, uri.path,
+                    &cur, pair->uri.max);
+            if (APR_SUCCESS != status) {
+                return status;
+            }
+        }
+        break;
+    }
+    case DEVICE_URI_TARGET_ABSOLUTE: {
+        /* absolute means scheme is present and fragment is absent */
+        if (!uri.scheme) {
+            apr_file_printf(ds->err, "argument '%s': uri must have a scheme.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1));
+            return APR_EINVAL;
+        }
+        else if (uri.fragment) {
+            apr_file_printf(ds->err, "argument '%s': uri must not have a fragment.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1));
+            return APR_EINVAL;
+        }
+        /* "//" authority path-abempty */
+        else if (uri.hostinfo) {
+            device_url_path_state_t cur = { 0 };
+
+            status = device_parse_url_path_ex(ds, pair, uri.path,
+                    &cur, pair->uri.max);
+            if (APR_SUCCESS != status) {
+                return status;
+            }
+        }
+        /* path must be path-absolute, path-rootless, path-empty */
+        else {
+            device_url_path_state_t cur = { 0 };
+
+            status = device_parse_url_path_ex(ds, pair, uri.path,
+                    &cur, pair->uri.max);
+            if (APR_SUCCESS != status) {
+                return status;
+            }
+
+            if (!cur.absolute && !cur.rootless && !cur.empty) {
+                apr_file_printf(ds->err,
+                        "argument '%s': uri's path must be absolute, rootless, or empty.\n",
+                        apr_pescape_echo(ds->pool, pair->key, 1));
                 return APR_EINVAL;
             }
+        }
+        break;
+    }
+    case DEVICE_URI_TARGET_RELATIVE: {
+        /* relative means scheme is absent */
+        if (uri.scheme) {
+            apr_file_printf(ds->err, "argument '%s': uri must not have a scheme.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1));
+            return APR_EINVAL;
+        }
+        else if (!uri.path) {
+            apr_file_printf(ds->err, "argument '%s': uri must have a path.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1));
+            return APR_EINVAL;
+        }
+        /* "//" authority path-abempty */
+        else if (uri.hostinfo) {
+            device_url_path_state_t cur = { 0 };
 
-            /* %x2B %x2C */
-            else if (ch == ',' || ch == '+') {
-
-                if (prev == ' ') {
-                    apr_file_printf(ds->err, "'%s' value cannot end with a space\n", pair->key);
-                    return APR_EINVAL;
-                }
-
-                state = DN_RDN_START;
-                cp++;
-                continue;
+            status = device_parse_url_path_ex(ds, pair, uri.path,
+                    &cur, pair->uri.max);
+            if (APR_SUCCESS != status) {
+                return status;
             }
+        }
+        /* path must be path-absolute, path-noscheme, path-empty */
+        else {
+            device_url_path_state_t cur = { 0 };
 
-            else if (ch == '\\') {
-                state = DN_STRING_ESC;
-                cp++;
-                continue;
+            status = device_parse_url_path_ex(ds, pair, uri.path,
+                    &cur, pair->uri.max);
+            if (APR_SUCCESS != status) {
+                return status;
             }
 
-            break;
+            if (!cur.absolute && !cur.noscheme && !cur.empty) {
+                apr_file_printf(ds->err,
+                        "argument '%s': uri's path must be absolute, relative with no scheme, or empty.\n",
+                        apr_pescape_echo(ds->pool, pair->key, 1));
+                return APR_EINVAL;
+            }
+        }
 
-        case DN_STRING_ESC:
-            /*
-             * pair = ESC ( ESC / special / hexpair )
-             * special = escaped / SPACE / SHARP / EQUALS
-             * escaped = DQUOTE / PLUS / COMMA / SEMI / LANGLE / RANGLE
-             */
+        break;
+    }
+    }
 
-            switch (ch) {
-            case '\\':
-            case '"':
-            case '+':
-            case ',':
-            case ';':
-            case '<':
-            case '>':
-            case ' ':
-            case '#':
-            case '=':
-                /* ESC / special */
+    return APR_SUCCESS;
+}
 
-                state = DN_STRING;
-                cp++;
-                ch = 0; /* previous character is always fine */
-                continue;
+static apr_status_t device_parse_uri(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    return device_parse_uri_ex(ds, pair, arg, DEVICE_URI_TARGET, options, option);
+}
 
-            default:
+static apr_status_t device_parse_uri_absolute(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    return device_parse_uri_ex(ds, pair, arg, DEVICE_URI_TARGET_ABSOLUTE, options, option);
+}
 
-                if (apr_isxdigit(ch)) {
-                    state = DN_STRING_HEX;
-                    cp++;
-                    continue;
-                }
-            }
+static apr_status_t device_parse_uri_relative(device_set_t *ds, device_pair_t *pair,
+        const char *arg, apr_array_header_t *options, const char **option)
+{
+    return device_parse_uri_ex(ds, pair, arg, DEVICE_URI_TARGET_RELATIVE, options, option);
+}
 
-            apr_file_printf(ds->err, "'%s' value character %c is not a valid escape character (\\\"+,;<> #=[hex])\n", pair->key, ch);
-            return APR_EINVAL;
+typedef struct device_address_state_t {
+    unsigned int address:1;
+    unsigned int mailbox:1;
+    unsigned int group:1;
+    unsigned int name_addr:1;
+    unsigned int addr_spec:1;
+    unsigned int display_name:1;
+    unsigned int angle_addr:1;
+    unsigned int local_part:1;
+    unsigned int domain:1;
+    unsigned int domain_literal:1;
+    unsigned int group_list:1;
+    unsigned int mailbox_list:1;
+    unsigned int address_list:1;
+    unsigned int phrase:1;
+    unsigned int word:1;
+    unsigned int atom:1;
+    unsigned int quoted_string:1;
+    unsigned int dot_atom:1;
+    unsigned int dot_atom_text:1;
+    unsigned int dns_atom:1;
+    unsigned int seen_atext:1;
+    unsigned int seen_left_cfws:1;
+    unsigned int seen_right_cfws:1;
+    unsigned int is_ws:1;
+    unsigned int is_atext:1;
+    unsigned int is_dnstext:1;
+    unsigned int is_dot:1;
+    unsigned int is_at:1;
+    apr_size_t local_part_len;
+    apr_size_t domain_label_len;
+    apr_size_t domain_len;
+} device_address_state_t;
 
-        case DN_STRING_HEX:
+static void want_dot_atom_text(device_address_state_t *cur)
+{
+    cur->dot_atom_text = 1;
+}
 
-            if (apr_isxdigit(ch)) {
-                state = DN_STRING;
-                cp++;
-                continue;
-            }
+static void want_dot_atom(device_address_state_t *cur)
+{
+    want_dot_atom_text(cur);
+    cur->dot_atom = 1;
+}
 
-            apr_file_printf(ds->err, "'%s' value character %c is not a valid escape hex character\n", pair->key, ch);
-            return APR_EINVAL;
-        }
+static void want_local_part(device_address_state_t *cur)
+{
+    want_dot_atom(cur);
+    cur->local_part = 1;
+    cur->local_part_len = 0;
+}
 
-        cp++;
-    }
+static void want_dns_atom(device_address_state_t *cur)
+{
+    cur->dns_atom = 1;
+}
 
-    switch (state) {
-    case DN_V_START:
-    case DN_HEX_LEFT:
-    case DN_STRING:
-    case DN_STRING_START:
-        /* if we're parsing the last string, it's valid to be done */
+static void want_domain(device_address_state_t *cur)
+{
+    want_dns_atom(cur);
+    cur->domain = 1;
+    cur->domain_len = 0;
+    cur->domain_label_len = 0;
+}
 
-        if (ch == ' ') {
-            apr_file_printf(ds->err, "'%s' value cannot end with a space\n", pair->key);
-            return APR_EINVAL;
-        }
+static void want_addr_spec(device_address_state_t *cur)
+{
+    want_local_part(cur);
+    cur->addr_spec = 1;
+}
 
-        if (option) {
-            option[0] = arg;
-        }
+static void want_mailbox(device_address_state_t *cur)
+{
+    want_addr_spec(cur);
+    /* want_name_addr(cur); */
+    cur->mailbox = 1;
+}
 
-        return APR_SUCCESS;
+static void want_address(device_address_state_t *cur)
+{
+    want_mailbox(cur);
+    /* want_group(cur); */
+    cur->address = 1;
+}
 
-    case DN_HEX_START:
-    case DN_HEX_RIGHT:
-    case DN_STRING_HEX:
+static int is_filesafe(char c)
+{
+    switch (c) {
+    case ':':
+    case '/':
+    case '\\':
+        return 0;
+    default:
+        return 1;
+    }
+}
 
-        apr_file_printf(ds->err, "'%s' ends too early (expecting hex digit)\n", pair->key);
-        return APR_EINVAL;
+static int is_ws(char c)
+{
+    switch (c) {
+    case '\t':
+    case ' ':
+        return 1;
+    default:
+        return 0;
+    }
+}
 
-    case DN_RDN_START:
+static int is_atext(char c)
+{
 
-        apr_file_printf(ds->err, "'%s' ends too early (expecting relative distinguished name)\n", pair->key);
-        return APR_EINVAL;
+    switch (c) {
+    case '!':
+    case '#':
+    case '$':
+    case '%':
+    case '&':
+    case '\'':
+    case '*':
+    case '+':
+    case '-':
+    case '/':
+    case '=':
+    case '?':
+    case '^':
+    case '_':
+    case '`':
+    case '{':
+    case '|':
+    case '}':
+    case '~':
+        return 1;
+    }
 
-    case DN_STRING_ESC:
+    if (apr_isalnum(c)) {
+        return 1;
+    }
 
-        apr_file_printf(ds->err, "'%s' ends too early (expecting escape)\n", pair->key);
-        return APR_EINVAL;
+    return 0;
+}
 
-    case DN_DESCR:
-    case DN_NUMERICOID_N:
+static int is_dnstext(char c)
+{
 
-        apr_file_printf(ds->err, "'%s' ends too early (attribute needs value)\n", pair->key);
-        return APR_EINVAL;
+    switch (c) {
+    case '-':
+        return 1;
+    }
 
-    case DN_DN_START:
-    case DN_ATAV_START:
-    case DN_AT_START:
-    case DN_NUMERICOID_N_START:
+    if (apr_isalnum(c)) {
+        return 1;
+    }
 
-        apr_file_printf(ds->err, "'%s' ends too early %d\n", pair->key, state);
-        return APR_EINVAL;
+    return 0;
+}
 
+static int is_at(char c)
+{
+    switch (c) {
+    case '@':
+        return 1;
+    default:
+        return 0;
     }
+}
 
-    /* we should never reach here */
-    return APR_EGENERAL;
+static int is_dot(char c)
+{
+    switch (c) {
+    case '.':
+        return 1;
+    default:
+        return 0;
+    }
 }
 
-/**
- * Relation is a name that will be linked to a given file beneath directories at
- * a target path.
+/*
+ * Address matches the parts described by 3.4 of RFC5322.
  */
-static apr_status_t device_parse_relation(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option,
-        const char **link)
+static apr_status_t device_parse_address_ex(device_set_t *ds, device_pair_t *pair,
+        const char *arg, device_address_state_t *cur, apr_uint64_t max)
 {
-    const char *none = NULL;
-    apr_status_t status;
-    apr_size_t arglen = arg ? strlen(arg) : 0;
-
-    apr_pool_t *pool;
-
-    apr_array_header_t *possibles = apr_array_make(ds->pool, 10, sizeof(char *));
+    apr_size_t len = 0;
 
-    int i;
+    device_address_state_t prev = { 0 };
 
-    if (option) {
-        option[0] = NULL; /* until further notice */
-    }
+    cur->seen_atext = 0;
+    cur->seen_left_cfws = 0;
+    cur->seen_right_cfws = 0;
 
-    if (!pair->r.relation_name) {
-        apr_file_printf(ds->err, "no relation name specified for '%s'\n", pair->key);
-        return APR_EGENERAL;
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is missing.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
     }
 
-    if (!pair->r.bases) {
-        apr_file_printf(ds->err, "no base directory specified for '%s'\n", pair->key);
-        return APR_EGENERAL;
-    }
+    while (1) {
+        char c = arg[len++];
 
-    if (pair->optional == DEVICE_IS_OPTIONAL) {
-        if (pair->unset) {
-            none = pair->unset;
-        }
-        else {
-            none = DEVICE_RELATION_NONE;
+        /* not too long? */
+        if (len >= max) {
+            /* not ok */
+            apr_file_printf(ds->err, "argument '%s': '%s' is too long (%" APR_SIZE_T_FMT " character limit).\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1),
+                    apr_pescape_echo(ds->pool,
+                            apr_pstrcat(ds->pool,
+                                    apr_pstrndup(ds->pool, arg, 64), "...",
+                                    NULL), 1), max);
+            return APR_EINVAL;
         }
-    }
-
-    apr_pool_create(&pool, ds->pool);
 
-    for (i = 0; i < pair->r.bases->nelts; i++) {
+        /* local part too long? */
+        if (cur->local_part_len > DEVICE_ADDRESS_LOCAL_PART_LIMIT) {
+            /* not ok */
+            apr_file_printf(ds->err, "argument '%s': address local part is too long (%" APR_SIZE_T_FMT " character limit).\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1),
+                    (apr_size_t)DEVICE_ADDRESS_LOCAL_PART_LIMIT);
+            return APR_EINVAL;
+        }
 
-        apr_dir_t *thedir;
-        apr_finfo_t dirent;
+        /* domain label too long? */
+        if (cur->domain_label_len > DEVICE_ADDRESS_DOMAIN_LABEL_LIMIT) {
+            /* not ok */
+            apr_file_printf(ds->err, "argument '%s': address domain label is too long (%" APR_SIZE_T_FMT " character limit).\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1),
+                    (apr_size_t)DEVICE_ADDRESS_DOMAIN_LABEL_LIMIT);
+            return APR_EINVAL;
+        }
 
-        const char *base = APR_ARRAY_IDX(pair->r.bases, i, const char *);
+        /* domain too long? */
+        if (cur->domain_len > DEVICE_ADDRESS_DOMAIN_LIMIT) {
+            /* not ok */
+            apr_file_printf(ds->err, "argument '%s': address domain is too long (%" APR_SIZE_T_FMT " character limit).\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1),
+                    (apr_size_t)DEVICE_ADDRESS_DOMAIN_LIMIT);
+            return APR_EINVAL;
+        }
 
-        if ((status = apr_dir_open(&thedir, base, ds->pool)) != APR_SUCCESS) {
-            /* could not open directory, skip */
-            continue;
+        /* end of address */
+        if (c == 0) {
+            break;
         }
 
-        do {
-            const char **possible;
-            char *name = NULL;
-            char *keypath;
+        prev = *cur;
 
-            int exact;
+        /* filesafe? */
+        if (pair->a.filesafe && !is_filesafe(c)) {
+            /* not ok */
+            apr_file_printf(ds->err, "argument '%s': contains invalid character '%c'.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1), c);
+            return APR_EINVAL;
+        }
 
-            apr_pool_clear(pool);
+        /* detect character type */
+        cur->is_ws = is_ws(c);
+        cur->is_atext = is_atext(c);
+        cur->is_dnstext = is_dnstext(c);
+        cur->is_dot = is_dot(c);
+        cur->is_at = is_at(c);
 
-            if (none) {
+        /* dot-atom-text   =   1*atext *("." 1*atext) */
+        if (cur->dot_atom_text) {
 
-                name = apr_pstrdup(ds->pool, none);
-                keypath = NULL;
+            if (cur->is_atext) {
+                /* ok */
+            }
+            else if (cur->is_dot) {
+                if (!prev.is_atext) {
+                    /* dot at start or dot repeated not ok */
+                    return APR_EINVAL;
+                }
+            }
+            else {
+                if (prev.is_atext) {
+                    /* ok */
+                    cur->dot_atom_text = 0;
+                }
+                else if (prev.is_dot) {
+                    /* dot at end not ok */
+                    return APR_EINVAL;
+                }
+                else {
+                    /* empty dot_atom_text not ok */
+                    return APR_EINVAL;
+                }
+            }
 
-            } else {
+        }
 
-                apr_file_t *in;
+        /* dot-atom        =   [CFWS] dot-atom-text [CFWS] */
+        if (cur->dot_atom) {
 
-                const char *keyname;
-                char *keyfile;
+//            if (cur->is_ws) {
+//                /* we don't support whitespace for now */
+//                return APR_ENOTIMPL;
+//            }
 
-                apr_off_t end = 0, start = 0;
+            if (!cur->dot_atom_text) {
+                /* our dot-atom is finished */
+                cur->dot_atom = 0;
+            }
+        }
 
-                status = apr_dir_read(&dirent,
-                        APR_FINFO_TYPE | APR_FINFO_NAME | APR_FINFO_WPROT, thedir);
-                if (APR_STATUS_IS_INCOMPLETE(status)) {
-                    continue; /* ignore un-stat()able files */
-                } else if (status != APR_SUCCESS) {
-                    break;
-                }
+        /* local-part      =   dot-atom / quoted-string */
+        if (cur->local_part) {
+            if (!cur->dot_atom && !cur->quoted_string) {
+                cur->local_part = 0;
+            }
+            else {
+                cur->local_part_len++;
+            }
+        }
 
-                /* hidden files are ignored */
-                if (dirent.name[0] == '.' || dirent.filetype != APR_DIR) {
-                    continue;
-                }
+        /* dns-atom   =   1*dnstext *("." 1*dnstext) */
+        if (cur->dns_atom) {
 
-                keyname = apr_pstrcat(pool, pair->r.relation_name, pair->r.relation_suffix, NULL);
-                if (APR_SUCCESS
-                        != (status = apr_filepath_merge(&keypath, base, dirent.name,
-                                APR_FILEPATH_NATIVE, pool))) {
-                    apr_file_printf(ds->err, "cannot merge option set key '%s' (base): %pm\n", pair->key,
-                            &status);
-                }
-                else if (pair->r.relation_prefix && APR_SUCCESS
-                        != (status = apr_filepath_merge(&keypath, keypath,
-                                pair->r.relation_prefix, APR_FILEPATH_NATIVE, pool))) {
-                    apr_file_printf(ds->err, "cannot merge option set key '%s' (prefix): %pm\n", pair->key,
-                            &status);
+            if (cur->is_dnstext) {
+                /* ok */
+                if (cur->is_dot) {
+                    cur->domain_label_len = 0;
                 }
-                else if (APR_SUCCESS
-                        != (status = apr_filepath_merge(&keyfile, keypath,
-                                keyname, APR_FILEPATH_NATIVE, pool))) {
-                    apr_file_printf(ds->err, "cannot merge option set key '%s' (name): %pm\n", pair->key,
-                            &status);
+                else {
+                    cur->domain_label_len++;
                 }
-
-                /* open the key */
-                else if (APR_SUCCESS
-                        != (status = apr_file_open(&in, keyfile, APR_FOPEN_READ,
-                                APR_FPROT_OS_DEFAULT, pool))) {
-                    apr_file_printf(ds->err, "cannot open option set '%s': %pm\n", pair->key,
-                            &status);
+            }
+            else if (cur->is_dot) {
+                if (!prev.is_dnstext) {
+                    /* dot at start or dot repeated not ok */
+                    return APR_EINVAL;
                 }
-
-                /* how long is the key? */
-                else if (APR_SUCCESS
-                        != (status = apr_file_seek(in, APR_END, &end))) {
-                    apr_file_printf(ds->err, "cannot seek end of option set '%s': %pm\n", pair->key,
-                            &status);
+            }
+            else {
+                if (prev.is_dnstext) {
+                    /* ok */
+                    cur->dns_atom = 0;
                 }
-
-                /* back to the beginning */
-                else if (APR_SUCCESS
-                        != (status = apr_file_seek(in, APR_SET, &start))) {
-                    apr_file_printf(ds->err, "cannot seek start of option set '%s': %pm\n", pair->key,
-                            &status);
+                else if (prev.is_dot) {
+                    /* dot at end not ok */
+                    return APR_EINVAL;
                 }
-
                 else {
-                    int size = end + 1;
-                    name = apr_palloc(pool, size);
-                    name[end] = 0;
-
-                    status = apr_file_gets(name, size, in);
-
-                    if (APR_EOF == status) {
-                        status = APR_SUCCESS;
-                    }
-                    if (APR_SUCCESS == status) {
-                        /* short circuit, all good */
-                        name = trim(name);
-                    }
-                    else {
-                        apr_file_printf(ds->err, "cannot read option set '%s': %pm\n", pair->key,
-                                &status);
-                    }
-                }
-
-                if (status != APR_SUCCESS) {
-                    continue;
+                    /* empty dns_atom_text not ok */
+                    return APR_EINVAL;
                 }
-
             }
 
-            exact = (0 == strcmp(arg, name));
-
-            possible = apr_array_push(possibles);
-            possible[0] = apr_pstrdup(possibles->pool, name);
-
-            if (!strncmp(arg, name, arglen)) {
-
-                const char **opt;
-
-                if (exact) {
-                    apr_array_clear(options);
-                }
-
-                opt = apr_array_push(options);
-                opt[0] = apr_pstrcat(ds->pool,
-                        pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
-                        device_pescape_shell(ds->pool, pair->key), "=",
-                        device_pescape_shell(ds->pool, name),
-                        NULL);
+        }
 
-                if (option) {
+        /* rfc5322#section-3.2.3 defines the liberal dot-atom */
+        /* domain          =   dot-atom / domain-literal */
+        /* rfc5321#section-2.3.5 defines the SMTP domain */
+        /* domain = dns-atom / domain-literal */
+        if (cur->domain) {
+            if (!cur->dns_atom && !cur->domain_literal) {
+                cur->domain = 0;
+            }
+            else {
+                cur->domain_len++;
+            }
+        }
 
-                    if (none) {
-                        option[0] = NULL;
-                        link[0] = NULL;
-                    }
-                    else {
-                        option[0] = apr_pstrdup(ds->pool, name);
-                        link[0] = apr_pstrdup(ds->pool, keypath);
-                    }
+        /* addr-spec       =   local-part "@" domain */
+        if (cur->addr_spec) {
 
-                }
+            if (!cur->local_part && !cur->is_at && !cur->domain) {
+                /* we are no longer an addr_spec */
+                cur->addr_spec = 0;
             }
+            else if (!cur->domain && cur->is_at) {
+                /* transition from local-part to domain */
+                want_domain(cur);
+                cur->domain_literal = 0;
+            }
+        }
 
-            if (exact) {
-
-                /* exact matches short circuit */
-                apr_dir_close(thedir);
+        /* mailbox         =   name-addr / addr-spec */
+        if (cur->mailbox) {
+            if (!cur->name_addr && !cur->addr_spec) {
+                cur->mailbox = 0;
+            }
+        }
 
-                goto done;
+        /* address         =   mailbox / group */
+        if (cur->address) {
+            if (!cur->mailbox && !cur->group) {
+                cur->address = 0;
+                apr_file_printf(ds->err, "argument '%s': is not an address at character %" APR_SIZE_T_FMT ".\n",
+                        apr_pescape_echo(ds->pool, pair->key, 1), len);
+                return APR_EINVAL;
             }
+        }
 
-            none = NULL;
+    }
 
-        } while (1);
+    /* did the address finish early? */
 
-        apr_dir_close(thedir);
+    /* dot-atom-text   =   1*atext *("." 1*atext) */
+    if (cur->dot_atom_text) {
+        if (cur->is_dot) {
+            /* no domain */
+            apr_file_printf(ds->err, "argument '%s': address ends with a dot.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1));
+            return APR_EINVAL;
+        }
 
     }
-done:
 
-    if (APR_SUCCESS == status) {
-        /* short circuit, all good */
-    }
-    else if (APR_STATUS_IS_ENOENT(status)) {
+    /* dns-atom   =   1*dnstext *("." 1*dnstext) */
+    if (cur->dns_atom) {
+        if (cur->is_dot) {
+            /* no domain */
+            apr_file_printf(ds->err, "argument '%s': address domain ends with a dot.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1));
+            return APR_EINVAL;
+        }
 
-        status = APR_SUCCESS;
+    }
 
-        if (option) {
-            if (options->nelts == 1) {
-                /* all ok */
-            }
-            else {
-                device_error_possibles(ds, pair->key, possibles);
+    /* addr-spec       =   local-part "@" domain */
+    if (cur->addr_spec) {
 
-                status = APR_INCOMPLETE;
-            }
+        if (cur->local_part) {
+            /* no at symbol */
+            apr_file_printf(ds->err, "argument '%s': address is missing an '@'.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1));
+            return APR_EINVAL;
+        }
+        else if (cur->is_at) {
+            /* no domain */
+            apr_file_printf(ds->err, "argument '%s': address is missing a domain.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1));
+            return APR_EINVAL;
         }
     }
-    else {
-        apr_file_printf(ds->err, "cannot read option '%s': %pm\n", pair->key,
-                &status);
-    }
-
-    apr_pool_destroy(pool);
 
-    return status;
+    return APR_SUCCESS;
 }
 
-/**
- * Polar is a string containing either the value "yes" or "no".
- */
-static apr_status_t device_parse_polar(device_set_t *ds, device_pair_t *pair,
+static apr_status_t device_parse_address_localpart(device_set_t *ds, device_pair_t *pair,
         const char *arg, apr_array_header_t *options, const char **option)
 {
-    apr_size_t arglen = arg ? strlen(arg) : 0;
-
-    const char **opt;
+    device_address_state_t cur = { 0 };
+    apr_status_t status;
 
-    if (option) {
-        option[0] = NULL; /* until further notice */
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
     }
 
-    if (!strncmp(arg, "yes", arglen)) {
-
-        if (!strcmp(arg, "yes")) {
-            apr_array_clear(options);
-        }
-
-        opt = apr_array_push(options);
-        opt[0] = apr_pstrcat(ds->pool,
-                pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
-                device_pescape_shell(ds->pool, pair->key), "=",
-                device_pescape_shell(ds->pool, "yes"),
-                NULL);
-
+    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+    else if (!arg[0]) {
         if (option) {
-            option[0] = ""; /* file exists and is empty */
+            option[0] = NULL;
         }
+        return APR_SUCCESS;
     }
 
-    if (!strncmp(arg, "no", arglen)) {
-
-        if (!strcmp(arg, "no")) {
-            apr_array_clear(options);
-        }
+    want_local_part(&cur);
 
-        opt = apr_array_push(options);
-        opt[0] = apr_pstrcat(ds->pool,
-                pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
-                device_pescape_shell(ds->pool, pair->key), "=",
-                device_pescape_shell(ds->pool, "no"),
-                NULL);
+    status = device_parse_address_ex(ds, pair, arg, &cur, pair->a.max);
+    if (APR_SUCCESS != status) {
+        return status;
+    }
 
-        if (option) {
-            option[0] = NULL; /* file does not exist */
-        }
+    if (!cur.local_part) {
+        apr_file_printf(ds->err, "argument '%s': local-part is not valid\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_EINVAL;
     }
 
     if (option) {
-        if (options->nelts == 1) {
-            /* all ok */
-        }
-        else {
-            apr_file_printf(ds->err, "%s: must be 'yes' or 'no'.\n",
-                apr_pescape_echo(ds->pool, arg, 1));
-            return APR_INCOMPLETE;
-        }
+        option[0] = arg;
     }
 
     return APR_SUCCESS;
 }
 
-/**
- * Switch is a string containing either the value "on" or "off".
- */
-static apr_status_t device_parse_switch(device_set_t *ds, device_pair_t *pair,
+static apr_status_t device_parse_address(device_set_t *ds, device_pair_t *pair,
         const char *arg, apr_array_header_t *options, const char **option)
 {
-    apr_size_t arglen = arg ? strlen(arg) : 0;
-
-    const char **opt;
+    device_address_state_t cur = { 0 };
+    apr_status_t status;
 
-    if (option) {
-        option[0] = NULL; /* until further notice */
+    if (!arg) {
+        apr_file_printf(ds->err, "argument '%s': is empty.\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_INCOMPLETE;
     }
 
-    if (!strncmp(arg, "on", arglen)) {
-
-        if (!strcmp(arg, "on")) {
-            apr_array_clear(options);
-        }
-
-        opt = apr_array_push(options);
-        opt[0] = apr_pstrcat(ds->pool,
-                pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
-                device_pescape_shell(ds->pool, pair->key), "=",
-                device_pescape_shell(ds->pool, "on"),
-                NULL);
-
+    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
+        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
+        return APR_EGENERAL;
+    }
+    else if (!arg[0]) {
         if (option) {
-            option[0] = ""; /* file exists and is empty */
+            option[0] = NULL;
         }
+        return APR_SUCCESS;
     }
 
-    if (!strncmp(arg, "off", arglen)) {
-
-        if (!strcmp(arg, "off")) {
-            apr_array_clear(options);
-        }
+    want_address(&cur);
 
-        opt = apr_array_push(options);
-        opt[0] = apr_pstrcat(ds->pool,
-                pair->optional == DEVICE_IS_OPTIONAL ? "-" : "*",
-                device_pescape_shell(ds->pool, pair->key), "=",
-                device_pescape_shell(ds->pool, "off"),
-                NULL);
+    status = device_parse_address_ex(ds, pair, arg, &cur, pair->a.max);
+    if (APR_SUCCESS != status) {
+        return status;
+    }
 
-        if (option) {
-            option[0] = NULL; /* file does not exist */
-        }
+    if (!cur.address) {
+        apr_file_printf(ds->err, "argument '%s': address is not valid\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_EINVAL;
     }
 
     if (option) {
-        if (options->nelts == 1) {
-            /* all ok */
-        }
-        else {
-            apr_file_printf(ds->err, "%s: must be 'on' or 'off'.\n",
-                apr_pescape_echo(ds->pool, arg, 1));
-            return APR_INCOMPLETE;
-        }
+        option[0] = arg;
     }
 
     return APR_SUCCESS;
 }
 
-/*
- * Integer is a signed 64 bit whole number.
- */
-static apr_status_t device_parse_integer(device_set_t *ds, device_pair_t *pair,
+static apr_status_t device_parse_address_mailbox(device_set_t *ds, device_pair_t *pair,
         const char *arg, apr_array_header_t *options, const char **option)
 {
-    apr_int64_t result;
-
+    device_address_state_t cur = { 0 };
     apr_status_t status;
 
     if (!arg) {
@@ -3443,41 +6150,30 @@ static apr_status_t device_parse_integer(device_set_t *ds, device_pair_t *pair,
         return APR_SUCCESS;
     }
 
-    status = device_parse_int64(ds, arg, &result);
-
-    if (APR_SUCCESS == status) {
+    want_mailbox(&cur);
 
-        if (!strcmp(arg, "min")) {
-            result = pair->i.min;
-        }
-        else if (!strcmp(arg, "max")) {
-            result = pair->i.max;
-        }
+    status = device_parse_address_ex(ds, pair, arg, &cur, pair->a.max);
+    if (APR_SUCCESS != status) {
+        return status;
+    }
 
-        if (result < pair->i.min || result > pair->i.max) {
-            apr_file_printf(ds->err, "%s: must be between %"
-                APR_INT64_T_FMT " and %" APR_INT64_T_FMT ".\n",
-                apr_pescape_echo(ds->pool, arg, 1),
-                    pair->i.min, pair->i.max);
-            return APR_ERANGE;
-        }
+    if (!cur.mailbox) {
+        apr_file_printf(ds->err, "argument '%s': mailbox is not valid\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_EINVAL;
+    }
 
-        if (option) {
-            option[0] = apr_ltoa(ds->pool, result);
-        }
+    if (option) {
+        option[0] = arg;
     }
 
-    return status;
+    return APR_SUCCESS;
 }
 
-/*
- * Hex is a signed 64 bit base 16 whole number.
- */
-static apr_status_t device_parse_hex(device_set_t *ds, device_pair_t *pair,
+static apr_status_t device_parse_address_addrspec(device_set_t *ds, device_pair_t *pair,
         const char *arg, apr_array_header_t *options, const char **option)
 {
-    apr_uint64_t result;
-
+    device_address_state_t cur = { 0 };
     apr_status_t status;
 
     if (!arg) {
@@ -3497,2276 +6193,2737 @@ static apr_status_t device_parse_hex(device_set_t *ds, device_pair_t *pair,
         return APR_SUCCESS;
     }
 
-    status = device_parse_hex64(ds, arg, &result);
+    want_addr_spec(&cur);
 
-    if (APR_SUCCESS == status) {
+    status = device_parse_address_ex(ds, pair, arg, &cur, pair->a.max);
+    if (APR_SUCCESS != status) {
+        return status;
+    }
 
-        if (!strcmp(arg, "min")) {
-            result = pair->h.min;
-        }
-        else if (!strcmp(arg, "max")) {
-            result = pair->h.max;
+    if (!cur.addr_spec) {
+        apr_file_printf(ds->err, "argument '%s': address is not valid\n",
+                apr_pescape_echo(ds->pool, pair->key, 1));
+        return APR_EINVAL;
+    }
+
+    if (option) {
+        option[0] = arg;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Read the name of the option set in the given directory, as found in
+ * the file, symlink or relation named by the key.
+ */
+static apr_status_t device_get_name(device_set_t *ds, apr_pool_t *pool,
+        device_pair_t *pair, const char *dir, const char **name)
+{
+    apr_finfo_t finfo;
+    const char *keyname;
+    const char *relname;
+    const char *relpath;
+    char *keypath;
+    apr_off_t len;
+    int dirfd = DEVICE_KEYDIR_UNOPENED;
+
+    apr_status_t status = APR_SUCCESS;
+
+    switch (pair->type) {
+
+    case DEVICE_PAIR_INDEX:
+    case DEVICE_PAIR_PORT:
+    case DEVICE_PAIR_UNPRIVILEGED_PORT:
+    case DEVICE_PAIR_HOSTNAME:
+    case DEVICE_PAIR_FQDN:
+    case DEVICE_PAIR_SELECT:
+    case DEVICE_PAIR_BYTES:
+    case DEVICE_PAIR_SQL_IDENTIFIER:
+    case DEVICE_PAIR_SQL_DELIMITED_IDENTIFIER:
+    case DEVICE_PAIR_USER:
+    case DEVICE_PAIR_DISTINGUISHED_NAME:
+    case DEVICE_PAIR_POLAR:
+    case DEVICE_PAIR_SWITCH:
+    case DEVICE_PAIR_INTEGER:
+    case DEVICE_PAIR_TEXT:
+    case DEVICE_PAIR_URL_PATH:
+    case DEVICE_PAIR_URL_PATH_ABEMPTY:
+    case DEVICE_PAIR_URL_PATH_ABSOLUTE:
+    case DEVICE_PAIR_URL_PATH_NOSCHEME:
+    case DEVICE_PAIR_URL_PATH_ROOTLESS:
+    case DEVICE_PAIR_URL_PATH_EMPTY:
+    case DEVICE_PAIR_ADDRESS:
+    case DEVICE_PAIR_ADDRESS_LOCALPART:
+    case DEVICE_PAIR_ADDRESS_MAILBOX:
+    case DEVICE_PAIR_ADDRESS_ADDRSPEC:
+
+        keyname = apr_pstrcat(pool, pair->key, pair->suffix, NULL);
+
+        /* open/read the key, relative to the option set */
+        status = device_file_readat(ds, pool, pair->key, &dirfd, dir, keyname,
+                name, &len);
+
+        break;
+
+    case DEVICE_PAIR_SYMLINK:
+
+        keyname = apr_pstrcat(pool, pair->key, pair->suffix, NULL);
+        if (APR_SUCCESS
+                != (status = apr_filepath_merge(&keypath, dir,
+                        keyname, APR_FILEPATH_NOTABSOLUTE, pool))) {
+            apr_file_printf(ds->err, "cannot merge option set key '%s': %pm\n", pair->key,
+                    &status);
         }
 
-        if (result < pair->h.min || result > pair->h.max) {
-            apr_file_printf(ds->err, "%s: must be between %"
-                APR_UINT64_T_HEX_FMT " and %" APR_UINT64_T_HEX_FMT ".\n",
-                apr_pescape_echo(ds->pool, arg, 1),
-                    pair->i.min, pair->i.max);
-            return APR_ERANGE;
+        /* stat the key */
+        else if (APR_SUCCESS
+                != (status = apr_stat(&finfo, keypath, APR_FINFO_LINK | APR_FINFO_TYPE | APR_FINFO_NAME,
+                        pool))) {
+            apr_file_printf(ds->err, "cannot stat option set '%s': %pm\n", pair->key,
+                    &status);
         }
 
-        if (option) {
+        else {
 
-            char fmt[16] = "%.*" APR_UINT64_T_HEX_FMT;
+            int size = strlen(finfo.name);
 
-            if (pair->h.cs == DEVICE_IS_UPPER) {
-                char *x = strchr(fmt, 'x');
-                if (x) {
-                    *x = 'X';
-                }
+            if (size >= pair->s.symlink_suffix_len) {
+                *name = apr_pstrndup(pool, finfo.name, size - pair->s.symlink_suffix_len);
+            }
+            else {
+                apr_file_printf(ds->err, "option set '%s' does not have suffix: %s\n", pair->key,
+                        pair->s.symlink_suffix);
+                status = APR_EGENERAL;
             }
 
-            option[0] = apr_psprintf(ds->pool, fmt, pair->h.width, result);
         }
+
+        break;
+
+    case DEVICE_PAIR_RELATION:
+
+        keyname = apr_pstrcat(pool, pair->key, pair->suffix, NULL);
+        relname = apr_pstrcat(pool, pair->r.relation_name,
+                pair->r.relation_suffix, NULL);
+
+        /* find relation, through the link */
+        relpath = apr_pstrcat(pool, keyname, "/", relname,
+                pair->r.relation_prefix ? "/" : "",
+                pair->r.relation_prefix ? pair->r.relation_prefix : "", NULL);
+
+        /* open/read the key, relative to the option set */
+        status = device_file_readat(ds, pool, pair->key, &dirfd, dir, relpath,
+                name, &len);
+
+        break;
+
+    case DEVICE_PAIR_HEX:
+    case DEVICE_PAIR_URI:
+    case DEVICE_PAIR_URI_ABSOLUTE:
+    case DEVICE_PAIR_URI_RELATIVE:
+        /* support me */
+        return APR_ENOTIMPL;
     }
 
+    device_keydir_close(dirfd);
+
     return status;
 }
 
 /*
- * Text is a string to be converted to the defined character set.
+ * Return the catalogue for the given key, rebuilding it from the option
+ * sets when missing, out of date, or when asked.
  */
-static apr_status_t device_parse_text(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
+static apr_status_t device_names_open(device_set_t *ds, device_pair_t *pair,
+        int rebuild, device_names_t *names)
 {
-    char *inbuf, *outbuf;
-    apr_size_t inbytesleft, outbytesleft, nchars, outlen;
-    apr_status_t status = APR_SUCCESS;
-
-    char *out;
-
-    const char *from = nl_langinfo(CODESET);
-
-    iconv_t ic = iconv_open(pair->t.format, from);
+    apr_dir_t *thedir;
+    apr_finfo_t dirent;
+    apr_array_header_t *dirs;
+    apr_array_header_t *pairs;
+    apr_array_header_t *entries;
+    const char *path;
+    apr_time_t stamp;
+    apr_status_t status;
+    int i;
 
-    if ((iconv_t)(-1) == ic) {
-        status = errno;
-        apr_file_printf(ds->err, "%s: cannot convert '%s' to '%s': %pm\n",
-                device_pescape_shell(ds->pool, pair->key), from, pair->t.format,
-                &status);
+    if (APR_SUCCESS != (status = device_names_stamp(ds, NULL, &stamp))) {
         return status;
     }
 
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
-    }
+    path = device_names_path(ds->pool, NULL,
+            apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL));
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
-    }
-    else if (!arg[0]) {
-        if (option) {
-            option[0] = NULL;
-        }
+    if (!rebuild && APR_SUCCESS == device_names_load(ds, path, stamp, names)) {
         return APR_SUCCESS;
     }
 
-    inbuf = (char *)arg;
-    inbytesleft = strlen(arg);
-    outbytesleft = 0;
+    /* scan the directories to build the catalogue */
+    if ((status = apr_dir_open(&thedir, ".", ds->pool)) != APR_SUCCESS) {
+        /* could not open directory, fail */
+        apr_file_printf(ds->err, "could not open current directory: %pm\n", &status);
+        return status;
+    }
 
-    out = NULL;
-    outlen = 0;
+    dirs = apr_array_make(ds->pool, 64, sizeof(const char *));
+    pairs = apr_array_make(ds->pool, 1, sizeof(device_pair_t *));
+    entries = apr_array_make(ds->pool, 64, sizeof(device_names_entry_t));
 
     do {
+        status = apr_dir_read(&dirent,
+                APR_FINFO_TYPE | APR_FINFO_NAME | APR_FINFO_WPROT, thedir);
+        if (APR_STATUS_IS_INCOMPLETE(status)) {
+            continue; /* ignore un-stat()able files */
+        } else if (status != APR_SUCCESS) {
+            break;
+        }
 
-        out = realloc(out, outlen + 256);
-        if (!out) {
-            iconv_close(ic);
-            return APR_ENOMEM;
+        /* hidden files are ignored */
+        if (dirent.name[0] == '.' || dirent.filetype != APR_DIR) {
+            continue;
         }
 
-        outbuf = out + outlen - outbytesleft;
-        outlen += 256;
-        outbytesleft += 256;
+        APR_ARRAY_PUSH(dirs, const char *) = apr_pstrdup(ds->pool, dirent.name);
 
-        nchars = iconv(ic, &inbuf, &inbytesleft, &outbuf, &outbytesleft);
+    } while (1);
 
-    } while (nchars == (apr_size_t)-1 && errno == E2BIG);
+    apr_dir_close(thedir);
 
-    if (nchars == (apr_size_t) -1) {
-        status = errno;
-        if (errno == EILSEQ) {
-            apr_file_printf(ds->err, "%s: contains an invalid '%s' character: %pm\n",
-                    device_pescape_shell(ds->pool, pair->key), from, &status);
-            goto end;
-        } else if (errno == EINVAL) {
-            apr_file_printf(ds->err, "%s: ends with a truncated '%s' character: %pm\n",
-                    device_pescape_shell(ds->pool, pair->key), from, &status);
-            goto end;
-        } else {
-            apr_file_printf(ds->err, "%s: cannot convert a '%s' character: %pm\n",
-                    device_pescape_shell(ds->pool, pair->key), from, &status);
-            goto end;
-        }
-    }
+    /* read the names in bulk where we can */
+    APR_ARRAY_PUSH(pairs, device_pair_t *) = pair;
 
-    outlen -= outbytesleft;
+    device_file_prefetch(ds, dirs, pairs);
 
-    if (outlen < pair->t.min) {
-        apr_file_printf(ds->err, "%s: text is too short (%" APR_SIZE_T_FMT " converted bytes)\n",
-                device_pescape_shell(ds->pool, pair->key), outlen);
-        status = APR_ERANGE;
-        goto end;
-    }
-    else if (outlen > pair->t.max) {
-        apr_file_printf(ds->err, "%s: text is too long (%" APR_SIZE_T_FMT " converted bytes)\n",
-                device_pescape_shell(ds->pool, pair->key), outlen);
-        status = APR_ERANGE;
-        goto end;
-    }
+    for (i = 0; i < dirs->nelts; i++) {
+        apr_pool_t *pool;
+        const char *dir = APR_ARRAY_IDX(dirs, i, const char *);
+        const char *name = NULL;
 
-    if (option) {
-        *option = apr_pstrndup(ds->pool, out, outlen);
-    }
+        apr_pool_create(&pool, ds->pool);
 
-end:
+        if (APR_SUCCESS == device_get_name(ds, pool, pair, dir, &name)) {
+            device_names_entry_t *entry = apr_array_push(entries);
+
+            entry->name = apr_pstrdup(ds->pool, name);
+            entry->dir = dir;
+        }
+
+        apr_pool_destroy(pool);
+
+    }
 
-    free(out);
+    ds->prefetch = NULL;
 
-    iconv_close(ic);
+    device_names_save(ds, path, entries, stamp, names);
 
-    return status;
+    return APR_SUCCESS;
 }
 
-typedef struct device_url_path_state_t {
-    unsigned int abempty:1;
-    unsigned int absolute:1;
-    unsigned int noscheme:1;
-    unsigned int rootless:1;
-    unsigned int empty:1;
-    unsigned int percent:2;
-    int segments;
-    int last_slash;
-} device_url_path_state_t;
-
 /*
- * URL path is a URL encoded string limited by section 3.3 of RFC3986.
+ * Bring the catalogue up to date with a change we made to the option set
+ * in the given directory. A catalogue already out of date before the
+ * change is left for the next lookup to rebuild.
  */
-static apr_status_t device_parse_url_path_ex(device_set_t *ds, device_pair_t *pair,
-        const char *arg, device_url_path_state_t *cur, apr_uint64_t max)
+static void device_names_update(device_set_t *ds, const char *key,
+        const char *dir, apr_time_t before)
 {
-    apr_size_t len = 0;
+    device_names_t names;
+    device_pair_t *pair;
+    apr_array_header_t *entries;
+    apr_finfo_t finfo;
+    apr_pool_t *pool;
+    const char *name = NULL, *path;
+    apr_time_t stamp;
+    apr_int64_t i;
+    int found = 0;
 
-    /* we begin with all path types possible, and eliminate as we go */
-    cur->abempty = 1;
-    cur->absolute = 1;
-    cur->noscheme = 1;
-    cur->rootless = 1;
-    cur->empty = 1;
-    cur->segments = 0;
-    cur->last_slash = 0;
-    cur->percent = 0;
+    pair = apr_hash_get(ds->pairs, key, APR_HASH_KEY_STRING);
 
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is missing.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
+    if (!pair || !dir) {
+        return;
     }
 
-    while (1) {
-        char c = arg[len++];
+    path = device_names_path(ds->pool, NULL,
+            apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL));
 
-        /* not too long? */
-        if (len >= max) {
-            /* not ok */
-            apr_file_printf(ds->err, "argument '%s': '%s' is too long (%" APR_SIZE_T_FMT " character limit).\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1),
-                    apr_pescape_echo(ds->pool,
-                            apr_pstrcat(ds->pool,
-                                    apr_pstrndup(ds->pool, arg, 64), "...",
-                                    NULL), 1), max);
-            return APR_EINVAL;
-        }
+    if (APR_SUCCESS != device_names_load(ds, path, before, &names)
+            || APR_SUCCESS != device_names_stamp(ds, NULL, &stamp)) {
+        return;
+    }
 
-        /* hexdig expected */
-        if (cur->percent) {
+    apr_pool_create(&pool, ds->pool);
 
-            /* but only two hexdigs */
-            if (cur->percent == 3) {
-                cur->percent = 0;
-                /* drop through */
-            }
+    /* option set still there? read its name */
+    if (APR_SUCCESS == apr_stat(&finfo, dir, APR_FINFO_TYPE, pool)
+            && APR_SUCCESS != device_get_name(ds, pool, pair, dir, &name)) {
+        name = NULL;
+    }
 
-            /* hexdig is good */
-            else if ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') || (c >= '0' && c <= '9')) {
-                cur->percent++;
-                continue;
-            }
+    entries = apr_array_make(pool, names.count + 1, sizeof(device_names_entry_t));
 
-            /* not hexdig is bad */
-            else {
-                apr_file_printf(ds->err, "argument '%s': percent encoding cut short.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1));
-                return APR_EINVAL;
-            }
+    for (i = 0; i < names.count; i++) {
+        device_names_entry_t *entry;
+
+        if (!strcmp(device_names_dir(&names, i), dir)) {
+            found = name && !strcmp(device_names_name(&names, i), name);
+            continue;
         }
 
-        /* end of path */
-        if (c == 0) {
-            if (len == 1) {
-                /* empty path detected */
-                cur->absolute = 0;
-                cur->noscheme = 0;
-                cur->rootless = 0;
-            }
+        entry = apr_array_push(entries);
+        entry->name = device_names_name(&names, i);
+        entry->dir = device_names_dir(&names, i);
+    }
 
-            break;
-        }
+    if (name) {
+        device_names_entry_t *entry = apr_array_push(entries);
 
-        /* slash detected */
-        if (c == '/') {
-            if (len == 1) {
-                /* absolute path detected */
-                cur->noscheme = 0;
-                cur->rootless = 0;
-                cur->empty = 0;
-            }
+        entry->name = name;
+        entry->dir = dir;
+    }
 
-            if (len == 2 && cur->last_slash == 1) {
-                /* double slash detected */
-                apr_file_printf(ds->err, "argument '%s': second character cannot be a slash.\n",
-                        apr_pescape_echo(ds->pool, pair->key, 1));
-                return APR_EINVAL;
-            }
+    /* nothing changed, leave the catalogue be */
+    if (!(found && stamp == before)) {
+        device_names_save(ds, path, entries, stamp, &names);
+    }
 
-            cur->segments++;
-            cur->last_slash = len;
-            continue;
-        }
+    apr_pool_destroy(pool);
+}
 
-        /* unreserved detected */
-        /* unreserved  = ALPHA / DIGIT / "-" / "." / "_" / "~" */
-        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' || c == '~') {
+static apr_status_t device_get(device_set_t *ds, const char *arg,
+        apr_array_header_t *options, const char **option, const char **path,
+        int *exact)
+{
+    device_names_t names;
 
-            if (len == 1) {
-                cur->absolute = 0;
-                cur->abempty = 0;
-                cur->empty = 0;
-            }
+    apr_array_header_t *possibles;
 
-            /* ok */
-            continue;
-        }
+    apr_status_t status;
 
-        /* pct-encoded detected */
-        if (c == '%') {
+    apr_size_t arglen = strlen(arg);
 
-            if (len == 1) {
-                cur->absolute = 0;
-                cur->abempty = 0;
-                cur->empty = 0;
-            }
+    device_pair_t *pair;
 
-            cur->percent++;
-            continue;
-        }
+    apr_int64_t i;
 
-        /* sub-delims detected */
-        if (c == '!' || c == '$' || c == '&' || c == '\'' || c == '(' || c == ')'
-                || c == '*' || c == '+' || c == ',' || c == ';' || c == '=') {
+    int ex = 0;
 
-            if (len == 1) {
-                cur->absolute = 0;
-                cur->abempty = 0;
-                cur->empty = 0;
-            }
+    pair = apr_hash_get(ds->pairs, ds->key, APR_HASH_KEY_STRING);
 
-            /* ok */
-            continue;
-        }
+    if (!pair) {
+        apr_file_printf(ds->err, "key '%s' is not recognised.\n",
+                apr_pescape_echo(ds->pool, ds->key, 1));
+        return APR_EINVAL;
+    }
 
-        /* colon detected */
-        if (c == ':') {
+    if (APR_SUCCESS != (status = device_names_open(ds, pair, 0, &names))) {
+        return status;
+    }
 
-            if (len == 1) {
-                cur->absolute = 0;
-                cur->abempty = 0;
-                cur->empty = 0;
-            }
+    /* names sharing the prefix sort together, any exact match first */
+    for (i = device_names_lower(&names, arg); i < names.count; i++) {
 
-            if (cur->segments == 0) {
-                cur->noscheme = 0;
-            }
+        const char *name = device_names_name(&names, i);
+        const char **opt;
 
-            continue;
+        if (strncmp(arg, name, arglen)) {
+            break;
         }
 
-        /* "@" detected */
-        if (c == '@') {
+        ex = (0 == strcmp(arg, name));
 
-            if (len == 1) {
-                cur->absolute = 0;
-                cur->abempty = 0;
-                cur->empty = 0;
-            }
+        if (ex) {
+            apr_array_clear(options);
+        }
 
-            /* ok */
-            continue;
+        opt = apr_array_push(options);
+        opt[0] = apr_pstrcat(ds->pool, "*",
+                device_pescape_shell(ds->pool, name), " ",
+                NULL);
+
+        if (option) {
+            *option = name;
+        }
+        if (path) {
+            *path = device_names_dir(&names, i);
+        }
+        if (exact) {
+            *exact = ex;
         }
 
-        /* anything else is a no */
-        else {
-            apr_file_printf(ds->err, "argument '%s': '%c' is an invalid character.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1), c);
-            return APR_EINVAL;
+        if (ex) {
+            /* exact matches short circuit */
+            break;
+        }
+    }
+
+    if (!ex && option && options->nelts != 1) {
+
+        possibles = apr_array_make(ds->pool, 10, sizeof(char *));
+
+        for (i = 0; i < names.count && i < DEVICE_ERROR_MAX; i++) {
+            APR_ARRAY_PUSH(possibles, const char *) = device_names_name(&names, i);
         }
 
+        device_error_possibles(ds, arg, possibles);
+
+        return APR_INCOMPLETE;
     }
 
     return APR_SUCCESS;
 }
 
-static apr_status_t device_parse_url_path(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
+static apr_status_t device_dir_cleanup(void *data)
 {
-    device_url_path_state_t cur = { 0 };
-    apr_status_t status;
+    close((int)(apr_intptr_t)data);
 
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
-    }
+    return APR_SUCCESS;
+}
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
-    }
-    else if (!arg[0]) {
-        if (option) {
-            option[0] = NULL;
-        }
-        return APR_SUCCESS;
-    }
+/*
+ * Open a handle on a directory, relative to which option files are
+ * created, renamed and removed without changing the working directory.
+ *
+ * The handle is closed along with the pool.
+ */
+static apr_status_t device_dir_open(apr_pool_t *pool, const char *path,
+        int *dirfd)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-    status = device_parse_url_path_ex(ds, pair, arg, &cur, pair->up.max);
-    if (APR_SUCCESS != status) {
-        return status;
+    if (fd < 0) {
+        return apr_get_os_error();
     }
 
-    if (option) {
-        option[0] = arg;
-    }
+    apr_pool_cleanup_register(pool, (void *)(apr_intptr_t)fd,
+            device_dir_cleanup, apr_pool_cleanup_null);
+
+    dirfd[0] = fd;
 
     return APR_SUCCESS;
 }
 
-static apr_status_t device_parse_url_path_abempty(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
+/*
+ * Unix mode of our option files, being APR_FPROT_OS_DEFAULT less
+ * DEVICE_FILE_UMASK.
+ */
+static mode_t device_file_mode(void)
 {
-    device_url_path_state_t cur = { 0 };
-    apr_status_t status;
-
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
-    }
+    apr_fileperms_t perms = APR_FPROT_OS_DEFAULT & ~DEVICE_FILE_UMASK;
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
-    }
-    else if (!arg[0]) {
-        if (option) {
-            option[0] = NULL;
-        }
-        return APR_SUCCESS;
-    }
+    return (((perms >> 8) & 07) << 6) | (((perms >> 4) & 07) << 3)
+            | (perms & 07);
+}
 
-    status = device_parse_url_path_ex(ds, pair, arg, &cur, pair->up.max);
-    if (APR_SUCCESS != status) {
-        return status;
+/*
+ * Create an empty marker file within the directory.
+ */
+static apr_status_t device_file_markat(int dirfd, const char *name)
+{
+    int fd = openat(dirfd, name, O_CREAT | O_WRONLY | O_CLOEXEC,
+            device_file_mode());
+
+    if (fd < 0) {
+        return apr_get_os_error();
     }
 
-    if (!cur.abempty) {
-        apr_file_printf(ds->err, "argument '%s': path not absolute or empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_EINVAL;
+    if (fchmod(fd, device_file_mode())) {
+        apr_status_t status = apr_get_os_error();
+        close(fd);
+        return status;
     }
 
-    if (option) {
-        option[0] = arg;
+    if (close(fd)) {
+        return apr_get_os_error();
     }
 
     return APR_SUCCESS;
 }
 
-static apr_status_t device_parse_url_path_absolute(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
+/*
+ * Replace the trailing XXXXXX of the template in place.
+ */
+static apr_status_t device_file_mktemp(char *template)
 {
-    device_url_path_state_t cur = { 0 };
+    static const char chars[] =
+            "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    unsigned char rnd[6];
+    apr_size_t tlen = strlen(template);
     apr_status_t status;
+    int i;
 
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
+    if (tlen < sizeof(rnd)) {
+        return APR_EINVAL;
     }
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
+    if (APR_SUCCESS != (status = apr_generate_random_bytes(rnd, sizeof(rnd)))) {
+        return status;
     }
-    else if (!arg[0]) {
-        if (option) {
-            option[0] = NULL;
-        }
-        return APR_SUCCESS;
+
+    for (i = 0; i < sizeof(rnd); i++) {
+        template[tlen - sizeof(rnd) + i] = chars[rnd[i] % (sizeof(chars) - 1)];
     }
 
-    status = device_parse_url_path_ex(ds, pair, arg, &cur, pair->up.max);
-    if (APR_SUCCESS != status) {
-        return status;
+    return APR_SUCCESS;
+}
+
+/*
+ * Open an unnamed file in the directory the template lives in, or -1
+ * where the system or filesystem has no O_TMPFILE.
+ */
+static int device_file_tmpfileat(int dirfd, char *template)
+{
+#ifdef O_TMPFILE
+    char *slash = strrchr(template, '/');
+    int fd;
+
+    if (slash) {
+        *slash = 0;
     }
 
-    if (!cur.absolute) {
-        apr_file_printf(ds->err, "argument '%s': path not absolute.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_EINVAL;
+    fd = openat(dirfd, slash ? template : ".",
+            O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600);
+
+    if (slash) {
+        *slash = '/';
     }
 
-    if (option) {
-        option[0] = arg;
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Give an unnamed file the template as its name.
+ */
+static int device_file_linkat(int fd, int dirfd, const char *template)
+{
+#ifdef O_TMPFILE
+    char path[64];
+
+    /* without privileges, linking needs to go by way of /proc */
+    if (!linkat(fd, "", dirfd, template, AT_EMPTY_PATH)) {
+        return 0;
     }
 
-    return APR_SUCCESS;
+    apr_snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+    return linkat(AT_FDCWD, path, dirfd, template, AT_SYMLINK_FOLLOW);
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
 }
 
-static apr_status_t device_parse_url_path_noscheme(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
+/*
+ * Like apr_file_mktemp() and apr_file_write_full() in one, relative to the
+ * directory. The trailing XXXXXX of the template is replaced in place.
+ *
+ * Where we can, the file is written unnamed and only named once complete,
+ * so that a failure part way leaves nothing behind.
+ */
+static apr_status_t device_file_writeat(int dirfd, char *template,
+        const char *val, apr_size_t len)
 {
-    device_url_path_state_t cur = { 0 };
+    apr_size_t tlen = strlen(template);
     apr_status_t status;
+    int fd, named, tries;
 
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
+    if (tlen < 6 || strcmp(template + tlen - 6, "XXXXXX")) {
+        return APR_EINVAL;
     }
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
+    fd = device_file_tmpfileat(dirfd, template);
+    named = (fd < 0);
+
+    for (tries = 0; fd < 0 && tries < 100; tries++) {
+
+        if (APR_SUCCESS != (status = device_file_mktemp(template))) {
+            return status;
+        }
+
+        fd = openat(dirfd, template, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC,
+                0600);
+        if (fd < 0 && errno != EEXIST) {
+            return apr_get_os_error();
+        }
     }
-    else if (!arg[0]) {
-        if (option) {
-            option[0] = NULL;
+
+    if (fd < 0) {
+        return APR_EEXIST;
+    }
+
+    while (len) {
+        ssize_t n = write(fd, val, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
-        return APR_SUCCESS;
+        if (n < 0) {
+            status = apr_get_os_error();
+            close(fd);
+            return status;
+        }
+
+        val += n;
+        len -= n;
     }
 
-    status = device_parse_url_path_ex(ds, pair, arg, &cur, pair->up.max);
-    if (APR_SUCCESS != status) {
+    if (fchmod(fd, device_file_mode())) {
+        status = apr_get_os_error();
+        close(fd);
         return status;
     }
 
-    if (!cur.noscheme) {
-        apr_file_printf(ds->err, "argument '%s': path contains a scheme\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_EINVAL;
+    for (tries = 0; !named && tries < 100; tries++) {
+
+        if (APR_SUCCESS != (status = device_file_mktemp(template))) {
+            close(fd);
+            return status;
+        }
+
+        if (!device_file_linkat(fd, dirfd, template)) {
+            named = 1;
+        }
+        else if (errno != EEXIST) {
+            status = apr_get_os_error();
+            close(fd);
+            return status;
+        }
     }
 
-    if (option) {
-        option[0] = arg;
+    if (!named) {
+        close(fd);
+        return APR_EEXIST;
+    }
+
+    if (close(fd)) {
+        return apr_get_os_error();
     }
 
     return APR_SUCCESS;
 }
 
-static apr_status_t device_parse_url_path_rootless(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
+/*
+ * Flush everything written beneath the directory to stable storage.
+ *
+ * One syncfs() covers every file of a transaction, where fsync() on each
+ * would cost a flush per file.
+ */
+static apr_status_t device_dir_syncfs(int dirfd)
 {
-    device_url_path_state_t cur = { 0 };
-    apr_status_t status;
+#if HAVE_SYNCFS
+    if (syncfs(dirfd)) {
+        return apr_get_os_error();
+    }
+#else
+    sync();
+#endif
 
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
+    return APR_SUCCESS;
+}
+
+/*
+ * Flush the entries of each directory holding the files, once each, so
+ * that the renames of the files reach stable storage.
+ *
+ * Paths are relative to dirfd, which is itself flushed for files that
+ * live directly within it. The first failure is returned.
+ */
+static apr_status_t device_files_syncdirs(device_set_t *ds, int dirfd,
+        apr_array_header_t *files)
+{
+    apr_hash_t *dirs = apr_hash_make(ds->pool);
+    apr_hash_index_t *hi;
+    apr_status_t status = APR_SUCCESS;
+    int i;
+
+    for (i = 0; i < files->nelts; i++) {
+        device_file_t *file = &APR_ARRAY_IDX(files, i, device_file_t);
+        const char *slash = strrchr(file->dest, '/');
+        const char *dir = slash ?
+                apr_pstrndup(ds->pool, file->dest, slash - file->dest) : ".";
+
+        apr_hash_set(dirs, dir, APR_HASH_KEY_STRING, dir);
     }
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
+    for (hi = apr_hash_first(ds->pool, dirs); hi; hi = apr_hash_next(hi)) {
+        const char *dir;
+        apr_status_t rv = APR_SUCCESS;
+        int fd;
+
+        apr_hash_this(hi, NULL, NULL, (void **)&dir);
+
+        fd = strcmp(dir, ".") ?
+                openat(dirfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : dirfd;
+
+        if (fd < 0 || fsync(fd)) {
+            rv = apr_get_os_error();
+            apr_file_printf(ds->err, "cannot sync '%s': %pm\n", dir, &rv);
+            if (APR_SUCCESS == status) {
+                status = rv;
+            }
+        }
+
+        if (fd >= 0 && fd != dirfd) {
+            close(fd);
+        }
     }
-    else if (!arg[0]) {
-        if (option) {
-            option[0] = NULL;
+
+    return status;
+}
+
+/*
+ * Write the files, all relative to the directory, as one unit.
+ *
+ * Each new file is written under a temporary name, leaving the originals
+ * untouched until all have been written, after which each replaces its
+ * original in a single rename. Should any write fail, the temporary files
+ * are removed and nothing has changed.
+ */
+static apr_status_t device_files_write(device_set_t *ds, int dirfd,
+        apr_array_header_t *files)
+{
+    apr_status_t status = APR_SUCCESS;
+    int i;
+
+    /* try to write */
+    for (i = 0; i < files->nelts; i++)
+    {
+        device_file_t *file = &APR_ARRAY_IDX(files, i, device_file_t);
+
+        if (!file->val) {
+
+            /* no value, the original is removed once all is written */
+
         }
-        return APR_SUCCESS;
+        else if (file->type == APR_REG) {
+
+            /* write the result */
+            if (APR_SUCCESS
+                    != (status = device_file_writeat(dirfd, file->template,
+                            file->val, strlen(file->val)))) {
+                apr_file_printf(ds->err, "cannot save '%s': %pm\n", file->key, &status);
+                break;
+            }
+        }
+        else if (file->type == APR_LNK) {
+
+            /* APR needs a mktemp function that can do symlinks */
+            pid_t pid = getpid();
+            file->template = apr_psprintf(ds->pool, "%s;%" APR_PID_T_FMT, file->dest, pid);
+
+            errno = 0;
+            if (symlinkat(file->link, dirfd, file->template)
+                    && APR_SUCCESS != (status = apr_get_os_error())) {
+                apr_file_printf(ds->err, "cannot link '%s': %pm\n", file->key, &status);
+                break;
+            }
+        }
+
     }
 
-    status = device_parse_url_path_ex(ds, pair, arg, &cur, pair->up.max);
+    /* the new files reach the disk before any replaces the old */
+    if (APR_SUCCESS == status && ds->sync
+            && APR_SUCCESS != (status = device_dir_syncfs(dirfd))) {
+        apr_file_printf(ds->err, "cannot sync '%s': %pm\n", ds->key, &status);
+    }
+
+    /* could not write, try to rollback */
     if (APR_SUCCESS != status) {
+
+        for (i = 0; i < files->nelts; i++) {
+
+            apr_status_t status; /* intentional shadowing of status */
+
+            device_file_t *file = &APR_ARRAY_IDX(files, i, device_file_t);
+
+            /* the originals are untouched, the new files just go away */
+            if (file->val && file->template && unlinkat(dirfd, file->template, 0)
+                    && !APR_STATUS_IS_ENOENT(status = apr_get_os_error())) {
+                apr_file_printf(ds->err, "cannot remove '%s': %pm\n", file->key, &status);
+            }
+
+        }
+
         return status;
     }
 
-    if (!cur.rootless) {
-        apr_file_printf(ds->err, "argument '%s': path is not rootless\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_EINVAL;
+    /*
+     * Otherwise do the renames. Past this point there is no going back, so
+     * a failed rename is reported, the rest carry on, and the first
+     * failure is returned.
+     */
+    for (i = 0; i < files->nelts; i++) {
+
+        apr_status_t rv;
+
+        device_file_t *file = &APR_ARRAY_IDX(files, i, device_file_t);
+
+        /* each replaces the original in a single step */
+        if (file->val && renameat(dirfd, file->template, dirfd, file->dest)) {
+            rv = apr_get_os_error();
+            apr_file_printf(ds->err, "cannot move '%s': %pm\n", file->key, &rv);
+            if (APR_SUCCESS == status) {
+                status = rv;
+            }
+        }
+
+        if (!file->val && unlinkat(dirfd, file->dest, 0)
+                && !APR_STATUS_IS_ENOENT(rv = apr_get_os_error())) {
+            apr_file_printf(ds->err, "cannot remove '%s': %pm\n", file->key, &rv);
+            if (APR_SUCCESS == status) {
+                status = rv;
+            }
+        }
+
     }
 
-    if (option) {
-        option[0] = arg;
+    /* then the renames, in each directory they touched */
+    if (ds->sync && APR_SUCCESS == status) {
+        status = device_files_syncdirs(ds, dirfd, files);
     }
 
-    return APR_SUCCESS;
+    return status;
 }
 
-static apr_status_t device_parse_url_path_empty(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
+/*
+ * Keep the files for a transaction to write later, along with a mark
+ * that the options were updated, and any move of the name link. Paths
+ * become relative to the option set, and are copied out of the pool of
+ * the request.
+ *
+ * What each file will hold is also kept in ds->pending by its path within
+ * the option set, so that later requests of the transaction see the
+ * indexes as they will be rather than as they are.
+ */
+static apr_status_t device_files_stage(device_set_t *ds,
+        apr_array_header_t *files)
 {
-    device_url_path_state_t cur = { 0 };
-    apr_status_t status;
-
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
-    }
+    apr_pool_t *pool = ds->staged->pool;
+    const char *prefix = ds->key ? apr_pstrcat(pool, ds->keypath, "/", NULL) : "";
+    device_file_t *file;
+    device_rename_t *move = NULL;
+    int i;
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
-    }
-    else if (!arg[0]) {
-        if (option) {
-            option[0] = NULL;
+    if (ds->key) {
+        const char *link = ds->keyval;
+
+        /* an earlier request may already have moved the link */
+        for (i = 0; i < ds->renames->nelts; i++) {
+            device_rename_t *prev = &APR_ARRAY_IDX(ds->renames, i, device_rename_t);
+
+            if (!strcmp(prev->keypath, ds->keypath) && prev->to) {
+                link = prev->to;
+            }
         }
-        return APR_SUCCESS;
-    }
 
-    status = device_parse_url_path_ex(ds, pair, arg, &cur, pair->up.max);
-    if (APR_SUCCESS != status) {
-        return status;
+        move = apr_array_push(ds->renames);
+        move->key = apr_pstrdup(pool, ds->key);
+        move->keypath = apr_pstrdup(pool, ds->keypath);
+        move->from = link ? apr_pstrdup(pool, link) : NULL;
+        move->to = NULL;
     }
 
-    if (!cur.empty) {
-        apr_file_printf(ds->err, "argument '%s': path is not empty\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_EINVAL;
-    }
+    for (i = 0; i < files->nelts; i++) {
+        device_file_t *from = &APR_ARRAY_IDX(files, i, device_file_t);
 
-    if (option) {
-        option[0] = arg;
+        if (move && from->index == DEVICE_IS_INDEXED) {
+            move->to = from->val ? apr_pstrdup(pool, from->val) : NULL;
+        }
+
+        file = apr_array_push(ds->staged);
+        file->key = apr_pstrdup(pool, from->key);
+        file->dest = apr_pstrcat(pool, prefix, from->dest, NULL);
+        file->template = from->template ?
+                apr_pstrcat(pool, prefix, from->template, NULL) : NULL;
+        file->val = from->val ? apr_pstrdup(pool, from->val) : NULL;
+        file->link = from->link ? apr_pstrdup(pool, from->link) : NULL;
+        file->order = from->order;
+        file->index = from->index;
+        file->type = from->type;
+
+        /* moves of neighbouring indexes are relative to the option set */
+        if (file->type == APR_REG) {
+            apr_hash_set(ds->pending, strncmp(from->dest, "../", 3) ?
+                    file->dest : apr_pstrdup(pool, from->dest + 3),
+                    APR_HASH_KEY_STRING, file->val ? file->val : "");
+        }
     }
 
+    file = apr_array_push(ds->staged);
+    file->key = apr_pstrdup(pool, ds->key);
+    file->dest = apr_pstrcat(pool, prefix, DEVICE_SET_MARKER, NULL);
+    file->template = apr_pstrcat(pool, file->dest, ".XXXXXX", NULL);
+    file->val = "";
+    file->index = DEVICE_IS_NORMAL;
+    file->type = APR_REG;
+
     return APR_SUCCESS;
 }
 
-typedef enum device_uri_target_e {
-    DEVICE_URI_TARGET = 0,
-    DEVICE_URI_TARGET_ABSOLUTE,
-    DEVICE_URI_TARGET_RELATIVE
-} device_uri_target_e;
-
 /*
- * Parse a URI.
+ * Move the name links of a transaction once its files are written, and
+ * bring the names catalogue up to date with each option set touched.
  */
-static apr_status_t device_parse_uri_ex(device_set_t *ds, device_pair_t *pair,
-        const char *arg, device_uri_target_e target, apr_array_header_t *options, const char **option)
+static apr_status_t device_files_rename(device_set_t *ds,
+        apr_array_header_t *renames)
 {
-    apr_uri_t uri;
-    apr_status_t status;
+    apr_file_t *lock;
+    apr_status_t status = APR_SUCCESS;
+    int i;
 
-    if (!arg) {
-        apr_file_printf(ds->err, "'%s': is empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
-    }
+    lock = renames->nelts ? device_names_lock(ds) : NULL;
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
-    }
-    else if (!arg[0]) {
-        if (option) {
-            option[0] = NULL;
+    for (i = 0; i < renames->nelts; i++) {
+        device_rename_t *move = &APR_ARRAY_IDX(renames, i, device_rename_t);
+        apr_time_t stamp;
+
+        /* the names catalogue as it stood before the move */
+        if (APR_SUCCESS != device_names_stamp(ds, NULL, &stamp)) {
+            break;
         }
-        return APR_SUCCESS;
-    }
 
-    status = apr_uri_parse(ds->pool, arg, &uri);
+        /* too late to back out */
+        if (move->from && move->to) {
+            apr_file_rename(move->from, move->to, ds->pool);
+        }
 
-    if (APR_SUCCESS != status) {
-        apr_file_printf(ds->err, "uri '%s' is not a valid uri.\n",
-                apr_pescape_echo(ds->pool, arg, 1));
-        return APR_EINVAL;
+        device_names_update(ds, move->key, move->keypath, stamp);
     }
 
-    if (pair->uri.schemes) {
-        if (!uri.scheme
-                || !apr_hash_get(pair->uri.schemes, uri.scheme,
-                        APR_HASH_KEY_STRING)) {
-            apr_file_printf(ds->err, "scheme '%s' must be one of: %s\n",
-                    apr_pescape_echo(ds->pool, uri.scheme, 1), device_hash_to_string(ds->pool, pair->uri.schemes));
-            return APR_EINVAL;
+    device_names_unlock(lock);
+
+    /* name links live in the option set */
+    if (ds->sync && renames->nelts) {
+
+        int setfd;
+
+        if (APR_SUCCESS != (status = device_dir_open(ds->pool, ".", &setfd))
+                || (fsync(setfd) && (status = apr_get_os_error()))) {
+            apr_file_printf(ds->err, "cannot sync name links: %pm\n", &status);
         }
     }
 
-    if (option) {
-        option[0] = arg;
-    }
+    return status;
+}
 
-    switch (target) {
-    case DEVICE_URI_TARGET: {
-        /* all uris accepted */
-        if (uri.path) {
-            device_url_path_state_t cur = { 0 };
+static apr_status_t device_files_apply(device_set_t *ds,
+        apr_array_header_t *files)
+{
+    const char *keypath = NULL, *keyval = NULL;
+    apr_time_t stamp = 0;
+    apr_status_t status = APR_SUCCESS;
+    int dirfd;
+    int i;
 
-            status = device_parse_url_path_ex(ds, pair, uri.path,
-                    &cur, pair->uri.max);
-            if (APR_SUCCESS != status) {
-                return status;
-            }
-        }
-        break;
+    /* the names catalogue as it stood before we started */
+    if (ds->key && ds->mode != DEVICE_REINDEX
+            && APR_SUCCESS != (status = device_names_stamp(ds, NULL, &stamp))) {
+        return status;
     }
-    case DEVICE_URI_TARGET_ABSOLUTE: {
-        /* absolute means scheme is present and fragment is absent */
-        if (!uri.scheme) {
-            apr_file_printf(ds->err, "argument '%s': uri must have a scheme.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1));
-            return APR_EINVAL;
-        }
-        else if (uri.fragment) {
-            apr_file_printf(ds->err, "argument '%s': uri must not have a fragment.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1));
-            return APR_EINVAL;
-        }
-        /* "//" authority path-abempty */
-        else if (uri.hostinfo) {
-            device_url_path_state_t cur = { 0 };
 
-            status = device_parse_url_path_ex(ds, pair, uri.path,
-                    &cur, pair->uri.max);
-            if (APR_SUCCESS != status) {
-                return status;
-            }
-        }
-        /* path must be path-absolute, path-rootless, path-empty */
-        else {
-            device_url_path_state_t cur = { 0 };
+    if (ds->mode == DEVICE_ADD) {
 
-            status = device_parse_url_path_ex(ds, pair, uri.path,
-                    &cur, pair->uri.max);
-            if (APR_SUCCESS != status) {
+        /* try the directory create */
+        if (ds->key) {
+
+            apr_uuid_t uuid;
+            char ustr[APR_UUID_FORMATTED_LENGTH + 1];
+
+            /* test for uniqueness */
+
+            apr_uuid_get(&uuid);
+            apr_uuid_format(ustr, &uuid);
+
+            keypath = apr_pstrdup(ds->pool, ustr);
+
+            if (APR_SUCCESS != (status = apr_dir_make(keypath,
+                    APR_FPROT_OS_DEFAULT, ds->pool))) {
+                apr_file_printf(ds->err, "cannot create '%s': %pm\n", ds->key, &status);
                 return status;
             }
 
-            if (!cur.absolute && !cur.rootless && !cur.empty) {
-                apr_file_printf(ds->err,
-                        "argument '%s': uri's path must be absolute, rootless, or empty.\n",
-                        apr_pescape_echo(ds->pool, pair->key, 1));
-                return APR_EINVAL;
+            /* everything from here is relative to the new directory */
+            if (APR_SUCCESS != (status = device_dir_open(ds->pool, keypath, &dirfd))) {
+                apr_file_printf(ds->err, "cannot access '%s': %pm\n", ds->key, &status);
+                return status;
             }
-        }
-        break;
-    }
-    case DEVICE_URI_TARGET_RELATIVE: {
-        /* relative means scheme is absent */
-        if (uri.scheme) {
-            apr_file_printf(ds->err, "argument '%s': uri must not have a scheme.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1));
-            return APR_EINVAL;
-        }
-        else if (!uri.path) {
-            apr_file_printf(ds->err, "argument '%s': uri must have a path.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1));
-            return APR_EINVAL;
-        }
-        /* "//" authority path-abempty */
-        else if (uri.hostinfo) {
-            device_url_path_state_t cur = { 0 };
-
-            status = device_parse_url_path_ex(ds, pair, uri.path,
-                    &cur, pair->uri.max);
-            if (APR_SUCCESS != status) {
+            else if (APR_SUCCESS
+                    != (status = device_file_markat(dirfd, DEVICE_ADD_MARKER))) {
+                apr_file_printf(ds->err, "cannot create add mark '%s': %pm\n", ds->key,
+                    &status);
                 return status;
             }
+
         }
-        /* path must be path-absolute, path-noscheme, path-empty */
         else {
-            device_url_path_state_t cur = { 0 };
+            apr_file_printf(ds->err, "option is unset\n");
+            return APR_EGENERAL;
+        }
 
-            status = device_parse_url_path_ex(ds, pair, uri.path,
-                    &cur, pair->uri.max);
-            if (APR_SUCCESS != status) {
-                return status;
-            }
+    }
+    else if (ds->mode == DEVICE_REINDEX) {
 
-            if (!cur.absolute && !cur.noscheme && !cur.empty) {
-                apr_file_printf(ds->err,
-                        "argument '%s': uri's path must be absolute, relative with no scheme, or empty.\n",
-                        apr_pescape_echo(ds->pool, pair->key, 1));
-                return APR_EINVAL;
-            }
+        /* paths are relative to the option set */
+        if (APR_SUCCESS != (status = device_dir_open(ds->pool, ".", &dirfd))) {
+            apr_file_printf(ds->err, "cannot access cwd: %pm\n", &status);
+            return status;
         }
 
-        break;
     }
-    }
-
-    return APR_SUCCESS;
-}
+    else {
 
-static apr_status_t device_parse_uri(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
-{
-    return device_parse_uri_ex(ds, pair, arg, DEVICE_URI_TARGET, options, option);
-}
+        /* paths are relative to the options being set */
+        if (APR_SUCCESS != (status = device_dir_open(ds->pool,
+                ds->key ? ds->keypath : ".", &dirfd))) {
+            apr_file_printf(ds->err, "cannot access '%s': %pm\n", ds->key, &status);
+            return status;
+        }
 
-static apr_status_t device_parse_uri_absolute(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
-{
-    return device_parse_uri_ex(ds, pair, arg, DEVICE_URI_TARGET_ABSOLUTE, options, option);
-}
+        /* try to mark updated file */
+        if (APR_SUCCESS
+                != (status = device_file_markat(dirfd, DEVICE_SET_MARKER))) {
+            apr_file_printf(ds->err, "cannot create set mark '%s': %pm\n", ds->key,
+                    &status);
+            return status;
+        }
 
-static apr_status_t device_parse_uri_relative(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
-{
-    return device_parse_uri_ex(ds, pair, arg, DEVICE_URI_TARGET_RELATIVE, options, option);
-}
+    }
 
-typedef struct device_address_state_t {
-    unsigned int address:1;
-    unsigned int mailbox:1;
-    unsigned int group:1;
-    unsigned int name_addr:1;
-    unsigned int addr_spec:1;
-    unsigned int display_name:1;
-    unsigned int angle_addr:1;
-    unsigned int local_part:1;
-    unsigned int domain:1;
-    unsigned int domain_literal:1;
-    unsigned int group_list:1;
-    unsigned int mailbox_list:1;
-    unsigned int address_list:1;
-    unsigned int phrase:1;
-    unsigned int word:1;
-    unsigned int atom:1;
-    unsigned int quoted_string:1;
-    unsigned int dot_atom:1;
-    unsigned int dot_atom_text:1;
-    unsigned int dns_atom:1;
-    unsigned int seen_atext:1;
-    unsigned int seen_left_cfws:1;
-    unsigned int seen_right_cfws:1;
-    unsigned int is_ws:1;
-    unsigned int is_atext:1;
-    unsigned int is_dnstext:1;
-    unsigned int is_dot:1;
-    unsigned int is_at:1;
-    apr_size_t local_part_len;
-    apr_size_t domain_label_len;
-    apr_size_t domain_len;
-} device_address_state_t;
+    /* try to write, and on failure remove what we added */
+    if (APR_SUCCESS != (status = device_files_write(ds, dirfd, files))) {
 
-static void want_dot_atom_text(device_address_state_t *cur)
-{
-    cur->dot_atom_text = 1;
-}
+        /* remove the added/updated markers here */
+        if (ds->mode == DEVICE_ADD && unlinkat(dirfd, DEVICE_ADD_MARKER, 0)
+                && !APR_STATUS_IS_ENOENT(status = apr_get_os_error())) {
+            apr_file_printf(ds->err, "cannot remove add mark: %pm\n", &status);
+        }
+        if (ds->mode == DEVICE_SET && unlinkat(dirfd, DEVICE_SET_MARKER, 0)
+                && !APR_STATUS_IS_ENOENT(status = apr_get_os_error())) {
+            apr_file_printf(ds->err, "cannot remove set mark: %pm\n", &status);
+        }
 
-static void want_dot_atom(device_address_state_t *cur)
-{
-    want_dot_atom_text(cur);
-    cur->dot_atom = 1;
-}
+        if (ds->key) {
 
-static void want_local_part(device_address_state_t *cur)
-{
-    want_dot_atom(cur);
-    cur->local_part = 1;
-    cur->local_part_len = 0;
-}
+            if (ds->mode == DEVICE_ADD) {
+                if (APR_SUCCESS != (status = apr_dir_remove(keypath, ds->pool))) {
+                    apr_file_printf(ds->err, "cannot remove '%s': %pm\n", ds->key, &status);
+                    return status;
+                }
+            }
+            else {
 
-static void want_dns_atom(device_address_state_t *cur)
-{
-    cur->dns_atom = 1;
-}
+                /* implement the undo of the reindex here */
 
-static void want_domain(device_address_state_t *cur)
-{
-    want_dns_atom(cur);
-    cur->domain = 1;
-    cur->domain_len = 0;
-    cur->domain_label_len = 0;
-}
+            }
+        }
 
-static void want_addr_spec(device_address_state_t *cur)
-{
-    want_local_part(cur);
-    cur->addr_spec = 1;
-}
+        return status;
+    }
 
-static void want_mailbox(device_address_state_t *cur)
-{
-    want_addr_spec(cur);
-    /* want_name_addr(cur); */
-    cur->mailbox = 1;
-}
+    for (i = 0; i < files->nelts; i++) {
 
-static void want_address(device_address_state_t *cur)
-{
-    want_mailbox(cur);
-    /* want_group(cur); */
-    cur->address = 1;
-}
+        device_file_t *file = &APR_ARRAY_IDX(files, i, device_file_t);
 
-static int is_filesafe(char c)
-{
-    switch (c) {
-    case ':':
-    case '/':
-    case '\\':
-        return 0;
-    default:
-        return 1;
+        if (file->index == DEVICE_IS_INDEXED) {
+            keyval = file->val;
+        }
     }
-}
 
-static int is_ws(char c)
-{
-    switch (c) {
-    case '\t':
-    case ' ':
-        return 1;
-    default:
-        return 0;
+    /* too late to back out */
+    if (ds->keyval && keyval) {
+        apr_file_rename(ds->keyval, keyval, ds->pool);
     }
-}
 
-static int is_atext(char c)
-{
+    else if (keypath && keyval) {
+        apr_file_remove(keyval, ds->pool);
+        if (symlink(keypath, keyval)) {
+            /* silently ignore any errors */
+        }
+    }
 
-    switch (c) {
-    case '!':
-    case '#':
-    case '$':
-    case '%':
-    case '&':
-    case '\'':
-    case '*':
-    case '+':
-    case '-':
-    case '/':
-    case '=':
-    case '?':
-    case '^':
-    case '_':
-    case '`':
-    case '{':
-    case '|':
-    case '}':
-    case '~':
-        return 1;
+    /* new directories and name links live in the option set */
+    if (ds->sync && ds->key && ds->mode != DEVICE_REINDEX) {
+
+        int setfd;
+
+        if (APR_SUCCESS != (status = device_dir_open(ds->pool, ".", &setfd))
+                || (fsync(setfd) && (status = apr_get_os_error()))) {
+            apr_file_printf(ds->err, "cannot sync '%s': %pm\n", ds->key, &status);
+        }
     }
 
-    if (apr_isalnum(c)) {
-        return 1;
+    if (ds->key && ds->mode != DEVICE_REINDEX) {
+        device_names_update(ds, ds->key, keypath ? keypath : ds->keypath, stamp);
     }
 
-    return 0;
+    return status;
 }
 
-static int is_dnstext(char c)
+static apr_status_t device_files(device_set_t *ds, apr_array_header_t *files)
 {
+    apr_file_t *lock = NULL;
+    apr_status_t status;
 
-    switch (c) {
-    case '-':
-        return 1;
+    /* part of a transaction, written later along with the rest */
+    if (ds->staged) {
+        return device_files_stage(ds, files);
     }
 
-    if (apr_isalnum(c)) {
-        return 1;
+    /* changes that touch the names catalogue are made one at a time */
+    if (ds->key && ds->mode != DEVICE_REINDEX) {
+        lock = device_names_lock(ds);
     }
 
-    return 0;
+    status = device_files_apply(ds, files);
+
+    device_names_unlock(lock);
+
+    return status;
 }
 
-static int is_at(char c)
+static apr_status_t device_command(device_set_t *ds, apr_array_header_t *files)
 {
-    switch (c) {
-    case '@':
-        return 1;
-    default:
-        return 0;
+
+    apr_procattr_t *procattr;
+    apr_proc_t *proc;
+
+    apr_status_t status = APR_SUCCESS;
+    int i, j;
+    int exitcode = 0;
+    apr_exit_why_e exitwhy = 0;
+
+    if (ds->key) {
+
+        char *var = apr_pstrcat(ds->pool, "DEVICE_", ds->key, NULL);
+
+        for (j = 7; var && var[j]; j++) {
+            var[j] = apr_toupper(var[j]);
+        }
+
+        apr_env_set(var, ds->keyval, ds->pool);
+
     }
-}
 
-static int is_dot(char c)
-{
-    switch (c) {
-    case '.':
-        return 1;
-    default:
-        return 0;
+
+    /* set up environment */
+    for (i = 0; i < files->nelts; i++)
+    {
+        device_file_t *file = &APR_ARRAY_IDX(files, i, device_file_t);
+
+        char *var = apr_pstrcat(ds->pool, "DEVICE_", file->key, NULL);
+
+        for (j = 7; var && var[j]; j++) {
+            var[j] = apr_toupper(var[j]);
+        }
+
+        if (!file->val) {
+
+            /* no value, leave unset */
+
+        }
+        else if (file->type == APR_REG) {
+
+            apr_env_set(var, file->val, ds->pool);
+
+        }
+        else if (file->type == APR_LNK) {
+
+            apr_env_set(var, file->link, ds->pool);
+
+        }
+
     }
-}
 
-/*
- * Address matches the parts described by 3.4 of RFC5322.
- */
-static apr_status_t device_parse_address_ex(device_set_t *ds, device_pair_t *pair,
-        const char *arg, device_address_state_t *cur, apr_uint64_t max)
-{
-    apr_size_t len = 0;
+    if ((status = apr_procattr_create(&procattr, ds->pool)) != APR_SUCCESS) {
+        apr_file_printf(ds->err, "cannot create procattr: %pm\n", &status);
+        return status;
+    }
 
-    device_address_state_t prev = { 0 };
+    if ((status = apr_procattr_cmdtype_set(procattr, APR_PROGRAM_ENV)) != APR_SUCCESS) {
+        apr_file_printf(ds->err, "cannot set command type in procattr: %pm\n", &status);
+        return status;
+    }
 
-    cur->seen_atext = 0;
-    cur->seen_left_cfws = 0;
-    cur->seen_right_cfws = 0;
+    /* the command runs within the options, we stay where we are */
+    if (ds->key && (status = apr_procattr_dir_set(procattr, ds->keypath)) != APR_SUCCESS) {
+        apr_file_printf(ds->err, "cannot access '%s': %pm\n", ds->key, &status);
+        return status;
+    }
 
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is missing.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
+    proc = apr_pcalloc(ds->pool, sizeof(apr_proc_t));
+    if ((status = apr_proc_create(proc, ds->argv[0], (const char* const*) ds->argv,
+            NULL, procattr, ds->pool)) != APR_SUCCESS) {
+        apr_file_printf(ds->err, "cannot run command: %pm\n", &status);
+        return status;
     }
 
-    while (1) {
-        char c = arg[len++];
+    if ((status = apr_proc_wait(proc, &exitcode, &exitwhy, APR_WAIT)) != APR_CHILD_DONE) {
+        apr_file_printf(ds->err, "cannot wait for command: %pm\n", &status);
+        return status;
+    }
 
-        /* not too long? */
-        if (len >= max) {
-            /* not ok */
-            apr_file_printf(ds->err, "argument '%s': '%s' is too long (%" APR_SIZE_T_FMT " character limit).\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1),
-                    apr_pescape_echo(ds->pool,
-                            apr_pstrcat(ds->pool,
-                                    apr_pstrndup(ds->pool, arg, 64), "...",
-                                    NULL), 1), max);
-            return APR_EINVAL;
+    if (exitcode != 0 || exitwhy != APR_PROC_EXIT) {
+        if (exitwhy != APR_PROC_EXIT) {
+            apr_file_printf(ds->err, "command exited %s with code %d\n",
+                    APR_PROC_CHECK_EXIT(exitwhy) ? "normally" :
+                    APR_PROC_CHECK_SIGNALED(exitwhy) ? "on signal" :
+                    APR_PROC_CHECK_CORE_DUMP(exitwhy) ? "and dumped core" : "",
+                    exitcode);
         }
+        return APR_EGENERAL;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t device_complete(device_set_t *ds, const char **args)
+{
+    const char *key = NULL, *value = NULL;
+
+    apr_status_t status;
+    int start = 0, count;
+
+    if (!args[0]) {
+        /* no args is not ok */
+        apr_file_printf(ds->err, "complete needs one or more arguments.\n");
+        return APR_EINVAL;
+    }
+
+    if (ds->key && (ds->mode == DEVICE_SET || ds->mode == DEVICE_RENAME || ds->mode == DEVICE_EXEC)) {
 
-        /* local part too long? */
-        if (cur->local_part_len > DEVICE_ADDRESS_LOCAL_PART_LIMIT) {
-            /* not ok */
-            apr_file_printf(ds->err, "argument '%s': address local part is too long (%" APR_SIZE_T_FMT " character limit).\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1),
-                    (apr_size_t)DEVICE_ADDRESS_LOCAL_PART_LIMIT);
-            return APR_EINVAL;
-        }
+        apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
+        int i;
 
-        /* domain label too long? */
-        if (cur->domain_label_len > DEVICE_ADDRESS_DOMAIN_LABEL_LIMIT) {
-            /* not ok */
-            apr_file_printf(ds->err, "argument '%s': address domain label is too long (%" APR_SIZE_T_FMT " character limit).\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1),
-                    (apr_size_t)DEVICE_ADDRESS_DOMAIN_LABEL_LIMIT);
-            return APR_EINVAL;
+        if (!args[1]) {
+            status = device_get(ds, args[0], options, NULL, NULL, NULL);
+
+            /* complete on the ids */
+            for (i = 0; i < options->nelts; i++) {
+                const char *option = APR_ARRAY_IDX(options, i, const char *);
+                apr_file_printf(ds->out, "%s\n", option);
+            }
+
+            return status;
         }
+        else {
+            status = device_get(ds, args[0], options, &ds->keyval, &ds->keypath, NULL);
 
-        /* domain too long? */
-        if (cur->domain_len > DEVICE_ADDRESS_DOMAIN_LIMIT) {
-            /* not ok */
-            apr_file_printf(ds->err, "argument '%s': address domain is too long (%" APR_SIZE_T_FMT " character limit).\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1),
-                    (apr_size_t)DEVICE_ADDRESS_DOMAIN_LIMIT);
-            return APR_EINVAL;
+            if (APR_SUCCESS != status) {
+                return status;
+            }
         }
 
-        /* end of address */
-        if (c == 0) {
+        start = 2;
+    }
+
+    /* find the last key/value pair, or just the key if odd */
+    count = start;
+    while(args[count]) {
+        if (!args[count + 1]) {
+            key = args[count + 0];
+            value = NULL;
             break;
         }
+        else {
+            key = args[count + 0];
+            value = args[count + 1];
+        }
+        count += 2;
+    }
 
-        prev = *cur;
-
-        /* filesafe? */
-        if (pair->a.filesafe && !is_filesafe(c)) {
-            /* not ok */
-            apr_file_printf(ds->err, "argument '%s': contains invalid character '%c'.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1), c);
+    if (ds->mode == DEVICE_REMOVE || ds->mode == DEVICE_MARK || ds->mode == DEVICE_SHOW) {
+        if (value) {
+            /* more than one arg is not ok */
+            apr_file_printf(ds->err, "complete has more than one argument.\n");
             return APR_EINVAL;
         }
+        else {
 
-        /* detect character type */
-        cur->is_ws = is_ws(c);
-        cur->is_atext = is_atext(c);
-        cur->is_dnstext = is_dnstext(c);
-        cur->is_dot = is_dot(c);
-        cur->is_at = is_at(c);
+            apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
+            int i;
 
-        /* dot-atom-text   =   1*atext *("." 1*atext) */
-        if (cur->dot_atom_text) {
+            status = device_get(ds, args[0], options, NULL, NULL, NULL);
 
-            if (cur->is_atext) {
-                /* ok */
-            }
-            else if (cur->is_dot) {
-                if (!prev.is_atext) {
-                    /* dot at start or dot repeated not ok */
-                    return APR_EINVAL;
-                }
-            }
-            else {
-                if (prev.is_atext) {
-                    /* ok */
-                    cur->dot_atom_text = 0;
-                }
-                else if (prev.is_dot) {
-                    /* dot at end not ok */
-                    return APR_EINVAL;
-                }
-                else {
-                    /* empty dot_atom_text not ok */
-                    return APR_EINVAL;
-                }
+            /* complete on the keys */
+            for (i = 0; i < options->nelts; i++) {
+                const char *option = APR_ARRAY_IDX(options, i, const char *);
+                apr_file_printf(ds->out, "%s\n", option);
             }
 
+            return status;
         }
+    }
+    else if (value) {
 
-        /* dot-atom        =   [CFWS] dot-atom-text [CFWS] */
-        if (cur->dot_atom) {
+        device_pair_t *pair;
 
-//            if (cur->is_ws) {
-//                /* we don't support whitespace for now */
-//                return APR_ENOTIMPL;
-//            }
+        pair = apr_hash_get(ds->pairs, key, APR_HASH_KEY_STRING);
 
-            if (!cur->dot_atom_text) {
-                /* our dot-atom is finished */
-                cur->dot_atom = 0;
-            }
-        }
+        if (pair) {
 
-        /* local-part      =   dot-atom / quoted-string */
-        if (cur->local_part) {
-            if (!cur->dot_atom && !cur->quoted_string) {
-                cur->local_part = 0;
+            apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
+            int i;
+
+            switch (pair->type) {
+            case DEVICE_PAIR_INDEX:
+                status = device_parse_index(ds, pair, value, NULL, NULL);
+                break;
+            case DEVICE_PAIR_PORT:
+                status = device_parse_port(ds, pair, value, NULL);
+                break;
+            case DEVICE_PAIR_UNPRIVILEGED_PORT:
+                status = device_parse_unprivileged_port(ds, pair, value, NULL);
+                break;
+            case DEVICE_PAIR_HOSTNAME:
+                status = device_parse_hostname(ds, pair, value, NULL);
+                break;
+            case DEVICE_PAIR_FQDN:
+                status = device_parse_fqdn(ds, pair, value, NULL);
+                break;
+            case DEVICE_PAIR_SELECT:
+                status = device_parse_select(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_BYTES:
+                status = device_parse_bytes(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_SYMLINK:
+                status = device_parse_symlink(ds, pair, value, options, NULL, NULL);
+                break;
+            case DEVICE_PAIR_SQL_IDENTIFIER:
+                status = device_parse_sql_identifier(ds, pair, value, NULL);
+                break;
+            case DEVICE_PAIR_SQL_DELIMITED_IDENTIFIER:
+                status = device_parse_sql_delimited_identifier(ds, pair, value,
+                        NULL);
+                break;
+            case DEVICE_PAIR_USER:
+                status = device_parse_user(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_DISTINGUISHED_NAME:
+                status = device_parse_distinguished_name(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_RELATION:
+                status = device_parse_relation(ds, pair, value, options, NULL, NULL);
+                break;
+            case DEVICE_PAIR_POLAR:
+                status = device_parse_polar(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_SWITCH:
+                status = device_parse_switch(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_INTEGER:
+                status = device_parse_integer(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_HEX:
+                status = device_parse_hex(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_TEXT:
+                status = device_parse_text(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_URL_PATH:
+                status = device_parse_url_path(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_URL_PATH_ABEMPTY:
+                status = device_parse_url_path_abempty(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_URL_PATH_ABSOLUTE:
+                status = device_parse_url_path_absolute(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_URL_PATH_NOSCHEME:
+                status = device_parse_url_path_noscheme(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_URL_PATH_ROOTLESS:
+                status = device_parse_url_path_rootless(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_URL_PATH_EMPTY:
+                status = device_parse_url_path_empty(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_URI:
+                status = device_parse_uri(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_URI_ABSOLUTE:
+                status = device_parse_uri_absolute(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_URI_RELATIVE:
+                status = device_parse_uri_relative(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_ADDRESS:
+                status = device_parse_address(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_ADDRESS_MAILBOX:
+                status = device_parse_address_mailbox(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_ADDRESS_ADDRSPEC:
+                status = device_parse_address_addrspec(ds, pair, value, options, NULL);
+                break;
+            case DEVICE_PAIR_ADDRESS_LOCALPART:
+                status = device_parse_address_localpart(ds, pair, value, options, NULL);
+                break;
             }
-            else {
-                cur->local_part_len++;
+
+            for (i = 0; i < options->nelts; i++) {
+                const char *option = APR_ARRAY_IDX(options, i, const char *);
+                apr_file_printf(ds->out, "%s\n", option);
             }
+
+        }
+        else {
+            // FIXME: add option for an "overflow" of unknown arguments
+            apr_file_printf(ds->err, "key '%s' is not recognised.\n",
+                    apr_pescape_echo(ds->pool, key, 1));
+            return APR_EINVAL;
         }
 
-        /* dns-atom   =   1*dnstext *("." 1*dnstext) */
-        if (cur->dns_atom) {
+    }
+    else {
+
+        apr_hash_index_t *hi;
+        void *v;
+        device_pair_t *pair;
+
+        for (hi = apr_hash_first(ds->pool, ds->pairs); hi; hi = apr_hash_next(hi)) {
+
+            int found = 0;
+
+            apr_hash_this(hi, NULL, NULL, &v);
+            pair = v;
+
+            /* skip primary key when setting but not renaming */
+            if (ds->key && ds->mode == DEVICE_SET && !strcmp(ds->key, pair->key)) {
+                continue;
+            }
 
-            if (cur->is_dnstext) {
-                /* ok */
-                if (cur->is_dot) {
-                    cur->domain_label_len = 0;
+            /* skip keys already seen in arguments */
+            count = start;
+            while(args[count]) {
+                if (!args[count + 1]) {
+                    break;
                 }
-                else {
-                    cur->domain_label_len++;
+                if (!strcmp(pair->key, args[count])) {
+                    found = 1;
+                    break;
                 }
+                count += 2;
             }
-            else if (cur->is_dot) {
-                if (!prev.is_dnstext) {
-                    /* dot at start or dot repeated not ok */
-                    return APR_EINVAL;
-                }
+            if (found) {
+                continue;
             }
-            else {
-                if (prev.is_dnstext) {
-                    /* ok */
-                    cur->dns_atom = 0;
-                }
-                else if (prev.is_dot) {
-                    /* dot at end not ok */
-                    return APR_EINVAL;
-                }
-                else {
-                    /* empty dns_atom_text not ok */
-                    return APR_EINVAL;
-                }
+
+            /* suggest remaining key */
+            if (!key || !key[0] || !strncmp(key, pair->key, strlen(key))) {
+                apr_file_printf(ds->out, "%c%s=\n",
+                        pair->optional == DEVICE_IS_OPTIONAL ? '-' : '*',
+                        device_pescape_shell(ds->pool, pair->key));
             }
 
         }
 
-        /* rfc5322#section-3.2.3 defines the liberal dot-atom */
-        /* domain          =   dot-atom / domain-literal */
-        /* rfc5321#section-2.3.5 defines the SMTP domain */
-        /* domain = dns-atom / domain-literal */
-        if (cur->domain) {
-            if (!cur->dns_atom && !cur->domain_literal) {
-                cur->domain = 0;
-            }
-            else {
-                cur->domain_len++;
-            }
+        status = APR_INCOMPLETE;
+
+    }
+
+    apr_file_flush(ds->out);
+    apr_file_flush(ds->err);
+
+    return status;
+}
+
+#define DEVICE_SERVE_ARG_MAX 65536
+
+/*
+ * Read one completion request from the shell.
+ *
+ * A request is a series of netstrings, one per argument, followed by
+ * a newline.
+ */
+static apr_status_t device_serve_read(device_set_t *ds, apr_file_t *in,
+        apr_array_header_t *args)
+{
+    apr_status_t status;
+    char ch;
+
+    while (APR_SUCCESS == (status = apr_file_getc(&ch, in))) {
+
+        const char **arg;
+        char *buf;
+        apr_size_t len = 0;
+        int digits = 0;
+
+        /* end of the request */
+        if (ch == '\n') {
+            apr_array_push(args);
+            return APR_SUCCESS;
         }
 
-        /* addr-spec       =   local-part "@" domain */
-        if (cur->addr_spec) {
+        while (apr_isdigit(ch)) {
 
-            if (!cur->local_part && !cur->is_at && !cur->domain) {
-                /* we are no longer an addr_spec */
-                cur->addr_spec = 0;
-            }
-            else if (!cur->domain && cur->is_at) {
-                /* transition from local-part to domain */
-                want_domain(cur);
-                cur->domain_literal = 0;
+            len = len * 10 + (ch - '0');
+            digits++;
+
+            if (len > DEVICE_SERVE_ARG_MAX) {
+                return APR_EINVAL;
             }
-        }
 
-        /* mailbox         =   name-addr / addr-spec */
-        if (cur->mailbox) {
-            if (!cur->name_addr && !cur->addr_spec) {
-                cur->mailbox = 0;
+            if (APR_SUCCESS != (status = apr_file_getc(&ch, in))) {
+                return status;
             }
         }
 
-        /* address         =   mailbox / group */
-        if (cur->address) {
-            if (!cur->mailbox && !cur->group) {
-                cur->address = 0;
-                apr_file_printf(ds->err, "argument '%s': is not an address at character %" APR_SIZE_T_FMT ".\n",
-                        apr_pescape_echo(ds->pool, pair->key, 1), len);
-                return APR_EINVAL;
-            }
+        if (!digits || ch != ':') {
+            return APR_EINVAL;
         }
 
-    }
+        buf = apr_palloc(ds->pool, len + 1);
 
-    /* did the address finish early? */
+        if (len && APR_SUCCESS != (status = apr_file_read_full(in, buf, len, NULL))) {
+            return status;
+        }
+        buf[len] = 0;
 
-    /* dot-atom-text   =   1*atext *("." 1*atext) */
-    if (cur->dot_atom_text) {
-        if (cur->is_dot) {
-            /* no domain */
-            apr_file_printf(ds->err, "argument '%s': address ends with a dot.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1));
+        if (APR_SUCCESS != (status = apr_file_getc(&ch, in))) {
+            return status;
+        }
+
+        if (ch != ',') {
             return APR_EINVAL;
         }
 
+        arg = apr_array_push(args);
+        arg[0] = buf;
     }
 
-    /* dns-atom   =   1*dnstext *("." 1*dnstext) */
-    if (cur->dns_atom) {
-        if (cur->is_dot) {
-            /* no domain */
-            apr_file_printf(ds->err, "argument '%s': address domain ends with a dot.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1));
-            return APR_EINVAL;
-        }
+    return status;
+}
+
+static void device_serve_respond(device_set_t *ds, apr_status_t status)
+{
+    /* valid or incomplete are all ok, as with --complete */
+    apr_file_putc(0, ds->out);
+    apr_file_printf(ds->out, "%d\n",
+            (APR_SUCCESS == status || APR_INCOMPLETE == status) ? 0 : 1);
+    apr_file_flush(ds->out);
+}
+
+/*
+ * Answer completion requests until stdin is closed.
+ *
+ * This saves the shell a fork, exec and option parse for each parameter
+ * it completes. Each request gets a fresh pool and starts with no key.
+ */
+static apr_status_t device_serve(device_set_t *ds)
+{
+    apr_pool_t *pool = ds->pool;
+    apr_file_t *in;
+    apr_status_t status;
 
+    /* requests and responses are small and many, buffer them */
+    if (APR_SUCCESS != (status = apr_file_open_flags_stdin(&in,
+            APR_FOPEN_BUFFERED, pool))
+            || APR_SUCCESS != (status = apr_file_open_flags_stdout(&ds->out,
+                    APR_FOPEN_BUFFERED, pool))) {
+        apr_file_printf(ds->err, "cannot open stdin/stdout: %pm\n", &status);
+        return status;
     }
 
-    /* addr-spec       =   local-part "@" domain */
-    if (cur->addr_spec) {
+    /* errors travel with the response, where the shell ignores them */
+    ds->err = ds->out;
 
-        if (cur->local_part) {
-            /* no at symbol */
-            apr_file_printf(ds->err, "argument '%s': address is missing an '@'.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1));
-            return APR_EINVAL;
-        }
-        else if (cur->is_at) {
-            /* no domain */
-            apr_file_printf(ds->err, "argument '%s': address is missing a domain.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1));
-            return APR_EINVAL;
+    /* let the shell know we are ready */
+    device_serve_respond(ds, APR_SUCCESS);
+
+    while (1) {
+
+        apr_array_header_t *args;
+
+        apr_pool_create(&ds->pool, pool);
+
+        args = apr_array_make(ds->pool, 8, sizeof(const char *));
+
+        if (APR_SUCCESS != (status = device_serve_read(ds, in, args))) {
+
+            apr_pool_destroy(ds->pool);
+            ds->pool = pool;
+
+            if (APR_STATUS_IS_EOF(status)) {
+                return APR_SUCCESS;
+            }
+
+            apr_file_printf(ds->err, "cannot read request: %pm\n", &status);
+            apr_file_flush(ds->err);
+            return status;
         }
+
+        ds->keypath = NULL;
+        ds->keyval = NULL;
+
+        status = device_complete(ds, (const char **)args->elts);
+
+        device_serve_respond(ds, status);
+
+        apr_pool_destroy(ds->pool);
+        ds->pool = pool;
     }
 
-    return APR_SUCCESS;
 }
 
-static apr_status_t device_parse_address_localpart(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
+/*
+ * Default index value is one higher than the highest
+ * current value.
+ */
+static apr_status_t device_default_index(device_set_t *ds, device_pair_t *pair,
+        apr_array_header_t *files)
 {
-    device_address_state_t cur = { 0 };
+    apr_dir_t *thedir;
+    apr_finfo_t dirent;
+
     apr_status_t status;
 
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
-    }
+    apr_int64_t max = 0;
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
+    /* scan the directories to find a match */
+    if ((status = apr_dir_open(&thedir, ".", ds->pool)) != APR_SUCCESS) {
+        /* could not open directory, fail */
+        apr_file_printf(ds->err, "could not open current directory: %pm\n", &status);
+        return status;
     }
-    else if (!arg[0]) {
-        if (option) {
-            option[0] = NULL;
+
+    do {
+
+        status = apr_dir_read(&dirent,
+                APR_FINFO_TYPE | APR_FINFO_NAME | APR_FINFO_WPROT, thedir);
+        if (APR_STATUS_IS_INCOMPLETE(status)) {
+            continue; /* ignore un-stat()able files */
+        } else if (status != APR_SUCCESS) {
+            break;
+        }
+
+        /* hidden files are ignored */
+        if (dirent.name[0] == '.') {
+            continue;
+        }
+
+        switch (dirent.filetype) {
+        case APR_DIR: {
+
+            apr_pool_t *pool;
+            const char *val = NULL;
+            const char *indexname;
+            apr_off_t len;
+            int dirfd = DEVICE_KEYDIR_UNOPENED;
+
+            apr_pool_create(&pool, ds->pool);
+
+            indexname = apr_pstrcat(pool, pair->key, pair->suffix, NULL);
+
+            /* read the index, relative to its option set */
+            status = device_file_readat(ds, pool, pair->key, &dirfd,
+                    dirent.name, indexname, &val, &len);
+
+            device_keydir_close(dirfd);
+
+            if (status != APR_SUCCESS) {
+                apr_pool_destroy(pool);
+                break;
+            }
+            else {
+
+                char *end;
+
+                /* parse index, is it the largest so far? */
+
+                apr_int64_t index = apr_strtoi64(val, &end, 10);
+                if (end[0] || errno == ERANGE) {
+                    apr_file_printf(ds->err, "argument '%s': '%s' is not a valid index, ignoring.\n",
+                            apr_pescape_echo(ds->pool, pair->key, 1),
+                            apr_pescape_echo(ds->pool, val, 1));
+                    /* ignore and loop round */
+                }
+                else if (index > APR_INT64_MAX - pair->ix.gap) {
+                    apr_file_printf(ds->err, "argument '%s': existing index '%s' is too big.\n",
+                            apr_pescape_echo(ds->pool, pair->key, 1),
+                            apr_pescape_echo(ds->pool, val, 1));
+                    return APR_EGENERAL;
+                }
+
+                else if (index >= max) {
+                    max = index + pair->ix.gap;
+                }
+            }
+
+            apr_pool_destroy(pool);
+
+            break;
+        }
+        default:
+            break;
         }
-        return APR_SUCCESS;
-    }
 
-    want_local_part(&cur);
+    } while (1);
 
-    status = device_parse_address_ex(ds, pair, arg, &cur, pair->a.max);
-    if (APR_SUCCESS != status) {
+    apr_dir_close(thedir);
+
+    if (APR_SUCCESS == status) {
+        /* short circuit, all good */
+    }
+    else if (APR_STATUS_IS_ENOENT(status)) {
+        status = APR_SUCCESS;
+    }
+    else {
+        apr_file_printf(ds->err, "cannot read indexes: %pm\n",
+                &status);
         return status;
     }
 
-    if (!cur.local_part) {
-        apr_file_printf(ds->err, "argument '%s': local-part is not valid\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_EINVAL;
-    }
+    device_file_t *file;
 
-    if (option) {
-        option[0] = arg;
-    }
+    file = apr_array_push(files);
+    file->type = APR_REG;
+
+    file->dest = apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL);
+    file->template = apr_pstrcat(ds->pool, file->dest, ".XXXXXX", NULL);
+    file->key = pair->key;
+    file->val = apr_psprintf(ds->pool, "%" APR_INT64_T_FMT, max);
+    file->index = pair->index;
 
     return APR_SUCCESS;
 }
 
-static apr_status_t device_parse_address(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
+/*
+ * Default polar answer is the option given (yes/no).
+ */
+static apr_status_t device_default_polar(device_set_t *ds, device_pair_t *pair,
+        apr_array_header_t *files)
 {
-    device_address_state_t cur = { 0 };
-    apr_status_t status;
+    device_file_t *file;
 
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
-    }
+    file = apr_array_push(files);
+    file->type = APR_REG;
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
-    }
-    else if (!arg[0]) {
-        if (option) {
-            option[0] = NULL;
-        }
-        return APR_SUCCESS;
-    }
+    file->dest = apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL);
+    file->template = apr_pstrcat(ds->pool, file->dest, ".XXXXXX", NULL);
+    file->key = pair->key;
+    file->val = pair->p.polar_default ? "" : NULL;
+    file->index = pair->index;
 
-    want_address(&cur);
+    return APR_SUCCESS;
+}
 
-    status = device_parse_address_ex(ds, pair, arg, &cur, pair->a.max);
-    if (APR_SUCCESS != status) {
-        return status;
-    }
+/*
+ * Default switch is the option given (on/off).
+ */
+static apr_status_t device_default_switch(device_set_t *ds, device_pair_t *pair,
+        apr_array_header_t *files)
+{
+    device_file_t *file;
 
-    if (!cur.address) {
-        apr_file_printf(ds->err, "argument '%s': address is not valid\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_EINVAL;
-    }
+    file = apr_array_push(files);
+    file->type = APR_REG;
 
-    if (option) {
-        option[0] = arg;
-    }
+    file->dest = apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL);
+    file->template = apr_pstrcat(ds->pool, file->dest, ".XXXXXX", NULL);
+    file->key = pair->key;
+    file->val = pair->sw.switch_default ? "" : NULL;
+    file->index = pair->index;
 
     return APR_SUCCESS;
 }
 
-static apr_status_t device_parse_address_mailbox(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
+static apr_status_t device_default(device_set_t *ds, device_pair_t *pair, apr_array_header_t *files)
 {
-    device_address_state_t cur = { 0 };
     apr_status_t status;
 
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
+    switch (pair->type) {
+    case DEVICE_PAIR_INDEX:
+        status = device_default_index(ds, pair, files);
+        break;
+    case DEVICE_PAIR_POLAR:
+        status = device_default_polar(ds, pair, files);
+        break;
+    case DEVICE_PAIR_SWITCH:
+        status = device_default_switch(ds, pair, files);
+        break;
+    default:
+        status = APR_SUCCESS;
     }
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
-    }
-    else if (!arg[0]) {
-        if (option) {
-            option[0] = NULL;
-        }
-        return APR_SUCCESS;
-    }
+    return status;
+}
 
-    want_mailbox(&cur);
+static apr_status_t device_parse(device_set_t *ds, const char *key, const char *val, apr_array_header_t *files)
+{
+    device_file_t *file;
+    device_pair_t *pair;
 
-    status = device_parse_address_ex(ds, pair, arg, &cur, pair->a.max);
-    if (APR_SUCCESS != status) {
-        return status;
-    }
+    apr_status_t status = APR_SUCCESS;
 
-    if (!cur.mailbox) {
-        apr_file_printf(ds->err, "argument '%s': mailbox is not valid\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_EINVAL;
-    }
+    /* look up the parameter */
+    pair = apr_hash_get(ds->pairs, key, APR_HASH_KEY_STRING);
 
-    if (option) {
-        option[0] = arg;
-    }
+    if (pair) {
 
-    return APR_SUCCESS;
-}
+        apr_array_header_t *options = apr_array_make(ds->pool, (10), sizeof(char *));
 
-static apr_status_t device_parse_address_addrspec(device_set_t *ds, device_pair_t *pair,
-        const char *arg, apr_array_header_t *options, const char **option)
-{
-    device_address_state_t cur = { 0 };
-    apr_status_t status;
+        apr_filetype_e type = APR_REG;
+
+        const char *link = NULL;
+
+        switch (pair->type) {
+        case DEVICE_PAIR_INDEX:
+            status = device_parse_index(ds, pair, val, &val, files);
+            break;
+        case DEVICE_PAIR_PORT:
+            status = device_parse_port(ds, pair, val, &val);
+            break;
+        case DEVICE_PAIR_UNPRIVILEGED_PORT:
+            status = device_parse_unprivileged_port(ds, pair, val, &val);
+            break;
+        case DEVICE_PAIR_HOSTNAME:
+            status = device_parse_hostname(ds, pair, val, &val);
+            break;
+        case DEVICE_PAIR_FQDN:
+            status = device_parse_fqdn(ds, pair, val, &val);
+            break;
+        case DEVICE_PAIR_SELECT:
+            status = device_parse_select(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_BYTES:
+            status = device_parse_bytes(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_SYMLINK:
+            status = device_parse_symlink(ds, pair, val, options, &val, &link);
+            type = APR_LNK;
+            break;
+        case DEVICE_PAIR_SQL_IDENTIFIER:
+            status = device_parse_sql_identifier(ds, pair, val, &val);
+            break;
+        case DEVICE_PAIR_SQL_DELIMITED_IDENTIFIER:
+            status = device_parse_sql_delimited_identifier(ds, pair, val,
+                    &val);
+            break;
+        case DEVICE_PAIR_USER:
+            status = device_parse_user(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_DISTINGUISHED_NAME:
+            status = device_parse_distinguished_name(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_RELATION:
+            status = device_parse_relation(ds, pair, val, options, &val, &link);
+            type = APR_LNK;
+            break;
+        case DEVICE_PAIR_POLAR:
+            status = device_parse_polar(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_SWITCH:
+            status = device_parse_switch(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_INTEGER:
+            status = device_parse_integer(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_HEX:
+            status = device_parse_hex(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_TEXT:
+            status = device_parse_text(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_URL_PATH:
+            status = device_parse_url_path(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_URL_PATH_ABEMPTY:
+            status = device_parse_url_path_abempty(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_URL_PATH_ABSOLUTE:
+            status = device_parse_url_path_absolute(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_URL_PATH_NOSCHEME:
+            status = device_parse_url_path_noscheme(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_URL_PATH_ROOTLESS:
+            status = device_parse_url_path_rootless(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_URL_PATH_EMPTY:
+            status = device_parse_url_path_empty(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_URI:
+            status = device_parse_uri(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_URI_ABSOLUTE:
+            status = device_parse_uri_absolute(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_URI_RELATIVE:
+            status = device_parse_uri_relative(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_ADDRESS:
+            status = device_parse_address(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_ADDRESS_MAILBOX:
+            status = device_parse_address_mailbox(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_ADDRESS_ADDRSPEC:
+            status = device_parse_address_addrspec(ds, pair, val, options, &val);
+            break;
+        case DEVICE_PAIR_ADDRESS_LOCALPART:
+            status = device_parse_address_localpart(ds, pair, val, options, &val);
+            break;
+        }
 
-    if (!arg) {
-        apr_file_printf(ds->err, "argument '%s': is empty.\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_INCOMPLETE;
-    }
+        file = apr_array_push(files);
+        file->type = type;
 
-    if (pair->optional == DEVICE_IS_REQUIRED && !arg[0]) {
-        apr_file_printf(ds->err, "'%s' is required\n", pair->key);
-        return APR_EGENERAL;
-    }
-    else if (!arg[0]) {
-        if (option) {
-            option[0] = NULL;
+        file->dest = apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL);
+        file->template = apr_pstrcat(ds->pool, file->dest, ".XXXXXX", NULL);
+        file->key = key;
+        file->val = val;
+        file->link = link;
+        file->index = pair->index;
+
+        if (APR_SUCCESS != status) {
+            return status;
         }
-        return APR_SUCCESS;
-    }
 
-    want_addr_spec(&cur);
+        pair->set = DEVICE_IS_SET;
 
-    status = device_parse_address_ex(ds, pair, arg, &cur, pair->a.max);
-    if (APR_SUCCESS != status) {
-        return status;
-    }
+        if (pair->unique == DEVICE_IS_UNIQUE) {
 
-    if (!cur.addr_spec) {
-        apr_file_printf(ds->err, "argument '%s': address is not valid\n",
-                apr_pescape_echo(ds->pool, pair->key, 1));
-        return APR_EINVAL;
-    }
+            /* index must be unique */
 
-    if (option) {
-        option[0] = arg;
-    }
+            int exact = 0, i;
 
-    return APR_SUCCESS;
-}
+            apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
 
-static apr_status_t device_get(device_set_t *ds, const char *arg,
-        apr_array_header_t *options, const char **option, const char **path,
-        int *exact)
-{
+            status = device_get(ds, val, options, NULL, NULL, &exact);
 
-    apr_dir_t *thedir;
-    apr_finfo_t dirent;
+            if (APR_SUCCESS != status) {
+                return status;
+            }
 
-    apr_array_header_t *possibles = apr_array_make(ds->pool, 10, sizeof(char *));
+            /* or taken by an earlier request of the transaction */
+            for (i = 0; !exact && ds->renames && i < ds->renames->nelts; i++) {
+                device_rename_t *move = &APR_ARRAY_IDX(ds->renames, i,
+                        device_rename_t);
 
-    apr_status_t status;
+                exact = (move->to && val && !strcmp(move->to, val));
+            }
 
-    apr_size_t arglen = strlen(arg);
+            if (exact) {
+                apr_file_printf(ds->err, "%s already exists.\n", ds->key);
+                return APR_EINVAL;
+            }
 
-    device_pair_t *pair;
+        }
 
-    pair = apr_hash_get(ds->pairs, ds->key, APR_HASH_KEY_STRING);
+        if (pair->optional == DEVICE_IS_REQUIRED && !file->val) {
+            apr_file_printf(ds->err, "'%s' is required, and cannot be unset.\n",
+                    apr_pescape_echo(ds->pool, key, 1));
+            return APR_EINVAL;
+        }
 
-    if (!pair) {
-        apr_file_printf(ds->err, "key '%s' is not recognised.\n",
-                apr_pescape_echo(ds->pool, ds->key, 1));
+    }
+    else {
+        // FIXME: add option for an "overflow" of unknown arguments
+        apr_file_printf(ds->err, "argument '%s' is not recognised.\n",
+                apr_pescape_echo(ds->pool, key, 1));
         return APR_EINVAL;
     }
 
-    /* scan the directories to find a match */
-    if ((status = apr_dir_open(&thedir, ".", ds->pool)) != APR_SUCCESS) {
-        /* could not open directory, fail */
-        apr_file_printf(ds->err, "could not open current directory: %pm\n", &status);
-        return status;
-    }
+    return status;
+}
 
-    do {
-        const char **possible;
+static apr_status_t device_add(device_set_t *ds, const char **args)
+{
+    const char *key = NULL, *val = NULL;
+    apr_status_t status = APR_SUCCESS;
+    int len;
 
-        status = apr_dir_read(&dirent,
-                APR_FINFO_TYPE | APR_FINFO_NAME | APR_FINFO_WPROT, thedir);
-        if (APR_STATUS_IS_INCOMPLETE(status)) {
-            continue; /* ignore un-stat()able files */
-        } else if (status != APR_SUCCESS) {
-            break;
-        }
+    for (len = 0; args && args[len]; len++);
 
-        /* hidden files are ignored */
-        if (dirent.name[0] == '.') {
-            continue;
-        }
+    apr_array_header_t *files = apr_array_make(ds->pool, len, sizeof(device_file_t));
 
-        switch (dirent.filetype) {
-        case APR_DIR: {
+    while (args && *args) {
 
-            apr_pool_t *pool;
-            const char *name = NULL;
-            apr_finfo_t finfo;
-            const char *keyname;
-            const char *relname;
-            char *keypath;
-            char *relpath;
-            apr_off_t len;
+        const char *arg = *(args++);
 
-            apr_pool_create(&pool, ds->pool);
+        if (!key) {
+            key = arg;
+            continue;
+        }
+        else {
+            val = arg;
+        }
 
-            switch (pair->type) {
+        status = device_parse(ds, key, val, files);
 
-            case DEVICE_PAIR_INDEX:
-            case DEVICE_PAIR_PORT:
-            case DEVICE_PAIR_UNPRIVILEGED_PORT:
-            case DEVICE_PAIR_HOSTNAME:
-            case DEVICE_PAIR_FQDN:
-            case DEVICE_PAIR_SELECT:
-            case DEVICE_PAIR_BYTES:
-            case DEVICE_PAIR_SQL_IDENTIFIER:
-            case DEVICE_PAIR_SQL_DELIMITED_IDENTIFIER:
-            case DEVICE_PAIR_USER:
-            case DEVICE_PAIR_DISTINGUISHED_NAME:
-            case DEVICE_PAIR_POLAR:
-            case DEVICE_PAIR_SWITCH:
-            case DEVICE_PAIR_INTEGER:
-            case DEVICE_PAIR_TEXT:
-            case DEVICE_PAIR_URL_PATH:
-            case DEVICE_PAIR_URL_PATH_ABEMPTY:
-            case DEVICE_PAIR_URL_PATH_ABSOLUTE:
-            case DEVICE_PAIR_URL_PATH_NOSCHEME:
-            case DEVICE_PAIR_URL_PATH_ROOTLESS:
-            case DEVICE_PAIR_URL_PATH_EMPTY:
-            case DEVICE_PAIR_ADDRESS:
-            case DEVICE_PAIR_ADDRESS_LOCALPART:
-            case DEVICE_PAIR_ADDRESS_MAILBOX:
-            case DEVICE_PAIR_ADDRESS_ADDRSPEC:
+        if (APR_SUCCESS != status) {
+            break;
+        }
 
-                keyname = apr_pstrcat(pool, pair->key, pair->suffix, NULL);
-                if (APR_SUCCESS
-                        != (status = apr_filepath_merge(&keypath, dirent.name,
-                                keyname, APR_FILEPATH_NOTABSOLUTE, pool))) {
-                    apr_file_printf(ds->err, "cannot merge option set key '%s': %pm\n", pair->key,
-                            &status);
-                }
+        key = NULL;
+        val = NULL;
+    }
 
-                /* open/seek/read the key */
-                else if (APR_SUCCESS
-                        != (status = device_file_read(ds, pool, pair->key, keypath,
-                                &name, &len))) {
-                    /* error already handled */
-                }
+    if (key && !val) {
+        apr_file_printf(ds->err, "argument '%s' has no corresponding value.\n",
+                apr_pescape_echo(ds->pool, key, 1));
+        return APR_EINVAL;
+    }
 
-                break;
+    if (APR_SUCCESS == status) {
 
-            case DEVICE_PAIR_SYMLINK:
+        apr_hash_index_t *hi;
+        void *v;
+        device_pair_t *pair;
 
-                keyname = apr_pstrcat(pool, pair->key, pair->suffix, NULL);
-                if (APR_SUCCESS
-                        != (status = apr_filepath_merge(&keypath, dirent.name,
-                                keyname, APR_FILEPATH_NOTABSOLUTE, pool))) {
-                    apr_file_printf(ds->err, "cannot merge option set key '%s': %pm\n", pair->key,
-                            &status);
-                }
+        /* check for required options that remain unset */
 
-                /* stat the key */
-                else if (APR_SUCCESS
-                        != (status = apr_stat(&finfo, keypath, APR_FINFO_LINK | APR_FINFO_TYPE | APR_FINFO_NAME,
-                                pool))) {
-                    apr_file_printf(ds->err, "cannot stat option set '%s': %pm\n", pair->key,
-                            &status);
-                }
+        for (hi = apr_hash_first(ds->pool, ds->pairs); hi; hi = apr_hash_next(hi)) {
 
-                else {
+            apr_hash_this(hi, NULL, NULL, &v);
+            pair = v;
 
-                    int size = strlen(finfo.name);
+            if (pair->set != DEVICE_IS_SET) {
 
-                    if (size >= pair->s.symlink_suffix_len) {
-                        name = apr_pstrndup(ds->pool, finfo.name, size - pair->s.symlink_suffix_len);
-                    }
-                    else {
-                        apr_file_printf(ds->err, "option set '%s' does not have suffix: %s\n", pair->key,
-                                pair->s.symlink_suffix);
-                        status = APR_EGENERAL;
-                    }
+                status = device_default(ds, pair, files);
 
+                if (APR_SUCCESS != status) {
+                    return status;
                 }
 
-                break;
+                if (pair->optional == DEVICE_IS_REQUIRED
+                        && pair->set == DEVICE_IS_UNSET) {
+                    apr_file_printf(ds->err, "'%s' is required.\n",
+                            apr_pescape_echo(ds->pool, pair->key, 1));
+                    return APR_EINVAL;
+                }
 
-            case DEVICE_PAIR_RELATION:
+            }
 
-                keyname = apr_pstrcat(pool, pair->key, pair->suffix, NULL);
-                relname = apr_pstrcat(pool, pair->r.relation_name,
-                        pair->r.relation_suffix, NULL);
-                if (APR_SUCCESS
-                        != (status = apr_filepath_merge(&keypath, dirent.name,
-                                keyname, APR_FILEPATH_NOTABSOLUTE, pool))) {
-                    apr_file_printf(ds->err, "cannot merge option set key '%s' (base): %pm\n", pair->key,
-                            &status);
-                }
+        }
 
-                /* find relation */
-                else if (APR_SUCCESS
-                        != (status = apr_filepath_merge(&relpath, keypath,
-                                relname, APR_FILEPATH_NOTABSOLUTE, pool))) {
-                    apr_file_printf(ds->err, "cannot merge option set key '%s' (name): %pm\n", pair->key,
-                            &status);
-                }
-                else if (pair->r.relation_prefix && APR_SUCCESS
-                        != (status = apr_filepath_merge(&relpath, relpath,
-                                pair->r.relation_prefix, APR_FILEPATH_NOTABSOLUTE, pool))) {
-                    apr_file_printf(ds->err, "cannot merge option set key '%s' (name): %pm\n", pair->key,
-                            &status);
-                }
+        status = device_files(ds, files);
+    }
 
-                /* open/seek/read the key */
-                else if (APR_SUCCESS
-                        != (status = device_file_read(ds, pool, pair->key, relpath,
-                                &name, &len))) {
-                    /* error already handled */
-                }
+    return status;
+}
 
-                break;
+static apr_status_t device_set(device_set_t *ds, const char **args)
+{
+    const char *key = NULL, *val = NULL;
+    apr_status_t status = APR_SUCCESS;
+    int len;
 
-            case DEVICE_PAIR_HEX:
-            case DEVICE_PAIR_URI:
-            case DEVICE_PAIR_URI_ABSOLUTE:
-            case DEVICE_PAIR_URI_RELATIVE:
-                /* support me */
-                apr_pool_destroy(pool);
-                continue;
-            }
+    for (len = 0; args && args[len]; len++);
 
-            if (status != APR_SUCCESS) {
-                apr_pool_destroy(pool);
-                continue;
-            }
+    apr_array_header_t *files = apr_array_make(ds->pool, len, sizeof(device_file_t));
 
-            int ex = (0 == strcmp(arg, name));
+    if (ds->key) {
 
-            possible = apr_array_push(possibles);
-            *possible = apr_pstrdup(ds->pool, name);
+        if (!args[0] || !args[1]) {
+            apr_file_printf(ds->err, "%s is required.\n", ds->key);
+            return APR_EINVAL;
+        }
+        else {
 
-            if (!strncmp(arg, name, arglen)) {
+            int exact = 0;
 
-                const char **opt;
+            apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
 
-                if (ex) {
-                    apr_array_clear(options);
-                }
+            status = device_get(ds, args[0], options, &ds->keyval, &ds->keypath, &exact);
 
-                opt = apr_array_push(options);
-                opt[0] = apr_pstrcat(ds->pool, "*",
-                        device_pescape_shell(ds->pool, name), " ",
-                        NULL);
+            if (APR_SUCCESS != status) {
+                return status;
+            }
 
-                if (option) {
-                    *option = *possible;
-                }
-                if (path) {
-                    *path = apr_pstrdup(ds->pool, dirent.name);
-                }
-                if (exact) {
-                    *exact = ex;
-                }
+            if (!exact) {
+                apr_file_printf(ds->err, "%s was not found.\n", args[0]);
+                return APR_EINVAL;
             }
+        }
+
+        args += 2;
+    }
 
-            apr_pool_destroy(pool);
+    while (args && *args) {
 
-            if (ex) {
-                /* exact matches short circuit */
-                goto done;
-            }
+        const char *arg = *(args++);
 
-            break;
+        if (!key) {
+            key = arg;
+            continue;
         }
-        default:
-            break;
+        else {
+            val = arg;
         }
 
-    } while (1);
+        if (ds->mode != DEVICE_RENAME && ds->key && !strcmp(key, ds->key)) {
+            apr_file_printf(ds->err, "'%s' cannot be modified.\n",
+                    apr_pescape_echo(ds->pool, key, 1));
+            return APR_EINVAL;
+        }
 
-done:
+        status = device_parse(ds, key, val, files);
 
-    apr_dir_close(thedir);
+        if (APR_SUCCESS != status) {
+            break;
+        }
 
-    if (APR_SUCCESS == status) {
-        /* short circuit, all good */
+        key = NULL;
+        val = NULL;
     }
-    else if (APR_STATUS_IS_ENOENT(status)) {
-
-        if (option) {
-            if (options->nelts == 1) {
-                /* all ok */
-            }
-            else {
-                device_error_possibles(ds, arg, possibles);
-
-                return APR_INCOMPLETE;
-            }
-        }
 
-        status = APR_SUCCESS;
+    if (key && !val) {
+        apr_file_printf(ds->err, "argument '%s' has no corresponding value.\n",
+                apr_pescape_echo(ds->pool, key, 1));
+        return APR_EINVAL;
     }
-    else {
-        apr_file_printf(ds->err, "cannot read option '%s': %pm\n",
-                apr_pescape_echo(ds->pool, arg, 1), &status);
+
+    if (APR_SUCCESS == status) {
+        status = device_files(ds, files);
     }
 
-    return APR_SUCCESS;
+    return status;
 }
 
-static apr_status_t device_files(device_set_t *ds, apr_array_header_t *files)
+static apr_status_t device_rename(device_set_t *ds, const char **args)
 {
-    apr_file_t *out;
 
-    char *pwd;
-    const char *keypath = NULL, *keyval = NULL;
-    apr_status_t status = APR_SUCCESS;
-    int i;
+    return device_set(ds, args);
+}
 
-    /* save the present working directory */
-    status = apr_filepath_get(&pwd, APR_FILEPATH_NATIVE, ds->pool);
+static apr_status_t device_value(device_set_t *ds, device_pair_t *pair,
+        const char *keypath, int *dirfd, apr_array_header_t *values,
+        const char **keyval, apr_int64_t *order, int *max)
+{
+    device_value_t *value;
+    const char *val = NULL;
+    apr_off_t len = 0;
 
-    if (APR_SUCCESS != status) {
-        apr_file_printf(ds->err, "cannot access cwd: %pm\n", &status);
-        return status;
-    }
+    apr_status_t status;
 
-    if (ds->mode == DEVICE_ADD) {
+    switch (pair->type) {
+    case DEVICE_PAIR_PORT:
+    case DEVICE_PAIR_UNPRIVILEGED_PORT:
+    case DEVICE_PAIR_HOSTNAME:
+    case DEVICE_PAIR_FQDN:
+    case DEVICE_PAIR_SELECT:
+    case DEVICE_PAIR_BYTES:
+    case DEVICE_PAIR_SQL_IDENTIFIER:
+    case DEVICE_PAIR_SQL_DELIMITED_IDENTIFIER:
+    case DEVICE_PAIR_USER:
+    case DEVICE_PAIR_DISTINGUISHED_NAME:
+    case DEVICE_PAIR_INTEGER:
+    case DEVICE_PAIR_TEXT:
+    case DEVICE_PAIR_HEX:
+    case DEVICE_PAIR_URL_PATH:
+    case DEVICE_PAIR_URL_PATH_ABEMPTY:
+    case DEVICE_PAIR_URL_PATH_ABSOLUTE:
+    case DEVICE_PAIR_URL_PATH_NOSCHEME:
+    case DEVICE_PAIR_URL_PATH_ROOTLESS:
+    case DEVICE_PAIR_URL_PATH_EMPTY:
+    case DEVICE_PAIR_URI:
+    case DEVICE_PAIR_URI_ABSOLUTE:
+    case DEVICE_PAIR_URI_RELATIVE:
+    case DEVICE_PAIR_ADDRESS:
+    case DEVICE_PAIR_ADDRESS_LOCALPART:
+    case DEVICE_PAIR_ADDRESS_MAILBOX:
+    case DEVICE_PAIR_ADDRESS_ADDRSPEC: {
 
-        /* try the directory create */
-        if (ds->key) {
+        const char *keyname;
+        struct stat st;
 
-            apr_uuid_t uuid;
-            char ustr[APR_UUID_FORMATTED_LENGTH + 1];
+        keyname = apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL);
 
-            /* test for uniqueness */
+        /* stat the file */
+        status = device_file_lookupat(ds, keypath, dirfd, keyname, 0, &st);
+        if (APR_ENOENT == status) {
+            /* missing - ignore the file */
 
-            apr_uuid_get(&uuid);
-            apr_uuid_format(ustr, &uuid);
+            /* FIXME: the none/default option goes here */
 
-            keypath = ustr;
+            break;
+        } else if (APR_SUCCESS != status) {
+            apr_file_printf(ds->err, "cannot stat option set '%s': %pm\n",
+                    pair->key, &status);
+            break;
+        }
 
-            if (APR_SUCCESS != (status = apr_dir_make(keypath,
-                    APR_FPROT_OS_DEFAULT, ds->pool))) {
-                apr_file_printf(ds->err, "cannot create '%s': %pm\n", ds->key, &status);
-                return status;
-            }
+        /* open/seek/read the file */
+        if (APR_SUCCESS
+                != (status = device_file_readat(ds, ds->pool, pair->key, dirfd,
+                        keypath, keyname, &val, &len))) {
+            /* error already handled */
+            break;
+        }
 
-            /* change current working directory */
-            status = apr_filepath_set(ustr, ds->pool);
-            if (APR_SUCCESS != status) {
-                apr_file_printf(ds->err, "cannot access '%s' (chdir): %pm\n", ds->key, &status);
-                return status;
-            }
-            else if (APR_SUCCESS
-                != (status = apr_file_open(&out, DEVICE_ADD_MARKER, APR_FOPEN_CREATE | APR_FOPEN_WRITE,
-                    APR_FPROT_OS_DEFAULT, ds->pool))) {
-                apr_file_printf(ds->err, "cannot create add mark '%s': %pm\n", ds->key,
-                    &status);
-                return status;
-            }
-            else if (APR_SUCCESS != (status = apr_file_close(out))) {
-                apr_file_printf(ds->err, "cannot close add mark '%s': %pm\n", ds->key, &status);
-                return status;
-            }
-            else if (APR_SUCCESS
-                    != (status = apr_file_perms_set(DEVICE_ADD_MARKER,
-                            APR_FPROT_OS_DEFAULT & ~DEVICE_FILE_UMASK))) {
-                apr_file_printf(ds->err, "cannot set permissions to add mark '%s': %pm\n",
-                        ds->key, &status);
-                return status;
-            }
+        value = apr_array_push(values);
+        value->pair = pair;
+        value->value = val;
+        value->len = len;
+        value->set = 1;
 
-        }
-        else {
-            apr_file_printf(ds->err, "option is unset\n");
-            return APR_EGENERAL;
-        }
+        max[0] = max[0] > value->len ? max[0] : value->len;
 
+        break;
     }
-    else if (ds->mode == DEVICE_REINDEX) {
+    case DEVICE_PAIR_POLAR:
+    case DEVICE_PAIR_SWITCH: {
 
-        /* no preparation needed */
+        const char *keyname;
+        struct stat st;
 
-    }
-    else {
+        keyname = apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL);
 
-        if (ds->key) {
+        /* stat the file */
+        status = device_file_lookupat(ds, keypath, dirfd, keyname, 0, &st);
+        if (APR_ENOENT == status) {
 
-            /* change current working directory */
-            status = apr_filepath_set(ds->keypath, ds->pool);
+            value = apr_array_push(values);
+            value->pair = pair;
 
-            if (APR_SUCCESS != status) {
-                apr_file_printf(ds->err, "cannot access '%s': %pm\n", ds->key, &status);
-                return status;
-            }
+            switch (pair->type) {
+            case DEVICE_PAIR_POLAR:
 
-        }
+                value->value = "no";
+                value->len = strlen("no");
 
-        /* try to mark updated file */
-        if (APR_SUCCESS
-                != (status = apr_file_open(&out, DEVICE_SET_MARKER,
-                        APR_FOPEN_CREATE | APR_FOPEN_WRITE,
-                        APR_FPROT_OS_DEFAULT, ds->pool))) {
-            apr_file_printf(ds->err, "cannot create set mark '%s': %pm\n", ds->key,
-                    &status);
-            return status;
-        } else if (APR_SUCCESS != (status = apr_file_close(out))) {
-            apr_file_printf(ds->err, "cannot close set mark '%s': %pm\n", ds->key,
-                    &status);
-            return status;
-        } else if (APR_SUCCESS != (status = apr_file_perms_set(DEVICE_SET_MARKER,
-                APR_FPROT_OS_DEFAULT & ~DEVICE_FILE_UMASK))) {
-            apr_file_printf(ds->err, "cannot set permissions to set mark '%s': %pm\n",
-                    ds->key, &status);
-            return status;
-        }
+                break;
+            case DEVICE_PAIR_SWITCH:
 
-    }
+                value->value = "off";
+                value->len = strlen("off");
 
-    /* try to write */
-    for (i = 0; i < files->nelts; i++)
-    {
-        apr_file_t *out;
+                break;
+            default:
+                break;
+            }
 
-        device_file_t *file = &APR_ARRAY_IDX(files, i, device_file_t);
+            max[0] = max[0] > value->len ? max[0] : value->len;
 
-        /* move away the original */
-        file->backup = apr_psprintf(ds->pool, "%s.backup", file->dest);
-        if (APR_SUCCESS
-                != (status = apr_file_rename(file->dest, file->backup, ds->pool))
-                && !APR_STATUS_IS_ENOENT(status)) {
-            apr_file_printf(ds->err, "cannot move '%s': %pm\n", file->key, &status);
-            break;
-        }
+        } else if (APR_SUCCESS == (status)) {
 
-        if (!file->val) {
+            value = apr_array_push(values);
+            value->pair = pair;
 
-            /* no value, write nothing */
+            switch (pair->type) {
+            case DEVICE_PAIR_POLAR:
 
-        }
-        else if (file->type == APR_REG) {
+                value->value = "yes";
+                value->len = strlen("yes");
+                value->set = 1;
 
-            /* write the result */
-            if (APR_SUCCESS
-                    != (status = apr_file_mktemp(&out, file->template,
-                            APR_FOPEN_CREATE | APR_FOPEN_WRITE | APR_FOPEN_EXCL,
-                            ds->pool))) {
-                apr_file_printf(ds->err, "cannot save '%s': %pm\n", file->key, &status);
                 break;
-            }
-            else if (APR_SUCCESS
-                    != (status = apr_file_write_full(out, file->val, strlen(file->val),
-                            NULL))) {
-                apr_file_printf(ds->err, "cannot write '%s': %pm\n", file->key, &status);
-                break;
-            }
-            else if (APR_SUCCESS != (status = apr_file_close(out))) {
-                apr_file_printf(ds->err, "cannot close '%s': %pm\n", file->key, &status);
+            case DEVICE_PAIR_SWITCH:
+
+                value->value = "on";
+                value->len = strlen("on");
+                value->set = 1;
+
                 break;
-            }
-            else if (APR_SUCCESS
-                    != (status = apr_file_perms_set(file->template,
-                            APR_FPROT_OS_DEFAULT & ~DEVICE_FILE_UMASK))) {
-                apr_file_printf(ds->err, "cannot set permissions on '%s': %pm\n",
-                        file->key, &status);
+            default:
                 break;
             }
+
+            max[0] = max[0] > value->len ? max[0] : value->len;
+
+        } else {
+            apr_file_printf(ds->err, "cannot stat option set '%s': %pm\n",
+                    pair->key, &status);
+            break;
         }
-        else if (file->type == APR_LNK) {
 
-            /* APR needs a mktemp function that can do symlinks */
-            pid_t pid = getpid();
-            file->template = apr_psprintf(ds->pool, "%s;%" APR_PID_T_FMT, file->dest, pid);
+        break;
+    }
+    case DEVICE_PAIR_INDEX: {
+
+        const char *keyname;
+        struct stat st;
+        char *end;
+
+        if (!order) {
+            status = APR_ENOENT;
+            break;
+        }
+
+        keyname = apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL);
+
+        /* stat the file */
+        status = device_file_lookupat(ds, keypath, dirfd, keyname, 0, &st);
+        if (APR_ENOENT == status) {
+            /* missing - ignore the file */
+            break;
+        } else if (APR_SUCCESS != status) {
+            apr_file_printf(ds->err, "cannot stat option set '%s': %pm\n",
+                    pair->key, &status);
+            break;
+        }
 
-            errno = 0;
-            if (symlink(file->link, file->template) && APR_SUCCESS != (status = errno)) {
-                apr_file_printf(ds->err, "cannot link '%s': %pm\n", file->key, &status);
-                break;
-            }
+        /* open/seek/read the file */
+        if (APR_SUCCESS
+                != (status = device_file_readat(ds, ds->pool, pair->key, dirfd,
+                        keypath, keyname, &val, &len))) {
+            /* error already handled */
+            break;
         }
 
-        if (file->index == DEVICE_IS_INDEXED) {
-            keyval = file->val;
+        order[0] = apr_strtoi64(val, &end, 10);
+        status = apr_get_os_error();
+        if (end[0] || status == APR_ERANGE) {
+            apr_file_printf(ds->err,
+                    "argument '%s': '%s' is not a valid index, ignoring.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1),
+                    apr_pescape_echo(ds->pool, val, 1));
+            /* ignore and loop round */
+            break;
         }
 
-    }
+        value = apr_array_push(values);
+        value->pair = pair;
+        value->value = val;
+        value->len = len;
+        value->set = 1;
 
-    /* could not write, try to rollback */
-    if (APR_SUCCESS != status && !APR_STATUS_IS_ENOENT(status)) {
+        max[0] = max[0] > value->len ? max[0] : value->len;
 
-        for (i = 0; i < files->nelts; i++) {
+        break;
+    }
+    case DEVICE_PAIR_SYMLINK: {
 
-            apr_status_t status; /* intentional shadowing of status */
+        const char *keyname;
+        struct stat st;
+        char target[PATH_MAX];
+        apr_ssize_t size;
 
-            device_file_t *file = &APR_ARRAY_IDX(files, i, device_file_t);
+        keyname = apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL);
 
-            if (file->backup && APR_SUCCESS
-                    != (status = apr_file_rename(file->backup, file->dest, ds->pool))
-                    && !APR_STATUS_IS_ENOENT(status)) {
-                apr_file_printf(ds->err, "cannot move '%s': %pm\n", file->key, &status);
-            }
+        /* stat the link */
+        status = device_file_lookupat(ds, keypath, dirfd, keyname, AT_SYMLINK_NOFOLLOW, &st);
+        if (APR_ENOENT == status) {
+            /* missing - ignore the file */
+            status = APR_SUCCESS;
 
-            if (APR_SUCCESS != (status = apr_file_remove(file->template, ds->pool))
-                    && !APR_STATUS_IS_ENOENT(status)) {
-                apr_file_printf(ds->err, "cannot remove '%s': %pm\n", file->key, &status);
-            }
+            value = apr_array_push(values);
+            value->pair = pair;
 
-        }
+            switch (pair->optional) {
+            case DEVICE_IS_OPTIONAL:
 
-        /* remove the added/updated markers here */
-        if (ds->mode == DEVICE_ADD && APR_SUCCESS !=
-                (status = apr_file_remove(DEVICE_ADD_MARKER, ds->pool))
-                && !APR_STATUS_IS_ENOENT(status)) {
-            apr_file_printf(ds->err, "cannot remove add mark: %pm\n", &status);
-        }
-        if (ds->mode == DEVICE_SET && APR_SUCCESS !=
-                (status = apr_file_remove(DEVICE_SET_MARKER, ds->pool))
-                && !APR_STATUS_IS_ENOENT(status)) {
-            apr_file_printf(ds->err, "cannot remove set mark: %pm\n", &status);
-        }
+                if (pair->unset) {
+                    value->len = strlen(pair->unset);
+                    value->value = pair->unset;
+                }
+                else {
+                    value->len = strlen(DEVICE_SYMLINK_NONE);
+                    value->value = DEVICE_SYMLINK_NONE;
+                }
 
-        if (ds->key) {
+                break;
+            case DEVICE_IS_REQUIRED:
 
-            /* revert to present working directory */
-            status = apr_filepath_set(pwd, ds->pool);
-            if (APR_SUCCESS != status) {
-                apr_file_printf(ds->err, "cannot revert '%s': %pm\n", ds->key, &status);
-                return status;
-            }
+                value->len = strlen(DEVICE_SYMLINK_ERROR);
+                value->value = DEVICE_SYMLINK_ERROR;
 
-            if (ds->mode == DEVICE_ADD) {
-                if (APR_SUCCESS != (status = apr_dir_remove(keypath, ds->pool))) {
-                    apr_file_printf(ds->err, "cannot remove '%s': %pm\n", ds->key, &status);
-                    return status;
-                }
+                break;
             }
-            else {
 
-                /* implement the undo of the reindex here */
+            max[0] = max[0] > value->len ? max[0] : value->len;
 
-            }
+            break;
+        } else if (APR_SUCCESS == status && !S_ISLNK(st.st_mode)) {
+            apr_file_printf(ds->err,
+                    "option set '%s': link expected, ignoring\n", pair->key);
+            break;
+        } else if (APR_SUCCESS != status) {
+            apr_file_printf(ds->err, "cannot stat option set '%s': %pm\n",
+                    pair->key, &status);
+            break;
         }
 
-        return status;
-    }
+        /* stat the key */
+        if ((size = readlinkat(device_keydir_get(keypath, dirfd), keyname,
+                target, sizeof(target))) < 0) {
+            status = apr_get_os_error();
+            apr_file_printf(ds->err, "cannot readlink option set '%s': %pm\n",
+                    pair->key, &status);
+        }
 
-    /* otherwise do the renames */
-    else {
+        else {
 
-        for (i = 0; i < files->nelts; i++) {
+            const char *val;
 
-            device_file_t *file = &APR_ARRAY_IDX(files, i, device_file_t);
+            int i;
+            int found = 0;
 
-            if (file->template && APR_SUCCESS != (status = apr_file_rename(file->template, file->dest, ds->pool))
-                    && !APR_STATUS_IS_ENOENT(status)) {
-                apr_file_printf(ds->err, "cannot move '%s': %pm\n", file->key, &status);
-            }
+            /* match the base path */
+            for (i = 0; i < pair->s.bases->nelts; i++) {
 
-            if (file->backup && APR_SUCCESS != (status = apr_file_remove(file->backup, ds->pool))
-                    && !APR_STATUS_IS_ENOENT(status)) {
-                apr_file_printf(ds->err, "cannot remove '%s': %pm\n", file->key, &status);
-            }
+                char *base = APR_ARRAY_IDX(pair->s.bases, i, char *);
 
-            if (file->index == DEVICE_IS_INDEXED) {
+                int baselen = strlen(base);
 
-            }
-        }
+                /* ignore trailing '/' if it exists */
+                if (baselen && base[baselen - 1] == '/') {
+                    baselen--;
+                }
 
-        /* revert to present working directory */
-        status = apr_filepath_set(pwd, ds->pool);
-        if (APR_SUCCESS != status) {
-            apr_file_printf(ds->err, "cannot create index (cwd): %pm\n", &status);
-            return status;
-        }
+                /* do we have a prefix match? */
+                if (baselen <= size && !strncmp(base, target, baselen)) {
 
-        /* too late to back out */
-        if (ds->keyval && keyval) {
-            apr_file_rename(ds->keyval, keyval, ds->pool);
-        }
+                    val = target + baselen;
+                    size = size - baselen;
 
-        else if (keypath && keyval) {
-            apr_file_remove(keyval, ds->pool);
-            if (symlink(keypath, keyval)) {
-                /* silently ignore any errors */
-            }
-        }
+                    /* do we have exact match or a '/' at the end? */
+                    if (!size || val[0] == '/') {
+                        found = 1;
+                        break;
+                    }
 
-        return APR_SUCCESS;
-    }
+                }
 
-}
+            }
 
-static apr_status_t device_command(device_set_t *ds, apr_array_header_t *files)
-{
+            /* oops, no base path matches */
+            if (!found) {
+                apr_file_printf(ds->err,
+                        "option set '%s' does not exist beneath bases.\n", pair->key);
+                status = APR_EGENERAL;
+            }
 
-    apr_procattr_t *procattr;
-    apr_proc_t *proc;
+            if (!pair->s.symlink_recursive && size && val[0] == '/') {
 
-    apr_status_t status = APR_SUCCESS;
-    int i, j;
-    int exitcode = 0;
-    apr_exit_why_e exitwhy = 0;
+                /* skip past '/' */
+                val++;
+                size--;
 
-    if (ds->key) {
+            }
 
-        char *var = apr_pstrcat(ds->pool, "DEVICE_", ds->key, NULL);
+            if (size >= pair->s.symlink_suffix_len) {
 
-        for (j = 7; var && var[j]; j++) {
-            var[j] = apr_toupper(var[j]);
-        }
+                apr_ssize_t len = size - pair->s.symlink_suffix_len;
+                val = apr_pstrndup(ds->pool, val, len);
 
-        apr_env_set(var, ds->keyval, ds->pool);
+                value = apr_array_push(values);
+                value->pair = pair;
+                value->value = val;
+                value->len = strlen(val);
+                value->set = 1;
 
-        /* change current working directory */
-        status = apr_filepath_set(ds->keypath, ds->pool);
+                max[0] = max[0] > value->len ? max[0] : value->len;
+
+            } else {
+                apr_file_printf(ds->err,
+                        "option set '%s' does not have suffix: %s\n", pair->key,
+                        pair->s.symlink_suffix);
+                status = APR_EGENERAL;
+            }
 
-        if (APR_SUCCESS != status) {
-            apr_file_printf(ds->err, "cannot access '%s': %pm\n", ds->key, &status);
-            return status;
         }
 
+        break;
 
     }
+    case DEVICE_PAIR_RELATION: {
 
+        const char *keyname;
+        const char *relname;
+        const char *relpath;
+        struct stat st;
 
-    /* set up environment */
-    for (i = 0; i < files->nelts; i++)
-    {
-        device_file_t *file = &APR_ARRAY_IDX(files, i, device_file_t);
+        keyname = apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL);
 
-        char *var = apr_pstrcat(ds->pool, "DEVICE_", file->key, NULL);
+        /* stat the file */
+        status = device_file_lookupat(ds, keypath, dirfd, keyname, AT_SYMLINK_NOFOLLOW, &st);
+        if (APR_ENOENT == status) {
+            /* missing - optional or error */
 
-        for (j = 7; var && var[j]; j++) {
-            var[j] = apr_toupper(var[j]);
-        }
+            value = apr_array_push(values);
+            value->pair = pair;
 
-        if (!file->val) {
+            switch (pair->optional) {
+            case DEVICE_IS_OPTIONAL:
 
-            /* no value, leave unset */
+                if (pair->unset) {
+                    value->len = strlen(pair->unset);
+                    value->value = pair->unset;
+                }
+                else {
+                    value->len = strlen(DEVICE_RELATION_NONE);
+                    value->value = DEVICE_RELATION_NONE;
+                }
 
-        }
-        else if (file->type == APR_REG) {
+                break;
+            case DEVICE_IS_REQUIRED:
 
-            apr_env_set(var, file->val, ds->pool);
+                value->len = strlen(DEVICE_RELATION_ERROR);
+                value->value = DEVICE_RELATION_ERROR;
 
-        }
-        else if (file->type == APR_LNK) {
+                break;
+            }
 
-            apr_env_set(var, file->link, ds->pool);
+            max[0] = max[0] > value->len ? max[0] : value->len;
 
+            break;
+        } else if (APR_SUCCESS != status) {
+            apr_file_printf(ds->err, "cannot stat option set '%s': %pm\n",
+                    pair->key, &status);
+            break;
         }
 
-    }
+        relname = apr_pstrcat(ds->pool, pair->r.relation_name,
+                pair->r.relation_suffix, NULL);
 
-    if ((status = apr_procattr_create(&procattr, ds->pool)) != APR_SUCCESS) {
-        apr_file_printf(ds->err, "cannot create procattr: %pm\n", &status);
-        return status;
-    }
+        /* find relation, through the link */
+        relpath = apr_pstrcat(ds->pool, keyname, "/", relname, NULL);
 
-    if ((status = apr_procattr_cmdtype_set(procattr, APR_PROGRAM_ENV)) != APR_SUCCESS) {
-        apr_file_printf(ds->err, "cannot set command type in procattr: %pm\n", &status);
-        return status;
-    }
+        /* open/seek/read the file */
+        if (APR_SUCCESS
+                != (status = device_file_readat(ds, ds->pool, pair->key, dirfd,
+                        keypath, relpath, &val, &len))) {
+            /* error already handled */
+            break;
+        }
 
-    proc = apr_pcalloc(ds->pool, sizeof(apr_proc_t));
-    if ((status = apr_proc_create(proc, ds->argv[0], (const char* const*) ds->argv,
-            NULL, procattr, ds->pool)) != APR_SUCCESS) {
-        apr_file_printf(ds->err, "cannot run command: %pm\n", &status);
-        return status;
-    }
+        value = apr_array_push(values);
+        value->pair = pair;
+        value->value = val;
+        value->len = len;
+        value->set = 1;
+
+        max[0] = max[0] > value->len ? max[0] : value->len;
+
+        break;
 
-    if ((status = apr_proc_wait(proc, &exitcode, &exitwhy, APR_WAIT)) != APR_CHILD_DONE) {
-        apr_file_printf(ds->err, "cannot wait for command: %pm\n", &status);
-        return status;
+    }
     }
 
-    if (exitcode != 0 || exitwhy != APR_PROC_EXIT) {
-        if (exitwhy != APR_PROC_EXIT) {
-            apr_file_printf(ds->err, "command exited %s with code %d\n",
-                    APR_PROC_CHECK_EXIT(exitwhy) ? "normally" :
-                    APR_PROC_CHECK_SIGNALED(exitwhy) ? "on signal" :
-                    APR_PROC_CHECK_CORE_DUMP(exitwhy) ? "and dumped core" : "",
-                    exitcode);
-        }
-        return APR_EGENERAL;
+    if (keyval && pair->key && ds->key && !strcmp(pair->key, ds->key)) {
+        keyval[0] = val;
     }
 
-    return APR_SUCCESS;
+    return status;
 }
 
-static apr_status_t device_complete(device_set_t *ds, const char **args)
-{
-    const char *key = NULL, *value = NULL;
+typedef struct device_list_t {
+    device_set_t ds;
+    apr_array_header_t *rows;
+    apr_array_header_t *dirs;
+    volatile apr_uint32_t *next;
+    int *max;
+} device_list_t;
 
+/*
+ * Read the values of one row of the table.
+ *
+ * Column widths are gathered into max, in order of the index, flags and
+ * values columns.
+ */
+static void device_list_row(device_set_t *ds, device_row_t *row,
+        const char *dir, int *max)
+{
+    device_table_t *table;
     apr_status_t status;
-    int start = 0, count;
-
-    if (!args[0]) {
-        /* no args is not ok */
-        apr_file_printf(ds->err, "complete needs one or more arguments.\n");
-        return APR_EINVAL;
-    }
-
-    if (ds->key && (ds->mode == DEVICE_SET || ds->mode == DEVICE_RENAME || ds->mode == DEVICE_EXEC)) {
+    int dirfd, i;
 
-        apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
-        int i;
+    /* each option is found relative to the option set, opened once if at all */
+    dirfd = DEVICE_KEYDIR_UNOPENED;
 
-        if (!args[1]) {
-            status = device_get(ds, args[0], options, NULL, NULL, NULL);
+    row->indexes = apr_array_make(ds->pool, 16, sizeof(device_value_t));
+    row->flags = apr_array_make(ds->pool, 16, sizeof(device_value_t));
+    row->values = apr_array_make(ds->pool, 16, sizeof(device_value_t));
 
-            /* complete on the ids */
-            for (i = 0; i < options->nelts; i++) {
-                const char *option = APR_ARRAY_IDX(options, i, const char *);
-                apr_file_printf(ds->out, "%s\n", option);
-            }
+    for (i = 0; i < ds->show_index->nelts; i++) {
+        table = &APR_ARRAY_IDX(ds->show_index, i, device_table_t);
 
-            return status;
-        }
-        else {
-            status = device_get(ds, args[0], options, &ds->keyval, &ds->keypath, NULL);
+        status = device_value(ds, table->pair, dir, &dirfd, row->indexes, &row->keyval,
+                &row->order, max++);
 
-            if (APR_SUCCESS != status) {
-                return status;
-            }
+        if (APR_SUCCESS != status) {
+            device_value_t *value;
+            value = apr_array_push(row->flags);
+            value->pair = table->pair;
+            value->value = "";
+            value->len = 0;
         }
 
-        start = 2;
     }
 
-    /* find the last key/value pair, or just the key if odd */
-    count = start;
-    while(args[count]) {
-        if (!args[count + 1]) {
-            key = args[count + 0];
-            value = NULL;
-            break;
-        }
-        else {
-            key = args[count + 0];
-            value = args[count + 1];
-        }
-        count += 2;
-    }
+    for (i = 0; i < ds->show_flags->nelts; i++) {
+        table = &APR_ARRAY_IDX(ds->show_flags, i, device_table_t);
 
-    if (ds->mode == DEVICE_REMOVE || ds->mode == DEVICE_MARK || ds->mode == DEVICE_SHOW) {
-        if (value) {
-            /* more than one arg is not ok */
-            apr_file_printf(ds->err, "complete has more than one argument.\n");
-            return APR_EINVAL;
+        status = device_value(ds, table->pair, dir, &dirfd, row->flags, &row->keyval,
+                &row->order, max++);
+
+        if (APR_SUCCESS != status) {
+            device_value_t *value;
+            value = apr_array_push(row->flags);
+            value->pair = table->pair;
+            value->value = "";
+            value->len = 0;
         }
-        else {
 
-            apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
-            int i;
+    }
 
-            status = device_get(ds, args[0], options, NULL, NULL, NULL);
+    for (i = 0; i < ds->show_table->nelts; i++) {
+        table = &APR_ARRAY_IDX(ds->show_table, i, device_table_t);
 
-            /* complete on the keys */
-            for (i = 0; i < options->nelts; i++) {
-                const char *option = APR_ARRAY_IDX(options, i, const char *);
-                apr_file_printf(ds->out, "%s\n", option);
-            }
+        status = device_value(ds, table->pair, dir, &dirfd, row->values, &row->keyval,
+                &row->order, max++);
 
-            return status;
+        if (APR_SUCCESS != status) {
+            device_value_t *value;
+            value = apr_array_push(row->values);
+            value->pair = table->pair;
+            value->value = "";
+            value->len = 0;
         }
+
     }
-    else if (value) {
 
-        device_pair_t *pair;
+    device_keydir_close(dirfd);
+}
 
-        pair = apr_hash_get(ds->pairs, key, APR_HASH_KEY_STRING);
+static void device_list_work(device_list_t *dl)
+{
+    apr_uint32_t i;
 
-        if (pair) {
+    while ((i = apr_atomic_inc32(dl->next)) < (apr_uint32_t)dl->dirs->nelts) {
+        device_list_row(&dl->ds, &APR_ARRAY_IDX(dl->rows, i, device_row_t),
+                APR_ARRAY_IDX(dl->dirs, i, const char *), dl->max);
+    }
+}
 
-            apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
-            int i;
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC device_list_worker(apr_thread_t *thd, void *data)
+{
+    device_list_work(data);
 
-            switch (pair->type) {
-            case DEVICE_PAIR_INDEX:
-                status = device_parse_index(ds, pair, value, NULL, NULL);
-                break;
-            case DEVICE_PAIR_PORT:
-                status = device_parse_port(ds, pair, value, NULL);
-                break;
-            case DEVICE_PAIR_UNPRIVILEGED_PORT:
-                status = device_parse_unprivileged_port(ds, pair, value, NULL);
-                break;
-            case DEVICE_PAIR_HOSTNAME:
-                status = device_parse_hostname(ds, pair, value, NULL);
-                break;
-            case DEVICE_PAIR_FQDN:
-                status = device_parse_fqdn(ds, pair, value, NULL);
-                break;
-            case DEVICE_PAIR_SELECT:
-                status = device_parse_select(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_BYTES:
-                status = device_parse_bytes(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_SYMLINK:
-                status = device_parse_symlink(ds, pair, value, options, NULL, NULL);
-                break;
-            case DEVICE_PAIR_SQL_IDENTIFIER:
-                status = device_parse_sql_identifier(ds, pair, value, NULL);
-                break;
-            case DEVICE_PAIR_SQL_DELIMITED_IDENTIFIER:
-                status = device_parse_sql_delimited_identifier(ds, pair, value,
-                        NULL);
-                break;
-            case DEVICE_PAIR_USER:
-                status = device_parse_user(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_DISTINGUISHED_NAME:
-                status = device_parse_distinguished_name(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_RELATION:
-                status = device_parse_relation(ds, pair, value, options, NULL, NULL);
-                break;
-            case DEVICE_PAIR_POLAR:
-                status = device_parse_polar(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_SWITCH:
-                status = device_parse_switch(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_INTEGER:
-                status = device_parse_integer(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_HEX:
-                status = device_parse_hex(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_TEXT:
-                status = device_parse_text(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_URL_PATH:
-                status = device_parse_url_path(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_URL_PATH_ABEMPTY:
-                status = device_parse_url_path_abempty(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_URL_PATH_ABSOLUTE:
-                status = device_parse_url_path_absolute(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_URL_PATH_NOSCHEME:
-                status = device_parse_url_path_noscheme(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_URL_PATH_ROOTLESS:
-                status = device_parse_url_path_rootless(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_URL_PATH_EMPTY:
-                status = device_parse_url_path_empty(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_URI:
-                status = device_parse_uri(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_URI_ABSOLUTE:
-                status = device_parse_uri_absolute(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_URI_RELATIVE:
-                status = device_parse_uri_relative(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_ADDRESS:
-                status = device_parse_address(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_ADDRESS_MAILBOX:
-                status = device_parse_address_mailbox(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_ADDRESS_ADDRSPEC:
-                status = device_parse_address_addrspec(ds, pair, value, options, NULL);
-                break;
-            case DEVICE_PAIR_ADDRESS_LOCALPART:
-                status = device_parse_address_localpart(ds, pair, value, options, NULL);
-                break;
-            }
+    apr_thread_exit(thd, APR_SUCCESS);
 
-            for (i = 0; i < options->nelts; i++) {
-                const char *option = APR_ARRAY_IDX(options, i, const char *);
-                apr_file_printf(ds->out, "%s\n", option);
-            }
+    return NULL;
+}
+#endif
 
-        }
-        else {
-            // FIXME: add option for an "overflow" of unknown arguments
-            apr_file_printf(ds->err, "key '%s' is not recognised.\n",
-                    apr_pescape_echo(ds->pool, key, 1));
-            return APR_EINVAL;
-        }
+/*
+ * Read the rows of the table, one per directory.
+ *
+ * Each row costs a stat and a read per column, which adds up on slow or
+ * cold storage, so rows are shared out between a bounded set of workers.
+ * Each worker has a pool of its own and its own column widths, merged
+ * once all are done. Rows keep the order of the directories given, so
+ * that the sorted table is the same as when read one at a time.
+ */
+static apr_array_header_t *device_list_rows(device_set_t *ds,
+        apr_array_header_t *dirs)
+{
+    apr_array_header_t *rows;
+    device_list_t *workers;
+#if APR_HAS_THREADS
+    apr_thread_t **threads;
+#endif
+    volatile apr_uint32_t next = 0;
+    int columns, count, i, j;
 
+    columns = ds->show_index->nelts + ds->show_flags->nelts
+            + ds->show_table->nelts;
+
+    rows = apr_array_make(ds->pool, dirs->nelts, sizeof(device_row_t));
+    for (i = 0; i < dirs->nelts; i++) {
+        apr_array_push(rows);
     }
-    else {
 
-        apr_hash_index_t *hi;
-        void *v;
-        device_pair_t *pair;
+#if APR_HAS_THREADS
+    count = dirs->nelts < DEVICE_LIST_WORKERS ? dirs->nelts : DEVICE_LIST_WORKERS;
+#else
+    count = 1;
+#endif
+    if (count < 1) {
+        count = 1;
+    }
 
-        for (hi = apr_hash_first(ds->pool, ds->pairs); hi; hi = apr_hash_next(hi)) {
+    workers = apr_pcalloc(ds->pool, count * sizeof(device_list_t));
 
-            int found = 0;
+    for (i = 0; i < count; i++) {
+        device_list_t *dl = &workers[i];
 
-            apr_hash_this(hi, NULL, NULL, &v);
-            pair = v;
+        dl->ds = *ds;
+        apr_pool_create(&dl->ds.pool, ds->pool);
+        dl->rows = rows;
+        dl->dirs = dirs;
+        dl->next = &next;
+        dl->max = apr_pcalloc(ds->pool, (columns + 1) * sizeof(int));
+    }
 
-            /* skip primary key when setting but not renaming */
-            if (ds->key && ds->mode == DEVICE_SET && !strcmp(ds->key, pair->key)) {
-                continue;
-            }
+#if APR_HAS_THREADS
+    threads = apr_pcalloc(ds->pool, count * sizeof(apr_thread_t *));
 
-            /* skip keys already seen in arguments */
-            count = start;
-            while(args[count]) {
-                if (!args[count + 1]) {
-                    break;
-                }
-                if (!strcmp(pair->key, args[count])) {
-                    found = 1;
-                    break;
-                }
-                count += 2;
-            }
-            if (found) {
-                continue;
-            }
+    /* a worker that cannot start leaves its share to the others */
+    for (i = 1; i < count; i++) {
+        if (APR_SUCCESS != apr_thread_create(&threads[i], NULL,
+                device_list_worker, &workers[i], ds->pool)) {
+            threads[i] = NULL;
+        }
+    }
+#endif
 
-            /* suggest remaining key */
-            if (!key || !key[0] || !strncmp(key, pair->key, strlen(key))) {
-                apr_file_printf(ds->out, "%c%s=\n",
-                        pair->optional == DEVICE_IS_OPTIONAL ? '-' : '*',
-                        device_pescape_shell(ds->pool, pair->key));
-            }
+    device_list_work(&workers[0]);
+
+#if APR_HAS_THREADS
+    for (i = 1; i < count; i++) {
+        apr_status_t status;
 
+        if (threads[i]) {
+            apr_thread_join(&status, threads[i]);
         }
+    }
+#endif
 
-        status = APR_INCOMPLETE;
+    /* merge the column widths */
+    for (i = 0; i < count; i++) {
+        int *max = workers[i].max;
 
+        for (j = 0; j < ds->show_index->nelts; j++, max++) {
+            device_table_t *table = &APR_ARRAY_IDX(ds->show_index, j, device_table_t);
+            table->max = table->max > *max ? table->max : *max;
+        }
+        for (j = 0; j < ds->show_flags->nelts; j++, max++) {
+            device_table_t *table = &APR_ARRAY_IDX(ds->show_flags, j, device_table_t);
+            table->max = table->max > *max ? table->max : *max;
+        }
+        for (j = 0; j < ds->show_table->nelts; j++, max++) {
+            device_table_t *table = &APR_ARRAY_IDX(ds->show_table, j, device_table_t);
+            table->max = table->max > *max ? table->max : *max;
+        }
     }
 
-    apr_file_flush(ds->out);
-    apr_file_flush(ds->err);
-
-    return status;
+    return rows;
 }
 
-/*
- * Default index value is one higher than the highest
- * current value.
- */
-static apr_status_t device_default_index(device_set_t *ds, device_pair_t *pair,
-        apr_array_header_t *files)
+static apr_status_t device_list(device_set_t *ds, const char **args)
 {
     apr_dir_t *thedir;
     apr_finfo_t dirent;
+    device_table_t *table;
+    device_row_t *row;
+    device_value_t *value;
 
-    apr_status_t status;
+    char *upper;
 
-    apr_int64_t max = 0;
+    apr_array_header_t *rows;
+    apr_array_header_t *dirs = apr_array_make(ds->pool,
+            16, sizeof(const char *));
+    apr_array_header_t *pairs = apr_array_make(ds->pool,
+            16, sizeof(device_pair_t *));
 
-    /* scan the directories to find a match */
+    apr_status_t status = APR_SUCCESS;
+
+    int i, j, k;
+
+    if (!ds->show_table) {
+        apr_file_printf(ds->err, "Name to show was not specified.\n");
+        return APR_EINVAL;
+    }
+
+    /* scan the directories to create our list */
     if ((status = apr_dir_open(&thedir, ".", ds->pool)) != APR_SUCCESS) {
         /* could not open directory, fail */
         apr_file_printf(ds->err, "could not open current directory: %pm\n", &status);
@@ -5791,1021 +8948,1244 @@ static apr_status_t device_default_index(device_set_t *ds, device_pair_t *pair,
         switch (dirent.filetype) {
         case APR_DIR: {
 
-            apr_pool_t *pool;
-            char *val = NULL;
-            apr_file_t *in;
-            const char *indexname;
-            char *indexpath;
-            apr_off_t end = 0, start = 0;
+            APR_ARRAY_PUSH(dirs, const char *) = apr_pstrdup(ds->pool, dirent.name);
 
-            apr_pool_create(&pool, ds->pool);
+            break;
+        }
+        default:
+            break;
+        }
 
-            indexname = apr_pstrcat(pool, pair->key, pair->suffix, NULL);
-            if (APR_SUCCESS
-                    != (status = apr_filepath_merge(&indexpath, dirent.name,
-                            indexname, APR_FILEPATH_NOTABSOLUTE, pool))) {
-                apr_file_printf(ds->err, "cannot merge option set key '%s': %pm\n", pair->key,
-                        &status);
-            }
+    } while (1);
 
-            /* open the index */
-            else if (APR_SUCCESS
-                    != (status = apr_file_open(&in, indexpath, APR_FOPEN_READ,
-                            APR_FPROT_OS_DEFAULT, pool))) {
-                apr_file_printf(ds->err, "cannot open option set '%s': %pm\n", pair->key,
-                        &status);
-            }
+    apr_dir_close(thedir);
 
-            /* how long is the key? */
-            else if (APR_SUCCESS
-                    != (status = apr_file_seek(in, APR_END, &end))) {
-                apr_file_printf(ds->err, "cannot seek end of option set '%s': %pm\n", pair->key,
-                        &status);
+    /* read the columns of every row in bulk where we can */
+    for (i = 0; i < ds->show_index->nelts; i++) {
+        APR_ARRAY_PUSH(pairs, device_pair_t *) =
+                APR_ARRAY_IDX(ds->show_index, i, device_table_t).pair;
+    }
+    for (i = 0; i < ds->show_flags->nelts; i++) {
+        APR_ARRAY_PUSH(pairs, device_pair_t *) =
+                APR_ARRAY_IDX(ds->show_flags, i, device_table_t).pair;
+    }
+    for (i = 0; i < ds->show_table->nelts; i++) {
+        APR_ARRAY_PUSH(pairs, device_pair_t *) =
+                APR_ARRAY_IDX(ds->show_table, i, device_table_t).pair;
+    }
+
+    device_file_prefetch(ds, dirs, pairs);
+
+    rows = device_list_rows(ds, dirs);
+
+    ds->prefetch = NULL;
+
+    /* flags summary row */
+    if (ds->show_flags->nelts) {
+        apr_file_puts("Flags: ", ds->out);
+        for (j = 0; j < ds->show_flags->nelts; j++) {
+
+            table = &APR_ARRAY_IDX(ds->show_flags, j, device_table_t);
+
+            if (j) {
+                apr_file_puts(",", ds->out);
             }
 
-            /* back to the beginning */
-            else if (APR_SUCCESS
-                    != (status = apr_file_seek(in, APR_SET, &start))) {
-                apr_file_printf(ds->err, "cannot seek start of option set '%s': %pm\n", pair->key,
-                        &status);
+            if (table->pair->flag) {
+                apr_file_printf(ds->out, "%s (%s)", table->pair->key, table->pair->flag);
+            } else {
+                apr_file_printf(ds->out, "%s", table->pair->key);
             }
 
-            else {
-                int size = end + 1;
-                val = apr_palloc(pool, size);
-                val[end] = 0;
+        }
+        apr_file_puts("\n", ds->out);
+    }
 
-                status = apr_file_gets(val, size, in);
+    /* index header row */
+    for (j = 0; j < ds->show_index->nelts; j++) {
 
-                if (APR_EOF == status) {
-                    status = APR_SUCCESS;
-                }
-                if (APR_SUCCESS == status) {
-                    /* short circuit, all good */
-                    val = trim(val);
-                }
-                else {
-                    apr_file_printf(ds->err, "cannot read option set '%s': %pm\n", pair->key,
-                            &status);
-                }
-            }
+        table = &APR_ARRAY_IDX(ds->show_index, j, device_table_t);
 
-            if (status != APR_SUCCESS) {
-                apr_pool_destroy(pool);
-                break;
+        apr_file_printf(ds->out, "%*s ", table->max, "#");
+
+    }
+
+    /* flags header row */
+    if (ds->show_flags->nelts) {
+        for (j = 0; j < ds->show_flags->nelts; j++) {
+
+            table = &APR_ARRAY_IDX(ds->show_flags, j, device_table_t);
+
+            if (table->pair->flag) {
+                apr_file_printf(ds->out, "%*s", (int)strlen(table->pair->flag), "");
+            } else {
+                apr_file_puts(" ", ds->out);
             }
-            else {
 
-                char *end;
+        }
+        apr_file_puts(" ", ds->out);
+    }
 
-                /* parse index, is it the largest so far? */
+    /* values header row */
+    for (j = 0; j < ds->show_table->nelts; j++) {
 
-                apr_int64_t index = apr_strtoi64(val, &end, 10);
-                if (end[0] || errno == ERANGE) {
-                    apr_file_printf(ds->err, "argument '%s': '%s' is not a valid index, ignoring.\n",
-                            apr_pescape_echo(ds->pool, pair->key, 1),
-                            apr_pescape_echo(ds->pool, val, 1));
-                    /* ignore and loop round */
-                }
-                else if (index == APR_INT64_MAX) {
-                    apr_file_printf(ds->err, "argument '%s': existing index '%s' is too big.\n",
-                            apr_pescape_echo(ds->pool, pair->key, 1),
-                            apr_pescape_echo(ds->pool, val, 1));
-                    return APR_EGENERAL;
-                }
+        table = &APR_ARRAY_IDX(ds->show_table, j, device_table_t);
+
+        upper = apr_pstrdup(ds->pool, table->pair->key);
+        for (k = 0; upper[k]; k++) {
+            upper[k] = apr_toupper(upper[k]);
+        }
+
+        apr_file_printf(ds->out, "%*s  ", table->max, upper);
+
+    }
+    apr_file_puts("\n", ds->out);
+
+    /* sort by order, then by key */
+    qsort(rows->elts, rows->nelts, rows->elt_size, rows_asc);
+
+    /* rows */
+    for (i = 0; i < rows->nelts; i++) {
+        row = &APR_ARRAY_IDX(rows, i, device_row_t);
 
-                if (index >= max) {
-                    max = index + 1;
+        for (j = 0; j < row->indexes->nelts && j < ds->show_index->nelts; j++) {
+            table = &APR_ARRAY_IDX(ds->show_index, j, device_table_t);
+            value = &APR_ARRAY_IDX(row->indexes, j, device_value_t);
+
+            apr_file_printf(ds->out, "%*s ", table->max, value->value);
+
+        }
+
+        for (j = 0; j < row->flags->nelts && j < ds->show_flags->nelts; j++) {
+            table = &APR_ARRAY_IDX(ds->show_flags, j, device_table_t);
+            value = &APR_ARRAY_IDX(row->flags, j, device_value_t);
+
+            if (value->set) {
+                if (table->pair->flag) {
+                    apr_file_printf(ds->out, "%*s", (int)strlen(table->pair->flag),
+                            table->pair->flag);
+                } else {
+                    apr_file_puts(".", ds->out);
+                }
+            }
+            else {
+                if (table->pair->flag) {
+                    apr_file_printf(ds->out, "%*s", (int)strlen(table->pair->flag),
+                            "");
+                } else {
+                    apr_file_puts(" ", ds->out);
                 }
             }
 
-            apr_pool_destroy(pool);
-
-            break;
         }
-        default:
-            break;
+        if (ds->show_flags->nelts) {
+            apr_file_puts(" ", ds->out);
         }
 
-    } while (1);
+        for (j = 0; j < row->values->nelts && j < ds->show_table->nelts; j++) {
+            table = &APR_ARRAY_IDX(ds->show_table, j, device_table_t);
+            value = &APR_ARRAY_IDX(row->values, j, device_value_t);
 
-    apr_dir_close(thedir);
+            apr_file_printf(ds->out, "%*s  ", table->max, value->value);
+
+        }
+        apr_file_puts("\n", ds->out);
 
-    if (APR_SUCCESS == status) {
-        /* short circuit, all good */
     }
-    else if (APR_STATUS_IS_ENOENT(status)) {
-        status = APR_SUCCESS;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t device_show(device_set_t *ds, const char **args)
+{
+    apr_hash_index_t *hi;
+    void *v;
+    device_pair_t *pair;
+    apr_off_t len;
+
+    apr_array_header_t *values = apr_array_make(ds->pool,
+            16, sizeof(device_value_t));
+    apr_array_header_t *dirs = apr_array_make(ds->pool,
+            1, sizeof(const char *));
+    apr_array_header_t *pairs = apr_array_make(ds->pool,
+            16, sizeof(device_pair_t *));
+
+    apr_status_t status = APR_SUCCESS;
+
+    int dirfd, i, max;
+
+    if (ds->key) {
+
+        if (!args[0] || !args[1]) {
+
+            /* no args gives full list */
+            return device_list(ds, args);
+
+        }
+        else {
+
+            int exact = 0;
+
+            apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
+
+            status = device_get(ds, args[0], options, &ds->keyval, &ds->keypath, &exact);
+
+            if (APR_SUCCESS != status) {
+                return status;
+            }
+
+            if (!exact) {
+                apr_file_printf(ds->err, "%s was not found.\n", args[0]);
+                return APR_EINVAL;
+            }
+
+        }
+
+        args += 2;
     }
-    else {
-        apr_file_printf(ds->err, "cannot read indexes: %pm\n",
-                &status);
-        return status;
+
+    /* read the options in bulk where we can */
+    for (hi = apr_hash_first(ds->pool, ds->pairs); hi; hi = apr_hash_next(hi)) {
+
+        apr_hash_this(hi, NULL, NULL, &v);
+
+        APR_ARRAY_PUSH(pairs, device_pair_t *) = v;
+
     }
 
-    device_file_t *file;
+    APR_ARRAY_PUSH(dirs, const char *) = ds->keypath;
 
-    file = apr_array_push(files);
-    file->type = APR_REG;
+    device_file_prefetch(ds, dirs, pairs);
 
-    file->dest = apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL);
-    file->template = apr_pstrcat(ds->pool, file->dest, ".XXXXXX", NULL);
-    file->key = pair->key;
-    file->val = apr_psprintf(ds->pool, "%" APR_INT64_T_FMT, max);
-    file->index = pair->index;
+    dirfd = DEVICE_KEYDIR_UNOPENED;
 
-    return APR_SUCCESS;
-}
+    for (i = 0; i < pairs->nelts; i++) {
+
+        pair = APR_ARRAY_IDX(pairs, i, device_pair_t *);
 
-/*
- * Default polar answer is the option given (yes/no).
- */
-static apr_status_t device_default_polar(device_set_t *ds, device_pair_t *pair,
-        apr_array_header_t *files)
-{
-    device_file_t *file;
+        device_value(ds, pair, ds->keypath, &dirfd, values, NULL, NULL, &max);
 
-    file = apr_array_push(files);
-    file->type = APR_REG;
+    }
 
-    file->dest = apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL);
-    file->template = apr_pstrcat(ds->pool, file->dest, ".XXXXXX", NULL);
-    file->key = pair->key;
-    file->val = pair->p.polar_default ? "" : NULL;
-    file->index = pair->index;
+    device_keydir_close(dirfd);
 
-    return APR_SUCCESS;
-}
+    ds->prefetch = NULL;
 
-/*
- * Default switch is the option given (on/off).
- */
-static apr_status_t device_default_switch(device_set_t *ds, device_pair_t *pair,
-        apr_array_header_t *files)
-{
-    device_file_t *file;
 
-    file = apr_array_push(files);
-    file->type = APR_REG;
+    max = 0;
 
-    file->dest = apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL);
-    file->template = apr_pstrcat(ds->pool, file->dest, ".XXXXXX", NULL);
-    file->key = pair->key;
-    file->val = pair->sw.switch_default ? "" : NULL;
-    file->index = pair->index;
+    qsort(values->elts, values->nelts, values->elt_size, values_asc);
 
-    return APR_SUCCESS;
-}
+    for (i = 0; i < values->nelts; i++) {
+        device_value_t *value = &APR_ARRAY_IDX(values, i, device_value_t);
 
-static apr_status_t device_default(device_set_t *ds, device_pair_t *pair, apr_array_header_t *files)
-{
-    apr_status_t status;
+        len = strlen(value->pair->key);
+        max = max > len ? max : len;
+    }
 
-    switch (pair->type) {
-    case DEVICE_PAIR_INDEX:
-        status = device_default_index(ds, pair, files);
-        break;
-    case DEVICE_PAIR_POLAR:
-        status = device_default_polar(ds, pair, files);
-        break;
-    case DEVICE_PAIR_SWITCH:
-        status = device_default_switch(ds, pair, files);
-        break;
-    default:
-        status = APR_SUCCESS;
+    for (i = 0; i < values->nelts; i++) {
+        device_value_t *value = &APR_ARRAY_IDX(values, i, device_value_t);
+
+        apr_file_printf(ds->out, "%*s: %s\n", max, value->pair->key, value->value);
     }
 
     return status;
 }
 
-static apr_status_t device_parse(device_set_t *ds, const char *key, const char *val, apr_array_header_t *files)
+static apr_status_t device_remove(device_set_t *ds, const char **args)
 {
-    device_file_t *file;
-    device_pair_t *pair;
+    apr_dir_t *thedir;
+    apr_finfo_t dirent;
 
+    const char *keyval = NULL, *keypath = NULL, *backup;
+    apr_file_t *lock;
+    apr_time_t stamp;
     apr_status_t status = APR_SUCCESS;
+    int dirfd;
 
-    /* look up the parameter */
-    pair = apr_hash_get(ds->pairs, key, APR_HASH_KEY_STRING);
+    apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
 
-    if (pair) {
+    if (!args[0]) {
+        apr_file_printf(ds->err, "%s is required.\n", ds->key);
+        return status;
+    }
+    if (args[1] && args[2]) {
+        apr_file_printf(ds->err, "no options are permitted other than %s.\n", ds->key);
+        return status;
+    }
+    else {
+        status = device_get(ds, args[0], options, &keyval, &keypath, NULL);
 
-        apr_array_header_t *options = apr_array_make(ds->pool, (10), sizeof(char *));
+        if (APR_SUCCESS != status) {
+            return status;
+        }
+    }
 
-        apr_filetype_e type = APR_REG;
+    /*
+     * Remove is dangerous, so we sanity check on first pass.
+     *
+     * Any hidden files, any directories, we don't touch at all.
+     */
 
-        const char *link = NULL;
+    if ((status = apr_dir_open(&thedir, keypath, ds->pool)) != APR_SUCCESS) {
 
-        switch (pair->type) {
-        case DEVICE_PAIR_INDEX:
-            status = device_parse_index(ds, pair, val, &val, files);
-            break;
-        case DEVICE_PAIR_PORT:
-            status = device_parse_port(ds, pair, val, &val);
-            break;
-        case DEVICE_PAIR_UNPRIVILEGED_PORT:
-            status = device_parse_unprivileged_port(ds, pair, val, &val);
-            break;
-        case DEVICE_PAIR_HOSTNAME:
-            status = device_parse_hostname(ds, pair, val, &val);
-            break;
-        case DEVICE_PAIR_FQDN:
-            status = device_parse_fqdn(ds, pair, val, &val);
-            break;
-        case DEVICE_PAIR_SELECT:
-            status = device_parse_select(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_BYTES:
-            status = device_parse_bytes(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_SYMLINK:
-            status = device_parse_symlink(ds, pair, val, options, &val, &link);
-            type = APR_LNK;
-            break;
-        case DEVICE_PAIR_SQL_IDENTIFIER:
-            status = device_parse_sql_identifier(ds, pair, val, &val);
-            break;
-        case DEVICE_PAIR_SQL_DELIMITED_IDENTIFIER:
-            status = device_parse_sql_delimited_identifier(ds, pair, val,
-                    &val);
-            break;
-        case DEVICE_PAIR_USER:
-            status = device_parse_user(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_DISTINGUISHED_NAME:
-            status = device_parse_distinguished_name(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_RELATION:
-            status = device_parse_relation(ds, pair, val, options, &val, &link);
-            type = APR_LNK;
-            break;
-        case DEVICE_PAIR_POLAR:
-            status = device_parse_polar(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_SWITCH:
-            status = device_parse_switch(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_INTEGER:
-            status = device_parse_integer(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_HEX:
-            status = device_parse_hex(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_TEXT:
-            status = device_parse_text(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_URL_PATH:
-            status = device_parse_url_path(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_URL_PATH_ABEMPTY:
-            status = device_parse_url_path_abempty(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_URL_PATH_ABSOLUTE:
-            status = device_parse_url_path_absolute(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_URL_PATH_NOSCHEME:
-            status = device_parse_url_path_noscheme(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_URL_PATH_ROOTLESS:
-            status = device_parse_url_path_rootless(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_URL_PATH_EMPTY:
-            status = device_parse_url_path_empty(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_URI:
-            status = device_parse_uri(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_URI_ABSOLUTE:
-            status = device_parse_uri_absolute(ds, pair, val, options, &val);
-            break;
-        case DEVICE_PAIR_URI_RELATIVE:
-            status = device_parse_uri_relative(ds, pair, val, options, &val);
+        /* could not open directory, skip */
+        apr_file_printf(ds->err, "could not remove '%s': %pm\n", keyval, &status);
+
+        return status;
+    }
+
+    do {
+        status = apr_dir_read(&dirent,
+                APR_FINFO_TYPE | APR_FINFO_NAME | APR_FINFO_WPROT, thedir);
+        if (APR_STATUS_IS_INCOMPLETE(status)) {
+            continue; /* ignore un-stat()able files */
+        } else if (APR_STATUS_IS_ENOENT(status)) {
             break;
-        case DEVICE_PAIR_ADDRESS:
-            status = device_parse_address(ds, pair, val, options, &val);
+        } else if (status != APR_SUCCESS) {
+            apr_file_printf(ds->err,
+                    "could not remove '%s' (not accessible): %pm\n", keyval,
+                    &status);
             break;
-        case DEVICE_PAIR_ADDRESS_MAILBOX:
-            status = device_parse_address_mailbox(ds, pair, val, options, &val);
+        }
+
+        /* ignore current and parent, fail on hidden files */
+        if (dirent.name[0] == '.') {
+            if (!dirent.name[1]) {
+                /* "." */
+                continue;
+            }
+            else if (dirent.name[1] == '.' && !dirent.name[2]) {
+                /* ".." */
+                continue;
+            }
+            else {
+                apr_file_printf(ds->err,
+                        "could not remove '%s': unexpected hidden file: %s\n", keyval, dirent.name);
+                apr_dir_close(thedir);
+                return APR_EINVAL;
+            }
+        }
+
+        switch (dirent.filetype) {
+        case APR_DIR: {
+            apr_file_printf(ds->err,
+                    "could not remove '%s': unexpected directory: %s\n", keyval, dirent.name);
+            apr_dir_close(thedir);
+            return APR_EINVAL;
+        }
+        default:
             break;
-        case DEVICE_PAIR_ADDRESS_ADDRSPEC:
-            status = device_parse_address_addrspec(ds, pair, val, options, &val);
+        }
+
+    } while (1);
+
+    apr_dir_close(thedir);
+
+    /*
+     * Second step - try rename the directory.
+     *
+     * If we can't do this, give up without touching anything.
+     */
+    backup = apr_psprintf(ds->pool, "%s;%" APR_PID_T_FMT, keypath, getpid());
+
+    lock = device_names_lock(ds);
+
+    /* the names catalogue as it stood before the rename */
+    if (APR_SUCCESS != (status = device_names_stamp(ds, NULL, &stamp))) {
+        device_names_unlock(lock);
+        return status;
+    }
+
+    if (APR_SUCCESS != (status = apr_file_rename(keypath, backup, ds->pool))) {
+        apr_file_printf(ds->err, "could not remove '%s' (rename): %pm\n", keyval, &status);
+        device_names_unlock(lock);
+        return status;
+    }
+
+    apr_file_remove(device_safename(ds->pool, keyval), ds->pool);
+
+    device_names_update(ds, ds->key, keypath, stamp);
+
+    device_names_unlock(lock);
+
+    /*
+     * Third step - let's remove the files.
+     *
+     * If we fail here it's too late to recover, but our directory is
+     * moved out the way.
+     */
+
+    /* files are removed relative to the directory */
+    if (APR_SUCCESS != (status = device_dir_open(ds->pool, backup, &dirfd))) {
+        apr_file_printf(ds->err, "could not remove '%s' (open): %pm\n", keyval, &status);
+        return status;
+    }
+
+    if ((status = apr_dir_open(&thedir, backup, ds->pool)) != APR_SUCCESS) {
+        apr_file_printf(ds->err, "could not remove '%s' (open options): %pm\n", keyval, &status);
+        return status;
+    }
+
+    do {
+        status = apr_dir_read(&dirent,
+                APR_FINFO_TYPE | APR_FINFO_NAME | APR_FINFO_WPROT, thedir);
+        if (APR_STATUS_IS_INCOMPLETE(status)) {
+            continue; /* ignore un-stat()able files */
+        } else if (APR_STATUS_IS_ENOENT(status)) {
             break;
-        case DEVICE_PAIR_ADDRESS_LOCALPART:
-            status = device_parse_address_localpart(ds, pair, val, options, &val);
+        } else if (status != APR_SUCCESS) {
+            apr_file_printf(ds->err,
+                    "could not remove '%s' (read options): %pm\n", keyval,
+                    &status);
             break;
         }
 
-        file = apr_array_push(files);
-        file->type = type;
-
-        file->dest = apr_pstrcat(ds->pool, pair->key, pair->suffix, NULL);
-        file->template = apr_pstrcat(ds->pool, file->dest, ".XXXXXX", NULL);
-        file->key = key;
-        file->val = val;
-        file->link = link;
-        file->index = pair->index;
+        /* ignore current and parent */
+        if (dirent.name[0] == '.') {
+            if (!dirent.name[1]) {
+                /* "." */
+                continue;
+            }
+            else if (dirent.name[1] == '.' && !dirent.name[2]) {
+                /* ".." */
+                continue;
+            }
+        }
 
-        if (APR_SUCCESS != status) {
+        if (unlinkat(dirfd, dirent.name, 0)) {
+            status = apr_get_os_error();
+            apr_file_printf(ds->err, "could not remove '%s' (delete option): %pm\n", keyval, &status);
+            apr_dir_close(thedir);
             return status;
         }
 
-        pair->set = DEVICE_IS_SET;
+    } while (1);
 
-        if (pair->unique == DEVICE_IS_UNIQUE) {
+    apr_dir_close(thedir);
 
-            /* index must be unique */
+    /*
+     * Last step - remove that directory.
+     */
 
-            int exact = 0;
+    if ((status = apr_dir_remove(backup, ds->pool)) != APR_SUCCESS) {
+        apr_file_printf(ds->err, "could not remove '%s': %pm\n", keyval, &status);
+        return status;
+    }
 
-            apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
+    return status;
+}
 
-            status = device_get(ds, val, options, NULL, NULL, &exact);
+static apr_status_t device_mark(device_set_t *ds, const char **args)
+{
+    const char *keyval = NULL, *keypath = NULL;
+    apr_status_t status = APR_SUCCESS;
+    int dirfd;
 
-            if (APR_SUCCESS != status) {
-                return status;
-            }
+    apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
 
-            if (exact) {
-                apr_file_printf(ds->err, "%s already exists.\n", ds->key);
-                return APR_EINVAL;
-            }
+    if (!args[0]) {
+        apr_file_printf(ds->err, "%s is required.\n", ds->key);
+        return status;
+    }
+    if (args[1] && args[2]) {
+        apr_file_printf(ds->err, "no options are permitted other than %s.\n", ds->key);
+        return status;
+    }
+    else {
+        status = device_get(ds, args[0], options, &keyval, &keypath, NULL);
 
+        if (APR_SUCCESS != status) {
+            return status;
         }
+    }
 
-        if (pair->optional == DEVICE_IS_REQUIRED && !file->val) {
-            apr_file_printf(ds->err, "'%s' is required, and cannot be unset.\n",
-                    apr_pescape_echo(ds->pool, key, 1));
-            return APR_EINVAL;
-        }
+    if (APR_SUCCESS != (status = device_dir_open(ds->pool, keypath, &dirfd))) {
+        apr_file_printf(ds->err, "could not mark '%s' (open): %pm\n", keyval, &status);
+    }
+    else if (APR_SUCCESS
+            != (status = device_file_markat(dirfd, DEVICE_REMOVE_MARKER))) {
+        apr_file_printf(ds->err, "cannot create mark '%s': %pm\n", keyval,
+            &status);
+    }
+
+    apr_file_remove(device_safename(ds->pool, keyval), ds->pool);
+
+    return status;
+}
 
+static apr_status_t device_rebuild(device_set_t *ds, const char **args)
+{
+    device_names_t names;
+    device_pair_t *pair;
+
+    if (args[0]) {
+        apr_file_printf(ds->err, "no options are permitted.\n");
+        return APR_EINVAL;
     }
-    else {
-        // FIXME: add option for an "overflow" of unknown arguments
-        apr_file_printf(ds->err, "argument '%s' is not recognised.\n",
-                apr_pescape_echo(ds->pool, key, 1));
+
+    pair = apr_hash_get(ds->pairs, ds->key, APR_HASH_KEY_STRING);
+
+    if (!pair) {
+        apr_file_printf(ds->err, "key '%s' is not recognised.\n",
+                apr_pescape_echo(ds->pool, ds->key, 1));
         return APR_EINVAL;
     }
 
-    return status;
+    return device_names_open(ds, pair, 1, &names);
 }
 
-static apr_status_t device_add(device_set_t *ds, const char **args)
+typedef struct device_export_row_t {
+    const char *keyval;
+    const char *line;
+} device_export_row_t;
+
+static int export_asc(const void *a, const void *b)
 {
-    const char *key = NULL, *val = NULL;
-    apr_status_t status = APR_SUCCESS;
-    int len;
+    const device_export_row_t *ra = a, *rb = b;
 
-    for (len = 0; args && args[len]; len++);
+    return strcmp(ra->keyval, rb->keyval);
+}
 
-    apr_array_header_t *files = apr_array_make(ds->pool, len, sizeof(device_file_t));
+static int pairs_asc(const void *a, const void *b)
+{
+    const device_pair_t *pa = *(const device_pair_t **)a;
+    const device_pair_t *pb = *(const device_pair_t **)b;
 
-    while (args && *args) {
+    return strcmp(pa->key, pb->key);
+}
 
-        const char *arg = *(args++);
+/*
+ * The columns of an export, the key first and the rest by name.
+ */
+static apr_array_header_t *device_export_columns(device_set_t *ds,
+        device_pair_t *key)
+{
+    apr_array_header_t *columns;
+    apr_hash_index_t *hi;
+    void *v;
 
-        if (!key) {
-            key = arg;
-            continue;
-        }
-        else {
-            val = arg;
-        }
+    columns = apr_array_make(ds->pool, apr_hash_count(ds->pairs),
+            sizeof(device_pair_t *));
 
-        status = device_parse(ds, key, val, files);
+    APR_ARRAY_PUSH(columns, device_pair_t *) = key;
 
-        if (APR_SUCCESS != status) {
-            break;
-        }
+    for (hi = apr_hash_first(ds->pool, ds->pairs); hi; hi = apr_hash_next(hi)) {
 
-        key = NULL;
-        val = NULL;
-    }
+        apr_hash_this(hi, NULL, NULL, &v);
 
-    if (key && !val) {
-        apr_file_printf(ds->err, "argument '%s' has no corresponding value.\n",
-                apr_pescape_echo(ds->pool, key, 1));
-        return APR_EINVAL;
+        if (v != key) {
+            APR_ARRAY_PUSH(columns, device_pair_t *) = v;
+        }
     }
 
-    if (APR_SUCCESS == status) {
+    qsort(columns->elts + columns->elt_size, columns->nelts - 1,
+            columns->elt_size, pairs_asc);
 
-        apr_hash_index_t *hi;
-        void *v;
-        device_pair_t *pair;
+    return columns;
+}
 
-        /* check for required options that remain unset */
+/*
+ * Escape a value for a tab separated line.
+ */
+static const char *device_export_escape(apr_pool_t *pool, const char *val)
+{
+    const char *v;
+    char *buf, *b;
 
-        for (hi = apr_hash_first(ds->pool, ds->pairs); hi; hi = apr_hash_next(hi)) {
+    for (v = val; *v; v++) {
+        if (*v == '\\' || *v == '\t' || *v == '\n' || *v == '\r') {
+            break;
+        }
+    }
 
-            apr_hash_this(hi, NULL, NULL, &v);
-            pair = v;
+    /* short circuit, nothing to escape */
+    if (!*v) {
+        return val;
+    }
 
-            if (pair->set != DEVICE_IS_SET) {
+    b = buf = apr_palloc(pool, strlen(val) * 2 + 1);
 
-                status = device_default(ds, pair, files);
+    for (v = val; *v; v++) {
+        switch (*v) {
+        case '\\':
+            *b++ = '\\';
+            *b++ = '\\';
+            break;
+        case '\t':
+            *b++ = '\\';
+            *b++ = 't';
+            break;
+        case '\n':
+            *b++ = '\\';
+            *b++ = 'n';
+            break;
+        case '\r':
+            *b++ = '\\';
+            *b++ = 'r';
+            break;
+        default:
+            *b++ = *v;
+        }
+    }
+    *b = 0;
 
-                if (APR_SUCCESS != status) {
-                    return status;
-                }
+    return buf;
+}
 
-                if (pair->optional == DEVICE_IS_REQUIRED
-                        && pair->set == DEVICE_IS_UNSET) {
-                    apr_file_printf(ds->err, "'%s' is required.\n",
-                            apr_pescape_echo(ds->pool, pair->key, 1));
-                    return APR_EINVAL;
-                }
+/*
+ * Reverse device_export_escape() in place. NULL stands for \N.
+ */
+static char *device_import_unescape(char *val)
+{
+    char *v, *b;
 
-            }
+    if (!strcmp(val, "\\N")) {
+        return NULL;
+    }
 
+    for (v = b = val; *v; v++) {
+        if (*v == '\\' && v[1]) {
+            switch (*++v) {
+            case 't':
+                *b++ = '\t';
+                break;
+            case 'n':
+                *b++ = '\n';
+                break;
+            case 'r':
+                *b++ = '\r';
+                break;
+            default:
+                *b++ = *v;
+            }
+        }
+        else {
+            *b++ = *v;
         }
-
-        status = device_files(ds, files);
     }
+    *b = 0;
 
-    return status;
+    return val;
 }
 
-static apr_status_t device_set(device_set_t *ds, const char **args)
+/*
+ * Write every set of options as one tab separated line each.
+ *
+ * The first line names the columns, the key first and the rest in order
+ * of name. Lines are sorted by the key, so that two exports of the same
+ * options can be compared line by line.
+ */
+static apr_status_t device_export(device_set_t *ds, const char **args)
 {
-    const char *key = NULL, *val = NULL;
-    apr_status_t status = APR_SUCCESS;
-    int len;
+    apr_dir_t *thedir;
+    apr_finfo_t dirent;
+    apr_array_header_t *columns, *dirs, *rows;
+    device_pair_t *key;
+    apr_status_t status;
+    int dirfd, i, j;
 
-    for (len = 0; args && args[len]; len++);
+    if (args[0]) {
+        apr_file_printf(ds->err, "no options are permitted.\n");
+        return APR_EINVAL;
+    }
 
-    apr_array_header_t *files = apr_array_make(ds->pool, len, sizeof(device_file_t));
+    key = apr_hash_get(ds->pairs, ds->key, APR_HASH_KEY_STRING);
 
-    if (ds->key) {
+    if (!key) {
+        apr_file_printf(ds->err, "key '%s' is not recognised.\n",
+                apr_pescape_echo(ds->pool, ds->key, 1));
+        return APR_EINVAL;
+    }
 
-        if (!args[0] || !args[1]) {
-            apr_file_printf(ds->err, "%s is required.\n", ds->key);
-            return APR_EINVAL;
+    columns = device_export_columns(ds, key);
+
+    if ((status = apr_dir_open(&thedir, ".", ds->pool)) != APR_SUCCESS) {
+        apr_file_printf(ds->err, "could not open current directory: %pm\n", &status);
+        return status;
+    }
+
+    dirs = apr_array_make(ds->pool, 64, sizeof(const char *));
+
+    do {
+        status = apr_dir_read(&dirent,
+                APR_FINFO_TYPE | APR_FINFO_NAME | APR_FINFO_WPROT, thedir);
+        if (APR_STATUS_IS_INCOMPLETE(status)) {
+            continue; /* ignore un-stat()able files */
+        } else if (status != APR_SUCCESS) {
+            break;
         }
-        else {
 
-            int exact = 0;
+        /* hidden files are ignored */
+        if (dirent.name[0] == '.' || dirent.filetype != APR_DIR) {
+            continue;
+        }
+
+        APR_ARRAY_PUSH(dirs, const char *) = apr_pstrdup(ds->pool, dirent.name);
+
+    } while (1);
+
+    apr_dir_close(thedir);
 
-            apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
+    device_file_prefetch(ds, dirs, columns);
 
-            status = device_get(ds, args[0], options, &ds->keyval, &ds->keypath, &exact);
+    rows = apr_array_make(ds->pool, dirs->nelts, sizeof(device_export_row_t));
 
-            if (APR_SUCCESS != status) {
-                return status;
-            }
+    for (i = 0; i < dirs->nelts; i++) {
+        device_set_t scratch = *ds;
+        const char *dir = APR_ARRAY_IDX(dirs, i, const char *);
+        apr_array_header_t *line;
+        device_export_row_t *row;
+        apr_int64_t order = 0;
+        int max = 0;
 
-            if (!exact) {
-                apr_file_printf(ds->err, "%s was not found.\n", args[0]);
-                return APR_EINVAL;
-            }
-        }
+        apr_pool_create(&scratch.pool, ds->pool);
 
-        args += 2;
-    }
+        line = apr_array_make(scratch.pool, columns->nelts, sizeof(const char *));
 
-    while (args && *args) {
+        dirfd = DEVICE_KEYDIR_UNOPENED;
 
-        const char *arg = *(args++);
+        for (j = 0; j < columns->nelts; j++) {
+            device_pair_t *pair = APR_ARRAY_IDX(columns, j, device_pair_t *);
+            apr_array_header_t *values = apr_array_make(scratch.pool, 1,
+                    sizeof(device_value_t));
 
-        if (!key) {
-            key = arg;
-            continue;
-        }
-        else {
-            val = arg;
-        }
+            device_value(&scratch, pair, dir, &dirfd, values, NULL, &order, &max);
 
-        if (ds->mode != DEVICE_RENAME && ds->key && !strcmp(key, ds->key)) {
-            apr_file_printf(ds->err, "'%s' cannot be modified.\n",
-                    apr_pescape_echo(ds->pool, key, 1));
-            return APR_EINVAL;
+            APR_ARRAY_PUSH(line, const char *) = values->nelts ?
+                    device_export_escape(scratch.pool,
+                            APR_ARRAY_IDX(values, 0, device_value_t).value) : "\\N";
         }
 
-        status = device_parse(ds, key, val, files);
+        device_keydir_close(dirfd);
 
-        if (APR_SUCCESS != status) {
-            break;
+        /* sets without a name are not ours */
+        if (!strcmp(APR_ARRAY_IDX(line, 0, const char *), "\\N")) {
+            apr_pool_destroy(scratch.pool);
+            continue;
         }
 
-        key = NULL;
-        val = NULL;
+        row = apr_array_push(rows);
+        row->keyval = apr_pstrdup(ds->pool, APR_ARRAY_IDX(line, 0, const char *));
+        row->line = apr_array_pstrcat(ds->pool, line, '\t');
+
+        apr_pool_destroy(scratch.pool);
     }
 
-    if (key && !val) {
-        apr_file_printf(ds->err, "argument '%s' has no corresponding value.\n",
-                apr_pescape_echo(ds->pool, key, 1));
-        return APR_EINVAL;
+    ds->prefetch = NULL;
+
+    qsort(rows->elts, rows->nelts, rows->elt_size, export_asc);
+
+    for (j = 0; j < columns->nelts; j++) {
+        apr_file_printf(ds->out, "%s%s", j ? "\t" : "",
+                APR_ARRAY_IDX(columns, j, device_pair_t *)->key);
     }
+    apr_file_putc('\n', ds->out);
 
-    if (APR_SUCCESS == status) {
-        status = device_files(ds, files);
+    for (i = 0; i < rows->nelts; i++) {
+        apr_file_printf(ds->out, "%s\n",
+                APR_ARRAY_IDX(rows, i, device_export_row_t).line);
     }
 
-    return status;
+    return APR_SUCCESS;
 }
 
-static apr_status_t device_rename(device_set_t *ds, const char **args)
+/*
+ * Read one line, without the newline.
+ */
+static apr_status_t device_import_read(device_set_t *ds, apr_file_t *in,
+        char **line)
 {
+    apr_array_header_t *buf = apr_array_make(ds->pool, 256, sizeof(char));
+    apr_status_t status;
+    char ch;
 
-    return device_set(ds, args);
+    while (APR_SUCCESS == (status = apr_file_getc(&ch, in)) && ch != '\n') {
+        APR_ARRAY_PUSH(buf, char) = ch;
+    }
+
+    if (APR_STATUS_IS_EOF(status) && buf->nelts) {
+        status = APR_SUCCESS;
+    }
+
+    if (APR_SUCCESS == status) {
+        APR_ARRAY_PUSH(buf, char) = 0;
+        line[0] = buf->elts;
+    }
+
+    return status;
 }
 
-static apr_status_t device_value(device_set_t *ds, device_pair_t *pair,
-        const char *keypath, apr_array_header_t *values, const char **keyval,
-        apr_int64_t *order, int *max)
+/*
+ * Bring one set of options in line with a record, adding the set if no
+ * set of that name exists. Options that already hold the value given
+ * are not written. Indexes are left to device_import_index().
+ */
+static apr_status_t device_import_record(device_set_t *ds,
+        apr_array_header_t *columns, const char **fields)
 {
-    char *path;
-    device_value_t *value;
-    const char *val = NULL;
-    apr_off_t len = 0;
-
+    device_names_t names;
+    device_pair_t *key = APR_ARRAY_IDX(columns, 0, device_pair_t *);
+    apr_array_header_t *args, *files;
     apr_status_t status;
+    apr_int64_t found, order = 0;
+    int dirfd, i, max = 0;
 
-    switch (pair->type) {
-    case DEVICE_PAIR_PORT:
-    case DEVICE_PAIR_UNPRIVILEGED_PORT:
-    case DEVICE_PAIR_HOSTNAME:
-    case DEVICE_PAIR_FQDN:
-    case DEVICE_PAIR_SELECT:
-    case DEVICE_PAIR_BYTES:
-    case DEVICE_PAIR_SQL_IDENTIFIER:
-    case DEVICE_PAIR_SQL_DELIMITED_IDENTIFIER:
-    case DEVICE_PAIR_USER:
-    case DEVICE_PAIR_DISTINGUISHED_NAME:
-    case DEVICE_PAIR_INTEGER:
-    case DEVICE_PAIR_TEXT:
-    case DEVICE_PAIR_HEX:
-    case DEVICE_PAIR_URL_PATH:
-    case DEVICE_PAIR_URL_PATH_ABEMPTY:
-    case DEVICE_PAIR_URL_PATH_ABSOLUTE:
-    case DEVICE_PAIR_URL_PATH_NOSCHEME:
-    case DEVICE_PAIR_URL_PATH_ROOTLESS:
-    case DEVICE_PAIR_URL_PATH_EMPTY:
-    case DEVICE_PAIR_URI:
-    case DEVICE_PAIR_URI_ABSOLUTE:
-    case DEVICE_PAIR_URI_RELATIVE:
-    case DEVICE_PAIR_ADDRESS:
-    case DEVICE_PAIR_ADDRESS_LOCALPART:
-    case DEVICE_PAIR_ADDRESS_MAILBOX:
-    case DEVICE_PAIR_ADDRESS_ADDRSPEC: {
+    if (!fields[0]) {
+        apr_file_printf(ds->err, "'%s' is required.\n",
+                apr_pescape_echo(ds->pool, key->key, 1));
+        return APR_EINVAL;
+    }
 
-        const char *keyname;
-        apr_finfo_t finfo;
-
-        keyname = path = apr_pstrcat(ds->pool, pair->key, pair->suffix,
-        NULL);
-        if (keypath
-                && APR_SUCCESS
-                        != (status = apr_filepath_merge(&path, keypath, keyname,
-                                APR_FILEPATH_NOTABSOLUTE, ds->pool))) {
-            apr_file_printf(ds->err, "cannot merge option set key '%s': %pm\n",
-                    pair->key, &status);
-            break;
-        }
+    if (APR_SUCCESS != (status = device_names_open(ds, key, 0, &names))) {
+        return status;
+    }
 
-        /* stat the file */
-        status = apr_stat(&finfo, path,
-        APR_FINFO_TYPE, ds->pool);
-        if (APR_ENOENT == status) {
-            /* missing - ignore the file */
+    found = device_names_lower(&names, fields[0]);
 
-            /* FIXME: the none/default option goes here */
+    /* not yet there, add it */
+    if (found >= names.count || strcmp(device_names_name(&names, found), fields[0])) {
 
-            break;
-        } else if (APR_SUCCESS != status) {
-            apr_file_printf(ds->err, "cannot stat option set '%s': %pm\n",
-                    pair->key, &status);
-            break;
-        }
+        args = apr_array_make(ds->pool, columns->nelts * 2 + 1, sizeof(const char *));
 
-        /* open/seek/read the file */
-        if (APR_SUCCESS
-                != (status = device_file_read(ds, ds->pool, pair->key, path,
-                        &val, &len))) {
-            /* error already handled */
-            break;
+        for (i = 0; i < columns->nelts; i++) {
+            device_pair_t *pair = APR_ARRAY_IDX(columns, i, device_pair_t *);
+
+            if (fields[i] && pair->type != DEVICE_PAIR_INDEX) {
+                APR_ARRAY_PUSH(args, const char *) = pair->key;
+                APR_ARRAY_PUSH(args, const char *) = fields[i];
+            }
         }
+        apr_array_push(args);
 
-        value = apr_array_push(values);
-        value->pair = pair;
-        value->value = val;
-        value->len = len;
-        value->set = 1;
+        ds->mode = DEVICE_ADD;
 
-        max[0] = max[0] > value->len ? max[0] : value->len;
+        status = device_add(ds, (const char **)args->elts);
 
-        break;
+        ds->mode = DEVICE_IMPORT;
+
+        return status;
     }
-    case DEVICE_PAIR_POLAR:
-    case DEVICE_PAIR_SWITCH: {
 
-        const char *keyname;
-        apr_finfo_t finfo;
-
-        keyname = path = apr_pstrcat(ds->pool, pair->key, pair->suffix,
-        NULL);
-        if (keypath
-                && APR_SUCCESS
-                        != (status = apr_filepath_merge(&path, keypath, keyname,
-                                APR_FILEPATH_NOTABSOLUTE, ds->pool))) {
-            apr_file_printf(ds->err, "cannot merge option set key '%s': %pm\n",
-                    pair->key, &status);
-            break;
-        }
+    ds->keyval = device_names_name(&names, found);
+    ds->keypath = device_names_dir(&names, found);
 
-        /* stat the file */
-        status = apr_stat(&finfo, path,
-        APR_FINFO_TYPE, ds->pool);
-        if (APR_ENOENT == status) {
+    ds->mode = DEVICE_SET;
 
-            value = apr_array_push(values);
-            value->pair = pair;
+    files = apr_array_make(ds->pool, columns->nelts, sizeof(device_file_t));
 
-            switch (pair->type) {
-            case DEVICE_PAIR_POLAR:
+    dirfd = DEVICE_KEYDIR_UNOPENED;
 
-                value->value = "no";
-                value->len = strlen("no");
+    for (i = 1; i < columns->nelts; i++) {
+        device_pair_t *pair = APR_ARRAY_IDX(columns, i, device_pair_t *);
+        apr_array_header_t *values;
 
-                break;
-            case DEVICE_PAIR_SWITCH:
+        if (!fields[i] || pair->type == DEVICE_PAIR_INDEX) {
+            continue;
+        }
 
-                value->value = "off";
-                value->len = strlen("off");
+        /* already so, leave alone */
+        values = apr_array_make(ds->pool, 1, sizeof(device_value_t));
+        device_value(ds, pair, ds->keypath, &dirfd, values, NULL, &order, &max);
+        if (values->nelts
+                && !strcmp(APR_ARRAY_IDX(values, 0, device_value_t).value, fields[i])) {
+            continue;
+        }
 
-                break;
-            default:
-                break;
-            }
+        if (APR_SUCCESS != (status = device_parse(ds, pair->key, fields[i], files))) {
+            break;
+        }
+    }
 
-            max[0] = max[0] > value->len ? max[0] : value->len;
+    device_keydir_close(dirfd);
 
-        } else if (APR_SUCCESS == (status)) {
+    if (APR_SUCCESS == status && files->nelts) {
+        status = device_files(ds, files);
+    }
 
-            value = apr_array_push(values);
-            value->pair = pair;
+    ds->mode = DEVICE_IMPORT;
 
-            switch (pair->type) {
-            case DEVICE_PAIR_POLAR:
+    return status;
+}
 
-                value->value = "yes";
-                value->len = strlen("yes");
-                value->set = 1;
+/*
+ * An index value given by a record, given once every record is in.
+ */
+typedef struct device_import_index_t {
+    device_pair_t *pair;
+    const char *keyval;
+    const char *index;
+    apr_int64_t order;
+    int lineno;
+} device_import_index_t;
 
-                break;
-            case DEVICE_PAIR_SWITCH:
+static int import_asc(const void *a, const void *b)
+{
+    const device_import_index_t *ia = a, *ib = b;
+    int cmp = strcmp(ia->pair->key, ib->pair->key);
 
-                value->value = "on";
-                value->len = strlen("on");
-                value->set = 1;
+    if (cmp) {
+        return cmp;
+    }
 
-                break;
-            default:
-                break;
-            }
+    if (ia->order != ib->order) {
+        return (ia->order > ib->order) - (ia->order < ib->order);
+    }
 
-            max[0] = max[0] > value->len ? max[0] : value->len;
+    return ia->lineno - ib->lineno;
+}
 
-        } else {
-            apr_file_printf(ds->err, "cannot stat option set '%s': %pm\n",
-                    pair->key, &status);
-            break;
-        }
+/*
+ * Give one set of options the index its record asked for, unless it
+ * already has it.
+ *
+ * Making space for an index moves those at or above it up, so the
+ * indexes of an import are given lowest first. Each index given can
+ * then only move those still to come, and every index ends up as its
+ * record gave it.
+ */
+static apr_status_t device_import_index(device_set_t *ds,
+        device_names_t *names, device_import_index_t *index)
+{
+    apr_array_header_t *values, *files;
+    apr_status_t status = APR_SUCCESS;
+    apr_int64_t found, order = 0;
+    int dirfd, max = 0;
 
-        break;
+    found = device_names_lower(names, index->keyval);
+    if (found >= names->count
+            || strcmp(device_names_name(names, found), index->keyval)) {
+        apr_file_printf(ds->err, "'%s' was not found.\n",
+                apr_pescape_echo(ds->pool, index->keyval, 1));
+        return APR_ENOENT;
     }
-    case DEVICE_PAIR_INDEX: {
 
-        const char *keyname;
-        apr_finfo_t finfo;
-        char *end;
+    ds->keyval = device_names_name(names, found);
+    ds->keypath = device_names_dir(names, found);
 
-        if (!order) {
-            status = APR_ENOENT;
-            break;
-        }
+    /* already so, leave alone */
+    dirfd = DEVICE_KEYDIR_UNOPENED;
 
-        keyname = path = apr_pstrcat(ds->pool, pair->key, pair->suffix,
-        NULL);
-        if (keypath
-                && APR_SUCCESS
-                        != (status = apr_filepath_merge(&path, keypath, keyname,
-                                APR_FILEPATH_NOTABSOLUTE, ds->pool))) {
-            apr_file_printf(ds->err, "cannot merge option set key '%s': %pm\n",
-                    pair->key, &status);
-            break;
-        }
+    values = apr_array_make(ds->pool, 1, sizeof(device_value_t));
+    device_value(ds, index->pair, ds->keypath, &dirfd, values, NULL, &order, &max);
 
-        /* stat the file */
-        status = apr_stat(&finfo, path,
-        APR_FINFO_TYPE, ds->pool);
-        if (APR_ENOENT == status) {
-            /* missing - ignore the file */
-            break;
-        } else if (APR_SUCCESS != status) {
-            apr_file_printf(ds->err, "cannot stat option set '%s': %pm\n",
-                    pair->key, &status);
-            break;
-        }
+    device_keydir_close(dirfd);
 
-        /* open/seek/read the file */
-        if (APR_SUCCESS
-                != (status = device_file_read(ds, ds->pool, pair->key, path,
-                        &val, &len))) {
-            /* error already handled */
-            break;
-        }
+    if (values->nelts
+            && !strcmp(APR_ARRAY_IDX(values, 0, device_value_t).value, index->index)) {
+        return APR_SUCCESS;
+    }
 
-        order[0] = apr_strtoi64(val, &end, 10);
-        status = apr_get_os_error();
-        if (end[0] || status == APR_ERANGE) {
-            apr_file_printf(ds->err,
-                    "argument '%s': '%s' is not a valid index, ignoring.\n",
-                    apr_pescape_echo(ds->pool, pair->key, 1),
-                    apr_pescape_echo(ds->pool, val, 1));
-            /* ignore and loop round */
-            break;
-        }
+    ds->mode = DEVICE_SET;
 
-        value = apr_array_push(values);
-        value->pair = pair;
-        value->value = val;
-        value->len = len;
-        value->set = 1;
+    files = apr_array_make(ds->pool, 16, sizeof(device_file_t));
 
-        max[0] = max[0] > value->len ? max[0] : value->len;
+    status = device_parse(ds, index->pair->key, index->index, files);
 
-        break;
+    if (APR_SUCCESS == status && files->nelts) {
+        status = device_files(ds, files);
     }
-    case DEVICE_PAIR_SYMLINK: {
-
-        const char *keyname;
-        apr_finfo_t finfo;
-        char target[PATH_MAX];
-        apr_ssize_t size;
-
-        keyname = path = apr_pstrcat(ds->pool, pair->key, pair->suffix,
-        NULL);
-        if (keypath
-                && APR_SUCCESS
-                        != (status = apr_filepath_merge(&path, keypath, keyname,
-                                APR_FILEPATH_NOTABSOLUTE, ds->pool))) {
-            apr_file_printf(ds->err, "cannot merge option set key '%s': %pm\n",
-                    pair->key, &status);
-            break;
-        }
 
-        /* stat the link */
-        status = apr_stat(&finfo, path,
-        APR_FINFO_LINK | APR_FINFO_TYPE, ds->pool);
-        if (APR_ENOENT == status) {
-            /* missing - ignore the file */
-            status = APR_SUCCESS;
+    ds->mode = DEVICE_IMPORT;
 
-            value = apr_array_push(values);
-            value->pair = pair;
+    return status;
+}
 
-            switch (pair->optional) {
-            case DEVICE_IS_OPTIONAL:
+/*
+ * Read records in the format written by device_export(), updating or
+ * adding each set of options in turn.
+ *
+ * Each record is written as a separate set, as if by --set or --add. A
+ * record that fails is reported and skipped. Once all are in, the
+ * indexes given are applied lowest first, so that an export imported
+ * again gives back the same order.
+ */
+static apr_status_t device_import(device_set_t *ds, const char **args)
+{
+    apr_pool_t *pool = ds->pool;
+    apr_file_t *in;
+    apr_array_header_t *columns;
+    apr_array_header_t *pairs;
+    apr_array_header_t *sets;
+    apr_array_header_t *indexes;
+    apr_hash_index_t *hi;
+    device_pair_t *key;
+    apr_status_t status;
+    char *line, *field, *state;
+    int failed = 0, lineno = 1;
+    int i;
 
-                if (pair->unset) {
-                    value->len = strlen(pair->unset);
-                    value->value = pair->unset;
-                }
-                else {
-                    value->len = strlen(DEVICE_SYMLINK_NONE);
-                    value->value = DEVICE_SYMLINK_NONE;
-                }
+    if (args[0]) {
+        apr_file_printf(ds->err, "no options are permitted.\n");
+        return APR_EINVAL;
+    }
 
-                break;
-            case DEVICE_IS_REQUIRED:
+    if (!(key = apr_hash_get(ds->pairs, ds->key, APR_HASH_KEY_STRING))) {
+        apr_file_printf(ds->err, "key '%s' is not recognised.\n",
+                apr_pescape_echo(ds->pool, ds->key, 1));
+        return APR_EINVAL;
+    }
 
-                value->len = strlen(DEVICE_SYMLINK_ERROR);
-                value->value = DEVICE_SYMLINK_ERROR;
+    if (APR_SUCCESS != (status = apr_file_open_flags_stdin(&in,
+            APR_FOPEN_BUFFERED, pool))) {
+        apr_file_printf(ds->err, "cannot open stdin: %pm\n", &status);
+        return status;
+    }
 
-                break;
-            }
+    /* the header names the columns, the key first */
+    if (APR_SUCCESS != (status = device_import_read(ds, in, &line))) {
+        apr_file_printf(ds->err, "cannot read header: %pm\n", &status);
+        return status;
+    }
 
-            max[0] = max[0] > value->len ? max[0] : value->len;
+    columns = apr_array_make(pool, 16, sizeof(device_pair_t *));
 
-            break;
-        } else if (finfo.filetype != APR_LNK) {
-            apr_file_printf(ds->err,
-                    "option set '%s': link expected, ignoring\n", pair->key);
-            break;
-        } else if (APR_SUCCESS != status) {
-            apr_file_printf(ds->err, "cannot stat option set '%s': %pm\n",
-                    pair->key, &status);
-            break;
-        }
+    for (field = apr_strtok(line, "\t", &state); field;
+            field = apr_strtok(NULL, "\t", &state)) {
+        device_pair_t *pair = apr_hash_get(ds->pairs, field, APR_HASH_KEY_STRING);
 
-        /* stat the key */
-        if ((size = readlink(path, target, sizeof(target))) < 0) {
-            status = apr_get_os_error();
-            apr_file_printf(ds->err, "cannot readlink option set '%s': %pm\n",
-                    pair->key, &status);
+        if (!pair) {
+            apr_file_printf(ds->err, "line 1: '%s' is not recognised.\n",
+                    apr_pescape_echo(ds->pool, field, 1));
+            return APR_EINVAL;
         }
 
-        else {
+        APR_ARRAY_PUSH(columns, device_pair_t *) = pair;
+    }
 
-            const char *val;
+    if (!columns->nelts || strcmp(APR_ARRAY_IDX(columns, 0, device_pair_t *)->key,
+            ds->key)) {
+        apr_file_printf(ds->err, "line 1: the first column must be '%s'.\n",
+                apr_pescape_echo(ds->pool, ds->key, 1));
+        return APR_EINVAL;
+    }
 
-            int i;
-            int found = 0;
+    /* remember how each option starts out */
+    pairs = apr_array_make(pool, apr_hash_count(ds->pairs), sizeof(device_pair_t *));
+    sets = apr_array_make(pool, apr_hash_count(ds->pairs), sizeof(device_set_e));
+    for (hi = apr_hash_first(pool, ds->pairs); hi; hi = apr_hash_next(hi)) {
+        device_pair_t *pair;
 
-            /* match the base path */
-            for (i = 0; i < pair->s.bases->nelts; i++) {
+        apr_hash_this(hi, NULL, NULL, (void **)&pair);
 
-                char *base = APR_ARRAY_IDX(pair->s.bases, i, char *);
+        APR_ARRAY_PUSH(pairs, device_pair_t *) = pair;
+        APR_ARRAY_PUSH(sets, device_set_e) = pair->set;
+    }
 
-                int baselen = strlen(base);
+    indexes = apr_array_make(pool, 16, sizeof(device_import_index_t));
 
-                /* ignore trailing '/' if it exists */
-                if (baselen && base[baselen - 1] == '/') {
-                    baselen--;
-                }
+    while (1) {
 
-                /* do we have a prefix match? */
-                if (baselen <= size && !strncmp(base, target, baselen)) {
+        const char **fields;
+        char *f;
 
-                    val = target + baselen;
-                    size = size - baselen;
+        apr_pool_create(&ds->pool, pool);
 
-                    /* do we have exact match or a '/' at the end? */
-                    if (!size || val[0] == '/') {
-                        found = 1;
-                        break;
-                    }
+        lineno++;
 
-                }
+        if (APR_SUCCESS != (status = device_import_read(ds, in, &line))) {
 
-            }
+            apr_pool_destroy(ds->pool);
+            ds->pool = pool;
 
-            /* oops, no base path matches */
-            if (!found) {
-                apr_file_printf(ds->err,
-                        "option set '%s' does not exist beneath bases.\n", pair->key);
-                status = APR_EGENERAL;
+            if (APR_STATUS_IS_EOF(status)) {
+                break;
             }
 
-            if (!pair->s.symlink_recursive && size && val[0] == '/') {
+            apr_file_printf(ds->err, "line %d: cannot read: %pm\n", lineno, &status);
+            return status;
+        }
 
-                /* skip past '/' */
-                val++;
-                size--;
+        /* empty fields count, so split by hand */
+        fields = apr_pcalloc(ds->pool, columns->nelts * sizeof(const char *));
+        for (i = 0, f = line; i < columns->nelts && f; i++) {
+            char *tab = strchr(f, '\t');
 
+            if (tab) {
+                *tab++ = 0;
             }
 
-            if (size >= pair->s.symlink_suffix_len) {
+            fields[i] = device_import_unescape(f);
+            f = tab;
+        }
 
-                apr_ssize_t len = size - pair->s.symlink_suffix_len;
-                val = apr_pstrndup(ds->pool, val, len);
+        if (i != columns->nelts || f) {
+            apr_file_printf(ds->err, "line %d: expected %d fields.\n", lineno,
+                    columns->nelts);
+            failed++;
+        }
 
-                value = apr_array_push(values);
-                value->pair = pair;
-                value->value = val;
-                value->len = strlen(val);
-                value->set = 1;
+        else {
 
-                max[0] = max[0] > value->len ? max[0] : value->len;
+            ds->keypath = NULL;
+            ds->keyval = NULL;
 
-            } else {
-                apr_file_printf(ds->err,
-                        "option set '%s' does not have suffix: %s\n", pair->key,
-                        pair->s.symlink_suffix);
-                status = APR_EGENERAL;
+            /* every option starts out as it was declared */
+            for (i = 0; i < pairs->nelts; i++) {
+                APR_ARRAY_IDX(pairs, i, device_pair_t *)->set =
+                        APR_ARRAY_IDX(sets, i, device_set_e);
             }
 
-        }
+            if (APR_SUCCESS != device_import_record(ds, columns, fields)) {
+                apr_file_printf(ds->err, "line %d: '%s' was not imported.\n",
+                        lineno, fields[0] ? fields[0] : "");
+                failed++;
+            }
 
-        break;
+            /* remember the indexes given, to apply at the end */
+            else {
+                for (i = 1; i < columns->nelts; i++) {
+                    device_pair_t *pair = APR_ARRAY_IDX(columns, i, device_pair_t *);
+                    device_import_index_t *index;
 
-    }
-    case DEVICE_PAIR_RELATION: {
+                    if (pair->type != DEVICE_PAIR_INDEX || !fields[i]) {
+                        continue;
+                    }
 
-        const char *keyname;
-        const char *relname;
-        char *relpath;
-        apr_finfo_t finfo;
-
-        keyname = path = apr_pstrcat(ds->pool, pair->key, pair->suffix,
-        NULL);
-        if (keypath
-                && APR_SUCCESS
-                        != (status = apr_filepath_merge(&path, keypath, keyname,
-                                APR_FILEPATH_NOTABSOLUTE, ds->pool))) {
-            apr_file_printf(ds->err, "cannot merge option set key '%s': %pm\n",
-                    pair->key, &status);
-            break;
-        }
+                    if (APR_SUCCESS != device_parse_index(ds, pair, fields[i],
+                            NULL, NULL)) {
+                        apr_file_printf(ds->err, "line %d: '%s' was not given %s.\n",
+                                lineno, fields[0], pair->key);
+                        failed++;
+                        continue;
+                    }
 
-        /* stat the file */
-        status = apr_stat(&finfo, path,
-        APR_FINFO_LINK | APR_FINFO_TYPE, ds->pool);
-        if (APR_ENOENT == status) {
-            /* missing - optional or error */
+                    index = apr_array_push(indexes);
+                    index->pair = pair;
+                    index->keyval = apr_pstrdup(pool, fields[0]);
+                    index->index = apr_pstrdup(pool, fields[i]);
+                    index->order = apr_strtoi64(fields[i], NULL, 10);
+                    index->lineno = lineno;
+                }
+            }
 
-            value = apr_array_push(values);
-            value->pair = pair;
+        }
 
-            switch (pair->optional) {
-            case DEVICE_IS_OPTIONAL:
+        apr_pool_destroy(ds->pool);
+        ds->pool = pool;
+    }
 
-                if (pair->unset) {
-                    value->len = strlen(pair->unset);
-                    value->value = pair->unset;
-                }
-                else {
-                    value->len = strlen(DEVICE_RELATION_NONE);
-                    value->value = DEVICE_RELATION_NONE;
-                }
+    /* indexes go in lowest first, so that none moves once given */
+    if (indexes->nelts) {
+        device_names_t names;
 
-                break;
-            case DEVICE_IS_REQUIRED:
+        qsort(indexes->elts, indexes->nelts, indexes->elt_size, import_asc);
 
-                value->len = strlen(DEVICE_RELATION_ERROR);
-                value->value = DEVICE_RELATION_ERROR;
+        if (APR_SUCCESS != (status = device_names_open(ds, key, 0, &names))) {
+            return status;
+        }
 
-                break;
-            }
+        for (i = 0; i < indexes->nelts; i++) {
+            device_import_index_t *index = &APR_ARRAY_IDX(indexes, i,
+                    device_import_index_t);
+            int j;
 
-            max[0] = max[0] > value->len ? max[0] : value->len;
+            apr_pool_create(&ds->pool, pool);
 
-            break;
-        } else if (APR_SUCCESS != status) {
-            apr_file_printf(ds->err, "cannot stat option set '%s': %pm\n",
-                    pair->key, &status);
-            break;
-        }
+            ds->keypath = NULL;
+            ds->keyval = NULL;
 
-        relname = apr_pstrcat(ds->pool, pair->r.relation_name,
-                pair->r.relation_suffix, NULL);
+            for (j = 0; j < pairs->nelts; j++) {
+                APR_ARRAY_IDX(pairs, j, device_pair_t *)->set =
+                        APR_ARRAY_IDX(sets, j, device_set_e);
+            }
 
-        /* find relation */
-        if (APR_SUCCESS
-                != (status = apr_filepath_merge(&relpath, path, relname,
-                        APR_FILEPATH_NOTABSOLUTE, ds->pool))) {
-            apr_file_printf(ds->err, "cannot merge option set key '%s': %pm\n",
-                    pair->key, &status);
-            break;
-        }
+            if (APR_SUCCESS != device_import_index(ds, &names, index)) {
+                apr_file_printf(ds->err, "line %d: '%s' was not given %s '%s'.\n",
+                        index->lineno, apr_pescape_echo(ds->pool, index->keyval, 1),
+                        index->pair->key,
+                        apr_pescape_echo(ds->pool, index->index, 1));
+                failed++;
+            }
 
-        /* open/seek/read the file */
-        else if (APR_SUCCESS
-                != (status = device_file_read(ds, ds->pool, pair->key, relpath,
-                        &val, &len))) {
-            /* error already handled */
-            break;
+            apr_pool_destroy(ds->pool);
+            ds->pool = pool;
         }
+    }
 
-        value = apr_array_push(values);
-        value->pair = pair;
-        value->value = val;
-        value->len = len;
-        value->set = 1;
+    return failed ? APR_EINVAL : APR_SUCCESS;
+}
 
-        max[0] = max[0] > value->len ? max[0] : value->len;
+typedef struct device_reindex_entry_t {
+    apr_int64_t order;
+    int dir;
+} device_reindex_entry_t;
 
-        break;
+typedef struct device_reindex_t {
+    device_pair_t *pair;
+    apr_array_header_t *entries;
+} device_reindex_t;
 
-    }
-    }
+static int reindex_asc(const void *a, const void *b)
+{
+    const device_reindex_entry_t *ea = a, *eb = b;
 
-    if (keyval && pair->key && ds->key && !strcmp(pair->key, ds->key)) {
-        keyval[0] = val;
+    if (ea->order != eb->order) {
+        return (ea->order > eb->order) - (ea->order < eb->order);
     }
 
-    return status;
+    return ea->dir - eb->dir;
 }
 
-static apr_status_t device_list(device_set_t *ds, const char **args)
+/*
+ * Renumber each index from zero, spaced by its gap, removing any other
+ * gaps left behind by option sets that have gone.
+ *
+ * The directory is scanned once, reading every index of each option set
+ * in turn. Only option sets whose index changes are rewritten. Index
+ * symlinks found along the way that no longer name an option set are
+ * removed.
+ */
+static apr_status_t device_reindex(device_set_t *ds, const char **args)
 {
+    apr_hash_index_t *hi;
+    void *v;
     apr_dir_t *thedir;
     apr_finfo_t dirent;
-    device_table_t *table;
-    device_row_t *row;
-    device_value_t *value;
-
-    char *upper;
+    apr_pool_t *pool;
 
-    apr_array_header_t *rows = apr_array_make(ds->pool,
-            16, sizeof(device_row_t));
+    apr_array_header_t *indexes = apr_array_make(ds->pool,
+            4, sizeof(device_reindex_t));
+    apr_array_header_t *dirs = apr_array_make(ds->pool,
+            64, sizeof(const char *));
+    apr_array_header_t *files = apr_array_make(ds->pool,
+            16, sizeof(device_file_t));
+    apr_array_header_t *slinks = apr_array_make(ds->pool,
+            64, sizeof(const char *));
+    apr_hash_t *links = apr_hash_make(ds->pool);
 
     apr_status_t status = APR_SUCCESS;
+    const char *indexed = NULL;
+    int dirfd, i, j;
 
-    int i, j, k;
+    for (hi = apr_hash_first(ds->pool, ds->pairs); hi; hi = apr_hash_next(hi)) {
+
+        apr_hash_this(hi, NULL, NULL, &v);
+
+        if (((device_pair_t *)v)->type == DEVICE_PAIR_INDEX) {
+
+            device_reindex_t *index = apr_array_push(indexes);
+
+            index->pair = v;
+            index->entries = apr_array_make(ds->pool, 64,
+                    sizeof(device_reindex_entry_t));
+        }
 
-    if (!ds->show_table) {
-        apr_file_printf(ds->err, "Name to show was not specified.\n");
-        return APR_EINVAL;
     }
 
-    /* scan the directories to create our list */
+    if (!indexes->nelts) {
+        return APR_SUCCESS;
+    }
+
+    /* scan the directories once, reading every index */
     if ((status = apr_dir_open(&thedir, ".", ds->pool)) != APR_SUCCESS) {
         /* could not open directory, fail */
         apr_file_printf(ds->err, "could not open current directory: %pm\n", &status);
         return status;
     }
 
+    apr_pool_create(&pool, ds->pool);
+
     do {
 
         status = apr_dir_read(&dirent,
@@ -6816,211 +10196,195 @@ static apr_status_t device_list(device_set_t *ds, const char **args)
             break;
         }
 
-        /* hidden files are ignored */
-        if (dirent.name[0] == '.') {
+        /* numeric symlinks are index links, checked once all are read */
+        if (dirent.filetype == APR_LNK && dirent.name[0]
+                && !dirent.name[strspn(dirent.name, "-0123456789")]) {
+            APR_ARRAY_PUSH(slinks, const char *) = apr_pstrdup(ds->pool, dirent.name);
             continue;
         }
 
-        switch (dirent.filetype) {
-        case APR_DIR: {
-
-            row = apr_array_push(rows);
-            row->indexes = apr_array_make(ds->pool, 16, sizeof(device_value_t));
-            row->flags = apr_array_make(ds->pool, 16, sizeof(device_value_t));
-            row->values = apr_array_make(ds->pool, 16, sizeof(device_value_t));
-
-            for (i = 0; i < ds->show_index->nelts; i++) {
-                table = &APR_ARRAY_IDX(ds->show_index, i, device_table_t);
-
-                status = device_value(ds, table->pair, dirent.name, row->indexes, &row->keyval, &row->order, &table->max);
-
-                if (APR_SUCCESS != status) {
-                    device_value_t *value;
-                    value = apr_array_push(row->flags);
-                    value->pair = table->pair;
-                    value->value = "";
-                    value->len = 0;
-                }
-
-            }
-
-            for (i = 0; i < ds->show_flags->nelts; i++) {
-                table = &APR_ARRAY_IDX(ds->show_flags, i, device_table_t);
-
-                status = device_value(ds, table->pair, dirent.name, row->flags, &row->keyval, &row->order, &table->max);
-
-                if (APR_SUCCESS != status) {
-                    device_value_t *value;
-                    value = apr_array_push(row->flags);
-                    value->pair = table->pair;
-                    value->value = "";
-                    value->len = 0;
-                }
-
-            }
-
-            for (i = 0; i < ds->show_table->nelts; i++) {
-                table = &APR_ARRAY_IDX(ds->show_table, i, device_table_t);
-
-                status = device_value(ds, table->pair, dirent.name, row->values, &row->keyval, &row->order, &table->max);
-
-                if (APR_SUCCESS != status) {
-                    device_value_t *value;
-                    value = apr_array_push(row->values);
-                    value->pair = table->pair;
-                    value->value = "";
-                    value->len = 0;
-                }
-
-            }
-
-            break;
-        }
-        default:
-            break;
+        /* hidden files are ignored */
+        if (dirent.name[0] == '.' || dirent.filetype != APR_DIR) {
+            continue;
         }
 
-    } while (1);
+        APR_ARRAY_PUSH(dirs, const char *) = apr_pstrdup(ds->pool, dirent.name);
 
-    apr_dir_close(thedir);
+        /* each index is found relative to the option set, opened once */
+        dirfd = DEVICE_KEYDIR_UNOPENED;
+
+        for (i = 0; i < indexes->nelts; i++) {
 
-    /* flags summary row */
-    if (ds->show_flags->nelts) {
-        apr_file_puts("Flags: ", ds->out);
-        for (j = 0; j < ds->show_flags->nelts; j++) {
+            device_reindex_t *index = &APR_ARRAY_IDX(indexes, i, device_reindex_t);
+            device_reindex_entry_t *entry;
+            const char *val;
+            char *end;
+            apr_int64_t order;
+            apr_off_t len;
 
-            table = &APR_ARRAY_IDX(ds->show_flags, j, device_table_t);
+            apr_pool_clear(pool);
 
-            if (j) {
-                apr_file_puts(",", ds->out);
+            /* open/read the index */
+            if (APR_SUCCESS
+                    != (status = device_file_readat(ds, pool, index->pair->key,
+                            &dirfd, dirent.name,
+                            apr_pstrcat(pool, index->pair->key,
+                                    index->pair->suffix, NULL),
+                            &val, &len))) {
+                /* error already handled */
+                continue;
             }
 
-            if (table->pair->flag) {
-                apr_file_printf(ds->out, "%s (%s)", table->pair->key, table->pair->flag);
-            } else {
-                apr_file_printf(ds->out, "%s", table->pair->key);
+            order = apr_strtoi64(val, &end, 10);
+            if (end[0] || errno == ERANGE) {
+                apr_file_printf(ds->err, "argument '%s': '%s' is not a valid index, ignoring.\n",
+                        apr_pescape_echo(ds->pool, index->pair->key, 1),
+                        apr_pescape_echo(ds->pool, val, 1));
+                continue;
             }
 
+            entry = apr_array_push(index->entries);
+            entry->order = order;
+            entry->dir = dirs->nelts - 1;
         }
-        apr_file_puts("\n", ds->out);
-    }
 
-    /* index header row */
-    for (j = 0; j < ds->show_index->nelts; j++) {
+        device_keydir_close(dirfd);
 
-        table = &APR_ARRAY_IDX(ds->show_index, j, device_table_t);
+    } while (1);
 
-        apr_file_printf(ds->out, "%*s ", table->max, "#");
+    apr_pool_destroy(pool);
 
-    }
+    apr_dir_close(thedir);
 
-    /* flags header row */
-    if (ds->show_flags->nelts) {
-        for (j = 0; j < ds->show_flags->nelts; j++) {
+    if (APR_SUCCESS == status) {
+        /* short circuit, all good */
+    }
+    else if (APR_STATUS_IS_ENOENT(status)) {
+        status = APR_SUCCESS;
+    }
+    else {
+        apr_file_printf(ds->err, "cannot read indexes: %pm\n",
+                &status);
+        return status;
+    }
 
-            table = &APR_ARRAY_IDX(ds->show_flags, j, device_table_t);
+    for (i = 0; i < indexes->nelts; i++) {
 
-            if (table->pair->flag) {
-                apr_file_printf(ds->out, "%*s", (int)strlen(table->pair->flag), "");
-            } else {
-                apr_file_puts(" ", ds->out);
-            }
+        device_reindex_t *index = &APR_ARRAY_IDX(indexes, i, device_reindex_t);
+        device_pair_t *pair = index->pair;
 
+        if (index->entries->nelts
+                && pair->ix.gap > APR_INT64_MAX / index->entries->nelts) {
+            apr_file_printf(ds->err, "argument '%s': index gap is too big to reindex.\n",
+                    apr_pescape_echo(ds->pool, pair->key, 1));
+            return APR_EGENERAL;
         }
-        apr_file_puts(" ", ds->out);
-    }
 
-    /* values header row */
-    for (j = 0; j < ds->show_table->nelts; j++) {
+        qsort(index->entries->elts, index->entries->nelts,
+                index->entries->elt_size, reindex_asc);
 
-        table = &APR_ARRAY_IDX(ds->show_table, j, device_table_t);
+        /* the symlinks that will remain, named by their new index */
+        if (pair->index == DEVICE_IS_INDEXED) {
 
-        upper = apr_pstrdup(ds->pool, table->pair->key);
-        for (k = 0; upper[k]; k++) {
-            upper[k] = apr_toupper(upper[k]);
+            indexed = pair->key;
+
+            for (j = 0; j < index->entries->nelts; j++) {
+
+                const char *slink = apr_psprintf(ds->pool, "%" APR_INT64_T_FMT,
+                        j * pair->ix.gap);
+
+                apr_hash_set(links, slink, APR_HASH_KEY_STRING, slink);
+            }
         }
 
-        apr_file_printf(ds->out, "%*s  ", table->max, upper);
+        for (j = 0; j < index->entries->nelts; j++) {
 
-    }
-    apr_file_puts("\n", ds->out);
+            device_reindex_entry_t *entry = &APR_ARRAY_IDX(index->entries, j,
+                    device_reindex_entry_t);
+            const char *dir = APR_ARRAY_IDX(dirs, entry->dir, const char *);
+            apr_int64_t order = j * pair->ix.gap;
+            device_file_t *file;
 
-    /* sort by order, then by key */
-    qsort(rows->elts, rows->nelts, rows->elt_size, rows_asc);
+            /* already in place, leave alone */
+            if (entry->order == order) {
+                continue;
+            }
 
-    /* rows */
-    for (i = 0; i < rows->nelts; i++) {
-        row = &APR_ARRAY_IDX(rows, i, device_row_t);
+            /* add index */
+            file = apr_array_push(files);
+            file->type = APR_REG;
+            file->order = order;
 
-        for (j = 0; j < row->indexes->nelts && j < ds->show_index->nelts; j++) {
-            table = &APR_ARRAY_IDX(ds->show_index, j, device_table_t);
-            value = &APR_ARRAY_IDX(row->indexes, j, device_value_t);
+            file->val = apr_psprintf(ds->pool, "%" APR_INT64_T_FMT, order);
+            file->dest = apr_pstrcat(ds->pool, dir, "/", pair->key, pair->suffix, NULL);
+            file->template = apr_pstrcat(ds->pool, file->dest, ".XXXXXX", NULL);
+            file->key = pair->key;
+            file->index = DEVICE_IS_NORMAL;
 
-            apr_file_printf(ds->out, "%*s ", table->max, value->value);
+            if (pair->index == DEVICE_IS_INDEXED) {
 
-        }
+                device_file_t *link;
 
-        for (j = 0; j < row->flags->nelts && j < ds->show_flags->nelts; j++) {
-            table = &APR_ARRAY_IDX(ds->show_flags, j, device_table_t);
-            value = &APR_ARRAY_IDX(row->flags, j, device_value_t);
+                /* add symlink */
+                link = apr_array_push(files);
+                link->type = APR_LNK;
+                link->order = order;
 
-            if (value->set) {
-                if (table->pair->flag) {
-                    apr_file_printf(ds->out, "%*s", (int)strlen(table->pair->flag),
-                            table->pair->flag);
-                } else {
-                    apr_file_puts(".", ds->out);
-                }
-            }
-            else {
-                if (table->pair->flag) {
-                    apr_file_printf(ds->out, "%*s", (int)strlen(table->pair->flag),
-                            "");
-                } else {
-                    apr_file_puts(" ", ds->out);
-                }
+                link->dest = file->val;
+                link->key = pair->key;
+                link->val = dir;
+                link->link = dir;
+                link->index = DEVICE_IS_NORMAL;
             }
 
         }
-        if (ds->show_flags->nelts) {
-            apr_file_puts(" ", ds->out);
-        }
 
-        for (j = 0; j < row->values->nelts && j < ds->show_table->nelts; j++) {
-            table = &APR_ARRAY_IDX(ds->show_table, j, device_table_t);
-            value = &APR_ARRAY_IDX(row->values, j, device_value_t);
+    }
 
-            apr_file_printf(ds->out, "%*s  ", table->max, value->value);
+    /* remove every old symlink not reused above, moved or dangling */
+    for (i = 0; indexed && i < slinks->nelts; i++) {
 
+        const char *old = APR_ARRAY_IDX(slinks, i, const char *);
+        device_file_t *link;
+
+        if (apr_hash_get(links, old, APR_HASH_KEY_STRING)) {
+            continue;
         }
-        apr_file_puts("\n", ds->out);
 
+        link = apr_array_push(files);
+        link->type = APR_LNK;
+        link->order = apr_atoi64(old);
+
+        link->dest = old;
+        link->key = indexed;
+        link->val = NULL; /* delete the index */
+        link->index = DEVICE_IS_NORMAL;
     }
 
-    return APR_SUCCESS;
-}
+    if (!files->nelts) {
+        return APR_SUCCESS;
+    }
 
-static apr_status_t device_show(device_set_t *ds, const char **args)
-{
-    apr_hash_index_t *hi;
-    void *v;
-    device_pair_t *pair;
-    apr_off_t len;
+    status = device_files(ds, files);
 
-    apr_array_header_t *values = apr_array_make(ds->pool,
-            16, sizeof(device_value_t));
+    return status;
+}
 
+static apr_status_t device_exec(device_set_t *ds, const char **args)
+{
+    const char *key = NULL, *val = NULL;
     apr_status_t status = APR_SUCCESS;
+    int len;
+
+    for (len = 0; args && args[len]; len++);
 
-    int i, max;
+    apr_array_header_t *files = apr_array_make(ds->pool, len, sizeof(device_file_t));
 
     if (ds->key) {
 
         if (!args[0] || !args[1]) {
-
-            /* no args gives full list */
-            return device_list(ds, args);
-
+            apr_file_printf(ds->err, "%s is required.\n", ds->key);
+            return APR_EINVAL;
         }
         else {
 
@@ -7038,575 +10402,760 @@ static apr_status_t device_show(device_set_t *ds, const char **args)
                 apr_file_printf(ds->err, "%s was not found.\n", args[0]);
                 return APR_EINVAL;
             }
-
         }
 
         args += 2;
     }
 
-    for (hi = apr_hash_first(ds->pool, ds->pairs); hi; hi = apr_hash_next(hi)) {
-
-        apr_hash_this(hi, NULL, NULL, &v);
-        pair = v;
-
-        device_value(ds, pair, ds->keypath, values, NULL, NULL, &max);
-
-    }
-
-
-    max = 0;
-
-    qsort(values->elts, values->nelts, values->elt_size, values_asc);
-
-    for (i = 0; i < values->nelts; i++) {
-        device_value_t *value = &APR_ARRAY_IDX(values, i, device_value_t);
-
-        len = strlen(value->pair->key);
-        max = max > len ? max : len;
-    }
-
-    for (i = 0; i < values->nelts; i++) {
-        device_value_t *value = &APR_ARRAY_IDX(values, i, device_value_t);
-
-        apr_file_printf(ds->out, "%*s: %s\n", max, value->pair->key, value->value);
-    }
-
-    return status;
-}
-
-static apr_status_t device_remove(device_set_t *ds, const char **args)
-{
-    apr_dir_t *thedir;
-    apr_finfo_t dirent;
-
-    char *pwd;
-    const char *keyval = NULL, *keypath = NULL, *backup;
-    apr_status_t status = APR_SUCCESS;
-
-    apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
+    while (args && *args) {
 
-    if (!args[0]) {
-        apr_file_printf(ds->err, "%s is required.\n", ds->key);
-        return status;
-    }
-    if (args[1] && args[2]) {
-        apr_file_printf(ds->err, "no options are permitted other than %s.\n", ds->key);
-        return status;
-    }
-    else {
-        status = device_get(ds, args[0], options, &keyval, &keypath, NULL);
+        const char *arg = *(args++);
 
-        if (APR_SUCCESS != status) {
-            return status;
+        if (!key) {
+            key = arg;
+            continue;
         }
-    }
-
-    /* save the present working directory */
-    status = apr_filepath_get(&pwd, APR_FILEPATH_NATIVE, ds->pool);
-    if (APR_SUCCESS != status) {
-        apr_file_printf(ds->err, "could not remove '%s' (cwd): %pm\n", keyval, &status);
-        return status;
-    }
-
-    /*
-     * Remove is dangerous, so we sanity check on first pass.
-     *
-     * Any hidden files, any directories, we don't touch at all.
-     */
-
-    if ((status = apr_dir_open(&thedir, keypath, ds->pool)) != APR_SUCCESS) {
-
-        /* could not open directory, skip */
-        apr_file_printf(ds->err, "could not remove '%s': %pm\n", keyval, &status);
-
-        return status;
-    }
-
-    do {
-        status = apr_dir_read(&dirent,
-                APR_FINFO_TYPE | APR_FINFO_NAME | APR_FINFO_WPROT, thedir);
-        if (APR_STATUS_IS_INCOMPLETE(status)) {
-            continue; /* ignore un-stat()able files */
-        } else if (APR_STATUS_IS_ENOENT(status)) {
-            break;
-        } else if (status != APR_SUCCESS) {
-            apr_file_printf(ds->err,
-                    "could not remove '%s' (not accessible): %pm\n", keyval,
-                    &status);
-            break;
+        else {
+            val = arg;
         }
 
-        /* ignore current and parent, fail on hidden files */
-        if (dirent.name[0] == '.') {
-            if (!dirent.name[1]) {
-                /* "." */
-                continue;
-            }
-            else if (dirent.name[1] == '.' && !dirent.name[2]) {
-                /* ".." */
-                continue;
-            }
-            else {
-                apr_file_printf(ds->err,
-                        "could not remove '%s': unexpected hidden file: %s\n", keyval, dirent.name);
-                apr_dir_close(thedir);
-                return APR_EINVAL;
-            }
-        }
+        status = device_parse(ds, key, val, files);
 
-        switch (dirent.filetype) {
-        case APR_DIR: {
-            apr_file_printf(ds->err,
-                    "could not remove '%s': unexpected directory: %s\n", keyval, dirent.name);
-            apr_dir_close(thedir);
-            return APR_EINVAL;
-        }
-        default:
+        if (APR_SUCCESS != status) {
             break;
         }
 
-    } while (1);
+        key = NULL;
+        val = NULL;
+    }
+
+    if (key && !val) {
+        apr_file_printf(ds->err, "argument '%s' has no corresponding value.\n",
+                apr_pescape_echo(ds->pool, key, 1));
+        return APR_EINVAL;
+    }
 
-    apr_dir_close(thedir);
+    if (APR_SUCCESS == status) {
+        status = device_command(ds, files);
+    }
 
-    /*
-     * Second step - try rename the directory.
-     *
-     * If we can't do this, give up without touching anything.
-     */
-    backup = apr_psprintf(ds->pool, "%s;%" APR_PID_T_FMT, keypath, getpid());
+    return status;
+}
 
-    if (APR_SUCCESS != (status = apr_file_rename(keypath, backup, ds->pool))) {
-        apr_file_printf(ds->err, "could not remove '%s' (rename): %pm\n", keyval, &status);
-        return status;
+/*
+ * Run one batch request in the mode given on the command line.
+ */
+static apr_status_t device_batch_run(device_set_t *ds, const char **args)
+{
+    switch (ds->mode) {
+    case DEVICE_ADD:
+        return device_add(ds, args);
+    case DEVICE_REMOVE:
+        return device_remove(ds, args);
+    case DEVICE_RENAME:
+        return device_rename(ds, args);
+    case DEVICE_MARK:
+        return device_mark(ds, args);
+    case DEVICE_REINDEX:
+        return device_reindex(ds, args);
+    case DEVICE_REBUILD:
+        return device_rebuild(ds, args);
+    case DEVICE_EXPORT:
+        return device_export(ds, args);
+    case DEVICE_SHOW:
+        return device_show(ds, args);
+    case DEVICE_LIST:
+        return device_list(ds, args);
+    default:
+        return device_set(ds, args);
     }
+}
 
-    apr_file_remove(device_safename(ds->pool, keyval), ds->pool);
+static void device_batch_respond(device_set_t *ds, int exitcode)
+{
+    apr_file_flush(ds->err);
+    apr_file_putc(0, ds->out);
+    apr_file_printf(ds->out, "%d\n", exitcode);
+    apr_file_flush(ds->out);
+}
 
-    /*
-     * Third step - let's remove the files.
-     *
-     * If we fail here it's too late to recover, but our directory is
-     * moved out the way.
-     */
+/*
+ * Run requests until stdin is closed.
+ *
+ * This saves the shell a fork, exec and option parse for each line of a
+ * script aimed at this command. Each request gets a fresh pool, and
+ * starts from the same directory with no options set.
+ *
+ * Commands run by --exec, and records read by --import, share our stdin,
+ * and so cannot be batched.
+ */
+static apr_status_t device_batch(device_set_t *ds)
+{
+    apr_pool_t *pool = ds->pool;
+    apr_file_t *in;
+    apr_array_header_t *pairs;
+    apr_array_header_t *sets;
+    apr_hash_index_t *hi;
+    apr_status_t status;
+    int i;
 
-    /* jump into directory */
-    status = apr_filepath_set(backup, ds->pool);
-    if (APR_SUCCESS != status) {
-        apr_file_printf(ds->err, "could not remove '%s' (chdir): %pm\n", keyval, &status);
+    /* requests and responses are small and many, buffer them */
+    if (APR_SUCCESS != (status = apr_file_open_flags_stdin(&in,
+            APR_FOPEN_BUFFERED, pool))
+            || APR_SUCCESS != (status = apr_file_open_flags_stdout(&ds->out,
+                    APR_FOPEN_BUFFERED, pool))) {
+        apr_file_printf(ds->err, "cannot open stdin/stdout: %pm\n", &status);
         return status;
     }
 
-    if ((status = apr_dir_open(&thedir, ".", ds->pool)) != APR_SUCCESS) {
-        apr_file_printf(ds->err, "could not remove '%s' (open options): %pm\n", keyval, &status);
-        return status;
+    if (ds->mode == DEVICE_EXEC || ds->mode == DEVICE_IMPORT) {
+        device_batch_respond(ds, 1);
+        return APR_ENOTIMPL;
     }
 
-    do {
-        status = apr_dir_read(&dirent,
-                APR_FINFO_TYPE | APR_FINFO_NAME | APR_FINFO_WPROT, thedir);
-        if (APR_STATUS_IS_INCOMPLETE(status)) {
-            continue; /* ignore un-stat()able files */
-        } else if (APR_STATUS_IS_ENOENT(status)) {
-            break;
-        } else if (status != APR_SUCCESS) {
-            apr_file_printf(ds->err,
-                    "could not remove '%s' (read options): %pm\n", keyval,
-                    &status);
-            break;
-        }
+    /* remember how each option starts out */
+    pairs = apr_array_make(pool, apr_hash_count(ds->pairs), sizeof(device_pair_t *));
+    sets = apr_array_make(pool, apr_hash_count(ds->pairs), sizeof(device_set_e));
+    for (hi = apr_hash_first(pool, ds->pairs); hi; hi = apr_hash_next(hi)) {
+        device_pair_t *pair;
 
-        /* ignore current and parent */
-        if (dirent.name[0] == '.') {
-            if (!dirent.name[1]) {
-                /* "." */
-                continue;
-            }
-            else if (dirent.name[1] == '.' && !dirent.name[2]) {
-                /* ".." */
-                continue;
+        apr_hash_this(hi, NULL, NULL, (void **)&pair);
+
+        APR_ARRAY_PUSH(pairs, device_pair_t *) = pair;
+        APR_ARRAY_PUSH(sets, device_set_e) = pair->set;
+    }
+
+    /* let the shell know we are ready */
+    device_batch_respond(ds, 0);
+
+    while (1) {
+
+        apr_array_header_t *args;
+
+        apr_pool_create(&ds->pool, pool);
+
+        args = apr_array_make(ds->pool, 8, sizeof(const char *));
+
+        if (APR_SUCCESS != (status = device_serve_read(ds, in, args))) {
+
+            apr_pool_destroy(ds->pool);
+            ds->pool = pool;
+
+            if (APR_STATUS_IS_EOF(status)) {
+                return APR_SUCCESS;
             }
-        }
 
-        if (APR_SUCCESS != (status = apr_file_remove(dirent.name, ds->pool))) {
-            apr_file_printf(ds->err, "could not remove '%s' (delete option): %pm\n", keyval, &status);
-            apr_dir_close(thedir);
+            apr_file_printf(ds->err, "cannot read request: %pm\n", &status);
             return status;
         }
 
-    } while (1);
+        ds->keypath = NULL;
+        ds->keyval = NULL;
 
-    apr_dir_close(thedir);
+        /* every option starts out as it was declared */
+        for (i = 0; i < pairs->nelts; i++) {
+            APR_ARRAY_IDX(pairs, i, device_pair_t *)->set =
+                    APR_ARRAY_IDX(sets, i, device_set_e);
+        }
 
-    /* change current working directory */
-    status = apr_filepath_set(pwd, ds->pool);
-    if (APR_SUCCESS != status) {
-        apr_file_printf(ds->err, "could not remove '%s' (chdir): %pm\n", keyval, &status);
-        return status;
-    }
+        status = device_batch_run(ds, (const char **)args->elts);
 
-    /*
-     * Last step - remove that directory.
-     */
+        device_batch_respond(ds, APR_SUCCESS == status ? 0 : 1);
 
-    if ((status = apr_dir_remove(backup, ds->pool)) != APR_SUCCESS) {
-        apr_file_printf(ds->err, "could not remove '%s': %pm\n", keyval, &status);
-        return status;
+        apr_pool_destroy(ds->pool);
+        ds->pool = pool;
     }
 
-    return status;
 }
 
-static apr_status_t device_mark(device_set_t *ds, const char **args)
+/*
+ * Run set requests as a single transaction.
+ *
+ * Requests are read and answered as with --batch, except that the files
+ * of each are kept rather than written. Once stdin is closed, the files
+ * of every request are written as one unit, sharing one flush under
+ * --sync, unless any request failed, in which case nothing is written.
+ * Name links are moved and the names catalogue refreshed afterwards.
+ */
+static apr_status_t device_transaction(device_set_t *ds)
 {
-    apr_file_t *out;
-
-    const char *keyval = NULL, *keypath = NULL;
-    apr_status_t status = APR_SUCCESS;
-
-    apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
+    apr_pool_t *pool = ds->pool;
+    apr_file_t *in;
+    apr_array_header_t *pairs;
+    apr_array_header_t *sets;
+    apr_array_header_t *staged;
+    apr_array_header_t *renames;
+    apr_hash_t *pending;
+    apr_hash_index_t *hi;
+    apr_status_t status;
+    int dirfd, failed = 0;
+    int i;
 
-    if (!args[0]) {
-        apr_file_printf(ds->err, "%s is required.\n", ds->key);
+    /* requests and responses are small and many, buffer them */
+    if (APR_SUCCESS != (status = apr_file_open_flags_stdin(&in,
+            APR_FOPEN_BUFFERED, pool))
+            || APR_SUCCESS != (status = apr_file_open_flags_stdout(&ds->out,
+                    APR_FOPEN_BUFFERED, pool))) {
+        apr_file_printf(ds->err, "cannot open stdin/stdout: %pm\n", &status);
         return status;
     }
-    if (args[1] && args[2]) {
-        apr_file_printf(ds->err, "no options are permitted other than %s.\n", ds->key);
-        return status;
+
+    /* remember how each option starts out */
+    pairs = apr_array_make(pool, apr_hash_count(ds->pairs), sizeof(device_pair_t *));
+    sets = apr_array_make(pool, apr_hash_count(ds->pairs), sizeof(device_set_e));
+    for (hi = apr_hash_first(pool, ds->pairs); hi; hi = apr_hash_next(hi)) {
+        device_pair_t *pair;
+
+        apr_hash_this(hi, NULL, NULL, (void **)&pair);
+
+        APR_ARRAY_PUSH(pairs, device_pair_t *) = pair;
+        APR_ARRAY_PUSH(sets, device_set_e) = pair->set;
     }
-    else {
-        status = device_get(ds, args[0], options, &keyval, &keypath, NULL);
 
-        if (APR_SUCCESS != status) {
+    staged = apr_array_make(pool, 64, sizeof(device_file_t));
+    renames = apr_array_make(pool, 16, sizeof(device_rename_t));
+    pending = apr_hash_make(pool);
+
+    /* let the shell know we are ready */
+    device_batch_respond(ds, 0);
+
+    while (1) {
+
+        apr_array_header_t *args;
+
+        apr_pool_create(&ds->pool, pool);
+
+        args = apr_array_make(ds->pool, 8, sizeof(const char *));
+
+        if (APR_SUCCESS != (status = device_serve_read(ds, in, args))) {
+
+            apr_pool_destroy(ds->pool);
+            ds->pool = pool;
+
+            if (APR_STATUS_IS_EOF(status)) {
+                break;
+            }
+
+            apr_file_printf(ds->err, "cannot read request: %pm\n", &status);
             return status;
         }
-    }
 
-    if (APR_SUCCESS != (status = apr_filepath_set(keypath, ds->pool))) {
-        apr_file_printf(ds->err, "could not mark '%s' (chdir): %pm\n", keyval, &status);
-    }
-    else if (APR_SUCCESS
-        != (status = apr_file_open(&out, DEVICE_REMOVE_MARKER, APR_FOPEN_CREATE | APR_FOPEN_WRITE,
-            APR_FPROT_OS_DEFAULT, ds->pool))) {
-        apr_file_printf(ds->err, "cannot create mark '%s': %pm\n", keyval,
-            &status);
-    }
-    else if (APR_SUCCESS != (status = apr_file_close(out))) {
-        apr_file_printf(ds->err, "cannot close mark '%s': %pm\n", keyval, &status);
-    }
-    else if (APR_SUCCESS
-            != (status = apr_file_perms_set(DEVICE_REMOVE_MARKER,
-                    APR_FPROT_OS_DEFAULT & ~DEVICE_FILE_UMASK))) {
-        apr_file_printf(ds->err, "cannot set permissions to mark '%s': %pm\n",
-                keyval, &status);
-    }
+        ds->keypath = NULL;
+        ds->keyval = NULL;
 
-    apr_file_remove(device_safename(ds->pool, keyval), ds->pool);
+        /* every option starts out as it was declared */
+        for (i = 0; i < pairs->nelts; i++) {
+            APR_ARRAY_IDX(pairs, i, device_pair_t *)->set =
+                    APR_ARRAY_IDX(sets, i, device_set_e);
+        }
 
-    return status;
-}
+        ds->staged = staged;
+        ds->renames = renames;
+        ds->pending = pending;
 
-static apr_status_t device_reindex(device_set_t *ds, const char **args)
-{
-    apr_hash_index_t *hi;
-    void *v;
-    device_pair_t *pair;
+        status = device_set(ds, (const char **)args->elts);
 
-    apr_array_header_t *files = apr_array_make(ds->pool,
-            16, sizeof(device_file_t));
+        ds->staged = NULL;
+        ds->renames = NULL;
+        ds->pending = NULL;
 
-    apr_status_t status = APR_SUCCESS;
+        if (APR_SUCCESS != status) {
+            failed++;
+        }
 
-    for (hi = apr_hash_first(ds->pool, ds->pairs); hi; hi = apr_hash_next(hi)) {
+        device_batch_respond(ds, APR_SUCCESS == status ? 0 : 1);
 
-        apr_hash_this(hi, NULL, NULL, &v);
-        pair = v;
+        apr_pool_destroy(ds->pool);
+        ds->pool = pool;
+    }
 
-        if (pair->type == DEVICE_PAIR_INDEX) {
+    if (failed) {
+        apr_file_printf(ds->err, "%d request(s) failed, nothing was written.\n",
+                failed);
+        status = APR_EINVAL;
+    }
 
-            apr_dir_t *thedir;
-            apr_finfo_t dirent;
+    /* paths are relative to the option set */
+    else if (APR_SUCCESS != (status = device_dir_open(pool, ".", &dirfd))) {
+        apr_file_printf(ds->err, "cannot access cwd: %pm\n", &status);
+    }
 
-            apr_array_header_t *tfiles = apr_array_make(ds->pool, 16, sizeof(device_file_t));
-            apr_array_header_t *sfiles = apr_array_make(ds->pool, 16, sizeof(device_file_t));
+    /* the name links follow once everything else is in place */
+    else if (APR_SUCCESS == (status = device_files_write(ds, dirfd, staged))) {
+        status = device_files_rename(ds, renames);
+    }
 
-            int i, nelts;
+    device_batch_respond(ds, APR_SUCCESS == status ? 0 : 1);
 
-            /* scan the directories to find a match */
-            if ((status = apr_dir_open(&thedir, ".", ds->pool)) != APR_SUCCESS) {
-                /* could not open directory, fail */
-                apr_file_printf(ds->err, "could not open current directory: %pm\n", &status);
-                return status;
-            }
+    return status;
+}
 
-            do {
+#define DEVICE_SCHEMA_MAGIC "DEVSCHM3"
+#define DEVICE_SCHEMA_MAGIC_LEN 8
 
-                status = apr_dir_read(&dirent,
-                        APR_FINFO_TYPE | APR_FINFO_NAME | APR_FINFO_WPROT, thedir);
-                if (APR_STATUS_IS_INCOMPLETE(status)) {
-                    continue; /* ignore un-stat()able files */
-                } else if (status != APR_SUCCESS) {
-                    break;
-                }
+/*
+ * A compiled schema holds the pair table built from a script's option
+ * declarations, so that later runs need not parse them again.
+ *
+ * The file starts with a magic number, the size of the structures it
+ * was written from, and the declarations it was compiled from. A
+ * script that changes its declarations no longer matches, and the
+ * schema is compiled again. Strings are stored NUL terminated and used
+ * in place from the mapping.
+ *
+ * The same functions read and write each field, so that the two cannot
+ * disagree.
+ */
+typedef struct device_schema_t {
+    apr_pool_t *pool;
+    apr_array_header_t *out;
+    const char *in;
+    const char *end;
+    int reading;
+    int error;
+} device_schema_t;
+
+static void device_schema_write(device_schema_t *sc, const void *buf,
+        apr_size_t len)
+{
+    apr_array_header_t arr = { 0 };
 
-                /* hidden files are ignored */
-                if (dirent.name[0] == '.') {
-                    continue;
-                }
+    arr.pool = sc->pool;
+    arr.elt_size = sizeof(char);
+    arr.nelts = arr.nalloc = len;
+    arr.elts = (char *)buf;
 
-                switch (dirent.filetype) {
-                case APR_DIR: {
+    apr_array_cat(sc->out, &arr);
+}
 
-                    apr_pool_t *pool;
+static void device_schema_int(device_schema_t *sc, apr_int64_t *val)
+{
+    if (sc->reading) {
+        if (sc->end - sc->in < (apr_ssize_t)sizeof(apr_int64_t)) {
+            sc->error = 1;
+            *val = 0;
+            return;
+        }
+        memcpy(val, sc->in, sizeof(apr_int64_t));
+        sc->in += sizeof(apr_int64_t);
+    }
+    else {
+        device_schema_write(sc, val, sizeof(apr_int64_t));
+    }
+}
 
-                    apr_pool_create(&pool, ds->pool);
+#define DEVICE_SCHEMA_FIELD(sc, field) \
+    { \
+        apr_int64_t v = (field); \
+        device_schema_int(sc, &v); \
+        (field) = v; \
+    }
 
-                    char *val = NULL;
-                    apr_file_t *in;
-                    const char *indexname;
-                    char *indexpath;
-                    apr_off_t end = 0, start = 0;
+static void device_schema_str(device_schema_t *sc, const char **str)
+{
+    apr_int64_t len = *str ? strlen(*str) + 1 : 0;
 
+    device_schema_int(sc, &len);
 
-                    indexname = apr_pstrcat(pool, pair->key, pair->suffix, NULL);
-                    if (APR_SUCCESS
-                            != (status = apr_filepath_merge(&indexpath, dirent.name,
-                                    indexname, APR_FILEPATH_NOTABSOLUTE, pool))) {
-                        apr_file_printf(ds->err, "cannot merge option set key '%s': %pm\n", pair->key,
-                                &status);
-                    }
+    if (sc->reading) {
+        if (!len) {
+            *str = NULL;
+        }
+        else if (len < 0 || sc->end - sc->in < len || sc->in[len - 1]) {
+            sc->error = 1;
+            *str = NULL;
+        }
+        else {
+            *str = sc->in;
+            sc->in += len;
+        }
+    }
+    else if (len) {
+        device_schema_write(sc, *str, len);
+    }
+}
 
-                    /* open the index */
-                    else if (APR_SUCCESS
-                            != (status = apr_file_open(&in, indexpath, APR_FOPEN_READ,
-                                    APR_FPROT_OS_DEFAULT, pool))) {
-                        apr_file_printf(ds->err, "cannot open option set '%s': %pm\n", pair->key,
-                                &status);
-                    }
+static void device_schema_strs(device_schema_t *sc, apr_array_header_t **strs)
+{
+    apr_int64_t count = *strs ? (*strs)->nelts : -1;
+    int i;
 
-                    /* how long is the key? */
-                    else if (APR_SUCCESS
-                            != (status = apr_file_seek(in, APR_END, &end))) {
-                        apr_file_printf(ds->err, "cannot seek end of option set '%s': %pm\n", pair->key,
-                                &status);
-                    }
+    device_schema_int(sc, &count);
 
-                    /* back to the beginning */
-                    else if (APR_SUCCESS
-                            != (status = apr_file_seek(in, APR_SET, &start))) {
-                        apr_file_printf(ds->err, "cannot seek start of option set '%s': %pm\n", pair->key,
-                                &status);
-                    }
+    if (sc->reading) {
+        if (count < 0 || count > sc->end - sc->in) {
+            *strs = NULL;
+            return;
+        }
+        *strs = apr_array_make(sc->pool, count, sizeof(const char *));
+        for (i = 0; i < count && !sc->error; i++) {
+            device_schema_str(sc, apr_array_push(*strs));
+        }
+    }
+    else {
+        for (i = 0; i < count; i++) {
+            device_schema_str(sc, &APR_ARRAY_IDX(*strs, i, const char *));
+        }
+    }
+}
+
+static void device_schema_pair(device_schema_t *sc, device_pair_t *pair)
+{
+    DEVICE_SCHEMA_FIELD(sc, pair->type);
+    DEVICE_SCHEMA_FIELD(sc, pair->optional);
+    DEVICE_SCHEMA_FIELD(sc, pair->unique);
+    DEVICE_SCHEMA_FIELD(sc, pair->index);
+    DEVICE_SCHEMA_FIELD(sc, pair->set);
+
+    device_schema_str(sc, &pair->key);
+    device_schema_str(sc, &pair->suffix);
+    device_schema_str(sc, &pair->flag);
+    device_schema_str(sc, &pair->unset);
+
+    switch (pair->type) {
+    case DEVICE_PAIR_INDEX:
+        DEVICE_SCHEMA_FIELD(sc, pair->ix.gap);
+        break;
+    case DEVICE_PAIR_SELECT:
+        device_schema_strs(sc, &pair->sl.bases);
+        break;
+    case DEVICE_PAIR_BYTES:
+        DEVICE_SCHEMA_FIELD(sc, pair->b.min);
+        DEVICE_SCHEMA_FIELD(sc, pair->b.max);
+        break;
+    case DEVICE_PAIR_SYMLINK:
+        device_schema_strs(sc, &pair->s.bases);
+        device_schema_str(sc, &pair->s.symlink_suffix);
+        DEVICE_SCHEMA_FIELD(sc, pair->s.symlink_suffix_len);
+        device_schema_str(sc, &pair->s.symlink_context_type);
+        DEVICE_SCHEMA_FIELD(sc, pair->s.symlink_recursive);
+        break;
+    case DEVICE_PAIR_SQL_IDENTIFIER:
+    case DEVICE_PAIR_SQL_DELIMITED_IDENTIFIER:
+        DEVICE_SCHEMA_FIELD(sc, pair->q.min);
+        DEVICE_SCHEMA_FIELD(sc, pair->q.max);
+        break;
+    case DEVICE_PAIR_USER:
+        device_schema_strs(sc, &pair->u.groups);
+        DEVICE_SCHEMA_FIELD(sc, pair->u.ttl);
+        break;
+    case DEVICE_PAIR_RELATION:
+        device_schema_strs(sc, &pair->r.bases);
+        device_schema_str(sc, &pair->r.relation_name);
+        DEVICE_SCHEMA_FIELD(sc, pair->r.relation_name_len);
+        device_schema_str(sc, &pair->r.relation_prefix);
+        DEVICE_SCHEMA_FIELD(sc, pair->r.relation_prefix_len);
+        device_schema_str(sc, &pair->r.relation_suffix);
+        DEVICE_SCHEMA_FIELD(sc, pair->r.relation_suffix_len);
+        break;
+    case DEVICE_PAIR_POLAR:
+        device_schema_str(sc, &pair->p.flag);
+        DEVICE_SCHEMA_FIELD(sc, pair->p.polar_default);
+        break;
+    case DEVICE_PAIR_SWITCH:
+        device_schema_str(sc, &pair->sw.flag);
+        DEVICE_SCHEMA_FIELD(sc, pair->sw.switch_default);
+        break;
+    case DEVICE_PAIR_INTEGER:
+        DEVICE_SCHEMA_FIELD(sc, pair->i.min);
+        DEVICE_SCHEMA_FIELD(sc, pair->i.max);
+        break;
+    case DEVICE_PAIR_TEXT:
+        device_schema_str(sc, &pair->t.format);
+        DEVICE_SCHEMA_FIELD(sc, pair->t.min);
+        DEVICE_SCHEMA_FIELD(sc, pair->t.max);
+        break;
+    case DEVICE_PAIR_HEX:
+        DEVICE_SCHEMA_FIELD(sc, pair->h.min);
+        DEVICE_SCHEMA_FIELD(sc, pair->h.max);
+        DEVICE_SCHEMA_FIELD(sc, pair->h.cs);
+        DEVICE_SCHEMA_FIELD(sc, pair->h.width);
+        break;
+    case DEVICE_PAIR_URL_PATH:
+    case DEVICE_PAIR_URL_PATH_ABEMPTY:
+    case DEVICE_PAIR_URL_PATH_ABSOLUTE:
+    case DEVICE_PAIR_URL_PATH_NOSCHEME:
+    case DEVICE_PAIR_URL_PATH_ROOTLESS:
+    case DEVICE_PAIR_URL_PATH_EMPTY:
+        DEVICE_SCHEMA_FIELD(sc, pair->up.max);
+        break;
+    case DEVICE_PAIR_URI:
+    case DEVICE_PAIR_URI_ABSOLUTE:
+    case DEVICE_PAIR_URI_RELATIVE: {
+        apr_array_header_t *schemes = NULL;
+        apr_hash_index_t *hi;
+        int i;
 
-                    else {
-                        int size = end + 1;
-                        val = apr_palloc(pool, size);
-                        val[end] = 0;
-
-                        status = apr_file_gets(val, size, in);
-
-                        if (APR_EOF == status) {
-                            status = APR_SUCCESS;
-                        }
-                        if (APR_SUCCESS == status) {
-                            /* short circuit, all good */
-                            val = trim(val);
-                        }
-                        else {
-                            apr_file_printf(ds->err, "cannot read option set '%s': %pm\n", pair->key,
-                                    &status);
-                        }
-                    }
+        if (!sc->reading && pair->uri.schemes) {
+            schemes = apr_array_make(sc->pool, apr_hash_count(pair->uri.schemes),
+                    sizeof(const char *));
+            for (hi = apr_hash_first(sc->pool, pair->uri.schemes); hi; hi = apr_hash_next(hi)) {
+                const void *scheme;
+                apr_hash_this(hi, &scheme, NULL, NULL);
+                APR_ARRAY_PUSH(schemes, const char *) = scheme;
+            }
+        }
 
-                    if (status != APR_SUCCESS) {
-                        apr_pool_destroy(pool);
-                        continue;
-                    }
-                    else {
+        device_schema_strs(sc, &schemes);
 
-                        char *end;
+        if (sc->reading) {
+            pair->uri.schemes = NULL;
+            if (schemes) {
+                pair->uri.schemes = apr_hash_make(sc->pool);
+                for (i = 0; i < schemes->nelts; i++) {
+                    const char *scheme = APR_ARRAY_IDX(schemes, i, const char *);
+                    apr_hash_set(pair->uri.schemes, scheme, APR_HASH_KEY_STRING, scheme);
+                }
+            }
+        }
 
-                        device_file_t *file;
+        DEVICE_SCHEMA_FIELD(sc, pair->uri.max);
+        break;
+    }
+    case DEVICE_PAIR_ADDRESS:
+    case DEVICE_PAIR_ADDRESS_LOCALPART:
+    case DEVICE_PAIR_ADDRESS_MAILBOX:
+    case DEVICE_PAIR_ADDRESS_ADDRSPEC:
+        DEVICE_SCHEMA_FIELD(sc, pair->a.max);
+        DEVICE_SCHEMA_FIELD(sc, pair->a.noquotes);
+        DEVICE_SCHEMA_FIELD(sc, pair->a.filesafe);
+        break;
+    default:
+        break;
+    }
+}
 
-                        apr_int64_t order = apr_strtoi64(val, &end, 10);
-                        if (end[0] || errno == ERANGE) {
-                            apr_file_printf(ds->err, "argument '%s': '%s' is not a valid index, ignoring.\n",
-                                    apr_pescape_echo(ds->pool, pair->key, 1),
-                                    apr_pescape_echo(ds->pool, val, 1));
-                            /* ignore and loop round */
-                        }
-                        else {
+/*
+ * Read or write everything the declarations leave behind.
+ */
+static void device_schema_state(device_schema_t *sc, device_set_t *ds,
+        const char **show_index, const char **show_flags, const char **show_table)
+{
+    apr_array_header_t *argv = NULL;
+    apr_hash_index_t *hi;
+    apr_int64_t count = apr_hash_count(ds->pairs);
+    int i;
 
-                            /* add index */
-                            file = apr_array_push(tfiles);
-                            file->type = APR_REG;
-                            file->order = order;
+    device_schema_str(sc, &ds->path);
+    device_schema_str(sc, &ds->key);
+    DEVICE_SCHEMA_FIELD(sc, ds->mode);
+    DEVICE_SCHEMA_FIELD(sc, ds->sync);
+    device_schema_str(sc, show_index);
+    device_schema_str(sc, show_flags);
+    device_schema_str(sc, show_table);
 
-                            file->dest = indexpath;
-                            file->template = apr_pstrcat(ds->pool, file->dest, ".XXXXXX", NULL);
-                            file->key = pair->key;
-                            file->val = apr_pstrdup(ds->pool, dirent.name);
-                            file->index = pair->index;
+    if (!sc->reading && ds->argv) {
+        argv = apr_array_make(sc->pool, 4, sizeof(const char *));
+        for (i = 0; ds->argv[i]; i++) {
+            APR_ARRAY_PUSH(argv, const char *) = ds->argv[i];
+        }
+    }
 
-                        }
+    device_schema_strs(sc, &argv);
 
-                    }
+    if (sc->reading && argv) {
+        apr_array_push(argv);
+        ds->argv = (char **)argv->elts;
+    }
 
-                    apr_pool_destroy(pool);
+    device_schema_int(sc, &count);
 
-                    break;
-                }
-                case APR_LNK: {
+    if (sc->reading) {
+        for (i = 0; i < count && !sc->error; i++) {
+            device_pair_t *pair = apr_pcalloc(sc->pool, sizeof(device_pair_t));
 
-                    if (pair->index == DEVICE_IS_INDEXED) {
+            device_schema_pair(sc, pair);
 
-                        device_file_t *old;
+            if (!pair->key) {
+                sc->error = 1;
+                break;
+            }
 
-                        /* remove old index */
-                        old = apr_array_push(sfiles);
-                        old->type = APR_LNK;
+            apr_hash_set(ds->pairs, pair->key, APR_HASH_KEY_STRING, pair);
+        }
+    }
+    else {
+        for (hi = apr_hash_first(sc->pool, ds->pairs); hi; hi = apr_hash_next(hi)) {
+            void *v;
 
-                        old->dest = apr_pstrdup(ds->pool, dirent.name);
-                        old->key = pair->key;
-                        old->val = NULL; /* delete the index */
-                        old->link = NULL;
-                        old->index = pair->index;
+            apr_hash_this(hi, NULL, NULL, &v);
 
-                    }
+            device_schema_pair(sc, v);
+        }
+    }
+}
 
-                    break;
-                }
-                default:
-                    break;
-                }
+/*
+ * Find the end of the declarations, being the first argument that
+ * starts a run rather than declares an option.
+ */
+static int device_schema_declarations(int argc, const char * const argv[])
+{
+    int i, j;
 
-            } while (1);
+    for (i = 2; i < argc; i++) {
+        const char *arg = argv[i];
 
-            apr_dir_close(thedir);
+        if (!strcmp(arg, "--") || !strcmp(arg, "-c")
+                || !strcmp(arg, "--complete") || !strcmp(arg, "--serve")
+                || !strcmp(arg, "--batch") || !strcmp(arg, "--transaction")) {
+            break;
+        }
 
-            if (APR_SUCCESS == status) {
-                /* short circuit, all good */
-            }
-            else if (APR_STATUS_IS_ENOENT(status)) {
-                status = APR_SUCCESS;
-            }
-            else {
-                apr_file_printf(ds->err, "cannot read indexes: %pm\n",
-                        &status);
-                return status;
+        /* skip over the argument of an option that takes one */
+        for (j = 0; cmdline_opts[j].name; j++) {
+            if (((arg[0] == '-' && arg[1] == '-' && !strcmp(arg + 2, cmdline_opts[j].name))
+                    || (arg[0] == '-' && arg[1] == cmdline_opts[j].optch
+                            && apr_isalpha(arg[1]) && !arg[2]))
+                    && cmdline_opts[j].has_arg) {
+                i++;
+                break;
             }
+        }
+    }
 
-            apr_array_cat(files, sfiles);
-
-            /* sort tfiles small to large so reindex doesn't stomp on files */
-            qsort(tfiles->elts, tfiles->nelts, tfiles->elt_size, files_asc);
+    return i < argc ? i : argc;
+}
 
-            for (i = 0, nelts = tfiles->nelts; i < nelts; i++) {
+static const char *device_schema_key(apr_pool_t *pool, int start, int end,
+        const char * const argv[], apr_size_t *len)
+{
+    char *key, *k;
+    int i;
 
-                const char *slink;
+    for (*len = 0, i = start; i < end; i++) {
+        *len += strlen(argv[i]) + 1;
+    }
 
-                device_file_t *file = &APR_ARRAY_IDX(tfiles, i, device_file_t);
+    k = key = apr_palloc(pool, *len + 1);
 
-                slink = apr_psprintf(ds->pool, "%d", i);
+    for (i = start; i < end; i++) {
+        apr_size_t l = strlen(argv[i]) + 1;
+        memcpy(k, argv[i], l);
+        k += l;
+    }
 
-                if (file->index == DEVICE_IS_INDEXED) {
+    return key;
+}
 
-                    device_file_t *link;
+/*
+ * Load a compiled schema, if it exists and was compiled from the same
+ * declarations. The mapping lives as long as the pool.
+ */
+static apr_status_t device_schema_load(device_set_t *ds, const char *path,
+        const char *key, apr_size_t keylen, const char **show_index,
+        const char **show_flags, const char **show_table)
+{
+    device_schema_t sc = { 0 };
+    device_set_t saved = *ds;
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+    apr_int64_t size;
+    apr_status_t status;
 
-                    /* add symlink */
-                    link = apr_array_push(tfiles);
-                    link->type = APR_LNK;
-                    link->order = i;
+    if (APR_SUCCESS != (status = apr_file_open(&file, path, APR_FOPEN_READ,
+            APR_FPROT_OS_DEFAULT, ds->pool))) {
+        return status;
+    }
 
-                    link->dest = slink;
-                    link->key = pair->key;
-                    link->link = file->link;
-                    link->index = DEVICE_IS_NORMAL;
-                }
+    if (APR_SUCCESS != (status = apr_file_info_get(&finfo, APR_FINFO_SIZE, file))
+            || finfo.size < DEVICE_SCHEMA_MAGIC_LEN
+            || APR_SUCCESS != (status = apr_mmap_create(&mm, file, 0,
+                    finfo.size, APR_MMAP_READ, ds->pool))) {
+        apr_file_close(file);
+        return status ? status : APR_EINVAL;
+    }
 
-                file->link = slink;
+    apr_file_close(file);
 
-            }
+    sc.pool = ds->pool;
+    sc.reading = 1;
+    sc.in = mm->mm;
+    sc.end = sc.in + mm->size;
 
-            apr_array_cat(files, tfiles);
+    if (memcmp(sc.in, DEVICE_SCHEMA_MAGIC, DEVICE_SCHEMA_MAGIC_LEN)) {
+        return APR_EINVAL;
+    }
+    sc.in += DEVICE_SCHEMA_MAGIC_LEN;
 
-        }
+    /* written by someone else? */
+    device_schema_int(&sc, &size);
+    if (sc.error || size != sizeof(device_pair_t)) {
+        return APR_EINVAL;
+    }
 
+    /* written from different declarations? */
+    device_schema_int(&sc, &size);
+    if (sc.error || size != (apr_int64_t)keylen || sc.end - sc.in < size
+            || memcmp(sc.in, key, keylen)) {
+        return APR_EINVAL;
     }
+    sc.in += size;
 
-    status = device_files(ds, files);
+    device_schema_state(&sc, ds, show_index, show_flags, show_table);
 
-    return status;
+    /* truncated or corrupt, start again */
+    if (sc.error) {
+        *ds = saved;
+        ds->pairs = apr_hash_make(ds->pool);
+        *show_index = *show_flags = *show_table = NULL;
+        return APR_EINVAL;
+    }
+
+    return APR_SUCCESS;
 }
 
-static apr_status_t device_exec(device_set_t *ds, const char **args)
+/*
+ * Save a compiled schema alongside the script. A schema that cannot be
+ * written is not an error, the declarations are parsed next time.
+ */
+static apr_status_t device_schema_save(device_set_t *ds, const char *path,
+        const char *key, apr_size_t keylen, const char **show_index,
+        const char **show_flags, const char **show_table)
 {
-    const char *key = NULL, *val = NULL;
-    apr_status_t status = APR_SUCCESS;
-    int len;
-
-    for (len = 0; args && args[len]; len++);
-
-    apr_array_header_t *files = apr_array_make(ds->pool, len, sizeof(device_file_t));
-
-    if (ds->key) {
-
-        if (!args[0] || !args[1]) {
-            apr_file_printf(ds->err, "%s is required.\n", ds->key);
-            return APR_EINVAL;
-        }
-        else {
-
-            int exact = 0;
-
-            apr_array_header_t *options = apr_array_make(ds->pool, 10, sizeof(char *));
-
-            status = device_get(ds, args[0], options, &ds->keyval, &ds->keypath, &exact);
-
-            if (APR_SUCCESS != status) {
-                return status;
-            }
+    device_schema_t sc = { 0 };
+    apr_file_t *file;
+    apr_pool_t *pool;
+    apr_int64_t size;
+    char *tmp;
+    apr_status_t status;
 
-            if (!exact) {
-                apr_file_printf(ds->err, "%s was not found.\n", args[0]);
-                return APR_EINVAL;
-            }
-        }
+    apr_pool_create(&pool, ds->pool);
 
-        args += 2;
-    }
+    sc.pool = pool;
+    sc.out = apr_array_make(pool, 4096, sizeof(char));
 
-    while (args && *args) {
+    device_schema_write(&sc, DEVICE_SCHEMA_MAGIC, DEVICE_SCHEMA_MAGIC_LEN);
 
-        const char *arg = *(args++);
+    size = sizeof(device_pair_t);
+    device_schema_int(&sc, &size);
 
-        if (!key) {
-            key = arg;
-            continue;
-        }
-        else {
-            val = arg;
-        }
+    size = keylen;
+    device_schema_int(&sc, &size);
+    device_schema_write(&sc, key, keylen);
 
-        status = device_parse(ds, key, val, files);
+    device_schema_state(&sc, ds, show_index, show_flags, show_table);
 
-        if (APR_SUCCESS != status) {
-            break;
-        }
+    tmp = apr_pstrcat(pool, path, ".XXXXXX", NULL);
 
-        key = NULL;
-        val = NULL;
+    if (APR_SUCCESS != (status = apr_file_mktemp(&file, tmp,
+            APR_FOPEN_CREATE | APR_FOPEN_WRITE | APR_FOPEN_EXCL, pool))) {
+        apr_pool_destroy(pool);
+        return status;
     }
 
-    if (key && !val) {
-        apr_file_printf(ds->err, "argument '%s' has no corresponding value.\n",
-                apr_pescape_echo(ds->pool, key, 1));
-        return APR_EINVAL;
+    if (APR_SUCCESS != (status = apr_file_write_full(file, sc.out->elts,
+            sc.out->nelts, NULL))
+            || APR_SUCCESS != (status = apr_file_close(file))
+            || APR_SUCCESS != (status = apr_file_perms_set(tmp,
+                    APR_FPROT_UREAD | APR_FPROT_UWRITE | APR_FPROT_GREAD
+                    | APR_FPROT_WREAD))
+            || APR_SUCCESS != (status = apr_file_rename(tmp, path, pool))) {
+        apr_file_remove(tmp, pool);
     }
 
-    if (APR_SUCCESS == status) {
-        status = device_command(ds, files);
-    }
+    apr_pool_destroy(pool);
 
     return status;
 }
@@ -7622,6 +11171,9 @@ int main(int argc, const char * const argv[])
     int optch;
     apr_status_t status = 0;
     int complete = 0;
+    int serve = 0;
+    int batch = 0;
+    int transaction = 0;
     device_optional_e optional = DEVICE_IS_OPTIONAL;
 
     apr_uint64_t bytes_min = 0;
@@ -7641,6 +11193,9 @@ int main(int argc, const char * const argv[])
 
     apr_int64_t hex_width;
 
+    apr_int64_t index_gap = DEVICE_INDEX_GAP_DEFAULT;
+    apr_int64_t user_ttl = DEVICE_USER_TTL_DEFAULT;
+
     device_case_e hex_case = DEVICE_HEX_CASE_VAL;
 
     apr_uint64_t text_min = DEVICE_TEXT_MIN_DEFAULT;
@@ -7661,6 +11216,11 @@ int main(int argc, const char * const argv[])
 
     const char *unset = NULL;
 
+    const char *schema = NULL;
+    const char *schema_key = NULL;
+    apr_size_t schema_keylen = 0;
+    int schema_cached = 0;
+
     /* lets get APR off the ground, and make sure it terminates cleanly */
     if (APR_SUCCESS != (status = apr_app_initialize(&argc, &argv, NULL))) {
         return 1;
@@ -7687,7 +11247,35 @@ int main(int argc, const char * const argv[])
 
     setlocale(LC_CTYPE,"");
 
-    apr_getopt_init(&opt, ds.pool, argc, argv);
+    /* declarations already compiled? parse only what follows them */
+    if (argc > 1 && !strncmp(argv[1], "--schema=", 9)) {
+        const char **args;
+        int end, i;
+
+        schema = argv[1] + 9;
+        end = device_schema_declarations(argc, argv);
+        schema_key = device_schema_key(ds.pool, 2, end, argv, &schema_keylen);
+
+        if (APR_SUCCESS == device_schema_load(&ds, schema, schema_key,
+                schema_keylen, &show_index, &show_flags, &show_table)) {
+
+            args = apr_palloc(ds.pool, (argc - end + 2) * sizeof(const char *));
+            args[0] = argv[0];
+            for (i = end; i < argc; i++) {
+                args[i - end + 1] = argv[i];
+            }
+            args[argc - end + 1] = NULL;
+
+            apr_getopt_init(&opt, ds.pool, argc - end + 1, args);
+
+            schema_cached = 1;
+        }
+    }
+
+    if (!schema_cached) {
+        apr_getopt_init(&opt, ds.pool, argc, argv);
+    }
+
     while ((status = apr_getopt_long(opt, cmdline_opts, &optch, &optarg))
             == APR_SUCCESS) {
 
@@ -7705,6 +11293,22 @@ int main(int argc, const char * const argv[])
             complete = 1;
             break;
         }
+        case DEVICE_SERVE: {
+            serve = 1;
+            break;
+        }
+        case DEVICE_BATCH: {
+            batch = 1;
+            break;
+        }
+        case DEVICE_TRANSACTION: {
+            transaction = 1;
+            break;
+        }
+        case DEVICE_SCHEMA: {
+            /* handled before parsing */
+            break;
+        }
         case 'd': {
             ds.mode = DEVICE_REMOVE;
             ds.key = optarg;
@@ -7733,6 +11337,25 @@ int main(int argc, const char * const argv[])
             ds.key = optarg;
             break;
         }
+        case DEVICE_SYNC: {
+            ds.sync = 1;
+            break;
+        }
+        case DEVICE_REBUILD_NAMES: {
+            ds.mode = DEVICE_REBUILD;
+            ds.key = optarg;
+            break;
+        }
+        case DEVICE_EXPORT_RECORDS: {
+            ds.mode = DEVICE_EXPORT;
+            ds.key = optarg;
+            break;
+        }
+        case DEVICE_IMPORT_RECORDS: {
+            ds.mode = DEVICE_IMPORT;
+            ds.key = optarg;
+            break;
+        }
         case 's': {
             ds.mode = DEVICE_SET;
             ds.key = optarg;
@@ -7779,6 +11402,7 @@ int main(int argc, const char * const argv[])
             pair->set = DEVICE_IS_DEFAULT;
             pair->flag = flag;
             pair->unset = unset;
+            pair->ix.gap = index_gap;
 
             apr_hash_set(ds.pairs, optarg, APR_HASH_KEY_STRING, pair);
 
@@ -8051,6 +11675,7 @@ int main(int argc, const char * const argv[])
             pair->flag = flag;
             pair->unset = unset;
             pair->u.groups = ds.user_groups;
+            pair->u.ttl = user_ttl;
 
             apr_hash_set(ds.pairs, optarg, APR_HASH_KEY_STRING, pair);
 
@@ -8072,6 +11697,21 @@ int main(int argc, const char * const argv[])
 
             break;
         }
+        case DEVICE_USER_TTL: {
+
+            status = device_parse_int64(&ds, optarg, &user_ttl);
+            if (APR_SUCCESS != status) {
+                exit(2);
+            }
+
+            if (user_ttl < 0) {
+                apr_file_printf(ds.err, "argument '%s': is less than zero.\n",
+                        apr_pescape_echo(ds.pool, optarg, 1));
+                exit(2);
+            }
+
+            break;
+        }
         case DEVICE_DISTINGUISHED_NAME: {
 
             device_pair_t *pair = apr_pcalloc(ds.pool, sizeof(device_pair_t));
@@ -8302,6 +11942,21 @@ int main(int argc, const char * const argv[])
 
             break;
         }
+        case DEVICE_INDEX_GAP: {
+
+            status = device_parse_int64(&ds, optarg, &index_gap);
+            if (APR_SUCCESS != status) {
+                exit(2);
+            }
+
+            if (index_gap < 1) {
+                apr_file_printf(ds.err, "argument '%s': is less than one.\n",
+                        apr_pescape_echo(ds.pool, optarg, 1));
+                exit(2);
+            }
+
+            break;
+        }
         case DEVICE_HEX_WIDTH: {
 
             status = device_parse_int64(&ds, optarg, &hex_width);
@@ -8758,7 +12413,7 @@ int main(int argc, const char * const argv[])
         }
         }
 
-        if (complete) {
+        if (complete || serve || batch || transaction) {
             break;
         }
 
@@ -8767,6 +12422,11 @@ int main(int argc, const char * const argv[])
         return help(ds.err, argv[0], NULL, EXIT_FAILURE, cmdline_opts);
     }
 
+    if (schema && !schema_cached) {
+        device_schema_save(&ds, schema, schema_key, schema_keylen,
+                &show_index, &show_flags, &show_table);
+    }
+
     ds.show_table = apr_array_make(ds.pool, 16, sizeof(device_table_t));
 
     if (show_table) {
@@ -8889,17 +12549,61 @@ int main(int argc, const char * const argv[])
                 return help(ds.err, argv[0], "The --set parameter was not found on the command line.",
                         EXIT_FAILURE, cmdline_opts);
             }
+
+            if (ds.mode == DEVICE_REBUILD) {
+                return help(ds.err, argv[0], "The --rebuild parameter was not found on the command line.",
+                        EXIT_FAILURE, cmdline_opts);
+            }
+
+            if (ds.mode == DEVICE_EXPORT) {
+                return help(ds.err, argv[0], "The --export parameter was not found on the command line.",
+                        EXIT_FAILURE, cmdline_opts);
+            }
+
+            if (ds.mode == DEVICE_IMPORT) {
+                return help(ds.err, argv[0], "The --import parameter was not found on the command line.",
+                        EXIT_FAILURE, cmdline_opts);
+            }
         }
     }
 
-    if (ds.mode == DEVICE_EXEC && !complete) {
+    if (transaction && ds.mode != DEVICE_SET) {
+        return help(ds.err, argv[0], "The --transaction parameter needs the --set parameter.",
+                EXIT_FAILURE, cmdline_opts);
+    }
+
+    if (ds.mode == DEVICE_EXEC && !complete && !serve && !batch) {
         if (!ds.argv) {
             return help(ds.err, argv[0], "The --command parameter was not found on the command line.",
                     EXIT_FAILURE, cmdline_opts);
         }
     }
 
-    if (complete) {
+    if (serve) {
+
+        status = device_serve(&ds);
+
+        if (APR_SUCCESS != status) {
+            exit(1);
+        }
+    }
+    else if (batch) {
+
+        status = device_batch(&ds);
+
+        if (APR_SUCCESS != status) {
+            exit(1);
+        }
+    }
+    else if (transaction) {
+
+        status = device_transaction(&ds);
+
+        if (APR_SUCCESS != status) {
+            exit(1);
+        }
+    }
+    else if (complete) {
 
         status = device_complete(&ds, opt->argv + opt->ind);
 
@@ -8954,6 +12658,30 @@ int main(int argc, const char * const argv[])
             exit(1);
         }
     }
+    else if (ds.mode == DEVICE_REBUILD) {
+
+        status = device_rebuild(&ds, opt->argv + opt->ind);
+
+        if (APR_SUCCESS != status) {
+            exit(1);
+        }
+    }
+    else if (ds.mode == DEVICE_EXPORT) {
+
+        status = device_export(&ds, opt->argv + opt->ind);
+
+        if (APR_SUCCESS != status) {
+            exit(1);
+        }
+    }
+    else if (ds.mode == DEVICE_IMPORT) {
+
+        status = device_import(&ds, opt->argv + opt->ind);
+
+        if (APR_SUCCESS != status) {
+            exit(1);
+        }
+    }
     else if (ds.mode == DEVICE_SHOW) {
 
         status = device_show(&ds, opt->argv + opt->ind);
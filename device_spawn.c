@@ -0,0 +1,243 @@
+/**
+ *    Copyright (C) 2021 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Launch commands, with posix_spawn where we can.
+ */
+
+#include "device_spawn.h"
+
+#include <apr_portable.h>
+
+#include "config.h"
+
+#include <signal.h>
+
+#if HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#if HAVE_SPAWN_H
+#include <spawn.h>
+#endif
+
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#if HAVE_SPAWN_H && HAVE_POSIX_SPAWN && HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+
+/*
+ * Launch with posix_spawn, which unlike fork does not copy our page
+ * tables, however large our pools have grown.
+ */
+apr_status_t device_spawn_posix(apr_proc_t *proc, const char *progname,
+        const char * const *args, const char * const *env, const char *dir,
+        apr_file_t *in, apr_file_t *out, apr_file_t *err, int inpipe,
+        apr_pool_t *pool)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    apr_file_t *files[2] = { out, err };
+    apr_file_t *reads[2] = { NULL, NULL };
+    apr_file_t *writes[2] = { NULL, NULL };
+    apr_file_t *inread = NULL, *inwrite = NULL;
+    apr_os_file_t fd;
+    pid_t pid;
+    apr_status_t status = APR_SUCCESS;
+    int rv;
+    int i;
+
+    /* parent reads without blocking, child writes blocking */
+    for (i = 0; i < 2; i++) {
+        if (!files[i] && (status = apr_file_pipe_create_ex(&reads[i], &writes[i],
+                APR_WRITE_BLOCK, pool)) != APR_SUCCESS) {
+            return status;
+        }
+    }
+
+    /* both ends of a stdin pipe block, we write whole requests */
+    if (!in && inpipe && (status = apr_file_pipe_create_ex(&inread, &inwrite,
+            APR_FULL_BLOCK, pool)) != APR_SUCCESS) {
+        return status;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    /* children start with default signals, none blocked */
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGPIPE);
+    sigaddset(&sigs, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    rv = posix_spawn_file_actions_addchdir_np(&actions, dir);
+
+    if (!rv && (in || inread)) {
+        apr_os_file_get(&fd, in ? in : inread);
+        rv = posix_spawn_file_actions_adddup2(&actions, fd, STDIN_FILENO);
+    }
+    else if (!rv) {
+        rv = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+                "/dev/null", O_RDONLY, 0);
+    }
+
+    for (i = 0; !rv && i < 2; i++) {
+        apr_os_file_get(&fd, files[i] ? files[i] : writes[i]);
+        rv = posix_spawn_file_actions_adddup2(&actions, fd,
+                i ? STDERR_FILENO : STDOUT_FILENO);
+    }
+
+#if HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+    if (!rv) {
+        rv = posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+    }
+#else
+    for (i = 0; !rv && i < 2; i++) {
+        if (reads[i]) {
+            apr_os_file_get(&fd, reads[i]);
+            rv = posix_spawn_file_actions_addclose(&actions, fd);
+        }
+    }
+    if (!rv && inwrite) {
+        apr_os_file_get(&fd, inwrite);
+        rv = posix_spawn_file_actions_addclose(&actions, fd);
+    }
+#endif
+
+    if (!rv) {
+        rv = posix_spawn(&pid, progname, &actions, &attr, (char * const *)args,
+                (char * const *)env);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    /* the child has its ends, we have ours */
+    for (i = 0; i < 2; i++) {
+        if (writes[i]) {
+            apr_file_close(writes[i]);
+        }
+    }
+    if (inread) {
+        apr_file_close(inread);
+    }
+
+    if (rv) {
+        for (i = 0; i < 2; i++) {
+            if (reads[i]) {
+                apr_file_close(reads[i]);
+            }
+        }
+        if (inwrite) {
+            apr_file_close(inwrite);
+        }
+        return APR_FROM_OS_ERROR(rv);
+    }
+
+    proc->pid = pid;
+    proc->in = inwrite;
+    proc->out = reads[0];
+    proc->err = reads[1];
+
+    return APR_SUCCESS;
+}
+
+#else
+
+apr_status_t device_spawn_posix(apr_proc_t *proc, const char *progname,
+        const char * const *args, const char * const *env, const char *dir,
+        apr_file_t *in, apr_file_t *out, apr_file_t *err, int inpipe,
+        apr_pool_t *pool)
+{
+    return APR_ENOTIMPL;
+}
+
+#endif
+
+/*
+ * Launch with apr_proc_create, being fork and exec, available everywhere.
+ */
+apr_status_t device_spawn_apr(apr_proc_t *proc, const char *progname,
+        const char * const *args, const char * const *env, const char *dir,
+        apr_file_t *in, apr_file_t *out, apr_file_t *err, int inpipe,
+        apr_pool_t *pool)
+{
+    apr_procattr_t *procattr;
+    apr_status_t status;
+
+    if ((status = apr_procattr_create(&procattr, pool)) != APR_SUCCESS) {
+        return status;
+    }
+
+    if ((status = apr_procattr_io_set(procattr,
+            in ? APR_NO_PIPE : inpipe ? APR_FULL_BLOCK : APR_CHILD_BLOCK,
+            out ? APR_NO_PIPE : APR_CHILD_BLOCK,
+            err ? APR_NO_PIPE : APR_CHILD_BLOCK)) != APR_SUCCESS) {
+        return status;
+    }
+
+    if (in && (status = apr_procattr_child_in_set(procattr, in, NULL)) != APR_SUCCESS) {
+        return status;
+    }
+
+    if (out && (status = apr_procattr_child_out_set(procattr, out, NULL)) != APR_SUCCESS) {
+        return status;
+    }
+
+    if (err && (status = apr_procattr_child_err_set(procattr, err, NULL)) != APR_SUCCESS) {
+        return status;
+    }
+
+    if ((status = apr_procattr_dir_set(procattr, dir)) != APR_SUCCESS) {
+        return status;
+    }
+
+    if ((status = apr_procattr_cmdtype_set(procattr, APR_PROGRAM)) != APR_SUCCESS) {
+        return status;
+    }
+
+    if ((status = apr_proc_create(proc, progname, args, env, procattr,
+            pool)) != APR_SUCCESS) {
+        return status;
+    }
+
+    /* nothing to say to the command, give it end of file */
+    if (!in && !inpipe) {
+        apr_file_close(proc->in);
+        proc->in = NULL;
+    }
+
+    return APR_SUCCESS;
+}
+
+apr_status_t device_spawn(apr_proc_t *proc, const char *progname,
+        const char * const *args, const char * const *env, const char *dir,
+        apr_file_t *in, apr_file_t *out, apr_file_t *err, int inpipe,
+        apr_pool_t *pool)
+{
+#if HAVE_SPAWN_H && HAVE_POSIX_SPAWN && HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+    return device_spawn_posix(proc, progname, args, env, dir, in, out, err,
+            inpipe, pool);
+#else
+    return device_spawn_apr(proc, progname, args, env, dir, in, out, err,
+            inpipe, pool);
+#endif
+}
@@ -0,0 +1,58 @@
+/**
+ *    Copyright (C) 2021 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Launch commands.
+ */
+
+#ifndef DEVICE_SPAWN_H
+#define DEVICE_SPAWN_H
+
+#include <apr_file_io.h>
+#include <apr_pools.h>
+#include <apr_thread_proc.h>
+
+/*
+ * Launch a command in the directory given, the best way we can.
+ *
+ * The child inherits the given stdin, stdout and stderr. Where these are
+ * NULL, stdout and stderr are pipes returned in proc, and stdin is empty,
+ * unless inpipe is set, in which case stdin is a pipe returned in proc.
+ */
+apr_status_t device_spawn(apr_proc_t *proc, const char *progname,
+        const char * const *args, const char * const *env, const char *dir,
+        apr_file_t *in, apr_file_t *out, apr_file_t *err, int inpipe,
+        apr_pool_t *pool);
+
+/*
+ * Launch as device_spawn() does, with posix_spawn. Returns APR_ENOTIMPL
+ * where posix_spawn cannot change directory for us.
+ */
+apr_status_t device_spawn_posix(apr_proc_t *proc, const char *progname,
+        const char * const *args, const char * const *env, const char *dir,
+        apr_file_t *in, apr_file_t *out, apr_file_t *err, int inpipe,
+        apr_pool_t *pool);
+
+/*
+ * Launch as device_spawn() does, with apr_proc_create.
+ */
+apr_status_t device_spawn_apr(apr_proc_t *proc, const char *progname,
+        const char * const *args, const char * const *env, const char *dir,
+        apr_file_t *in, apr_file_t *out, apr_file_t *err, int inpipe,
+        apr_pool_t *pool);
+
+#endif